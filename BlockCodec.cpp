@@ -0,0 +1,314 @@
+#include "BlockCodec.h"
+#include "OctreeFile.h"
+#include <cstring>
+#include <algorithm>
+
+static unsigned int ReadWord(const char *_data, unsigned long long _index) {
+  unsigned int word;
+  memcpy(&word, _data + _index*sizeof(unsigned int), sizeof(word));
+  return word;
+}
+
+static void WriteVarint(std::vector<char> &_out, unsigned long long _value) {
+  while (_value >= 0x80) {
+    _out.push_back(static_cast<char>((_value & 0x7F) | 0x80));
+    _value >>= 7;
+  }
+  _out.push_back(static_cast<char>(_value));
+}
+
+static bool ReadVarint(const unsigned char *&_in,
+                       const unsigned char *_end,
+                       unsigned long long &_value) {
+  _value = 0;
+  for (unsigned int shift=0; shift<64; shift+=7) {
+    if (_in >= _end) {
+      return false;
+    }
+    unsigned char byte = *_in++;
+    _value |= (unsigned long long)(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// LZ lengths above 14 continue in bytes of 255 and a final smaller one
+static void WriteLength(std::vector<char> &_out, unsigned long long _length) {
+  while (_length >= 255) {
+    _out.push_back(static_cast<char>(255));
+    _length -= 255;
+  }
+  _out.push_back(static_cast<char>(_length));
+}
+
+static bool ReadLength(const unsigned char *&_in,
+                       const unsigned char *_end,
+                       unsigned long long &_length) {
+  unsigned char byte;
+  do {
+    if (_in >= _end) {
+      return false;
+    }
+    byte = *_in++;
+    _length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+// Continues the _period bytes before _target for _length bytes. Matches
+// may overlap the bytes they produce, such as runs of a value with a
+// period of 1, but what is already copied repeats with the period, so the
+// copies can double in size.
+static void RepeatBytes(char *_target,
+                        unsigned long long _period,
+                        unsigned long long _length) {
+  unsigned long long copied = 0;
+  while (copied < _length) {
+    unsigned long long count = std::min(_period, _length - copied);
+    memcpy(_target + copied, _target + copied - _period, count);
+    copied += count;
+    _period *= 2;
+  }
+}
+
+void BlockCodec::Compress(unsigned int _codec,
+                          const char *_data,
+                          unsigned long long _size,
+                          unsigned int _stride,
+                          std::vector<char> &_out) {
+  switch (_codec) {
+  case OctreeFile::DELTA_RLE:
+    CompressDeltaRle(_data, _size, _stride, _out);
+    break;
+  case OctreeFile::LZ:
+    CompressLz(_data, _size, _out);
+    break;
+  default:
+    _out.insert(_out.end(), _data, _data + _size);
+    break;
+  }
+}
+
+bool BlockCodec::Decompress(unsigned int _codec,
+                            const char *_data,
+                            unsigned long long _compressedSize,
+                            unsigned int _stride,
+                            char *_out,
+                            unsigned long long _size) {
+  switch (_codec) {
+  case OctreeFile::DELTA_RLE:
+    return DecompressDeltaRle(_data, _compressedSize, _stride, _out, _size);
+  case OctreeFile::LZ:
+    return DecompressLz(_data, _compressedSize, _out, _size);
+  case OctreeFile::UNCOMPRESSED:
+    if (_compressedSize != _size) {
+      return false;
+    }
+    memcpy(_out, _data, _size);
+    return true;
+  }
+  return false;
+}
+
+// Each word is stored as the difference to the same word of the previous
+// record. Air and homogeneous regions give long runs of zero differences,
+// which become a single token, the rest are zigzag varints. Tokens are a
+// varint of the run length shifted left once, the low bit set for zeros.
+void BlockCodec::CompressDeltaRle(const char *_data,
+                                  unsigned long long _size,
+                                  unsigned int _stride,
+                                  std::vector<char> &_out) {
+  unsigned long long nrWords = _size/sizeof(unsigned int);
+  auto delta = [=](unsigned long long _i) -> unsigned int {
+    unsigned int previous = _i >= _stride ? ReadWord(_data, _i-_stride) : 0;
+    return ReadWord(_data, _i) - previous;
+  };
+  auto zeroRun = [=](unsigned long long _i) -> unsigned long long {
+    unsigned long long end = _i;
+    while (end < nrWords && delta(end) == 0) {
+      end++;
+    }
+    return end - _i;
+  };
+
+  unsigned long long i = 0;
+  while (i < nrWords) {
+    unsigned long long zeros = zeroRun(i);
+    if (zeros >= MIN_ZERO_RUN) {
+      WriteVarint(_out, zeros << 1 | 1);
+      i += zeros;
+      continue;
+    }
+    // Short zero runs are cheaper as literals than as tokens
+    unsigned long long end = i;
+    while (end < nrWords) {
+      unsigned long long run = zeroRun(end);
+      if (run >= MIN_ZERO_RUN) {
+        break;
+      }
+      end += std::max(run, 1ULL);
+    }
+    WriteVarint(_out, (end - i) << 1);
+    for (; i<end; i++) {
+      unsigned int value = delta(i);
+      WriteVarint(_out, (value << 1) ^ (0U - (value >> 31)));
+    }
+  }
+}
+
+bool BlockCodec::DecompressDeltaRle(const char *_data,
+                                    unsigned long long _compressedSize,
+                                    unsigned int _stride,
+                                    char *_out,
+                                    unsigned long long _size) {
+  if (_size % sizeof(unsigned int) != 0 || _stride == 0) {
+    return false;
+  }
+  const unsigned char *in = reinterpret_cast<const unsigned char*>(_data);
+  const unsigned char *end = in + _compressedSize;
+  unsigned long long nrWords = _size/sizeof(unsigned int);
+  unsigned long long i = 0;
+  while (i < nrWords) {
+    unsigned long long token;
+    if (!ReadVarint(in, end, token)) {
+      return false;
+    }
+    unsigned long long count = token >> 1;
+    if (count == 0 || count > nrWords - i) {
+      return false;
+    }
+    unsigned long long last = i + count;
+    if (token & 1) {
+      // The first record has nothing before it, its words stay 0
+      for (; i<last && i<_stride; i++) {
+        memset(_out + i*sizeof(unsigned int), 0, sizeof(unsigned int));
+      }
+      if (i < last) {
+        RepeatBytes(_out + i*sizeof(unsigned int),
+                    _stride*sizeof(unsigned int),
+                    (last - i)*sizeof(unsigned int));
+      }
+      i = last;
+      continue;
+    }
+    for (; i<last; i++) {
+      unsigned long long zigzag;
+      if (!ReadVarint(in, end, zigzag) || zigzag > 0xFFFFFFFFULL) {
+        return false;
+      }
+      unsigned int value = static_cast<unsigned int>(zigzag);
+      unsigned int word = (value >> 1) ^ (0U - (value & 1));
+      if (i >= _stride) {
+        word += ReadWord(_out, i-_stride);
+      }
+      memcpy(_out + i*sizeof(unsigned int), &word, sizeof(word));
+    }
+  }
+  return in == end;
+}
+
+// Byte oriented LZ77 along the lines of LZ4. A sequence is a token byte
+// with the literal count in the high and the match length minus MIN_MATCH
+// in the low nibble, the literals, and a 16-bit offset back to the match.
+// The last sequence only has literals.
+void BlockCodec::CompressLz(const char *_data,
+                            unsigned long long _size,
+                            std::vector<char> &_out) {
+  const unsigned char *in = reinterpret_cast<const unsigned char*>(_data);
+  std::vector<long long> table(1 << HASH_BITS, -1);
+  unsigned long long matchEnd = _size > LAST_LITERALS ? _size - LAST_LITERALS
+                                                      : 0;
+  unsigned long long anchor = 0;
+  unsigned long long position = 0;
+  // Data without matches is skipped through faster and faster
+  unsigned long long misses = 0;
+  while (position + MIN_MATCH <= matchEnd) {
+    unsigned int sequence;
+    memcpy(&sequence, in + position, sizeof(sequence));
+    unsigned int hash = (sequence*2654435761U) >> (32 - HASH_BITS);
+    long long candidate = table[hash];
+    table[hash] = position;
+    if (candidate < 0 || position - candidate > MAX_OFFSET ||
+        memcmp(in + candidate, in + position, MIN_MATCH) != 0) {
+      position += 1 + (misses++ >> 6);
+      continue;
+    }
+    misses = 0;
+    unsigned long long length = MIN_MATCH;
+    while (position + length < matchEnd &&
+           in[candidate + length] == in[position + length]) {
+      length++;
+    }
+
+    unsigned long long literals = position - anchor;
+    unsigned long long extra = length - MIN_MATCH;
+    _out.push_back(static_cast<char>(std::min(literals, 15ULL) << 4 |
+                                     std::min(extra, 15ULL)));
+    if (literals >= 15) {
+      WriteLength(_out, literals - 15);
+    }
+    _out.insert(_out.end(), _data + anchor, _data + position);
+    unsigned int offset = static_cast<unsigned int>(position - candidate);
+    _out.push_back(static_cast<char>(offset & 0xFF));
+    _out.push_back(static_cast<char>(offset >> 8));
+    if (extra >= 15) {
+      WriteLength(_out, extra - 15);
+    }
+    position += length;
+    anchor = position;
+  }
+
+  unsigned long long literals = _size - anchor;
+  _out.push_back(static_cast<char>(std::min(literals, 15ULL) << 4));
+  if (literals >= 15) {
+    WriteLength(_out, literals - 15);
+  }
+  _out.insert(_out.end(), _data + anchor, _data + _size);
+}
+
+bool BlockCodec::DecompressLz(const char *_data,
+                              unsigned long long _compressedSize,
+                              char *_out,
+                              unsigned long long _size) {
+  const unsigned char *in = reinterpret_cast<const unsigned char*>(_data);
+  const unsigned char *end = in + _compressedSize;
+  unsigned long long position = 0;
+  while (true) {
+    if (in >= end) {
+      return false;
+    }
+    unsigned char token = *in++;
+    unsigned long long literals = token >> 4;
+    if (literals == 15 && !ReadLength(in, end, literals)) {
+      return false;
+    }
+    if (literals > (unsigned long long)(end - in) ||
+        literals > _size - position) {
+      return false;
+    }
+    memcpy(_out + position, in, literals);
+    in += literals;
+    position += literals;
+    if (position == _size) {
+      return in == end;
+    }
+
+    if (end - in < 2) {
+      return false;
+    }
+    unsigned long long offset = in[0] | in[1] << 8;
+    in += 2;
+    unsigned long long length = token & 0x0F;
+    if (length == 15 && !ReadLength(in, end, length)) {
+      return false;
+    }
+    length += MIN_MATCH;
+    if (offset == 0 || offset > position || length > _size - position) {
+      return false;
+    }
+    RepeatBytes(_out + position, offset, length);
+    position += length;
+  }
+}
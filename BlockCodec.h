@@ -0,0 +1,58 @@
+#ifndef BLOCKCODEC_H
+#define BLOCKCODEC_H
+
+#include <vector>
+
+// Lossless codecs for the independently compressed blocks of an octree
+// file, see OctreeFile::Codec. Blocks hold whole node records, which are
+// made of 32-bit words.
+class BlockCodec {
+public:
+  // Appends the compressed block to _out. _stride is the number of words
+  // per node record, the delta codec compares a word to the same word of
+  // the previous record.
+  static void Compress(unsigned int _codec,
+                       const char *_data,
+                       unsigned long long _size,
+                       unsigned int _stride,
+                       std::vector<char> &_out);
+  // Expands a block into exactly _size bytes at _out. Returns false if the
+  // block is corrupt.
+  static bool Decompress(unsigned int _codec,
+                         const char *_data,
+                         unsigned long long _compressedSize,
+                         unsigned int _stride,
+                         char *_out,
+                         unsigned long long _size);
+
+private:
+  // Shortest zero run worth a token of its own in the delta codec
+  static const unsigned int MIN_ZERO_RUN = 3;
+  // Shortest match and farthest offset of the LZ codec
+  static const unsigned int MIN_MATCH = 4;
+  static const unsigned int MAX_OFFSET = 65535;
+  // Entries in the table of recent positions per 4-byte hash
+  static const unsigned int HASH_BITS = 14;
+  // The last bytes of a block are always literals
+  static const unsigned int LAST_LITERALS = 5;
+
+  BlockCodec() {}
+  static void CompressDeltaRle(const char *_data,
+                               unsigned long long _size,
+                               unsigned int _stride,
+                               std::vector<char> &_out);
+  static bool DecompressDeltaRle(const char *_data,
+                                 unsigned long long _compressedSize,
+                                 unsigned int _stride,
+                                 char *_out,
+                                 unsigned long long _size);
+  static void CompressLz(const char *_data,
+                         unsigned long long _size,
+                         std::vector<char> &_out);
+  static bool DecompressLz(const char *_data,
+                           unsigned long long _compressedSize,
+                           char *_out,
+                           unsigned long long _size);
+};
+
+#endif
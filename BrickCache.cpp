@@ -0,0 +1,254 @@
+#include "BrickCache.h"
+#include "BrickPool.h"
+#include "Manager.h"
+#include <gl\glew.h>
+#include <iostream>
+#include <algorithm>
+#include <utility>
+
+BrickCache * BrickCache::New() {
+  return new BrickCache();
+}
+
+BrickCache::BrickCache()
+  : nrBricks_(0),
+    atlasHandle_(0),
+    nrSlots_(0),
+    nrResident_(0),
+    pageTableBuffer_(0),
+    pageTableHandle_(0),
+    frame_(1),
+    feedbackBuffer_(0),
+    feedbackPixels_(0),
+    pending_(false) {
+  atlasBricks_[0] = atlasBricks_[1] = atlasBricks_[2] = 0;
+}
+
+BrickCache::~BrickCache() {
+  if (atlasHandle_ != 0) {
+    glDeleteTextures(1, &atlasHandle_);
+  }
+  if (pageTableHandle_ != 0) {
+    glDeleteTextures(1, &pageTableHandle_);
+    glDeleteBuffers(1, &pageTableBuffer_);
+  }
+  if (feedbackBuffer_ != 0) {
+    glDeleteBuffers(1, &feedbackBuffer_);
+  }
+}
+
+bool BrickCache::Init(std::vector<float> &_bricks,
+                      unsigned int _nrBricks,
+                      unsigned long long _maxBytes) {
+  bricks_.swap(_bricks);
+  nrBricks_ = _nrBricks;
+  unsigned long long brickTexels = BrickPool::PADDED_SIZE*
+    BrickPool::PADDED_SIZE*BrickPool::PADDED_SIZE;
+  // The atlas stores half floats
+  unsigned long long slotBytes = brickTexels*2;
+
+  int maxAtlasDim;
+  glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxAtlasDim);
+  unsigned long long maxPerAxis = maxAtlasDim/BrickPool::PADDED_SIZE;
+  unsigned long long slots = std::min((unsigned long long)_nrBricks,
+                                      _maxBytes/slotBytes);
+  slots = std::min(slots, maxPerAxis*maxPerAxis*maxPerAxis);
+  if (slots == 0 && _nrBricks > 0) {
+    std::cout << "Error: Brick cache of " << _maxBytes << " bytes has no "
+      << "room for a single brick\n";
+    return false;
+  }
+  nrSlots_ = static_cast<unsigned int>(slots);
+
+  // Roughly cubic like a BrickPool atlas, never empty
+  unsigned int side = 1;
+  while ((unsigned long long)side*side*side < slots) {
+    side++;
+  }
+  atlasBricks_[0] = std::min((unsigned long long)side, maxPerAxis);
+  atlasBricks_[1] = atlasBricks_[0];
+  unsigned int perSlice = atlasBricks_[0]*atlasBricks_[1];
+  atlasBricks_[2] = std::max(1U, (nrSlots_ + perSlice - 1)/perSlice);
+
+  glGenTextures(1, &atlasHandle_);
+  glBindTexture(GL_TEXTURE_3D, atlasHandle_);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+  glTexImage3D(GL_TEXTURE_3D,
+               0,
+               GL_R16F,
+               atlasBricks_[0]*BrickPool::PADDED_SIZE,
+               atlasBricks_[1]*BrickPool::PADDED_SIZE,
+               atlasBricks_[2]*BrickPool::PADDED_SIZE,
+               0,
+               GL_RED,
+               GL_FLOAT,
+               NULL);
+  glBindTexture(GL_TEXTURE_3D, 0);
+
+  // Nothing is resident yet
+  pageTable_.assign(std::max(1U, nrBricks_), -1);
+  glGenBuffers(1, &pageTableBuffer_);
+  glBindBuffer(GL_TEXTURE_BUFFER, pageTableBuffer_);
+  glBufferData(GL_TEXTURE_BUFFER,
+               pageTable_.size()*sizeof(int),
+               &pageTable_[0],
+               GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  glGenTextures(1, &pageTableHandle_);
+  glBindTexture(GL_TEXTURE_BUFFER, pageTableHandle_);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, pageTableBuffer_);
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+
+  slotBricks_.assign(nrSlots_, -1);
+  lastUsed_.assign(nrSlots_, 0);
+  lru_.clear();
+  lruPositions_.resize(nrSlots_);
+  for (unsigned int i=0; i<nrSlots_; i++) {
+    lruPositions_[i] = lru_.insert(lru_.end(), i);
+  }
+
+  Manager::CheckGLErrors("BrickCache::Init()");
+  std::cout << "Brick cache with " << nrSlots_ << " of " << nrBricks_
+    << " bricks, " << nrSlots_*slotBytes/(1024*1024) << " MB\n";
+  return true;
+}
+
+void BrickCache::ReadFeedback(unsigned int _attachment,
+                              unsigned int _width,
+                              unsigned int _height) {
+  unsigned long long pixels = (unsigned long long)_width*_height;
+  if (feedbackBuffer_ == 0) {
+    glGenBuffers(1, &feedbackBuffer_);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, feedbackBuffer_);
+  glBufferData(GL_PIXEL_PACK_BUFFER,
+               pixels*sizeof(unsigned int),
+               NULL,
+               GL_STREAM_READ);
+  // Lands in the buffer without waiting for the frame to finish
+  glReadBuffer(GL_COLOR_ATTACHMENT0 + _attachment);
+  glReadPixels(0, 0, _width, _height, GL_RED_INTEGER, GL_UNSIGNED_INT, 0);
+  glReadBuffer(GL_COLOR_ATTACHMENT0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  feedbackPixels_ = pixels;
+}
+
+void BrickCache::Touch(unsigned int _slot) {
+  lru_.splice(lru_.begin(), lru_, lruPositions_[_slot]);
+  lastUsed_[_slot] = frame_;
+}
+
+bool BrickCache::Update(unsigned long long _budget) {
+  pending_ = false;
+  if (feedbackPixels_ == 0) {
+    return false;
+  }
+
+  // Used bricks go to the front of the LRU list, missing ones are counted
+  std::vector<unsigned int> missing;
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, feedbackBuffer_);
+  const unsigned int *feedback = static_cast<const unsigned int*>(
+    glMapBufferRange(GL_PIXEL_PACK_BUFFER,
+                     0,
+                     feedbackPixels_*sizeof(unsigned int),
+                     GL_MAP_READ_BIT));
+  if (feedback != NULL) {
+    for (unsigned long long i=0; i<feedbackPixels_; i++) {
+      unsigned int value = feedback[i];
+      if (value == 0) {
+        continue;
+      }
+      unsigned int brick = (value & ~FEEDBACK_USED) - 1;
+      if (brick >= nrBricks_) {
+        continue;
+      }
+      int slot = pageTable_[brick];
+      if (slot >= 0) {
+        Touch(slot);
+      } else if ((value & FEEDBACK_USED) == 0) {
+        missing.push_back(brick);
+      }
+    }
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  feedbackPixels_ = 0;
+
+  // Most requested first, ties by brick so the order is reproducible
+  std::sort(missing.begin(), missing.end());
+  std::vector< std::pair<int, unsigned int> > requests;
+  for (unsigned int i=0; i<missing.size(); ) {
+    unsigned int j = i;
+    while (j < missing.size() && missing[j] == missing[i]) {
+      j++;
+    }
+    requests.push_back(std::make_pair(-(int)(j - i), missing[i]));
+    i = j;
+  }
+  std::sort(requests.begin(), requests.end());
+
+  unsigned long long brickBytes = BrickPool::PADDED_SIZE*
+    BrickPool::PADDED_SIZE*BrickPool::PADDED_SIZE*sizeof(float);
+  unsigned long long uploaded = 0;
+  bool changed = false;
+  for (unsigned int i=0; i<requests.size(); i++) {
+    if (uploaded > 0 && uploaded + brickBytes > _budget) {
+      pending_ = true;
+      break;
+    }
+    // Pixels report a used brick only now and then, so a slot reported in
+    // the last frames is likely still in view. Evicting it would trade one
+    // missing brick for another, the cache is too small for the view then.
+    unsigned int slot = lru_.back();
+    if (slotBricks_[slot] >= 0 && frame_ - lastUsed_[slot] < RECENT_FRAMES) {
+      break;
+    }
+    unsigned int brick = requests[i].second;
+    if (slotBricks_[slot] >= 0) {
+      unsigned int evicted = slotBricks_[slot];
+      pageTable_[evicted] = -1;
+      glBindBuffer(GL_TEXTURE_BUFFER, pageTableBuffer_);
+      glBufferSubData(GL_TEXTURE_BUFFER, evicted*sizeof(int), sizeof(int),
+                      &pageTable_[evicted]);
+      nrResident_--;
+    }
+    UploadBrick(brick, slot);
+    slotBricks_[slot] = brick;
+    pageTable_[brick] = slot;
+    glBindBuffer(GL_TEXTURE_BUFFER, pageTableBuffer_);
+    glBufferSubData(GL_TEXTURE_BUFFER, brick*sizeof(int), sizeof(int),
+                    &pageTable_[brick]);
+    Touch(slot);
+    nrResident_++;
+    uploaded += brickBytes;
+    changed = true;
+  }
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  frame_++;
+  return changed;
+}
+
+void BrickCache::UploadBrick(unsigned int _brick, unsigned int _slot) {
+  unsigned int size = BrickPool::PADDED_SIZE;
+  unsigned long long texels = size*size*size;
+  unsigned int x = _slot % atlasBricks_[0];
+  unsigned int y = _slot/atlasBricks_[0] % atlasBricks_[1];
+  unsigned int z = _slot/(atlasBricks_[0]*atlasBricks_[1]);
+  glBindTexture(GL_TEXTURE_3D, atlasHandle_);
+  glTexSubImage3D(GL_TEXTURE_3D,
+                  0,
+                  x*size,
+                  y*size,
+                  z*size,
+                  size,
+                  size,
+                  size,
+                  GL_RED,
+                  GL_FLOAT,
+                  &bricks_[_brick*texels]);
+  glBindTexture(GL_TEXTURE_3D, 0);
+}
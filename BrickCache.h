@@ -0,0 +1,87 @@
+#ifndef BRICKCACHE_H
+#define BRICKCACHE_H
+
+#include <vector>
+#include <list>
+
+// Virtual memory for the bricks of a brick tree (see BrickPool) that do
+// not all fit on the GPU. The GPU holds a fixed number of brick slots in a
+// 3D atlas and a page table with the slot of every brick, -1 for bricks
+// that are not resident. The ray caster writes the brick id of the first
+// missing brick per pixel into a feedback attachment and stands in the
+// parent's value for it. Update() reads that back a frame later, loads the
+// most wanted bricks from the host copy and evicts the least recently used
+// ones. Pixels without a miss report one of the resident bricks they used,
+// picked differently every frame, which keeps those from being evicted.
+class BrickCache {
+public:
+  static BrickCache * New();
+  ~BrickCache();
+  // Takes over the bricks of a pool built without an atlas limit, the
+  // vector is left empty. The atlas gets up to _maxBytes of slots, but at
+  // most one per brick. Returns false if not even one slot fits.
+  bool Init(std::vector<float> &_bricks,
+            unsigned int _nrBricks,
+            unsigned long long _maxBytes);
+  // 3D atlas with the resident bricks, same layout as a BrickPool atlas
+  unsigned int AtlasHandle() { return atlasHandle_; }
+  // Buffer texture with the atlas slot of every brick, -1 if not resident
+  unsigned int PageTableHandle() { return pageTableHandle_; }
+  // Varies the resident brick the pixels report, call once per frame
+  int FeedbackPick() { return frame_; }
+  // Starts the readback of the feedback attachment of the bound read
+  // framebuffer, call after the frame is drawn
+  void ReadFeedback(unsigned int _attachment,
+                    unsigned int _width,
+                    unsigned int _height);
+  // Reads the last feedback and uploads up to _budget bytes of missing
+  // bricks, the ones most pixels wanted first. Returns true if any brick
+  // became resident.
+  bool Update(unsigned long long _budget);
+  // True if the last feedback asked for more bricks than the budget
+  // allowed, so Update() has more to do
+  bool Pending() { return pending_; }
+  unsigned int NrSlots() { return nrSlots_; }
+  unsigned int NrResident() { return nrResident_; }
+
+  // Bit set in the feedback of resident bricks that were used, the rest
+  // of the value is the brick id plus one. 0 is no brick.
+  static const unsigned int FEEDBACK_USED = 0x80000000u;
+
+private:
+  // Slots reported this many frames back are not evicted
+  static const unsigned int RECENT_FRAMES = 8;
+
+  BrickCache();
+  BrickCache(const BrickCache&) {}
+  // Copies a brick from the host copy into a slot
+  void UploadBrick(unsigned int _brick, unsigned int _slot);
+  // Moves a slot to the front of the LRU list
+  void Touch(unsigned int _slot);
+
+  // Host copy of every brick, PADDED_SIZE^3 values each
+  std::vector<float> bricks_;
+  unsigned int nrBricks_;
+  unsigned int atlasHandle_;
+  unsigned int atlasBricks_[3];
+  unsigned int nrSlots_;
+  unsigned int nrResident_;
+  // Slot per brick, -1 if not resident, and its copy on the GPU
+  std::vector<int> pageTable_;
+  unsigned int pageTableBuffer_;
+  unsigned int pageTableHandle_;
+  // Brick per slot, -1 if free
+  std::vector<int> slotBricks_;
+  // Slots from most to least recently used, and where each slot is in it
+  std::list<unsigned int> lru_;
+  std::vector<std::list<unsigned int>::iterator> lruPositions_;
+  // Frame each slot was last reported in
+  std::vector<unsigned int> lastUsed_;
+  unsigned int frame_;
+  // Pixel pack buffer the feedback is read into, 0 pixels if none
+  unsigned int feedbackBuffer_;
+  unsigned long long feedbackPixels_;
+  bool pending_;
+};
+
+#endif
@@ -0,0 +1,203 @@
+#include "BrickPool.h"
+#include "OctreeBuilder.h"
+#include "Morton.h"
+#include "ThreadPool.h"
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+// Volume value with coordinates clamped to the volume, so that the aprons
+// of bricks on the border repeat the edge voxels
+static float ClampedVoxel(const std::vector<float> &_volume,
+                          unsigned int _dim,
+                          int _x,
+                          int _y,
+                          int _z) {
+  int last = static_cast<int>(_dim) - 1;
+  unsigned long long x = std::min(std::max(_x, 0), last);
+  unsigned long long y = std::min(std::max(_y, 0), last);
+  unsigned long long z = std::min(std::max(_z, 0), last);
+  return _volume[(z*_dim + y)*_dim + x];
+}
+
+BrickPool * BrickPool::New() {
+  return new BrickPool();
+}
+
+BrickPool::BrickPool()
+  : nrBricks_(0),
+    maxDepth_(0) {
+  atlasBricks_[0] = atlasBricks_[1] = atlasBricks_[2] = 0;
+}
+
+bool BrickPool::Build(const std::vector<float> &_volume,
+                      unsigned int _dim,
+                      unsigned int _maxAtlasDim) {
+  if (_dim < BRICK_SIZE || (_dim & (_dim-1)) != 0) {
+    std::cout << "Error: Brick pool dimensions need to be a power of 2 "
+      << "and at least " << BRICK_SIZE << "\n";
+    return false;
+  }
+  unsigned int bricksPerAxis = _dim/BRICK_SIZE;
+  maxDepth_ = 0;
+  while ((1U << maxDepth_) < bricksPerAxis) {
+    maxDepth_++;
+  }
+  unsigned int nrLeaves = 1U << (3*maxDepth_);
+  unsigned long long firstLeaf = OctreeBuilder::LevelStart(maxDepth_);
+  nodes_.assign(OctreeBuilder::NrNodes(maxDepth_+1)*OctreeBuilder::NODE_SIZE,
+                0.f);
+  ranges_.assign(OctreeBuilder::NrNodes(maxDepth_+1)*OctreeBuilder::RANGE_SIZE,
+                 0.f);
+  deviations_.assign(OctreeBuilder::NrNodes(maxDepth_+1)*
+                     OctreeBuilder::DEVIATION_SIZE, 0.f);
+  gradients_.assign(OctreeBuilder::NrNodes(maxDepth_+1)*
+                    OctreeBuilder::GRADIENT_SIZE, 0.f);
+
+  // Leaf value is the brick average. The range includes the apron, since
+  // filtered samples near the brick faces blend in the neighbours.
+  const std::vector<float> *volume = &_volume;
+  BrickPool *pool = this;
+  ThreadPool::Instance().ParallelFor(nrLeaves, [=](unsigned int _i) {
+    unsigned int bx, by, bz;
+    Morton::Decode(_i, bx, by, bz);
+    int x0 = static_cast<int>(bx*BRICK_SIZE) - 1;
+    int y0 = static_cast<int>(by*BRICK_SIZE) - 1;
+    int z0 = static_cast<int>(bz*BRICK_SIZE) - 1;
+    // Doubles keep the deviation of a constant brick at exactly 0
+    double sum = 0.0;
+    double sumSquares = 0.0;
+    double gradient[OctreeBuilder::GRADIENT_SIZE] = { 0.0, 0.0, 0.0 };
+    float min = ClampedVoxel(*volume, _dim, x0, y0, z0);
+    float max = min;
+    int last = PADDED_SIZE - 1;
+    for (int z=0; z<(int)PADDED_SIZE; z++) {
+      for (int y=0; y<(int)PADDED_SIZE; y++) {
+        for (int x=0; x<(int)PADDED_SIZE; x++) {
+          float value = ClampedVoxel(*volume, _dim, x0+x, y0+y, z0+z);
+          min = std::min(min, value);
+          max = std::max(max, value);
+          bool apron = x == 0 || y == 0 || z == 0 ||
+                       x == last || y == last || z == last;
+          if (!apron) {
+            sum += value;
+            sumSquares += (double)value*value;
+            int vx = x0+x;
+            int vy = y0+y;
+            int vz = z0+z;
+            gradient[0] += ClampedVoxel(*volume, _dim, vx+1, vy, vz) -
+                           ClampedVoxel(*volume, _dim, vx-1, vy, vz);
+            gradient[1] += ClampedVoxel(*volume, _dim, vx, vy+1, vz) -
+                           ClampedVoxel(*volume, _dim, vx, vy-1, vz);
+            gradient[2] += ClampedVoxel(*volume, _dim, vx, vy, vz+1) -
+                           ClampedVoxel(*volume, _dim, vx, vy, vz-1);
+          }
+        }
+      }
+    }
+    unsigned long long node = firstLeaf + _i;
+    double nrVoxels = BRICK_SIZE*BRICK_SIZE*BRICK_SIZE;
+    double mean = sum/nrVoxels;
+    double variance = std::max(sumSquares/nrVoxels - mean*mean, 0.0);
+    pool->nodes_[node*OctreeBuilder::NODE_SIZE] = static_cast<float>(mean);
+    pool->deviations_[node*OctreeBuilder::DEVIATION_SIZE] =
+      static_cast<float>(sqrt(variance));
+    for (unsigned int k=0; k<OctreeBuilder::GRADIENT_SIZE; k++) {
+      pool->gradients_[node*OctreeBuilder::GRADIENT_SIZE+k] =
+        static_cast<float>(0.5*gradient[k]/nrVoxels);
+    }
+    pool->nodes_[node*OctreeBuilder::NODE_SIZE+1] = -1.f;
+    pool->ranges_[node*OctreeBuilder::RANGE_SIZE] = min;
+    pool->ranges_[node*OctreeBuilder::RANGE_SIZE+1] = max;
+  });
+
+  // Hand out atlas slots in Morton order, so the layout does not depend on
+  // the thread count and neighbouring bricks end up close in the atlas
+  slots_.assign(nrLeaves, -1);
+  nrBricks_ = 0;
+  for (unsigned int i=0; i<nrLeaves; i++) {
+    unsigned long long node = firstLeaf + i;
+    const float *range = &ranges_[node*OctreeBuilder::RANGE_SIZE];
+    if (range[0] != range[1]) {
+      slots_[i] = nrBricks_;
+      nodes_[node*OctreeBuilder::NODE_SIZE+1] = -2.f - nrBricks_;
+      nrBricks_++;
+    }
+  }
+
+  // Roughly cubic atlas, never empty so that it can always be uploaded
+  unsigned int maxBricks = _maxAtlasDim/PADDED_SIZE;
+  unsigned int side = 1;
+  while (side*side*side < nrBricks_) {
+    side++;
+  }
+  if (_maxAtlasDim == 0) {
+    // A column of bricks, each one contiguous
+    side = 1;
+    maxBricks = std::max(1U, nrBricks_);
+  }
+  atlasBricks_[0] = std::max(1U, std::min(side, maxBricks));
+  atlasBricks_[1] = atlasBricks_[0];
+  unsigned int perSlice = atlasBricks_[0]*atlasBricks_[1];
+  atlasBricks_[2] = std::max(1U, (nrBricks_ + perSlice - 1)/perSlice);
+  if (atlasBricks_[2] > maxBricks) {
+    std::cout << "Error: " << nrBricks_ << " bricks do not fit in a "
+      << _maxAtlasDim << "^3 atlas\n";
+    return false;
+  }
+  atlas_.assign((unsigned long long)atlasBricks_[0]*atlasBricks_[1]*
+                atlasBricks_[2]*PADDED_SIZE*PADDED_SIZE*PADDED_SIZE, 0.f);
+
+  ThreadPool::Instance().ParallelFor(nrLeaves, [=](unsigned int _i) {
+    pool->CopyBrick(*volume, _dim, _i);
+  });
+
+  // The coarse levels above the bricks
+  for (int level=maxDepth_-1; level>=0; level--) {
+    unsigned long long first = OctreeBuilder::LevelStart(level);
+    unsigned long long count = 1ULL << (3*level);
+    for (unsigned long long i=0; i<count; i++) {
+      OctreeBuilder::ReduceNode(nodes_, ranges_, deviations_, gradients_,
+                                first+i);
+    }
+  }
+
+  std::cout << "Created brick pool\n"
+    << "Nr of levels in octree: " << maxDepth_+1 << "\n"
+    << "Bricks in atlas: " << nrBricks_ << " of " << nrLeaves << "\n"
+    << "Atlas size in bricks: " << atlasBricks_[0] << "x"
+    << atlasBricks_[1] << "x" << atlasBricks_[2] << "\n"
+    << "Node bytes per voxel: "
+    << (double)(nodes_.size() + ranges_.size() + deviations_.size())*
+       sizeof(float)/
+       ((double)_dim*_dim*_dim) << "\n";
+  return true;
+}
+
+void BrickPool::CopyBrick(const std::vector<float> &_volume,
+                          unsigned int _dim,
+                          unsigned long long _brick) {
+  int slot = slots_[_brick];
+  if (slot < 0) {
+    return;
+  }
+  unsigned int bx, by, bz;
+  Morton::Decode(_brick, bx, by, bz);
+  int x0 = static_cast<int>(bx*BRICK_SIZE) - 1;
+  int y0 = static_cast<int>(by*BRICK_SIZE) - 1;
+  int z0 = static_cast<int>(bz*BRICK_SIZE) - 1;
+
+  unsigned long long atlasX = atlasBricks_[0]*PADDED_SIZE;
+  unsigned long long atlasY = atlasBricks_[1]*PADDED_SIZE;
+  unsigned long long ax = (slot % atlasBricks_[0])*PADDED_SIZE;
+  unsigned long long ay = (slot/atlasBricks_[0] % atlasBricks_[1])*PADDED_SIZE;
+  unsigned long long az = (slot/(atlasBricks_[0]*atlasBricks_[1]))*PADDED_SIZE;
+  for (int z=0; z<(int)PADDED_SIZE; z++) {
+    for (int y=0; y<(int)PADDED_SIZE; y++) {
+      float *row = &atlas_[((az+z)*atlasY + ay+y)*atlasX + ax];
+      for (int x=0; x<(int)PADDED_SIZE; x++) {
+        row[x] = ClampedVoxel(_volume, _dim, x0+x, y0+y, z0+z);
+      }
+    }
+  }
+}
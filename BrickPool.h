@@ -0,0 +1,69 @@
+#ifndef BRICKPOOL_H
+#define BRICKPOOL_H
+
+#include <vector>
+
+// Sparse voxel octree whose leaves reference small bricks of voxels instead
+// of single values. The node array uses the regular layout down to the
+// brick level, where every node covers BRICK_SIZE^3 voxels. Bricks that are
+// not constant are copied, with a one voxel apron from their neighbours,
+// into a 3D atlas so that the shader can march inside them with trilinear
+// filtering. Constant bricks need no storage, their node value is exact.
+class BrickPool {
+public:
+  static BrickPool * New();
+  // Voxels per brick side
+  static const unsigned int BRICK_SIZE = 8;
+  // Texels per brick side in the atlas, including the apron
+  static const unsigned int PADDED_SIZE = BRICK_SIZE + 2;
+  // Builds the node tree and the atlas from normalized values in x-fastest
+  // order. Bricks are processed in parallel on the ThreadPool.
+  // Params: volume values, dimensions (cube, power of 2, at least
+  // BRICK_SIZE), largest atlas side in texels. With 0 there is no limit,
+  // the atlas is one brick wide and brick b is stored at b*PADDED_SIZE^3,
+  // for streaming through a BrickCache.
+  // Returns false if the bricks do not fit in an atlas of that size
+  bool Build(const std::vector<float> &_volume,
+             unsigned int _dim,
+             unsigned int _maxAtlasDim);
+  // Node and range arrays in the OctreeBuilder layout. The child offset of
+  // a leaf is -1 for a constant brick and -2-b for brick b in the atlas.
+  const std::vector<float> & Nodes() { return nodes_; }
+  const std::vector<float> & Ranges() { return ranges_; }
+  // Standard deviation per node, over the brick voxels without the apron
+  const std::vector<float> & Deviations() { return deviations_; }
+  // Average central difference per node, over the brick voxels without
+  // the apron, OctreeBuilder::GRADIENT_SIZE floats per node
+  const std::vector<float> & Gradients() { return gradients_; }
+  // Atlas texels, x fastest
+  const std::vector<float> & Atlas() { return atlas_; }
+  // Moves the atlas texels into _atlas, leaving the pool without them
+  void ReleaseAtlas(std::vector<float> &_atlas) { atlas_.swap(_atlas); }
+  // Atlas size in bricks along each axis
+  unsigned int AtlasBricks(unsigned int _axis) { return atlasBricks_[_axis]; }
+  unsigned int NrBricks() { return nrBricks_; }
+  // Depth of the node tree, the level holding the bricks
+  unsigned int MaxDepth() { return maxDepth_; }
+
+private:
+  BrickPool();
+  BrickPool(const BrickPool&) {}
+
+  // Fills the leaf and the atlas slot of one brick
+  void CopyBrick(const std::vector<float> &_volume,
+                 unsigned int _dim,
+                 unsigned long long _brick);
+
+  std::vector<float> nodes_;
+  std::vector<float> ranges_;
+  std::vector<float> deviations_;
+  std::vector<float> gradients_;
+  std::vector<float> atlas_;
+  // Atlas slot per brick in Morton order, -1 for constant bricks
+  std::vector<int> slots_;
+  unsigned int atlasBricks_[3];
+  unsigned int nrBricks_;
+  unsigned int maxDepth_;
+};
+
+#endif
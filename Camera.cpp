@@ -0,0 +1,42 @@
+#include "Camera.h"
+#include <glm/gtc/matrix_transform.hpp>
+
+glm::mat4 Camera::ProjMatrix(float _aspect) {
+  return glm::perspective(40.f, _aspect, 0.1f, 100.f);
+}
+
+glm::mat4 Camera::ViewMatrix() {
+  glm::mat4 view = glm::rotate(glm::mat4(1.f), 180.f, glm::vec3(1.f, 0.f, 0.f));
+  view = glm::translate(view, glm::vec3(-0.5f, -0.5f, 2.2f));
+  return view;
+}
+
+glm::mat4 Camera::ModelMatrix(float _pitch, float _roll, float _yaw) {
+  glm::mat4 model = glm::mat4(1.f);
+  model = glm::translate(model, glm::vec3(0.5f, 0.5f, 0.5f));
+  model = glm::rotate(model, _roll, glm::vec3(1.f, 0.f, 0.0));
+  model = glm::rotate(model, -_pitch, glm::vec3(0.f, 1.f, 0.0));
+  model = glm::rotate(model, _yaw, glm::vec3(0.f, 0.f, 1.f));
+  model = glm::translate(model, glm::vec3(-0.5f, -0.5f, -0.5f));
+  return model;
+}
+
+glm::mat4 Camera::JitterMatrix(float _dx,
+                               float _dy,
+                               unsigned int _width,
+                               unsigned int _height) {
+  // Applied after the projection, so the offset is in NDC
+  return glm::translate(glm::mat4(1.f),
+                        glm::vec3(2.f*_dx/_width, 2.f*_dy/_height, 0.f));
+}
+
+float Camera::Halton(unsigned int _index, unsigned int _base) {
+  float result = 0.f;
+  float fraction = 1.f/_base;
+  while (_index > 0) {
+    result += fraction*(_index % _base);
+    _index /= _base;
+    fraction /= _base;
+  }
+  return result;
+}
@@ -0,0 +1,25 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include <glm/glm.hpp>
+
+// Camera and model matrices shared by the GL renderer and the tools that
+// render without a GL context
+class Camera {
+public:
+  // Perspective projection for the given aspect ratio
+  static glm::mat4 ProjMatrix(float _aspect);
+  // Flips the coord system and backs off from the unit cube
+  static glm::mat4 ViewMatrix();
+  // Rotates the unit cube around its center, angles in degrees
+  static glm::mat4 ModelMatrix(float _pitch, float _roll, float _yaw);
+  // Shifts a projection by a fraction of a pixel, for supersampling
+  static glm::mat4 JitterMatrix(float _dx,
+                                float _dy,
+                                unsigned int _width,
+                                unsigned int _height);
+  // Radical inverse of _index, low discrepancy samples in [0, 1)
+  static float Halton(unsigned int _index, unsigned int _base);
+};
+
+#endif
@@ -0,0 +1,240 @@
+#include "Compositor.h"
+#include "Socket.h"
+#include "Timer.h"
+#include <iostream>
+#include <algorithm>
+#include <thread>
+
+Compositor * Compositor::New(Method _method,
+                             unsigned int _rank,
+                             unsigned int _nrProcesses,
+                             unsigned int _width,
+                             unsigned int _height) {
+  return new Compositor(_method, _rank, _nrProcesses, _width, _height);
+}
+
+Compositor::Compositor(Method _method,
+                       unsigned int _rank,
+                       unsigned int _nrProcesses,
+                       unsigned int _width,
+                       unsigned int _height)
+  : method_(_method),
+    rank_(_rank),
+    nrProcesses_(_nrProcesses),
+    width_(_width),
+    height_(_height),
+    firstRow_(0),
+    nrRows_(_height),
+    peers_(_nrProcesses, static_cast<Socket*>(NULL)),
+    lastMs_(0.0) {
+  if (method_ == DIRECT_SEND) {
+    Band(rank_, firstRow_, nrRows_);
+  } else {
+    for (unsigned int bit=1; bit<nrProcesses_; bit<<=1) {
+      Halve((rank_ & bit) != 0, firstRow_, nrRows_);
+    }
+  }
+}
+
+Compositor::~Compositor() {
+  for (unsigned int i=0; i<peers_.size(); i++) {
+    delete peers_[i];
+  }
+}
+
+bool Compositor::ParseMethod(std::string _name, Method &_method) {
+  if (_name == "direct") {
+    _method = DIRECT_SEND;
+  } else if (_name == "swap") {
+    _method = BINARY_SWAP;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+std::string Compositor::MethodName(Method _method) {
+  return _method == DIRECT_SEND ? "direct send" : "binary swap";
+}
+
+void Compositor::SetPeer(unsigned int _rank, Socket *_socket) {
+  delete peers_[_rank];
+  peers_[_rank] = _socket;
+}
+
+bool Compositor::Composite(std::vector<float> &_rgba,
+                           std::vector<float> &_depths) {
+  Timer timer;
+  bool composited = method_ == DIRECT_SEND ? DirectSend(_rgba, _depths)
+                                           : BinarySwap(_rgba, _depths);
+  lastMs_ = timer.Milliseconds();
+  return composited;
+}
+
+void Compositor::Merge(float *_rgba,
+                       float *_depths,
+                       const float *_otherRgba,
+                       const float *_otherDepths,
+                       unsigned long long _nrPixels) {
+  for (unsigned long long i=0; i<_nrPixels; i++) {
+    const float *front = &_rgba[4*i];
+    const float *back = &_otherRgba[4*i];
+    if (_otherDepths[i] < _depths[i]) {
+      std::swap(front, back);
+      _depths[i] = _otherDepths[i];
+    }
+    float transparency = 1.f - front[3];
+    float pixel[4];
+    for (unsigned int c=0; c<4; c++) {
+      pixel[c] = front[c] + transparency*back[c];
+    }
+    std::copy(pixel, pixel+4, &_rgba[4*i]);
+  }
+}
+
+void Compositor::Band(unsigned int _rank,
+                      unsigned int &_first,
+                      unsigned int &_count) {
+  _first = _rank*height_/nrProcesses_;
+  _count = (_rank+1)*height_/nrProcesses_ - _first;
+}
+
+void Compositor::Halve(bool _upper,
+                       unsigned int &_first,
+                       unsigned int &_count) {
+  unsigned int lower = _count/2;
+  if (_upper) {
+    _first += lower;
+    _count -= lower;
+  } else {
+    _count = lower;
+  }
+}
+
+bool Compositor::Exchange(unsigned int _to,
+                          const float *_rgba,
+                          const float *_depths,
+                          unsigned int _nrSentRows,
+                          unsigned int _from,
+                          float *_receivedRgba,
+                          float *_receivedDepths,
+                          unsigned int _nrReceivedRows) {
+  Socket *out = peers_[_to];
+  unsigned long long sentPixels = (unsigned long long)_nrSentRows*width_;
+  bool sent = true;
+  std::thread sender([&]() {
+    sent = out->Send(_rgba, sentPixels*4*sizeof(float)) &&
+           out->Send(_depths, sentPixels*sizeof(float));
+  });
+  Socket *in = peers_[_from];
+  unsigned long long receivedPixels =
+    (unsigned long long)_nrReceivedRows*width_;
+  bool received =
+    in->Receive(_receivedRgba, receivedPixels*4*sizeof(float)) &&
+    in->Receive(_receivedDepths, receivedPixels*sizeof(float));
+  sender.join();
+  if (!sent || !received) {
+    std::cout << "Error: Lost connection while compositing\n";
+    return false;
+  }
+  return true;
+}
+
+bool Compositor::DirectSend(std::vector<float> &_rgba,
+                            std::vector<float> &_depths) {
+  unsigned long long nrPixels = (unsigned long long)nrRows_*width_;
+  receivedRgba_.resize((nrProcesses_-1)*nrPixels*4);
+  receivedDepths_.resize((nrProcesses_-1)*nrPixels);
+  // In step s every process sends to the one s ranks above it and
+  // receives from the one s ranks below
+  for (unsigned int s=1; s<nrProcesses_; s++) {
+    unsigned int to = (rank_ + s) % nrProcesses_;
+    unsigned int from = (rank_ + nrProcesses_ - s) % nrProcesses_;
+    unsigned int first, count;
+    Band(to, first, count);
+    if (!Exchange(to,
+                  _rgba.data() + (unsigned long long)first*width_*4,
+                  _depths.data() + (unsigned long long)first*width_,
+                  count,
+                  from,
+                  receivedRgba_.data() + (s-1)*nrPixels*4,
+                  receivedDepths_.data() + (s-1)*nrPixels,
+                  nrRows_)) {
+      return false;
+    }
+  }
+
+  // Front to back by depth, image 0 is this process's own
+  float *rgba = _rgba.data() + (unsigned long long)firstRow_*width_*4;
+  float *depths = _depths.data() + (unsigned long long)firstRow_*width_;
+  std::vector<unsigned int> order(nrProcesses_);
+  std::vector<const float*> images(nrProcesses_);
+  std::vector<float> imageDepths(nrProcesses_);
+  for (unsigned long long i=0; i<nrPixels; i++) {
+    images[0] = &rgba[4*i];
+    imageDepths[0] = depths[i];
+    for (unsigned int j=1; j<nrProcesses_; j++) {
+      images[j] = &receivedRgba_[((j-1)*nrPixels + i)*4];
+      imageDepths[j] = receivedDepths_[(j-1)*nrPixels + i];
+    }
+    // Few images per pixel, insertion sort keeps ties in image order
+    for (unsigned int j=0; j<nrProcesses_; j++) {
+      unsigned int k = j;
+      for (; k>0 && imageDepths[order[k-1]] > imageDepths[j]; k--) {
+        order[k] = order[k-1];
+      }
+      order[k] = j;
+    }
+    float pixel[4] = { 0.f, 0.f, 0.f, 0.f };
+    for (unsigned int j=0; j<nrProcesses_; j++) {
+      const float *image = images[order[j]];
+      float transparency = 1.f - pixel[3];
+      for (unsigned int c=0; c<4; c++) {
+        pixel[c] += transparency*image[c];
+      }
+    }
+    std::copy(pixel, pixel+4, &rgba[4*i]);
+    depths[i] = imageDepths[order[0]];
+  }
+  return true;
+}
+
+bool Compositor::BinarySwap(std::vector<float> &_rgba,
+                            std::vector<float> &_depths) {
+  unsigned int first = 0;
+  unsigned int count = height_;
+  // Ranks differing in the lowest bits hold neighbouring boxes, merging
+  // them first keeps every merged group a box
+  for (unsigned int bit=1; bit<nrProcesses_; bit<<=1) {
+    bool upper = (rank_ & bit) != 0;
+    unsigned int keepFirst = first;
+    unsigned int keepCount = count;
+    Halve(upper, keepFirst, keepCount);
+    unsigned int sendFirst = first;
+    unsigned int sendCount = count;
+    Halve(!upper, sendFirst, sendCount);
+
+    unsigned long long keptPixels = (unsigned long long)keepCount*width_;
+    receivedRgba_.resize(keptPixels*4);
+    receivedDepths_.resize(keptPixels);
+    unsigned int partner = rank_ ^ bit;
+    if (!Exchange(partner,
+                  _rgba.data() + (unsigned long long)sendFirst*width_*4,
+                  _depths.data() + (unsigned long long)sendFirst*width_,
+                  sendCount,
+                  partner,
+                  receivedRgba_.data(),
+                  receivedDepths_.data(),
+                  keepCount)) {
+      return false;
+    }
+    Merge(_rgba.data() + (unsigned long long)keepFirst*width_*4,
+          _depths.data() + (unsigned long long)keepFirst*width_,
+          receivedRgba_.data(),
+          receivedDepths_.data(),
+          keptPixels);
+    first = keepFirst;
+    count = keepCount;
+  }
+  return true;
+}
@@ -0,0 +1,100 @@
+#ifndef COMPOSITOR_H
+#define COMPOSITOR_H
+
+#include <string>
+#include <vector>
+
+class Socket;
+
+// Sort-last compositing of the partial images of a RenderCluster. Every
+// process holds the image of its own subtree as premultiplied RGBA plus
+// the ray depth of every pixel (see octreeFrag.glsl). The subtrees are
+// disjoint boxes, so at any pixel the image with the smaller depth is in
+// front and the images can be composited in visibility order without a
+// global sort. Each process ends up with the final pixels of one band of
+// rows of the image, rows are stored bottom-up like GL reads them.
+class Compositor {
+public:
+  enum Method {
+    // Every process sends each of the others their band of its image and
+    // composites the images of its own band in depth order. N-1 messages
+    // per process.
+    DIRECT_SEND = 0,
+    // Pairs of processes swap halves of the rows they have left, in log2(N)
+    // rounds, and merge the halves they keep. Needs a power of two
+    // processes whose ranks differing in one bit have neighbouring boxes.
+    BINARY_SWAP
+  };
+
+  // Compositor for process _rank of _nrProcesses, for images of the given
+  // size
+  static Compositor * New(Method _method,
+                          unsigned int _rank,
+                          unsigned int _nrProcesses,
+                          unsigned int _width,
+                          unsigned int _height);
+  ~Compositor();
+  // Method by name (direct or swap). Returns false for unknown names.
+  static bool ParseMethod(std::string _name, Method &_method);
+  static std::string MethodName(Method _method);
+  // Connection to another process, the compositor takes ownership
+  void SetPeer(unsigned int _rank, Socket *_socket);
+  // Composites this process's image with those of the others, who have to
+  // call it for the same frame. Afterwards rows [FirstRow(), FirstRow()+
+  // NrRows()) of the image hold final pixels. Returns false if a
+  // connection is lost.
+  bool Composite(std::vector<float> &_rgba, std::vector<float> &_depths);
+  unsigned int FirstRow() { return firstRow_; }
+  unsigned int NrRows() { return nrRows_; }
+  // Time the last Composite() took, including waiting for the others
+  double LastMilliseconds() { return lastMs_; }
+  // Composites the pixels of another image into an image, the nearer
+  // pixel in front. The depths become those of the nearer pixels.
+  static void Merge(float *_rgba,
+                    float *_depths,
+                    const float *_otherRgba,
+                    const float *_otherDepths,
+                    unsigned long long _nrPixels);
+
+private:
+  Compositor(Method _method,
+             unsigned int _rank,
+             unsigned int _nrProcesses,
+             unsigned int _width,
+             unsigned int _height);
+  Compositor(const Compositor&) {}
+  bool DirectSend(std::vector<float> &_rgba, std::vector<float> &_depths);
+  bool BinarySwap(std::vector<float> &_rgba, std::vector<float> &_depths);
+  // Sends rows of an image to one process while receiving rows from
+  // another, so that processes sending each other large images never wait
+  // for each other
+  bool Exchange(unsigned int _to,
+                const float *_rgba,
+                const float *_depths,
+                unsigned int _nrSentRows,
+                unsigned int _from,
+                float *_receivedRgba,
+                float *_receivedDepths,
+                unsigned int _nrReceivedRows);
+  // Band of rows a process ends up with in direct send
+  void Band(unsigned int _rank, unsigned int &_first, unsigned int &_count);
+  // Rows a process keeps of its rows in a binary swap round, the lower or
+  // the upper half
+  static void Halve(bool _upper, unsigned int &_first, unsigned int &_count);
+
+  Method method_;
+  unsigned int rank_;
+  unsigned int nrProcesses_;
+  unsigned int width_;
+  unsigned int height_;
+  unsigned int firstRow_;
+  unsigned int nrRows_;
+  // Indexed by rank, NULL for this process
+  std::vector<Socket*> peers_;
+  // Rows received from other processes
+  std::vector<float> receivedRgba_;
+  std::vector<float> receivedDepths_;
+  double lastMs_;
+};
+
+#endif
@@ -0,0 +1,104 @@
+#include "OctreeFile.h"
+#include "OctreeBuilder.h"
+#include "SoftwareRenderer.h"
+#include "Camera.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cfloat>
+#include <cstdlib>
+#include <chrono>
+
+// Renders an octree file to a PPM image on the CPU, no GL context needed
+int main(int _argc, char **_argv) {
+  if (_argc < 3) {
+    std::cout << "Usage: CpuRenderer <in.oct> <out.ppm> "
+      << "[width height pitch roll yaw intensity opacityThreshold "
+      << "restart|ropes homogeneity]\n";
+    return 1;
+  }
+  unsigned int width = _argc > 3 ? atoi(_argv[3]) : 600;
+  unsigned int height = _argc > 4 ? atoi(_argv[4]) : 600;
+  // Same defaults as the interactive renderer
+  float pitch = _argc > 5 ? (float)atof(_argv[5]) : -30.f;
+  float roll = _argc > 6 ? (float)atof(_argv[6]) : 30.f;
+  float yaw = _argc > 7 ? (float)atof(_argv[7]) : 0.f;
+  float intensity = _argc > 8 ? (float)atof(_argv[8]) : 1.f;
+  float opacityThreshold = _argc > 9 ? (float)atof(_argv[9]) : 0.f;
+  SoftwareRenderer::Traversal traversal = SoftwareRenderer::RESTART_TRAVERSAL;
+  if (_argc > 10 &&
+      !SoftwareRenderer::ParseTraversal(_argv[10], traversal)) {
+    std::cout << "Error: Unknown traversal " << _argv[10] << "\n";
+    return 1;
+  }
+  float homogeneity = _argc > 11 ? (float)atof(_argv[11]) : 0.f;
+
+  OctreeFile *file = OctreeFile::New();
+  if (!file->Open(_argv[1])) {
+    return 1;
+  }
+
+  // The renderer walks float records, expand packed files
+  const void *fileNodes = file->NodeData();
+  if (fileNodes == NULL) {
+    return 1;
+  }
+  const float *nodeData = static_cast<const float*>(fileNodes);
+  std::vector<float> nodes;
+  if (file->Header().nodeLayout == OctreeFile::PACKED_32) {
+    const unsigned int *packed = static_cast<const unsigned int*>(fileNodes);
+    OctreeBuilder::UnpackNodes(packed,
+                               file->Header().nrNodes,
+                               nodes);
+    nodeData = &nodes[0];
+  }
+
+  // NULL for channels the file has means a corrupt block, which the file
+  // has reported
+  const float *rangeData =
+    static_cast<const float*>(file->ChannelData(OctreeFile::RANGE));
+  const float *deviationData =
+    static_cast<const float*>(file->ChannelData(OctreeFile::DEVIATION));
+  if ((rangeData == NULL && file->HasChannel(OctreeFile::RANGE)) ||
+      (deviationData == NULL && file->HasChannel(OctreeFile::DEVIATION))) {
+    return 1;
+  }
+
+  // Older files have no ranges, make every node look visible
+  std::vector<float> ranges;
+  if (rangeData == NULL) {
+    ranges.resize(file->Header().nrNodes*OctreeBuilder::RANGE_SIZE);
+    for (unsigned int i=0; i<ranges.size(); i+=2) {
+      ranges[i] = 0.f;
+      ranges[i+1] = FLT_MAX;
+    }
+    rangeData = &ranges[0];
+  }
+
+  SoftwareRenderer *renderer = SoftwareRenderer::New();
+  renderer->SetNodes(nodeData,
+                     rangeData,
+                     file->Header().maxDepth);
+  renderer->SetMatrices(Camera::ModelMatrix(pitch, roll, yaw),
+                        Camera::ViewMatrix(),
+                        Camera::ProjMatrix((float)width/(float)height));
+  renderer->SetIntensity(intensity);
+  renderer->SetOpacityThreshold(opacityThreshold);
+  renderer->SetTraversal(traversal);
+  // Files without deviations descend everywhere
+  renderer->SetDeviations(deviationData, homogeneity);
+
+  std::chrono::high_resolution_clock::time_point start =
+    std::chrono::high_resolution_clock::now();
+  renderer->Render(width, height);
+  double seconds = std::chrono::duration<double>(
+    std::chrono::high_resolution_clock::now() - start).count();
+  std::cout << "Rendered " << width << "x" << height << " in "
+    << seconds*1000.0 << " ms ("
+    << (double)width*height/seconds/1e6 << " Mrays/s)\n";
+
+  bool success = renderer->WritePPM(_argv[2]);
+  delete renderer;
+  delete file;
+  return success ? 0 : 1;
+}
@@ -0,0 +1,219 @@
+#include "FrameProfiler.h"
+#include <gl\glew.h>
+#include <sstream>
+#include <algorithm>
+
+FrameProfiler::Stats::Stats()
+  : next_(0) {}
+
+void FrameProfiler::Stats::Add(double _ms) {
+  if (samples_.size() < WINDOW) {
+    samples_.push_back(_ms);
+  } else {
+    samples_[next_] = _ms;
+  }
+  next_ = (next_ + 1) % WINDOW;
+}
+
+double FrameProfiler::Stats::Mean() const {
+  if (samples_.empty()) {
+    return 0.0;
+  }
+  double sum = 0.0;
+  for (unsigned int i=0; i<samples_.size(); i++) {
+    sum += samples_[i];
+  }
+  return sum/samples_.size();
+}
+
+double FrameProfiler::Stats::Min() const {
+  if (samples_.empty()) {
+    return 0.0;
+  }
+  return *std::min_element(samples_.begin(), samples_.end());
+}
+
+double FrameProfiler::Stats::Max() const {
+  if (samples_.empty()) {
+    return 0.0;
+  }
+  return *std::max_element(samples_.begin(), samples_.end());
+}
+
+double FrameProfiler::Stats::Last() const {
+  if (samples_.empty()) {
+    return 0.0;
+  }
+  return samples_[(next_ + samples_.size() - 1) % samples_.size()];
+}
+
+FrameProfiler * FrameProfiler::New() {
+  return new FrameProfiler();
+}
+
+FrameProfiler::FrameProfiler()
+  : frame_(0),
+    droppedQueries_(0),
+    initialized_(false) {}
+
+FrameProfiler::~FrameProfiler() {
+  if (!initialized_) {
+    return;
+  }
+  for (unsigned int i=0; i<passes_.size(); i++) {
+    glDeleteQueries(NR_BUFFERS, passes_[i].queries_);
+  }
+}
+
+unsigned int FrameProfiler::AddPass(std::string _name) {
+  Pass pass;
+  pass.name_ = _name;
+  for (unsigned int b=0; b<NR_BUFFERS; b++) {
+    pass.queries_[b] = 0;
+    pass.pending_[b] = false;
+  }
+  passes_.push_back(pass);
+  return passes_.size() - 1;
+}
+
+void FrameProfiler::Init() {
+  for (unsigned int i=0; i<passes_.size(); i++) {
+    glGenQueries(NR_BUFFERS, passes_[i].queries_);
+  }
+  initialized_ = true;
+}
+
+void FrameProfiler::BeginFrame() {
+  if (frame_ > 0) {
+    frameInterval_.Add(intervalTimer_.Milliseconds());
+  }
+  intervalTimer_.Restart();
+  frameTimer_.Restart();
+  // Pick up whatever earlier frames have finished
+  for (unsigned int i=0; i<passes_.size(); i++) {
+    for (unsigned int b=0; b<NR_BUFFERS; b++) {
+      Collect(passes_[i], b, false);
+    }
+  }
+}
+
+void FrameProfiler::EndFrame() {
+  frameCpu_.Add(frameTimer_.Milliseconds());
+  frame_++;
+}
+
+void FrameProfiler::BeginPass(unsigned int _pass) {
+  Pass &pass = passes_[_pass];
+  unsigned int buffer = frame_ % NR_BUFFERS;
+  if (pass.pending_[buffer]) {
+    // Still running after NR_BUFFERS frames, drop it rather than stall
+    pass.pending_[buffer] = false;
+    droppedQueries_++;
+  }
+  glBeginQuery(GL_TIME_ELAPSED, pass.queries_[buffer]);
+  pass.cpuTimer_.Restart();
+}
+
+void FrameProfiler::EndPass(unsigned int _pass) {
+  Pass &pass = passes_[_pass];
+  glEndQuery(GL_TIME_ELAPSED);
+  pass.pending_[frame_ % NR_BUFFERS] = true;
+  pass.cpu_.Add(pass.cpuTimer_.Milliseconds());
+}
+
+void FrameProfiler::Finish() {
+  for (unsigned int i=0; i<passes_.size(); i++) {
+    for (unsigned int b=0; b<NR_BUFFERS; b++) {
+      Collect(passes_[i], b, true);
+    }
+  }
+}
+
+void FrameProfiler::Collect(Pass &_pass, unsigned int _buffer, bool _wait) {
+  if (!_pass.pending_[_buffer]) {
+    return;
+  }
+  if (!_wait) {
+    int available = 0;
+    glGetQueryObjectiv(_pass.queries_[_buffer],
+                       GL_QUERY_RESULT_AVAILABLE,
+                       &available);
+    if (!available) {
+      return;
+    }
+  }
+  GLuint64 nanoseconds = 0;
+  glGetQueryObjectui64v(_pass.queries_[_buffer], GL_QUERY_RESULT, &nanoseconds);
+  _pass.gpu_.Add(static_cast<double>(nanoseconds)*1e-6);
+  _pass.pending_[_buffer] = false;
+}
+
+double FrameProfiler::LastGpuMs() const {
+  double sum = 0.0;
+  for (unsigned int i=0; i<passes_.size(); i++) {
+    sum += passes_[i].gpu_.Last();
+  }
+  return sum;
+}
+
+std::string FrameProfiler::Summary() const {
+  std::ostringstream out;
+  out.precision(2);
+  out << std::fixed;
+  double interval = frameInterval_.Mean();
+  if (interval > 0.0) {
+    out << 1000.0/interval << " fps";
+  }
+  for (unsigned int i=0; i<passes_.size(); i++) {
+    out << " | " << passes_[i].name_ << " " << passes_[i].gpu_.Mean()
+      << " ms";
+  }
+  return out.str();
+}
+
+void FrameProfiler::Print(std::ostream &_out) const {
+  std::ostringstream out;
+  out.precision(3);
+  out << std::fixed;
+  out << "Frame stats over the last " << frameCpu_.samples_.size()
+    << " of " << frame_ << " frames (mean / min / max ms)\n";
+  out << "  frame interval: " << frameInterval_.Mean() << " / "
+    << frameInterval_.Min() << " / " << frameInterval_.Max() << "\n";
+  out << "  frame cpu:      " << frameCpu_.Mean() << " / "
+    << frameCpu_.Min() << " / " << frameCpu_.Max() << "\n";
+  for (unsigned int i=0; i<passes_.size(); i++) {
+    const Pass &pass = passes_[i];
+    out << "  " << pass.name_ << " gpu: " << pass.gpu_.Mean() << " / "
+      << pass.gpu_.Min() << " / " << pass.gpu_.Max() << ", cpu: "
+      << pass.cpu_.Mean() << " / " << pass.cpu_.Min() << " / "
+      << pass.cpu_.Max() << "\n";
+  }
+  out << "  dropped queries: " << droppedQueries_ << "\n";
+  _out << out.str();
+}
+
+void FrameProfiler::WriteStats(std::ostream &_out, const Stats &_stats) {
+  _out << "{\"mean_ms\": " << _stats.Mean()
+    << ", \"min_ms\": " << _stats.Min()
+    << ", \"max_ms\": " << _stats.Max()
+    << ", \"samples\": " << _stats.samples_.size() << "}";
+}
+
+void FrameProfiler::WriteJSON(std::ostream &_out) const {
+  _out << "{\n  \"frames\": " << frame_
+    << ",\n  \"dropped_queries\": " << droppedQueries_
+    << ",\n  \"frame_interval\": ";
+  WriteStats(_out, frameInterval_);
+  _out << ",\n  \"frame_cpu\": ";
+  WriteStats(_out, frameCpu_);
+  _out << ",\n  \"passes\": [\n";
+  for (unsigned int i=0; i<passes_.size(); i++) {
+    const Pass &pass = passes_[i];
+    _out << "    {\"name\": \"" << pass.name_ << "\", \"gpu\": ";
+    WriteStats(_out, pass.gpu_);
+    _out << ", \"cpu\": ";
+    WriteStats(_out, pass.cpu_);
+    _out << "}" << (i+1 < passes_.size() ? "," : "") << "\n";
+  }
+  _out << "  ]\n}\n";
+}
@@ -0,0 +1,85 @@
+#ifndef FRAMEPROFILER_H
+#define FRAMEPROFILER_H
+
+#include "Timer.h"
+#include <string>
+#include <vector>
+#include <ostream>
+
+// Per pass GPU and CPU times with rolling statistics. GPU times come from
+// GL_TIME_ELAPSED queries, double buffered so that results are read a
+// frame later and never stall the pipeline. A result that is still not
+// available when its query is reused is dropped instead of waited for.
+// CPU times measure how long the pass takes to submit.
+class FrameProfiler {
+public:
+  static FrameProfiler * New();
+  ~FrameProfiler();
+
+  // Number of frames the rolling statistics cover
+  static const unsigned int WINDOW = 120;
+  // Frames a query can be in flight before it is reused
+  static const unsigned int NR_BUFFERS = 2;
+
+  // Registers a pass before Init(), returns its index
+  unsigned int AddPass(std::string _name);
+  // Creates the GL queries, needs a current context
+  void Init();
+
+  void BeginFrame();
+  void EndFrame();
+  void BeginPass(unsigned int _pass);
+  void EndPass(unsigned int _pass);
+  // Waits for all queries in flight, for the end of a batch
+  void Finish();
+
+  unsigned long long NrFrames() const { return frame_; }
+  // Sum of the latest GPU time of every pass, from a frame or two back
+  double LastGpuMs() const;
+  // Short summary of the averages, fits in a window title
+  std::string Summary() const;
+  // Table with mean, min and max of every pass
+  void Print(std::ostream &_out) const;
+  void WriteJSON(std::ostream &_out) const;
+
+private:
+  FrameProfiler();
+  FrameProfiler(const FrameProfiler&) {}
+
+  // Rolling window of samples in milliseconds
+  struct Stats {
+    Stats();
+    void Add(double _ms);
+    double Mean() const;
+    double Min() const;
+    double Max() const;
+    double Last() const;
+    std::vector<double> samples_;
+    unsigned int next_;
+  };
+
+  struct Pass {
+    std::string name_;
+    unsigned int queries_[NR_BUFFERS];
+    bool pending_[NR_BUFFERS];
+    Timer cpuTimer_;
+    Stats cpu_;
+    Stats gpu_;
+  };
+
+  // Reads the result of a query if it is done, or waits for it
+  void Collect(Pass &_pass, unsigned int _buffer, bool _wait);
+  static void WriteStats(std::ostream &_out, const Stats &_stats);
+
+  std::vector<Pass> passes_;
+  // Time between frame starts, and CPU time within the frame
+  Stats frameInterval_;
+  Stats frameCpu_;
+  Timer intervalTimer_;
+  Timer frameTimer_;
+  unsigned long long frame_;
+  unsigned long long droppedQueries_;
+  bool initialized_;
+};
+
+#endif
@@ -0,0 +1,103 @@
+#include "LodController.h"
+#include "FrameProfiler.h"
+#include <cmath>
+#include <algorithm>
+
+// Frame times outside [LOW, HIGH] times the target change the detail
+static const double LOW_FRACTION = 0.5;
+static const double HIGH_FRACTION = 1.2;
+// Narrower band for the resolution, which changes in small steps
+static const double SCALE_LOW_FRACTION = 0.8;
+static const double SCALE_HIGH_FRACTION = 1.1;
+// Frame time goes with the pixels, the square of the scale. Half of the
+// change that would hit the target is made per frame, since measurements
+// lag a couple of frames.
+static const double SCALE_EXPONENT = 0.25;
+static const float MIN_RENDER_SCALE = 0.25f;
+
+LodController * LodController::New() {
+  return new LodController();
+}
+
+LodController::LodController()
+  : maxLevel_(0),
+    interactiveLevel_(0),
+    interactiveStepScale_(1),
+    interactiveRenderScale_(1.f),
+    targetMs_(33.0),
+    interacting_(false),
+    settleFrames_(0) {}
+
+void LodController::SetMaxLevel(unsigned int _maxLevel) {
+  maxLevel_ = _maxLevel;
+  // Start optimistic, the first drag finds the level the GPU can handle
+  interactiveLevel_ = _maxLevel;
+  interactiveStepScale_ = 1;
+  interactiveRenderScale_ = 1.f;
+}
+
+void LodController::SetTargetMs(double _targetMs) {
+  targetMs_ = _targetMs;
+}
+
+void LodController::Update(bool _interacting, double _frameMs) {
+  if (_interacting != interacting_) {
+    interacting_ = _interacting;
+    settleFrames_ = FrameProfiler::NR_BUFFERS + 1;
+    return;
+  }
+  if (!interacting_ || _frameMs <= 0.0) {
+    return;
+  }
+  if (settleFrames_ > 0) {
+    settleFrames_--;
+    return;
+  }
+
+  // Resolution is given up first and won back last
+  bool fullDetail = interactiveLevel_ == maxLevel_ &&
+                    interactiveStepScale_ == 1;
+  if ((_frameMs > SCALE_HIGH_FRACTION*targetMs_ &&
+       interactiveRenderScale_ > MIN_RENDER_SCALE) ||
+      (_frameMs < SCALE_LOW_FRACTION*targetMs_ &&
+       interactiveRenderScale_ < 1.f && fullDetail)) {
+    float scale = interactiveRenderScale_*
+      static_cast<float>(pow(targetMs_/_frameMs, SCALE_EXPONENT));
+    interactiveRenderScale_ = std::min(1.f, std::max(MIN_RENDER_SCALE, scale));
+    return;
+  }
+
+  unsigned int minLevel = maxLevel_ < MIN_LEVEL ? maxLevel_ : MIN_LEVEL;
+  if (_frameMs > HIGH_FRACTION*targetMs_) {
+    if (interactiveLevel_ > minLevel) {
+      interactiveLevel_--;
+    } else if (interactiveStepScale_ < MAX_STEP_SCALE) {
+      interactiveStepScale_ *= 2;
+    } else {
+      return;
+    }
+  } else if (_frameMs < LOW_FRACTION*targetMs_) {
+    if (interactiveStepScale_ > 1) {
+      interactiveStepScale_ /= 2;
+    } else if (interactiveLevel_ < maxLevel_) {
+      interactiveLevel_++;
+    } else {
+      return;
+    }
+  } else {
+    return;
+  }
+  settleFrames_ = FrameProfiler::NR_BUFFERS + 1;
+}
+
+unsigned int LodController::Level() const {
+  return interacting_ ? interactiveLevel_ : maxLevel_;
+}
+
+float LodController::StepScale() const {
+  return interacting_ ? static_cast<float>(interactiveStepScale_) : 1.f;
+}
+
+float LodController::RenderScale() const {
+  return interacting_ ? interactiveRenderScale_ : 1.f;
+}
@@ -0,0 +1,46 @@
+#ifndef LODCONTROLLER_H
+#define LODCONTROLLER_H
+
+// Picks the render resolution, octree level and brick sampling rate for
+// the next frame. When idle the full tree is rendered at full resolution.
+// While the user interacts, measured frame times steer the detail towards
+// a target frame time: too slow frames first lower the resolution, which
+// follows the frame time every frame, then give up level, then sampling
+// rate. Fast frames win them back in the opposite order. The interactive
+// detail is kept between drags, so a weak GPU only has to find it once.
+class LodController {
+public:
+  static LodController * New();
+  // Deepest level of the tree, rendered when idle
+  void SetMaxLevel(unsigned int _maxLevel);
+  void SetTargetMs(double _targetMs);
+  double TargetMs() const { return targetMs_; }
+  // Call once per frame before rendering, with the latest measured frame
+  // time in milliseconds
+  void Update(bool _interacting, double _frameMs);
+  unsigned int Level() const;
+  // Multiplier on the brick sampling step
+  float StepScale() const;
+  // Fraction of the window width and height the volume is rendered at,
+  // down to 0.25
+  float RenderScale() const;
+
+  // Coarsest level and sparsest sampling the budget may go down to
+  static const unsigned int MIN_LEVEL = 1;
+  static const unsigned int MAX_STEP_SCALE = 4;
+
+private:
+  LodController();
+  LodController(const LodController&) {}
+
+  unsigned int maxLevel_;
+  unsigned int interactiveLevel_;
+  unsigned int interactiveStepScale_;
+  float interactiveRenderScale_;
+  double targetMs_;
+  bool interacting_;
+  // Frames to skip after a change, measurements lag a couple of frames
+  unsigned int settleFrames_;
+};
+
+#endif
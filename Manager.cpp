@@ -1,18 +1,40 @@
 ﻿#include "Manager.h"
 #include "ShaderProgram.h"
-#include "Texture2D.h"
 #include "VolumeTexture.h"
+#include "Camera.h"
+#include "BrickPool.h"
+#include "OffscreenContext.h"
+#include "Timer.h"
+#include "FrameProfiler.h"
+#include "UniformBuffer.h"
+#include "LodController.h"
+#include "TransferFunction.h"
+#include "TimeSeries.h"
+#include "VolumeLoader.h"
+#include "BrickCache.h"
+#include "Texture2D.h"
+#include "RenderCluster.h"
+#include "Morton.h"
 #include <gl\glew.h>
 #include <gl\glut.h>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <algorithm>
+
+// glGetError syncs with the driver, so in the per frame path errors are
+// only checked in debug builds
+#ifdef _DEBUG
+#define CHECK_FRAME_ERRORS(_location) CheckGLErrors(_location)
+#else
+#define CHECK_FRAME_ERRORS(_location)
+#endif
 
 // Static definitions
 unsigned int Manager::cubePositionBufferObject_;
-unsigned int Manager::renderbufferObject_;
-unsigned int Manager::cubeFrontFBO_;
-unsigned int Manager::cubeBackFBO_;
-unsigned int Manager::cubePositionAttrib_;
+unsigned int Manager::renderbufferObject_ = 0;
+unsigned int Manager::cubeVAO_;
 glm::mat4 Manager::model_;
 glm::mat4 Manager::view_;
 glm::mat4 Manager::proj_;
@@ -22,11 +44,37 @@ float Manager::roll_ = 30.f;
 bool Manager::mouseDown_ = false;
 int Manager::lastMouseX_ = 0;
 int Manager::lastMouseY_ = 0;
-ShaderProgram *Manager::cubeShaderProg_;
 ShaderProgram *Manager::volumeShaderProg_;
-Texture2D *Manager::cubeFrontTex_;
-Texture2D *Manager::cubeBackTex_;
-VolumeTexture *Manager::volumeTex_;
+VolumeTexture *Manager::volumeTex_ = NULL;
+ShaderProgram *Manager::upscaleShaderProg_ = NULL;
+int Manager::sourceSizeLocation_ = -1;
+int Manager::targetSizeLocation_ = -1;
+TimeSeries *Manager::timeSeries_ = NULL;
+VolumeLoader *Manager::loader_ = NULL;
+int Manager::loadedLevels_ = 0;
+OffscreenContext *Manager::offscreenContext_ = NULL;
+FrameProfiler *Manager::profiler_ = NULL;
+UniformBuffer *Manager::transformBuffer_ = NULL;
+UniformBuffer *Manager::constantsBuffer_ = NULL;
+bool Manager::constantsDirty_ = false;
+unsigned int Manager::accumFBO_ = 0;
+Texture2D *Manager::accumTexture_ = NULL;
+unsigned int Manager::renderWidth_ = 0;
+unsigned int Manager::renderHeight_ = 0;
+unsigned int Manager::refinementFrame_ = 0;
+int Manager::stepJitterLocation_ = -1;
+LodController *Manager::lod_ = NULL;
+int Manager::maxLevelLocation_ = -1;
+int Manager::stepScaleLocation_ = -1;
+Manager::Traversal Manager::traversal_ = Manager::ROPE_TRAVERSAL;
+int Manager::traversalLocation_ = -1;
+unsigned int Manager::feedbackbufferObject_ = 0;
+int Manager::feedbackPickLocation_ = -1;
+unsigned int Manager::rayDepthbufferObject_ = 0;
+bool Manager::rayDepths_ = false;
+TransferFunction *Manager::transferFunction_ = NULL;
+std::string Manager::transferFunctionFileName_;
+bool Manager::showStats_ = true;
 std::vector< std::pair<std::string, float> > Manager::constants_ ;
 std::string Manager::configFileName_;
 
@@ -48,7 +96,19 @@ void Manager::InitWindow(int &_argc, char **_argv) {
   glutInitWindowSize(width_, height_);
   glutCreateWindow("Volume renderer - Victor Sand");
   std::cout << "Window initialized\n\n";
+  InitGLEW();
+}
 
+void Manager::InitOffscreen(int &_argc, char **_argv) {
+  std::cout << "Initializing offscreen context and GLEW\n";
+  offscreenContext_ = OffscreenContext::New();
+  if (!offscreenContext_->Create(_argc, _argv, width_, height_)) {
+    exit(1);
+  }
+  InitGLEW();
+}
+
+void Manager::InitGLEW() {
   char* version = (char*)glGetString(GL_VERSION);
   if (version) {
     std::cout << "OpenGL version: " << version << "\n";
@@ -64,17 +124,19 @@ void Manager::InitWindow(int &_argc, char **_argv) {
   }
 
   glClearColor(.0f, .0f, .0f, 1.f);
+
+  // Passes are registered in the order of the Pass enum
+  profiler_ = FrameProfiler::New();
+  profiler_->AddPass("volume");
+  profiler_->AddPass("upscale");
+  profiler_->Init();
   CheckGLErrors();
 }
 
 void Manager::InitMatrices() {
   // Set perspective, flip coord system and set up camera
-  proj_ = glm::perspective(40.f, 
-                          (float)width_/(float)height_,
-                          0.1f,
-                          100.f);
-  view_ = glm::rotate(glm::mat4(1.f), 180.f, glm::vec3(1.f, 0.f, 0.f));
-  view_ = glm::translate(view_, glm::vec3(-0.5f, -0.5f, 2.2f));
+  proj_ = Camera::ProjMatrix((float)width_/(float)height_);
+  view_ = Camera::ViewMatrix();
 }
 
 void Manager::InitCallbacks() {
@@ -134,70 +196,136 @@ void Manager::InitCubePositionBuffer() {
   glGenBuffers(1, &cubePositionBufferObject_);
   glBindBuffer(GL_ARRAY_BUFFER, cubePositionBufferObject_);
   glBufferData(GL_ARRAY_BUFFER, sizeof(float)*144, v, GL_STATIC_DRAW);
+
+  // Both programs read the position from location 0
+  glGenVertexArrays(1, &cubeVAO_);
+  glBindVertexArray(cubeVAO_);
+  glEnableVertexAttribArray(0);
+  glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, 0);
+  glBindVertexArray(0);
   glBindBuffer(GL_ARRAY_BUFFER, 0);
   CheckGLErrors();
 }
 
+void Manager::InitRenderState() {
+  transformBuffer_ = UniformBuffer::New(TRANSFORM_BINDING);
+  if (!transformBuffer_->Init(volumeShaderProg_, "Transform")) {
+    exit(1);
+  }
+  constantsBuffer_ = UniformBuffer::New(CONSTANTS_BINDING);
+  if (!constantsBuffer_->Init(volumeShaderProg_, "Constants")) {
+    exit(1);
+  }
+  constantsDirty_ = true;
+
+  // Texture units never change, only the bound textures do
+  volumeShaderProg_->SetSampler("volumeTex", 0);
+  volumeShaderProg_->SetSampler("rangeTex", 1);
+  // Set even without bricks, a sampler left on unit 0 would clash with
+  // volumeTex and make the draw call fail
+  volumeShaderProg_->SetSampler("brickTex", 2);
+  volumeShaderProg_->SetSampler("transferFunc", 3);
+  volumeShaderProg_->SetSampler("opacityTable", 4);
+  volumeShaderProg_->SetSampler("deviationTex", 5);
+  volumeShaderProg_->SetSampler("pageTable", 6);
+  volumeShaderProg_->SetSampler("gradientTex", 7);
+  stepJitterLocation_ = volumeShaderProg_->UniformLocation("stepJitter");
+  maxLevelLocation_ = volumeShaderProg_->UniformLocation("maxLevel");
+  stepScaleLocation_ = volumeShaderProg_->UniformLocation("stepScale");
+  traversalLocation_ = volumeShaderProg_->UniformLocation("traversal");
+  feedbackPickLocation_ = volumeShaderProg_->UniformLocation("feedbackPick");
+  lod_ = LodController::New();
+  CheckGLErrors("InitRenderState()");
+}
+
 void Manager::InitFramebuffer() {
+  glGenFramebuffers(1, &accumFBO_);
+  AllocateRenderTargets();
+
+  // Batch views are always rendered at full resolution
+  if (offscreenContext_ == NULL) {
+    upscaleShaderProg_ = ShaderProgram::New();
+    upscaleShaderProg_->CreateShader(ShaderProgram::VERTEX,
+                                     "upscaleVert.glsl");
+    upscaleShaderProg_->CreateShader(ShaderProgram::FRAGMENT,
+                                     "upscaleFrag.glsl");
+    upscaleShaderProg_->CreateProgram();
+    upscaleShaderProg_->SetSampler("source", 0);
+    sourceSizeLocation_ = upscaleShaderProg_->UniformLocation("sourceSize");
+    targetSizeLocation_ = upscaleShaderProg_->UniformLocation("targetSize");
+  }
+  
+  CheckGLErrors();
+}
+
+void Manager::AllocateRenderTargets() {
+  unsigned int width = Instance().width_;
+  unsigned int height = Instance().height_;
+  if (renderbufferObject_ != 0) {
+    glDeleteRenderbuffers(1, &renderbufferObject_);
+    glDeleteRenderbuffers(1, &feedbackbufferObject_);
+    glDeleteRenderbuffers(1, &rayDepthbufferObject_);
+  }
+
   // Renderbuffer for depth component
   glGenRenderbuffers(1, &renderbufferObject_);
   glBindRenderbuffer(GL_RENDERBUFFER, renderbufferObject_);
   glRenderbufferStorage(GL_RENDERBUFFER,
                         GL_DEPTH_COMPONENT,
-                        width_, 
-                        height_);
+                        width, 
+                        height);
   glBindRenderbuffer(GL_RENDERBUFFER, 0);
 
-  // Front and back cube textures to different FBO's
-  glGenFramebuffers(1, &cubeFrontFBO_);
-  glBindFramebuffer(GL_FRAMEBUFFER, cubeFrontFBO_);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, 
-                         GL_COLOR_ATTACHMENT0,
-                         GL_TEXTURE_2D, 
-                         cubeFrontTex_->Handle(),
-                         0);  
-  glFramebufferRenderbuffer(GL_FRAMEBUFFER, 
-                            GL_DEPTH_ATTACHMENT, 
-                            GL_RENDERBUFFER,
-                            renderbufferObject_);
-  GLenum status;
-  status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-  if (status != GL_FRAMEBUFFER_COMPLETE) {
-    std::cout << "Error: Framebuffer not complete" << std::endl;
-    exit(1);
+  // Float target the refinement frames are averaged into, a texture so
+  // that it can be scaled up to the window
+  if (accumTexture_ == NULL) {
+    accumTexture_ = Texture2D::New(width, height);
+    accumTexture_->Init(GL_RGBA32F, GL_RGBA, GL_FLOAT);
+  } else {
+    accumTexture_->Resize(width, height);
   }
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-  glGenFramebuffers(1, &cubeBackFBO_);
-  glBindFramebuffer(GL_FRAMEBUFFER, cubeBackFBO_);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, 
+  glBindFramebuffer(GL_FRAMEBUFFER, accumFBO_);
+  glFramebufferTexture2D(GL_FRAMEBUFFER,
                          GL_COLOR_ATTACHMENT0,
-                         GL_TEXTURE_2D, 
-                         cubeBackTex_->Handle(),
-                         0);  
+                         GL_TEXTURE_2D,
+                         accumTexture_->Handle(),
+                         0);
   glFramebufferRenderbuffer(GL_FRAMEBUFFER, 
                             GL_DEPTH_ATTACHMENT, 
                             GL_RENDERBUFFER,
                             renderbufferObject_);
-
-  status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  // Integer target, blending leaves it alone
+  glGenRenderbuffers(1, &feedbackbufferObject_);
+  glBindRenderbuffer(GL_RENDERBUFFER, feedbackbufferObject_);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_R32UI, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER,
+                            GL_COLOR_ATTACHMENT0 + FEEDBACK_ATTACHMENT,
+                            GL_RENDERBUFFER,
+                            feedbackbufferObject_);
+  glGenRenderbuffers(1, &rayDepthbufferObject_);
+  glBindRenderbuffer(GL_RENDERBUFFER, rayDepthbufferObject_);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_R32F, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER,
+                            GL_COLOR_ATTACHMENT0 + RAY_DEPTH_ATTACHMENT,
+                            GL_RENDERBUFFER,
+                            rayDepthbufferObject_);
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
   if (status != GL_FRAMEBUFFER_COMPLETE) {
     std::cout << "Error: Framebuffer not complete" << std::endl;
     exit(1);
   }
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
-  
-  CheckGLErrors();
+  // The accumulated frames are gone
+  renderWidth_ = 0;
+  renderHeight_ = 0;
+  CheckGLErrors("AllocateRenderTargets()");
 }
 
 void Manager::UpdateMatrices() {
-  model_ = glm::mat4(1.f);
-  model_ = glm::translate(model_, glm::vec3(0.5f, 0.5f, 0.5f));
-  model_ = glm::rotate(model_, roll_, glm::vec3(1.f, 0.f, 0.0));
-  model_ = glm::rotate(model_, -pitch_, glm::vec3(0.f, 1.f, 0.0));
-  model_ = glm::rotate(model_, yaw_, glm::vec3(0.f, 0.f, 1.f));
-  model_ = glm::translate(model_, glm::vec3(-0.5f, -0.5f, -0.5f));
-  CheckGLErrors();
+  model_ = Camera::ModelMatrix(pitch_, roll_, yaw_);
+  CHECK_FRAME_ERRORS("UpdateMatrices()");
 }
 
 void Manager::ReadConfigFile() {
@@ -207,6 +335,8 @@ void Manager::ReadConfigFile() {
   if (inFileStream.is_open()) {
     std::string uniform;
     float value;
+    constants_.clear();
+    constantsDirty_ = true;
     while (!inFileStream.eof()) {
       inFileStream >> uniform;
       inFileStream >> value;
@@ -218,122 +348,544 @@ void Manager::ReadConfigFile() {
   }
 }
 
-void Manager::BindTransformationMatrices(ShaderProgram * _program) {
-  _program->BindMatrix4fv("modelMatrix", &model_[0][0]);
-  _program->BindMatrix4fv("viewMatrix", &view_[0][0]);
-  _program->BindMatrix4fv("projMatrix", &proj_[0][0]);
+void Manager::ReadTransferFunction() {
+  if (transferFunction_ == NULL) {
+    transferFunction_ = TransferFunction::New();
+  }
+  bool loaded = !transferFunctionFileName_.empty() &&
+    transferFunction_->ReadFromFile(transferFunctionFileName_);
+  if (!loaded) {
+    // Keep the last good one around when reloading a broken file
+    loaded = transferFunction_->Handle() != 0;
+  }
+  if (!loaded) {
+    std::cout << "No transfer function, integrating raw values\n";
+  }
+  volumeShaderProg_->BindInt("useTransferFunction", loaded ? 1 : 0);
+}
+
+void Manager::BindTransformationMatrices() {
+  // Refinement frames shift the image by a sub-pixel offset, the first
+  // frame is not shifted
+  glm::mat4 proj = proj_;
+  if (refinementFrame_ > 0) {
+    proj = Camera::JitterMatrix(Camera::Halton(refinementFrame_, 2) - 0.5f,
+                                Camera::Halton(refinementFrame_, 3) - 0.5f,
+                                renderWidth_,
+                                renderHeight_) * proj_;
+  }
+  // Takes clip space back to the unit cube, for the eye rays
+  glm::mat4 inverse = glm::inverse(proj*view_*model_);
+  transformBuffer_->SetMatrix4("modelMatrix", &model_[0][0]);
+  transformBuffer_->SetMatrix4("viewMatrix", &view_[0][0]);
+  transformBuffer_->SetMatrix4("projMatrix", &proj[0][0]);
+  transformBuffer_->SetMatrix4("inverseMatrix", &inverse[0][0]);
+  transformBuffer_->Update();
 }
 
 void Manager::BindShaderConstants() {
-  std::vector< std::pair<std::string, float> >::iterator it;
-  for (it=constants_.begin(); it!=constants_.end(); it++) {
-    volumeShaderProg_->BindFloat((*it).first, (*it).second);
+  // Only copied after the config file has been (re)read
+  if (constantsDirty_) {
+    std::vector< std::pair<std::string, float> >::iterator it;
+    for (it=constants_.begin(); it!=constants_.end(); it++) {
+      constantsBuffer_->SetFloat((*it).first, (*it).second);
+    }
+    constantsDirty_ = false;
   }
+  // Rays are set up for the pixels actually rendered, whatever size the
+  // config file gives
+  constantsBuffer_->SetFloat("winSizeX", static_cast<float>(renderWidth_));
+  constantsBuffer_->SetFloat("winSizeY", static_cast<float>(renderHeight_));
+  constantsBuffer_->Update();
+}
+
+void Manager::RequestRedraw() {
+  refinementFrame_ = 0;
+  glutPostRedisplay();
+}
+
+void Manager::UpdateLoader() {
+  loader_->Update(LOAD_BUDGET);
+  if (loader_->Failed()) {
+    std::cout << "Error: Could not load the volume\n";
+    exit(1);
+  }
+  int levels = loader_->LevelsReady();
+  if (levels == 0) {
+    return;
+  }
+  // Switches from the coarse levels to the whole tree once it has more
+  if (loader_->Texture() != volumeTex_) {
+    Instance().SetVolumeTexture(loader_->Texture());
+    loadedLevels_ = 0;
+  }
+  // Only complete levels are traversed, SetVolumeTexture() allowed all
+  if (levels != loadedLevels_) {
+    loadedLevels_ = levels;
+    lod_->SetMaxLevel(levels-1);
+    RequestRedraw();
+  }
+  if (loader_->Done()) {
+    delete loader_;
+    loader_ = NULL;
+  }
+}
+
+void Manager::DrawProgressBar(float _fraction) {
+  int width = Instance().width_;
+  glEnable(GL_SCISSOR_TEST);
+  glScissor(0, 0, width, PROGRESS_BAR_HEIGHT);
+  glClearColor(.2f, .2f, .2f, 1.f);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glScissor(0, 0, (int)(_fraction*width), PROGRESS_BAR_HEIGHT);
+  glClearColor(.8f, .8f, .8f, 1.f);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glDisable(GL_SCISSOR_TEST);
+  glClearColor(0.f, 0.f, 0.f, 1.f);
 }
 
 void Manager::RenderScene() {
+  if (loader_ != NULL) {
+    UpdateLoader();
+  }
+  if (timeSeries_ != NULL && timeSeries_->Update()) {
+    Instance().SetVolumeTexture(timeSeries_->Current());
+  }
+  // Bricks the last frame missed
+  if (volumeTex_ != NULL && volumeTex_->Cache() != NULL &&
+      volumeTex_->Cache()->Update(BRICK_BUDGET)) {
+    RequestRedraw();
+  }
 
-  CheckGLErrors("RenderScene() start");
+  if (volumeTex_ == NULL) {
+    // Nothing to draw before the root level has arrived
+    std::ostringstream title;
+    title << "Volume renderer - Loading "
+      << static_cast<int>(loader_->Progress()*100.f) << "%";
+    glutSetWindowTitle(title.str().c_str());
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glClear(GL_COLOR_BUFFER_BIT);
+    DrawProgressBar(loader_->Progress());
+    glutSwapBuffers();
+    glutPostRedisplay();
+    return;
+  }
 
-  BindShaderConstants();
+  profiler_->BeginFrame();
+  RenderFrame(0);
+  profiler_->EndFrame();
+  if (loader_ != NULL) {
+    DrawProgressBar(loader_->Progress());
+  }
+  glutSwapBuffers();
+  CHECK_FRAME_ERRORS("RenderScene() end");
+
+  // Nothing is drawn while idle, except refinement frames until the
+  // image has converged. Input callbacks call RequestRedraw().
+  bool converged = refinementFrame_+1 >= NR_REFINEMENT_FRAMES;
+  if (!converged) {
+    refinementFrame_++;
+    glutPostRedisplay();
+  } else if ((timeSeries_ != NULL && timeSeries_->Active()) ||
+             loader_ != NULL ||
+             (volumeTex_->Cache() != NULL && volumeTex_->Cache()->Pending())) {
+    // Keep polling for the next step, level or bricks
+    glutPostRedisplay();
+  }
 
-  UpdateMatrices();
-  BindTransformationMatrices(cubeShaderProg_);
-  BindTransformationMatrices(volumeShaderProg_);
+  // Stats overlay in the window title, a couple of times per second
+  if (showStats_ && (profiler_->NrFrames() % 30 == 0 || converged)) {
+    std::string title = "Volume renderer - " + profiler_->Summary();
+    glutSetWindowTitle(title.c_str());
+  }
+}
 
-  glUseProgram(cubeShaderProg_->Handle());
+void Manager::RenderFrame(unsigned int _framebuffer) {
+  DrawVolume();
+  PresentFrame(_framebuffer);
+}
 
-  // Render cube front
-  glBindFramebuffer(GL_FRAMEBUFFER, cubeFrontFBO_);
-  CullBackFace();
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  cubePositionAttrib_ = cubeShaderProg_->GetAttribLocation("position");
-  glBindBuffer(GL_ARRAY_BUFFER, cubePositionBufferObject_);
-  glEnableVertexAttribArray(cubePositionAttrib_);
-  glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, 0);
-  GLenum frontBuffer[1] = { GL_COLOR_ATTACHMENT0 };
-  //glDrawBuffers(1, frontBuffer);
-  glDrawArrays(GL_TRIANGLES, 0, 144);
-  glBindBuffer(GL_ARRAY_BUFFER, 0);
-  glDisableVertexAttribArray(cubePositionAttrib_);
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
-  
-  // Render cube back
-  glBindFramebuffer(GL_FRAMEBUFFER, cubeBackFBO_);
-  CullFrontFace();
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  cubePositionAttrib_ = cubeShaderProg_->GetAttribLocation("position");
-  glBindBuffer(GL_ARRAY_BUFFER, cubePositionBufferObject_);
-  glEnableVertexAttribArray(cubePositionAttrib_);
-  glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, 0);
-  GLenum backBuffer[1] = { GL_COLOR_ATTACHMENT1 };
-  //glDrawBuffers(1, backBuffer);
-  glDrawArrays(GL_TRIANGLES, 0, 144);
-  glBindBuffer(GL_ARRAY_BUFFER, 0);
-  glDisableVertexAttribArray(cubePositionAttrib_);
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+void Manager::DrawVolume() {
+
+  CHECK_FRAME_ERRORS("DrawVolume() start");
+
+  // Lower resolution while interacting keeps large windows responsive.
+  // Frames accumulated at another size can not be refined further.
+  lod_->Update(mouseDown_, profiler_->LastGpuMs());
+  unsigned int width = Instance().width_;
+  unsigned int height = Instance().height_;
+  float scale = lod_->RenderScale();
+  unsigned int renderWidth =
+    std::max(1U, static_cast<unsigned int>(width*scale + 0.5f));
+  unsigned int renderHeight =
+    std::max(1U, static_cast<unsigned int>(height*scale + 0.5f));
+  if (renderWidth != renderWidth_ || renderHeight != renderHeight_) {
+    renderWidth_ = renderWidth;
+    renderHeight_ = renderHeight;
+    refinementFrame_ = 0;
+  }
 
-  glUseProgram(0);
+  BindShaderConstants();
 
-  // We have now rendered to the textures and can bind them
-  volumeShaderProg_->BindTexture2D("cubeFrontTex", 
-                                    GL_TEXTURE0,
-                                    0,
-                                    cubeFrontTex_);
-  volumeShaderProg_->BindTexture2D("cubeBackTex",
-                                    GL_TEXTURE1,
-                                    1,
-                                    cubeBackTex_);
-  
-  volumeShaderProg_->BindVolumeTexture("volumeTex",
-                                       GL_TEXTURE2,
-                                       2,
-                                       volumeTex_);                                     
+  UpdateMatrices();
+  BindTransformationMatrices();
+
+  // The texture units were assigned in InitRenderState(). The frame is
+  // blended into the running average of the refinement frames.
+  profiler_->BeginPass(VOLUME_PASS);
+  BindTextureUnit(0, GL_TEXTURE_BUFFER, volumeTex_->Handle());
+  BindTextureUnit(1, GL_TEXTURE_BUFFER, volumeTex_->RangeHandle());
+  BindTextureUnit(2, GL_TEXTURE_3D, volumeTex_->BrickHandle());
+  BindTextureUnit(3, GL_TEXTURE_2D, transferFunction_->Handle());
+  BindTextureUnit(4, GL_TEXTURE_2D, transferFunction_->OpacityHandle());
+  BindTextureUnit(5, GL_TEXTURE_BUFFER, volumeTex_->DeviationHandle());
+  BrickCache *cache = volumeTex_->Cache();
+  BindTextureUnit(6, GL_TEXTURE_BUFFER,
+                  cache != NULL ? cache->PageTableHandle() : 0);
+  BindTextureUnit(7, GL_TEXTURE_BUFFER, volumeTex_->GradientHandle());
 
   glUseProgram(volumeShaderProg_->Handle());
+  glBindVertexArray(cubeVAO_);
+  float stepJitter = 0.5f;
+  if (refinementFrame_ > 0) {
+    stepJitter = Camera::Halton(refinementFrame_, 5);
+  }
+  glUniform1f(stepJitterLocation_, stepJitter);
+  glUniform1i(maxLevelLocation_, lod_->Level());
+  glUniform1f(stepScaleLocation_, lod_->StepScale());
+  glUniform1i(traversalLocation_, traversal_);
+  if (cache != NULL) {
+    glUniform1i(feedbackPickLocation_, cache->FeedbackPick());
+  }
   
-  // Render to screen
-  CullBackFace();
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  cubePositionAttrib_ = volumeShaderProg_->GetAttribLocation("position");
-  glBindBuffer(GL_ARRAY_BUFFER, cubePositionBufferObject_);
-  glEnableVertexAttribArray(cubePositionAttrib_);
-  glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, 0);
-  glDrawArrays(GL_TRIANGLES, 0, 144);
-  glBindBuffer(GL_ARRAY_BUFFER, 0);
-  glDisableVertexAttribArray(cubePositionAttrib_);
+  // Rays are set up in the fragment shader, the cube only has to cover
+  // the pixels. Back faces cover them even with the camera inside.
+  glBindFramebuffer(GL_FRAMEBUFFER, accumFBO_);
+  glViewport(0, 0, renderWidth_, renderHeight_);
+  CullFrontFace();
+  if (refinementFrame_ == 0) {
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  } else {
+    glClear(GL_DEPTH_BUFFER_BIT);
+  }
+  if (cache != NULL || rayDepths_) {
+    // Draw buffer i is attachment i, the clears below rely on that
+    GLenum buffers[3] = {
+      GL_COLOR_ATTACHMENT0,
+      cache != NULL ? GL_COLOR_ATTACHMENT0 + FEEDBACK_ATTACHMENT : GL_NONE,
+      rayDepths_ ? GL_COLOR_ATTACHMENT0 + RAY_DEPTH_ATTACHMENT : GL_NONE
+    };
+    glDrawBuffers(3, buffers);
+  }
+  if (cache != NULL) {
+    unsigned int noBrick[4] = { 0, 0, 0, 0 };
+    glClearBufferuiv(GL_COLOR, FEEDBACK_ATTACHMENT, noBrick);
+  }
+  if (rayDepths_) {
+    // Same as NO_DEPTH in octreeFrag.glsl, for pixels no ray reaches
+    float noDepth[4] = { 1e20f, 0.f, 0.f, 0.f };
+    glClearBufferfv(GL_COLOR, RAY_DEPTH_ATTACHMENT, noDepth);
+  }
+  glEnable(GL_BLEND);
+  glBlendColor(0.f, 0.f, 0.f, 1.f/(refinementFrame_+1));
+  glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA);
+  if (rayDepths_) {
+    glDisablei(GL_BLEND, RAY_DEPTH_ATTACHMENT);
+  }
+  glDrawArrays(GL_TRIANGLES, 0, NR_CUBE_VERTICES);
+  glDisable(GL_BLEND);
+  if (cache != NULL || rayDepths_) {
+    glDrawBuffer(GL_COLOR_ATTACHMENT0);
+  }
+  if (cache != NULL) {
+    cache->ReadFeedback(FEEDBACK_ATTACHMENT, renderWidth_, renderHeight_);
+  }
+  profiler_->EndPass(VOLUME_PASS);
  
+  glBindVertexArray(0);
   glUseProgram(0);
-  glutSwapBuffers();
-  glutPostRedisplay();
-  CheckGLErrors("RenderScene() end");
 }
 
-void Manager::SetCubeShaderProgram(ShaderProgram *_program) {
-  cubeShaderProg_ = _program;
+void Manager::PresentFrame(unsigned int _framebuffer) {
+  profiler_->BeginPass(UPSCALE_PASS);
+  unsigned int width = Instance().width_;
+  unsigned int height = Instance().height_;
+  glViewport(0, 0, width, height);
+  if ((renderWidth_ == width && renderHeight_ == height) ||
+      upscaleShaderProg_ == NULL) {
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, accumFBO_);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _framebuffer);
+    glBlitFramebuffer(0, 0, renderWidth_, renderHeight_, 0, 0, width, height,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+    profiler_->EndPass(UPSCALE_PASS);
+    return;
+  }
+
+  glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+  glDisable(GL_CULL_FACE);
+  glUseProgram(upscaleShaderProg_->Handle());
+  glUniform2f(sourceSizeLocation_,
+              static_cast<float>(renderWidth_),
+              static_cast<float>(renderHeight_));
+  glUniform2f(targetSizeLocation_,
+              static_cast<float>(width),
+              static_cast<float>(height));
+  BindTextureUnit(0, GL_TEXTURE_2D, accumTexture_->Handle());
+  // The vertex shader makes up the positions, any VAO will do
+  glBindVertexArray(cubeVAO_);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+  glBindVertexArray(0);
+  glUseProgram(0);
+  BindTextureUnit(0, GL_TEXTURE_2D, 0);
+  profiler_->EndPass(UPSCALE_PASS);
 }
 
-void Manager::SetVolumeShaderProgram(ShaderProgram *_program) {
-  volumeShaderProg_ = _program;
+void Manager::BindTextureUnit(unsigned int _unitNumber,
+                              unsigned int _target,
+                              unsigned int _handle) {
+  glActiveTexture(GL_TEXTURE0 + _unitNumber);
+  glBindTexture(_target, _handle);
+}
+
+bool Manager::RenderBatch(std::string _poseFileName,
+                          std::string _outputPrefix,
+                          bool _refine) {
+  std::ifstream poseFile(_poseFileName.c_str());
+  if (!poseFile.is_open()) {
+    std::cout << "Error: Could not open pose file " << _poseFileName << "\n";
+    return false;
+  }
+
+  // Output FBO, shares the depth renderbuffer with the accumulation FBO
+  unsigned int colorbuffer;
+  glGenRenderbuffers(1, &colorbuffer);
+  glBindRenderbuffer(GL_RENDERBUFFER, colorbuffer);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width_, height_);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+  unsigned int outputFBO;
+  glGenFramebuffers(1, &outputFBO);
+  glBindFramebuffer(GL_FRAMEBUFFER, outputFBO);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER,
+                            GL_COLOR_ATTACHMENT0,
+                            GL_RENDERBUFFER,
+                            colorbuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER,
+                            GL_DEPTH_ATTACHMENT,
+                            GL_RENDERBUFFER,
+                            renderbufferObject_);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    std::cout << "Error: Framebuffer not complete" << std::endl;
+    exit(1);
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(0, 0, width_, height_);
+
+  Timer timer;
+  unsigned int nrViews = 0;
+  std::string line;
+  while (std::getline(poseFile, line)) {
+    std::istringstream pose(line);
+    float pitch, roll, yaw;
+    if (line.empty() || line[0] == '#' || !(pose >> pitch >> roll >> yaw)) {
+      continue;
+    }
+    pitch_ = pitch;
+    roll_ = roll;
+    yaw_ = yaw;
+    if (timeSeries_ != NULL && nrViews > 0) {
+      timeSeries_->WaitForNextStep();
+      SetVolumeTexture(timeSeries_->Current());
+    }
+    // Streamed bricks are loaded until the view misses none, or no more
+    // fit in the cache
+    BrickCache *cache = volumeTex_->Cache();
+    if (cache != NULL) {
+      refinementFrame_ = 0;
+      for (unsigned int i=0; i<MAX_BRICK_PASSES; i++) {
+        RenderFrame(outputFBO);
+        if (!cache->Update(~0ULL)) {
+          break;
+        }
+      }
+    }
+    unsigned int nrFrames = _refine ? NR_REFINEMENT_FRAMES : 1;
+    for (refinementFrame_=0; refinementFrame_<nrFrames; refinementFrame_++) {
+      profiler_->BeginFrame();
+      RenderFrame(outputFBO);
+      profiler_->EndFrame();
+    }
+
+    char fileName[32];
+    sprintf(fileName, "%04u.ppm", nrViews);
+    glBindFramebuffer(GL_FRAMEBUFFER, outputFBO);
+    bool written = WriteFramebuffer(_outputPrefix + fileName);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (!written) {
+      break;
+    }
+    nrViews++;
+  }
+  double seconds = timer.Seconds();
+  profiler_->Finish();
+  CheckGLErrors("RenderBatch() end");
+
+  glDeleteFramebuffers(1, &outputFBO);
+  glDeleteRenderbuffers(1, &colorbuffer);
+  std::cout << "Rendered " << nrViews << " views in " << seconds << " s";
+  if (nrViews > 0) {
+    std::cout << " (" << seconds*1000.0/nrViews << " ms per view)";
+  }
+  std::cout << "\n";
+  profiler_->Print(std::cout);
+  return true;
+}
+
+bool Manager::RenderForCluster(RenderCluster *_cluster) {
+  unsigned long long nrPixels = (unsigned long long)width_*height_;
+  std::vector<float> rgba(nrPixels*4);
+  std::vector<float> depths(nrPixels);
+  rayDepths_ = true;
+  bool finished = true;
+  float pitch, roll, yaw;
+  bool refine;
+  while (_cluster->NextView(pitch, roll, yaw, refine)) {
+    pitch_ = pitch;
+    roll_ = roll;
+    yaw_ = yaw;
+    Timer timer;
+    unsigned int nrFrames = refine ? NR_REFINEMENT_FRAMES : 1;
+    for (refinementFrame_=0; refinementFrame_<nrFrames; refinementFrame_++) {
+      profiler_->BeginFrame();
+      DrawVolume();
+      profiler_->EndFrame();
+    }
+    // Floats keep the averaged frames exact until the final image
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, accumFBO_);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glReadPixels(0, 0, width_, height_, GL_RGBA, GL_FLOAT, &rgba[0]);
+    glReadBuffer(GL_COLOR_ATTACHMENT0 + RAY_DEPTH_ATTACHMENT);
+    glReadPixels(0, 0, width_, height_, GL_RED, GL_FLOAT, &depths[0]);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    if (!_cluster->FinishView(rgba, depths, timer.Milliseconds())) {
+      finished = false;
+      break;
+    }
+  }
+  rayDepths_ = false;
+  profiler_->Finish();
+  CheckGLErrors("RenderForCluster() end");
+  return finished;
+}
+
+void Manager::SetTargetFrameTime(double _milliseconds) {
+  lod_->SetTargetMs(_milliseconds);
+}
+
+void Manager::SetTraversal(Traversal _traversal) {
+  traversal_ = _traversal;
+}
+
+bool Manager::ParseTraversal(std::string _name, Traversal &_traversal) {
+  if (_name == "restart") {
+    _traversal = RESTART_TRAVERSAL;
+  } else if (_name == "ropes") {
+    _traversal = ROPE_TRAVERSAL;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool Manager::WriteProfile(std::string _fileName) {
+  std::ofstream out(_fileName.c_str());
+  if (!out.is_open()) {
+    std::cout << _fileName << " could not be opened." << std::endl;
+    return false;
+  }
+  profiler_->WriteJSON(out);
+  std::cout << "Wrote frame stats to " << _fileName << "\n";
+  return true;
+}
+
+bool Manager::WriteFramebuffer(std::string _fileName) {
+  std::vector<unsigned char> pixels(width_*height_*3);
+  glReadBuffer(GL_COLOR_ATTACHMENT0);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, width_, height_, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+  return WriteImage(_fileName, width_, height_, pixels);
 }
 
-void Manager::SetCubeFrontTexture(Texture2D *_texture) {
-  cubeFrontTex_ = _texture;
+bool Manager::WriteImage(std::string _fileName,
+                         unsigned int _width,
+                         unsigned int _height,
+                         std::vector<unsigned char> &_pixels) {
+  std::ofstream out(_fileName.c_str(), std::ios::out|std::ios::binary);
+  if (!out.is_open()) {
+    std::cout << _fileName << " could not be opened." << std::endl;
+    return false;
+  }
+  out << "P6\n" << _width << " " << _height << "\n255\n";
+  // GL rows start at the bottom
+  for (int y=_height-1; y>=0; y--) {
+    out.write(reinterpret_cast<const char*>(&_pixels[y*_width*3]),
+              _width*3);
+  }
+  return !out.fail();
 }
 
-void Manager::SetCubeBackTexture(Texture2D *_texture) {
-  cubeBackTex_ = _texture;
+void Manager::SetVolumeShaderProgram(ShaderProgram *_program) {
+  volumeShaderProg_ = _program;
 }
 
 void Manager::SetVolumeTexture(VolumeTexture *_texture) {
+  VolumeTexture *previous = volumeTex_;
   volumeTex_ = _texture;
+  refinementFrame_ = 0;
+  volumeShaderProg_->BindInt("useBrickCache",
+                             volumeTex_->Cache() != NULL ? 1 : 0);
+  volumeShaderProg_->BindInt("useGradients",
+                             volumeTex_->HasGradients() ? 1 : 0);
+  // A cluster worker's subtree fills one cell of its root level
+  unsigned int x, y, z;
+  Morton::Decode(volumeTex_->RootIndex(), x, y, z);
+  float treeSize = 1.f/static_cast<float>(1U << volumeTex_->RootLevel());
+  volumeShaderProg_->BindVec3("treeOrigin", x*treeSize, y*treeSize,
+                              z*treeSize);
+  volumeShaderProg_->BindFloat("treeSize", treeSize);
+  // Time series steps usually share the tree shape, keep the uniforms and
+  // the interactive level then
+  if (previous != NULL &&
+      previous->MaxDepth() == volumeTex_->MaxDepth() &&
+      previous->NodeLayout() == volumeTex_->NodeLayout()) {
+    return;
+  }
   // TODO move this somewhere sensible
   volumeShaderProg_->BindInt("maxDepth", volumeTex_->MaxDepth());
+  // The traversal depth is picked per frame by the LOD controller
+  lod_->SetMaxLevel(volumeTex_->MaxDepth());
+  volumeShaderProg_->BindInt("brickSize", BrickPool::BRICK_SIZE);
+  volumeShaderProg_->BindInt("nodeLayout", volumeTex_->NodeLayout());
+}
+
+void Manager::SetVolumeLoader(VolumeLoader *_loader) {
+  loader_ = _loader;
+  loadedLevels_ = 0;
+}
+
+void Manager::SetTimeSeries(TimeSeries *_series) {
+  timeSeries_ = _series;
+  SetVolumeTexture(timeSeries_->Current());
 }
 void Manager::SetConfigFileName(std::string _fileName) {
   configFileName_ = _fileName;
 }
 
+void Manager::SetTransferFunctionFileName(std::string _fileName) {
+  transferFunctionFileName_ = _fileName;
+}
+
 unsigned int Manager::CheckGLErrors(std::string _location) {
   unsigned int error = glGetError();
   switch (error) {
@@ -368,7 +920,16 @@ unsigned int Manager::CheckGLErrors(std::string _location) {
 }
 
 void Manager::ChangeSize(int _width, int _height) {
+  // Minimized windows have no size
+  if (_width <= 0 || _height <= 0) {
+    return;
+  }
+  Instance().width_ = _width;
+  Instance().height_ = _height;
+  proj_ = Camera::ProjMatrix((float)_width/(float)_height);
+  AllocateRenderTargets();
   glViewport(0, 0, (GLsizei)_width, (GLsizei)_height);
+  RequestRedraw();
 }
 
 void Manager::Keyboard(unsigned char _key, int _x, int _y) {
@@ -376,6 +937,42 @@ void Manager::Keyboard(unsigned char _key, int _x, int _y) {
   case 'r':
   case 'R':
     ReadConfigFile();
+    ReadTransferFunction();
+    RequestRedraw();
+    break;
+  case 't':
+  case 'T':
+    showStats_ = !showStats_;
+    if (!showStats_) {
+      glutSetWindowTitle("Volume renderer - Victor Sand");
+    }
+    break;
+  case 'o':
+  case 'O':
+    // Switch traversals to compare their timings
+    traversal_ = traversal_ == ROPE_TRAVERSAL ? RESTART_TRAVERSAL
+                                              : ROPE_TRAVERSAL;
+    std::cout << (traversal_ == ROPE_TRAVERSAL ? "Rope" : "Restart")
+      << " traversal\n";
+    RequestRedraw();
+    break;
+  case 'p':
+  case 'P':
+    profiler_->Print(std::cout);
+    WriteProfile("profile.json");
+    break;
+  case ' ':
+    if (timeSeries_ != NULL) {
+      timeSeries_->SetPlaying(!timeSeries_->Playing());
+      RequestRedraw();
+    }
+    break;
+  case 'n':
+  case 'N':
+    if (timeSeries_ != NULL) {
+      timeSeries_->RequestNextStep();
+      RequestRedraw();
+    }
     break;
   case 'q':
   case 'Q':
@@ -392,6 +989,8 @@ void Manager::MouseButtons(int _button, int _state, int _x, int _y) {
       lastMouseY_ = _y;
     } else if (_state == GLUT_UP) {
       mouseDown_ = false;
+      // Back to full detail
+      RequestRedraw();
     }
   }
 }
@@ -402,6 +1001,7 @@ void Manager::MouseMotion(int _x, int _y) {
      lastMouseX_ = _x;
      roll_ += 0.3f*(float)(_y - lastMouseY_);
      lastMouseY_ = _y;
+     RequestRedraw();
    }
 }
 
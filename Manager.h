@@ -9,44 +9,156 @@
 #include <utility>
 
 class ShaderProgram;
-class Texture2D;
 class VolumeTexture;
+class Texture2D;
+class OffscreenContext;
+class FrameProfiler;
+class UniformBuffer;
+class LodController;
+class TransferFunction;
+class TimeSeries;
+class VolumeLoader;
+class RenderCluster;
 
 class Manager {
 public:
+  // Octree traversal in the volume shader, same values as the traversal
+  // uniform in octreeFrag.glsl
+  enum Traversal {
+    RESTART_TRAVERSAL = 0,
+    ROPE_TRAVERSAL
+  };
+
   static Manager& Instance();
   void SetWinDimensions(unsigned int _width, unsigned int _height);
   // Initializes glew and the GLUT window
   void InitWindow(int &_argc, char **_argv);
-  // Initializes cube position buffers
+  // Initializes glew with an offscreen context instead of a window
+  void InitOffscreen(int &_argc, char **_argv);
+  // Initializes cube position buffer and its vertex array
   void InitCubePositionBuffer();
+  // Creates the uniform buffers and assigns texture units, once both
+  // shader programs are set
+  void InitRenderState();
   // Initializes renderbuffer and framebuffer objects
   void StartLoop();
   void InitFramebuffer();
   void InitMatrices();
   void InitCallbacks();
-  void SetCubeShaderProgram(ShaderProgram *_program);
   void SetVolumeShaderProgram(ShaderProgram *_program);
-  void SetCubeFrontTexture(Texture2D *_texture);
-  void SetCubeBackTexture(Texture2D *_texture);
   void SetVolumeTexture(VolumeTexture *_texture);
+  // Plays the steps of a time series instead of a single volume texture.
+  // Space toggles playback and n shows the next step.
+  void SetTimeSeries(TimeSeries *_series);
+  // Draws a progress bar, then the levels of the loader's tree as they
+  // arrive, until it is done and the texture takes over
+  void SetVolumeLoader(VolumeLoader *_loader);
   // Read a config file and bind float constants to volume shader
   static void ReadConfigFile();
   static void BindShaderConstants();
   void SetConfigFileName(std::string _fileName);
+  // Reads the transfer function file. Without one the shader integrates
+  // the raw values instead of compositing colors.
+  static void ReadTransferFunction();
+  void SetTransferFunctionFileName(std::string _fileName);
 
     // Checks for OpenGL errors and prints them if present
   static unsigned int CheckGLErrors(std::string _location = "");
 
+  // Renders one image per camera pose in a batch file, without a window.
+  // Every line of the file holds pitch, roll and yaw in degrees, lines
+  // starting with # are skipped. Images are written as <prefix>0000.ppm
+  // and so on. The volume is loaded once and reused for every view, with a
+  // time series every view shows the next step. With _refine set every
+  // view is refined until it has converged.
+  // Returns false if the pose file could not be read.
+  bool RenderBatch(std::string _poseFileName,
+                   std::string _outputPrefix,
+                   bool _refine = false);
+  // Frame time the level of detail aims for while interacting
+  static void SetTargetFrameTime(double _milliseconds);
+  // Defaults to ROPE_TRAVERSAL
+  static void SetTraversal(Traversal _traversal);
+  // "restart" or "ropes", returns false for other names
+  static bool ParseTraversal(std::string _name, Traversal &_traversal);
+  // Writes the rolling per pass timings as JSON
+  static bool WriteProfile(std::string _fileName);
+  // Renders the views the cluster's master asks for and hands every image,
+  // with the ray depths of its pixels, to the cluster for compositing.
+  // Returns false if the cluster lost a connection.
+  bool RenderForCluster(RenderCluster *_cluster);
+  // Writes 8 bit RGB pixels, rows bottom-up, as a binary PPM
+  static bool WriteImage(std::string _fileName,
+                         unsigned int _width,
+                         unsigned int _height,
+                         std::vector<unsigned char> &_pixels);
+
 private:
 
+  // Uniform buffer binding points
+  enum UniformBinding {
+    TRANSFORM_BINDING = 0,
+    CONSTANTS_BINDING
+  };
+  // 12 triangles
+  static const unsigned int NR_CUBE_VERTICES = 36;
+  // Jittered frames averaged before the image counts as converged
+  static const unsigned int NR_REFINEMENT_FRAMES = 16;
+  // Volume data uploaded per frame while loading
+  static const unsigned long long LOAD_BUDGET = 32*1024*1024;
+  // Streamed bricks uploaded per frame, and the frames a batch view may
+  // spend loading them before it is written anyway
+  static const unsigned long long BRICK_BUDGET = 16*1024*1024;
+  static const unsigned int MAX_BRICK_PASSES = 32;
+  // Color attachment of the accumulation FBO with the brick feedback
+  static const unsigned int FEEDBACK_ATTACHMENT = 1;
+  // Color attachment with the ray depths of a cluster worker's pixels
+  static const unsigned int RAY_DEPTH_ATTACHMENT = 2;
+  // Height in pixels of the load progress bar
+  static const int PROGRESS_BAR_HEIGHT = 6;
+
+  // Timed passes of a frame, in the order they are added to the profiler
+  enum Pass {
+    VOLUME_PASS = 0,
+    UPSCALE_PASS
+  };
+
   // Update matrices with current view params
   static void UpdateMatrices();
   // For clarity, functions that sets the culling mode
   static void CullFrontFace();
   static void CullBackFace();
-  // Helper to bind transformation matrices
-  static void BindTransformationMatrices(ShaderProgram * _program);
+  // Helper to update the shared transformation matrix buffer
+  static void BindTransformationMatrices();
+  // Binds a texture to a texture unit
+  static void BindTextureUnit(unsigned int _unitNumber,
+                              unsigned int _target,
+                              unsigned int _handle);
+
+  // Prints the GL version, initializes glew for the current context and
+  // creates the frame profiler
+  void InitGLEW();
+  // Renders the current view into a framebuffer, 0 is the window
+  static void RenderFrame(unsigned int _framebuffer);
+  // Volume pass of a frame into the accumulation FBO
+  static void DrawVolume();
+  // Copies the volume pass to a framebuffer, scaled up to the window size
+  // if it was rendered smaller
+  static void PresentFrame(unsigned int _framebuffer);
+  // Creates the targets of the accumulation FBO at the window size,
+  // replacing any earlier ones
+  static void AllocateRenderTargets();
+  // Writes the color buffer of the bound framebuffer as a binary PPM
+  bool WriteFramebuffer(std::string _fileName);
+
+  // Restarts refinement and schedules a frame, for anything that changes
+  // the image
+  static void RequestRedraw();
+  // Uploads the next part of the loading volume and draws whatever levels
+  // are complete
+  static void UpdateLoader();
+  // Bar along the bottom of the bound framebuffer
+  static void DrawProgressBar(float _fraction);
 
   // Callback functions for rendering loop
   static void RenderScene();
@@ -73,17 +185,57 @@ private:
   unsigned int height_;
 
   // Fixed buffer objects
-  static unsigned int cubePositionAttrib_;
-  static unsigned int cubeBackFBO_;
-  static unsigned int cubeFrontFBO_;
+  static unsigned int cubeVAO_;
   static unsigned int renderbufferObject_;
   static unsigned int cubePositionBufferObject_;
   // Fixed shaders and textures
-  static ShaderProgram *cubeShaderProg_;
   static ShaderProgram *volumeShaderProg_;
-  static Texture2D *cubeFrontTex_;
-  static Texture2D *cubeBackTex_;
   static VolumeTexture *volumeTex_;
+  // Scales the volume pass up to the window, null in batch mode
+  static ShaderProgram *upscaleShaderProg_;
+  static int sourceSizeLocation_;
+  static int targetSizeLocation_;
+  // Null unless a time series is played, volumeTex_ is its current step
+  static TimeSeries *timeSeries_;
+  // Null once the volume has finished loading, volumeTex_ is null until
+  // its root level is on the GPU
+  static VolumeLoader *loader_;
+  static int loadedLevels_;
+  static OffscreenContext *offscreenContext_;
+  // Transform block shared by both programs, Constants block from the
+  // config file, copied when constantsDirty_ is set
+  static UniformBuffer *transformBuffer_;
+  static UniformBuffer *constantsBuffer_;
+  static bool constantsDirty_;
+  // Running average of the refinement frames, blitted to the output. The
+  // targets have the window size, the volume pass only draws to the lower
+  // left renderWidth_ by renderHeight_ pixels of them.
+  static unsigned int accumFBO_;
+  static Texture2D *accumTexture_;
+  static unsigned int renderWidth_;
+  static unsigned int renderHeight_;
+  // Missing and used bricks per pixel, only drawn to while the volume
+  // texture streams its bricks
+  static unsigned int feedbackbufferObject_;
+  static int feedbackPickLocation_;
+  // Where rays enter the tree's box, only drawn to while rayDepths_ is set
+  static unsigned int rayDepthbufferObject_;
+  static bool rayDepths_;
+  // Index of the frame being drawn since the image last changed
+  static unsigned int refinementFrame_;
+  static int stepJitterLocation_;
+  // Traversal depth and sampling rate, coarser while the mouse is down
+  static LodController *lod_;
+  static int maxLevelLocation_;
+  static int stepScaleLocation_;
+  static Traversal traversal_;
+  static int traversalLocation_;
+  // Null until a transfer function file has been read
+  static TransferFunction *transferFunction_;
+  static std::string transferFunctionFileName_;
+  // Per pass timings, shown in the window title while showStats_ is set
+  static FrameProfiler *profiler_;
+  static bool showStats_;
 
   static std::vector< std::pair<std::string, float> > constants_;
   static std::string configFileName_;
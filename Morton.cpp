@@ -0,0 +1,451 @@
+#include "Morton.h"
+#include <cstring>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+// BMI2 and AVX2 need 64-bit registers
+#if defined(_M_X64) || defined(__x86_64__)
+#define MORTON_X64
+#include <immintrin.h>
+#ifndef _MSC_VER
+#include <cpuid.h>
+#endif
+#endif
+
+// Functions using instructions beyond the baseline are compiled for them
+// one by one and only called once the CPU is known to have them. MSVC
+// compiles intrinsics without being told.
+#ifdef __GNUC__
+#define TARGET_BMI2 __attribute__((target("bmi2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_BMI2
+#define TARGET_AVX2
+#endif
+
+// Bits of the x axis in a code, y and z sit one and two bits higher
+static const unsigned long long AXIS_MASK = 0x1249249249249249ULL;
+static const unsigned long long COORDINATE_MASK = 0x1fffff;
+
+// Spreads the lowest 21 bits of a coordinate so that two zero bits sit
+// between each pair of original bits
+static unsigned long long Part1By2(unsigned long long _v) {
+  _v &= COORDINATE_MASK;
+  _v = (_v | (_v << 32)) & 0x1f00000000ffffULL;
+  _v = (_v | (_v << 16)) & 0x1f0000ff0000ffULL;
+  _v = (_v | (_v <<  8)) & 0x100f00f00f00f00fULL;
+  _v = (_v | (_v <<  4)) & 0x10c30c30c30c30c3ULL;
+  _v = (_v | (_v <<  2)) & AXIS_MASK;
+  return _v;
+}
+
+// Inverse of Part1By2
+static unsigned int Compact1By2(unsigned long long _v) {
+  _v &= AXIS_MASK;
+  _v = (_v | (_v >>  2)) & 0x10c30c30c30c30c3ULL;
+  _v = (_v | (_v >>  4)) & 0x100f00f00f00f00fULL;
+  _v = (_v | (_v >>  8)) & 0x1f0000ff0000ffULL;
+  _v = (_v | (_v >> 16)) & 0x1f00000000ffffULL;
+  _v = (_v | (_v >> 32)) & COORDINATE_MASK;
+  return static_cast<unsigned int>(_v);
+}
+
+// Spread bytes, and the x, y and z bits of every 9-bit group of a code
+// packed 3 bits each
+struct MortonTables {
+  MortonTables() {
+    for (unsigned int i=0; i<256; i++) {
+      spread[i] = static_cast<unsigned int>(Part1By2(i));
+    }
+    for (unsigned int i=0; i<512; i++) {
+      gathered[i] = static_cast<unsigned short>(
+        Compact1By2(i) | (Compact1By2(i >> 1) << 3) |
+        (Compact1By2(i >> 2) << 6));
+    }
+  }
+  unsigned int spread[256];
+  unsigned short gathered[512];
+};
+static const MortonTables tables;
+
+static unsigned long long SpreadLut(unsigned int _v) {
+  return tables.spread[_v & 0xff] |
+         ((unsigned long long)tables.spread[(_v >> 8) & 0xff] << 24) |
+         ((unsigned long long)tables.spread[(_v >> 16) & 0x1f] << 48);
+}
+
+static void DecodeLut(unsigned long long _code,
+                      unsigned int &_x,
+                      unsigned int &_y,
+                      unsigned int &_z) {
+  // Locals, the outputs may alias arrays the compiler has to write back
+  unsigned int x = 0;
+  unsigned int y = 0;
+  unsigned int z = 0;
+  for (unsigned int level=0; level<Morton::MAX_BITS; level+=3) {
+    unsigned int group = tables.gathered[(_code >> (3*level)) & 0x1ff];
+    x |= (group & 7) << level;
+    y |= ((group >> 3) & 7) << level;
+    z |= (group >> 6) << level;
+  }
+  _x = x;
+  _y = y;
+  _z = z;
+}
+
+#ifdef MORTON_X64
+static void CpuId(int _leaf, int _regs[4]) {
+#ifdef _MSC_VER
+  __cpuidex(_regs, _leaf, 0);
+#else
+  unsigned int a, b, c, d;
+  __cpuid_count(_leaf, 0, a, b, c, d);
+  _regs[0] = a;
+  _regs[1] = b;
+  _regs[2] = c;
+  _regs[3] = d;
+#endif
+}
+
+// Register state the OS saves on context switches
+static unsigned long long EnabledStates() {
+#ifdef _MSC_VER
+  return _xgetbv(0);
+#else
+  unsigned int low, high;
+  __asm__ __volatile__("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+  return ((unsigned long long)high << 32) | low;
+#endif
+}
+
+// CPUID leaf 7 EBX bits
+static const int CPUID_AVX2 = 1 << 5;
+static const int CPUID_BMI2 = 1 << 8;
+// CPUID leaf 1 ECX bits
+static const int CPUID_OSXSAVE = 1 << 27;
+static const int CPUID_AVX = 1 << 28;
+// XMM and YMM state
+static const unsigned long long YMM_STATES = 6;
+
+static int ExtendedFeatures() {
+  int regs[4];
+  CpuId(0, regs);
+  if (regs[0] < 7) {
+    return 0;
+  }
+  CpuId(7, regs);
+  return regs[1];
+}
+
+static bool HasAvxState() {
+  int regs[4];
+  CpuId(1, regs);
+  if ((regs[2] & CPUID_OSXSAVE) == 0 || (regs[2] & CPUID_AVX) == 0) {
+    return false;
+  }
+  return (EnabledStates() & YMM_STATES) == YMM_STATES;
+}
+
+// AMD CPUs before Zen 3 run pdep and pext in microcode, slower than
+// shifts and masks
+static bool HasSlowBmi2() {
+  int regs[4];
+  CpuId(0, regs);
+  char vendor[13];
+  memcpy(vendor, &regs[1], 4);
+  memcpy(vendor+4, &regs[3], 4);
+  memcpy(vendor+8, &regs[2], 4);
+  vendor[12] = '\0';
+  if (strcmp(vendor, "AuthenticAMD") != 0) {
+    return false;
+  }
+  CpuId(1, regs);
+  unsigned int family = (regs[0] >> 8) & 0xf;
+  if (family == 0xf) {
+    family += (regs[0] >> 20) & 0xff;
+  }
+  return family < 0x19;
+}
+
+TARGET_BMI2
+static unsigned long long EncodeBmi2(unsigned int _x,
+                                     unsigned int _y,
+                                     unsigned int _z) {
+  return _pdep_u64(_x, AXIS_MASK) | _pdep_u64(_y, AXIS_MASK << 1) |
+         _pdep_u64(_z, AXIS_MASK << 2);
+}
+
+TARGET_BMI2
+static void DecodeBmi2(unsigned long long _code,
+                       unsigned int &_x,
+                       unsigned int &_y,
+                       unsigned int &_z) {
+  _x = static_cast<unsigned int>(_pext_u64(_code, AXIS_MASK));
+  _y = static_cast<unsigned int>(_pext_u64(_code, AXIS_MASK << 1));
+  _z = static_cast<unsigned int>(_pext_u64(_code, AXIS_MASK << 2));
+}
+
+TARGET_BMI2
+static void EncodeRowBmi2(unsigned int _x,
+                          unsigned long long _yz,
+                          unsigned int _count,
+                          unsigned long long *_codes) {
+  for (unsigned int i=0; i<_count; i++) {
+    _codes[i] = _pdep_u64(_x+i, AXIS_MASK) | _yz;
+  }
+}
+
+TARGET_BMI2
+static void DecodeRangeBmi2(unsigned long long _first,
+                            unsigned int _count,
+                            unsigned int *_x,
+                            unsigned int *_y,
+                            unsigned int *_z) {
+  for (unsigned int i=0; i<_count; i++) {
+    DecodeBmi2(_first+i, _x[i], _y[i], _z[i]);
+  }
+}
+
+// Part1By2 and Compact1By2 on four coordinates or codes
+TARGET_AVX2
+static __m256i Part1By2x4(__m256i _v) {
+  _v = _mm256_and_si256(_v, _mm256_set1_epi64x(COORDINATE_MASK));
+  _v = _mm256_and_si256(_mm256_or_si256(_v, _mm256_slli_epi64(_v, 32)),
+                        _mm256_set1_epi64x(0x1f00000000ffffLL));
+  _v = _mm256_and_si256(_mm256_or_si256(_v, _mm256_slli_epi64(_v, 16)),
+                        _mm256_set1_epi64x(0x1f0000ff0000ffLL));
+  _v = _mm256_and_si256(_mm256_or_si256(_v, _mm256_slli_epi64(_v, 8)),
+                        _mm256_set1_epi64x(0x100f00f00f00f00fLL));
+  _v = _mm256_and_si256(_mm256_or_si256(_v, _mm256_slli_epi64(_v, 4)),
+                        _mm256_set1_epi64x(0x10c30c30c30c30c3LL));
+  _v = _mm256_and_si256(_mm256_or_si256(_v, _mm256_slli_epi64(_v, 2)),
+                        _mm256_set1_epi64x(AXIS_MASK));
+  return _v;
+}
+
+TARGET_AVX2
+static __m256i Compact1By2x4(__m256i _v) {
+  _v = _mm256_and_si256(_v, _mm256_set1_epi64x(AXIS_MASK));
+  _v = _mm256_and_si256(_mm256_or_si256(_v, _mm256_srli_epi64(_v, 2)),
+                        _mm256_set1_epi64x(0x10c30c30c30c30c3LL));
+  _v = _mm256_and_si256(_mm256_or_si256(_v, _mm256_srli_epi64(_v, 4)),
+                        _mm256_set1_epi64x(0x100f00f00f00f00fLL));
+  _v = _mm256_and_si256(_mm256_or_si256(_v, _mm256_srli_epi64(_v, 8)),
+                        _mm256_set1_epi64x(0x1f0000ff0000ffLL));
+  _v = _mm256_and_si256(_mm256_or_si256(_v, _mm256_srli_epi64(_v, 16)),
+                        _mm256_set1_epi64x(0x1f00000000ffffLL));
+  _v = _mm256_and_si256(_mm256_or_si256(_v, _mm256_srli_epi64(_v, 32)),
+                        _mm256_set1_epi64x(COORDINATE_MASK));
+  return _v;
+}
+
+TARGET_AVX2
+static void EncodeRowAvx2(unsigned int _x,
+                          unsigned long long _yz,
+                          unsigned int _count,
+                          unsigned long long *_codes) {
+  __m256i yz = _mm256_set1_epi64x(_yz);
+  __m256i x = _mm256_setr_epi64x(_x, _x+1ULL, _x+2ULL, _x+3ULL);
+  __m256i step = _mm256_set1_epi64x(4);
+  unsigned int i = 0;
+  for (; i+4<=_count; i+=4) {
+    __m256i codes = _mm256_or_si256(Part1By2x4(x), yz);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(_codes+i), codes);
+    x = _mm256_add_epi64(x, step);
+  }
+  for (; i<_count; i++) {
+    _codes[i] = Part1By2(_x+i) | _yz;
+  }
+}
+
+TARGET_AVX2
+static void DecodeRangeAvx2(unsigned long long _first,
+                            unsigned int _count,
+                            unsigned int *_x,
+                            unsigned int *_y,
+                            unsigned int *_z) {
+  __m256i codes = _mm256_setr_epi64x(_first, _first+1, _first+2, _first+3);
+  __m256i step = _mm256_set1_epi64x(4);
+  // The low words of the four lanes, coordinates fit in them
+  __m256i lowWords = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+  unsigned int i = 0;
+  for (; i+4<=_count; i+=4) {
+    __m256i x = Compact1By2x4(codes);
+    __m256i y = Compact1By2x4(_mm256_srli_epi64(codes, 1));
+    __m256i z = Compact1By2x4(_mm256_srli_epi64(codes, 2));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(_x+i),
+      _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(x, lowWords)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(_y+i),
+      _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(y, lowWords)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(_z+i),
+      _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(z, lowWords)));
+    codes = _mm256_add_epi64(codes, step);
+  }
+  for (; i<_count; i++) {
+    unsigned long long code = _first+i;
+    _x[i] = Compact1By2(code);
+    _y[i] = Compact1By2(code >> 1);
+    _z[i] = Compact1By2(code >> 2);
+  }
+}
+#endif
+
+Morton::Path Morton::path_ = Morton::DetectPath();
+
+Morton::Path Morton::DetectPath() {
+  if (Supported(AVX2)) {
+    return AVX2;
+  }
+#ifdef MORTON_X64
+  if (Supported(BMI2) && !HasSlowBmi2()) {
+    return BMI2;
+  }
+#endif
+  // Tables only win for encoding, decoding through them is slower
+  return SCALAR;
+}
+
+bool Morton::Supported(Path _path) {
+  switch (_path) {
+  case SCALAR:
+  case LUT:
+    return true;
+#ifdef MORTON_X64
+  case BMI2:
+    return (ExtendedFeatures() & CPUID_BMI2) != 0;
+  case AVX2:
+    return (ExtendedFeatures() & CPUID_AVX2) != 0 && HasAvxState();
+#endif
+  default:
+    return false;
+  }
+}
+
+bool Morton::SetPath(Path _path) {
+  if (!Supported(_path)) {
+    return false;
+  }
+  path_ = _path;
+  return true;
+}
+
+const char * Morton::PathName(Path _path) {
+  static const char *names[NR_PATHS] = { "scalar", "lut", "bmi2", "avx2" };
+  return _path < NR_PATHS ? names[_path] : "unknown";
+}
+
+unsigned long long Morton::Encode(unsigned int _x,
+                                  unsigned int _y,
+                                  unsigned int _z) {
+  switch (path_) {
+  case LUT:
+    return SpreadLut(_x) | (SpreadLut(_y) << 1) | (SpreadLut(_z) << 2);
+#ifdef MORTON_X64
+  case BMI2:
+    return EncodeBmi2(_x, _y, _z);
+#endif
+  default:
+    return Part1By2(_x) | (Part1By2(_y) << 1) | (Part1By2(_z) << 2);
+  }
+}
+
+void Morton::Decode(unsigned long long _code,
+                    unsigned int &_x,
+                    unsigned int &_y,
+                    unsigned int &_z) {
+  switch (path_) {
+  case LUT:
+    DecodeLut(_code, _x, _y, _z);
+    break;
+#ifdef MORTON_X64
+  case BMI2:
+    DecodeBmi2(_code, _x, _y, _z);
+    break;
+#endif
+  default:
+    _x = Compact1By2(_code);
+    _y = Compact1By2(_code >> 1);
+    _z = Compact1By2(_code >> 2);
+  }
+}
+
+void Morton::EncodeRow(unsigned int _x,
+                       unsigned int _y,
+                       unsigned int _z,
+                       unsigned int _count,
+                       unsigned long long *_codes) {
+  // y and z are the same along the row
+  unsigned long long yz = Encode(0, _y, _z);
+  switch (path_) {
+  case LUT:
+    for (unsigned int i=0; i<_count; i++) {
+      _codes[i] = SpreadLut(_x+i) | yz;
+    }
+    break;
+#ifdef MORTON_X64
+  case BMI2:
+    EncodeRowBmi2(_x, yz, _count, _codes);
+    break;
+  case AVX2:
+    EncodeRowAvx2(_x, yz, _count, _codes);
+    break;
+#endif
+  default:
+    for (unsigned int i=0; i<_count; i++) {
+      _codes[i] = Part1By2(_x+i) | yz;
+    }
+  }
+}
+
+void Morton::DecodeRange(unsigned long long _first,
+                         unsigned int _count,
+                         unsigned int *_x,
+                         unsigned int *_y,
+                         unsigned int *_z) {
+  switch (path_) {
+  case LUT:
+    for (unsigned int i=0; i<_count; i++) {
+      DecodeLut(_first+i, _x[i], _y[i], _z[i]);
+    }
+    break;
+#ifdef MORTON_X64
+  case BMI2:
+    DecodeRangeBmi2(_first, _count, _x, _y, _z);
+    break;
+  case AVX2:
+    DecodeRangeAvx2(_first, _count, _x, _y, _z);
+    break;
+#endif
+  default:
+    for (unsigned int i=0; i<_count; i++) {
+      unsigned long long code = _first+i;
+      _x[i] = Compact1By2(code);
+      _y[i] = Compact1By2(code >> 1);
+      _z[i] = Compact1By2(code >> 2);
+    }
+  }
+}
+
+// x, y and z of the codes 0..63
+const unsigned char Morton::BLOCK_OFFSETS[BLOCK_CODES][3] = {
+  {0,0,0}, {1,0,0}, {0,1,0}, {1,1,0}, {0,0,1}, {1,0,1}, {0,1,1}, {1,1,1},
+  {2,0,0}, {3,0,0}, {2,1,0}, {3,1,0}, {2,0,1}, {3,0,1}, {2,1,1}, {3,1,1},
+  {0,2,0}, {1,2,0}, {0,3,0}, {1,3,0}, {0,2,1}, {1,2,1}, {0,3,1}, {1,3,1},
+  {2,2,0}, {3,2,0}, {2,3,0}, {3,3,0}, {2,2,1}, {3,2,1}, {2,3,1}, {3,3,1},
+  {0,0,2}, {1,0,2}, {0,1,2}, {1,1,2}, {0,0,3}, {1,0,3}, {0,1,3}, {1,1,3},
+  {2,0,2}, {3,0,2}, {2,1,2}, {3,1,2}, {2,0,3}, {3,0,3}, {2,1,3}, {3,1,3},
+  {0,2,2}, {1,2,2}, {0,3,2}, {1,3,2}, {0,2,3}, {1,2,3}, {0,3,3}, {1,3,3},
+  {2,2,2}, {3,2,2}, {2,3,2}, {3,3,2}, {2,2,3}, {3,2,3}, {2,3,3}, {3,3,3}
+};
+
+Morton::Cursor::Cursor(unsigned long long _code)
+  : code_(_code) {
+  NextBlock();
+}
+
+void Morton::Cursor::NextBlock() {
+  Decode(code_ & ~(unsigned long long)(BLOCK_CODES-1),
+         block_[0], block_[1], block_[2]);
+  index_ = static_cast<unsigned int>(code_ & (BLOCK_CODES-1));
+}
@@ -0,0 +1,99 @@
+#ifndef MORTON_H
+#define MORTON_H
+
+// Morton (Z-order) codes of 3D positions, the order of the nodes within
+// every level of the octree. A code interleaves the bits of x, y and z,
+// x in the lowest bit, so 21 bits per axis fit in a 64-bit code.
+//
+// Single codes and whole runs of codes can be encoded and decoded. The
+// runs are what the builder streams through, they go through the fastest
+// path the CPU supports, picked at startup: AVX2 with four codes per
+// instruction, BMI2 bit deposit/extract, or plain shifts and masks. All
+// paths give the same codes. Walking a level in order is best done with a
+// Cursor.
+class Morton {
+public:
+  enum Path {
+    // Shifts and masks, works everywhere
+    SCALAR = 0,
+    // Tables of spread bytes and of gathered 9-bit groups. Encodes faster
+    // than SCALAR but decodes slower, so it is only used when set.
+    LUT,
+    // pdep/pext, one instruction per axis
+    BMI2,
+    // Shifts and masks on four 64-bit codes at once, single codes take
+    // the scalar path
+    AVX2,
+    NR_PATHS
+  };
+  // Bits per axis that fit in a code
+  static const unsigned int MAX_BITS = 21;
+  // Codes per block of a Cursor
+  static const unsigned int BLOCK_CODES = 64;
+
+  static unsigned long long Encode(unsigned int _x,
+                                   unsigned int _y,
+                                   unsigned int _z);
+  static void Decode(unsigned long long _code,
+                     unsigned int &_x,
+                     unsigned int &_y,
+                     unsigned int &_z);
+  // Codes of _count positions along x, starting at (_x, _y, _z)
+  static void EncodeRow(unsigned int _x,
+                        unsigned int _y,
+                        unsigned int _z,
+                        unsigned int _count,
+                        unsigned long long *_codes);
+  // Positions of the codes [_first, _first+_count)
+  static void DecodeRange(unsigned long long _first,
+                          unsigned int _count,
+                          unsigned int *_x,
+                          unsigned int *_y,
+                          unsigned int *_z);
+
+  // Path in use, the fastest supported one unless set otherwise
+  static Path ActivePath() { return path_; }
+  // Switches paths, e.g. to compare them. Returns false if the CPU does
+  // not support the path.
+  static bool SetPath(Path _path);
+  static bool Supported(Path _path);
+  static const char * PathName(Path _path);
+
+  // Walks consecutive codes. Only the first code of every aligned block of
+  // 64 codes, a 4^3 cube, is decoded, the positions within the block come
+  // from a table. Much cheaper than decoding every code.
+  class Cursor {
+  public:
+    explicit Cursor(unsigned long long _code);
+    // Moves to the next code
+    void Next() {
+      code_++;
+      if (++index_ == BLOCK_CODES) {
+        NextBlock();
+      }
+    }
+    unsigned long long Code() const { return code_; }
+    unsigned int X() const { return block_[0] + BLOCK_OFFSETS[index_][0]; }
+    unsigned int Y() const { return block_[1] + BLOCK_OFFSETS[index_][1]; }
+    unsigned int Z() const { return block_[2] + BLOCK_OFFSETS[index_][2]; }
+
+  private:
+    // Decodes the block the current code is in
+    void NextBlock();
+
+    unsigned long long code_;
+    unsigned int index_;
+    unsigned int block_[3];
+  };
+
+private:
+  Morton() {}
+  // Fastest path the CPU supports
+  static Path DetectPath();
+
+  static Path path_;
+  // Position of every code within a block, see Cursor
+  static const unsigned char BLOCK_OFFSETS[BLOCK_CODES][3];
+};
+
+#endif
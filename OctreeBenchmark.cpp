@@ -0,0 +1,605 @@
+#include "OctreeBuilder.h"
+#include "Morton.h"
+#include "SoftwareRenderer.h"
+#include "OffscreenContext.h"
+#include "ThreadPool.h"
+#include "Camera.h"
+#include "Timer.h"
+#include <gl\glew.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+// Synthetic volumes, all written as 8-bit raw data
+enum VolumeKind {
+  // Radial gradient, same as the control data in VolumeTexture
+  GRADIENT = 0,
+  // White noise, nothing to skip
+  NOISE,
+  // A few spheres in empty space
+  BLOBS,
+  NR_VOLUME_KINDS
+};
+static const char *VOLUME_NAMES[NR_VOLUME_KINDS] = {
+  "gradient", "noise", "blobs"
+};
+static const unsigned int NR_BLOBS = 16;
+// Starts the line a volume's process reports its Result on
+static const char *RESULT_PREFIX = "result ";
+
+// Everything measured for one volume
+struct Result {
+  std::string volume;
+  unsigned int dim;
+  unsigned int threads;
+  double generateMs;
+  double readMs;
+  double convertMs;
+  double mortonMs;
+  double reduceMs;
+  double packMs;
+  double uploadMs;
+  double peakRssMB;
+  double floatBytesPerVoxel;
+  double packedBytesPerVoxel;
+  double raysPerSecond;
+  // Scalar rays of both traversals, to compare them on equal terms
+  double restartRaysPerSecond;
+  double ropeRaysPerSecond;
+};
+
+// Every volume is benchmarked in a process of its own, so that the peak
+// memory is that volume's alone
+static double PeakRssMegabytes() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+  return counters.PeakWorkingSetSize/(1024.0*1024.0);
+#else
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  // Kilobytes on Linux
+  return usage.ru_maxrss/1024.0;
+#endif
+}
+
+// Runs a command and reads its output
+static FILE * OpenPipe(std::string _command) {
+#ifdef _WIN32
+  return _popen(_command.c_str(), "r");
+#else
+  return popen(_command.c_str(), "r");
+#endif
+}
+
+static int ClosePipe(FILE *_pipe) {
+#ifdef _WIN32
+  return _pclose(_pipe);
+#else
+  return pclose(_pipe);
+#endif
+}
+
+static unsigned int Hash(unsigned int _x, unsigned int _y, unsigned int _z) {
+  unsigned int h = _x*73856093U ^ _y*19349663U ^ _z*83492791U;
+  h ^= h >> 13;
+  h *= 0x5bd1e995U;
+  h ^= h >> 15;
+  return h;
+}
+
+// Fills one z slice of a synthetic volume
+static void GenerateSlice(VolumeKind _kind,
+                          unsigned int _dim,
+                          unsigned int _z,
+                          const std::vector<float> &_blobs,
+                          unsigned char *_slice) {
+  double last = _dim > 1 ? _dim-1 : 1;
+  for (unsigned int y=0; y<_dim; y++) {
+    for (unsigned int x=0; x<_dim; x++) {
+      float value = 0.f;
+      if (_kind == GRADIENT) {
+        value = static_cast<float>(0.57*sqrt(pow(x/last, 2.0) +
+                                             pow(y/last, 2.0) +
+                                             pow(_z/last, 2.0)));
+      } else if (_kind == NOISE) {
+        value = (Hash(x, y, _z) & 0xff)/255.f;
+      } else {
+        for (unsigned int i=0; i<NR_BLOBS; i++) {
+          const float *blob = &_blobs[4*i];
+          float dx = x - blob[0];
+          float dy = y - blob[1];
+          float dz = _z - blob[2];
+          float distance = sqrt(dx*dx + dy*dy + dz*dz)/blob[3];
+          if (distance < 1.f) {
+            value = std::max(value, 1.f - distance);
+          }
+        }
+      }
+      value = std::min(std::max(value, 0.f), 1.f);
+      _slice[y*_dim + x] = static_cast<unsigned char>(value*255.f + 0.5f);
+    }
+  }
+}
+
+// Writes a synthetic volume as a raw file, in parallel over z slices
+static bool GenerateRawFile(VolumeKind _kind,
+                            unsigned int _dim,
+                            std::string _fileName) {
+  // Blob centers and radii from a fixed seed, so runs are comparable
+  std::vector<float> blobs(4*NR_BLOBS);
+  unsigned int seed = 12345;
+  for (unsigned int i=0; i<blobs.size(); i++) {
+    seed = seed*1664525U + 1013904223U;
+    float random = (seed >> 8)/16777216.f;
+    blobs[i] = (i % 4 == 3) ? (0.03f + 0.07f*random)*_dim : random*_dim;
+  }
+
+  std::ofstream out(_fileName.c_str(), std::ios::out|std::ios::binary);
+  if (!out.is_open()) {
+    std::cout << _fileName << " could not be opened." << std::endl;
+    return false;
+  }
+  // A slab of slices at a time keeps the memory use small
+  const unsigned int slabSlices = 16;
+  unsigned long long sliceSize = (unsigned long long)_dim*_dim;
+  std::vector<unsigned char> slab(sliceSize*std::min(slabSlices, _dim));
+  for (unsigned int z0=0; z0<_dim; z0+=slabSlices) {
+    unsigned int nrSlices = std::min(slabSlices, _dim-z0);
+    unsigned char *data = &slab[0];
+    const std::vector<float> *blobData = &blobs;
+    ThreadPool::Instance().ParallelFor(nrSlices, [=](unsigned int _i) {
+      GenerateSlice(_kind, _dim, z0+_i, *blobData, data + _i*sliceSize);
+    });
+    out.write(reinterpret_cast<const char*>(data), nrSlices*sliceSize);
+  }
+  out.close();
+  return !out.fail();
+}
+
+// Traces every pixel with the scalar path on the ThreadPool, the image
+// size comes from the last Render()
+static double ScalarRaysPerSecond(SoftwareRenderer *_renderer) {
+  unsigned int width = _renderer->Width();
+  unsigned int height = _renderer->Height();
+  std::vector<float> image(width*height);
+  float *pixels = &image[0];
+  Timer timer;
+  ThreadPool::Instance().ParallelFor(height, [=](unsigned int _y) {
+    for (unsigned int x=0; x<width; x++) {
+      glm::vec3 origin, direction;
+      _renderer->GenerateRay(x, _y, origin, direction);
+      pixels[_y*width + x] = _renderer->TraceRay(origin, direction);
+    }
+  });
+  return (double)width*height/timer.Seconds();
+}
+
+// Reorders a _dim^3 volume of bytes into Morton order with every Morton
+// path the CPU has, next to a plain copy of the same bytes. A reorder
+// close to the copy's rate is bound by memory bandwidth.
+static void RunMortonBenchmark(unsigned int _dim) {
+  unsigned long long nrVoxels = (unsigned long long)_dim*_dim*_dim;
+  std::vector<unsigned char> volume(nrVoxels);
+  std::vector<unsigned char> reordered(nrVoxels);
+  for (unsigned long long i=0; i<nrVoxels; i++) {
+    volume[i] = static_cast<unsigned char>(i*31);
+  }
+  const unsigned char *source = &volume[0];
+  unsigned char *destination = &reordered[0];
+  const unsigned long long chunk = 1 << 16;
+  unsigned int nrChunks = static_cast<unsigned int>((nrVoxels+chunk-1)/chunk);
+  // Both directions of every byte count
+  double gigabytes = 2.0*nrVoxels/1e9;
+
+  Timer timer;
+  ThreadPool::Instance().ParallelFor(nrChunks, [=](unsigned int _c) {
+    unsigned long long first = _c*chunk;
+    memcpy(destination + first, source + first,
+           std::min(chunk, nrVoxels - first));
+  });
+  double copySeconds = timer.Seconds();
+  std::cout << "Morton reorder of " << _dim << "^3 bytes\n"
+    << "copy: " << copySeconds*1000.0 << " ms, "
+    << gigabytes/copySeconds << " GB/s\n";
+
+  // Every path decodes the codes in batches
+  const unsigned int batch = 1024;
+  Morton::Path detected = Morton::ActivePath();
+  for (unsigned int p=0; p<Morton::NR_PATHS; p++) {
+    Morton::Path path = static_cast<Morton::Path>(p);
+    if (!Morton::SetPath(path)) {
+      continue;
+    }
+    timer.Restart();
+    ThreadPool::Instance().ParallelFor(nrChunks, [=](unsigned int _c) {
+      unsigned int x[batch], y[batch], z[batch];
+      unsigned long long end = std::min((_c+1)*chunk, nrVoxels);
+      for (unsigned long long i=_c*chunk; i<end; i+=batch) {
+        unsigned int count =
+          static_cast<unsigned int>(std::min<unsigned long long>(batch,
+                                                                 end-i));
+        Morton::DecodeRange(i, count, x, y, z);
+        for (unsigned int j=0; j<count; j++) {
+          destination[i+j] =
+            source[((unsigned long long)z[j]*_dim + y[j])*_dim + x[j]];
+        }
+      }
+    });
+    double seconds = timer.Seconds();
+    std::cout << Morton::PathName(path)
+      << (path == detected ? " (detected)" : "") << ": "
+      << seconds*1000.0 << " ms, " << gigabytes/seconds << " GB/s\n";
+  }
+  Morton::SetPath(detected);
+
+  // The cursor only decodes one code per block
+  timer.Restart();
+  ThreadPool::Instance().ParallelFor(nrChunks, [=](unsigned int _c) {
+    unsigned long long end = std::min((_c+1)*chunk, nrVoxels);
+    Morton::Cursor cursor(_c*chunk);
+    for (unsigned long long i=_c*chunk; i<end; i++, cursor.Next()) {
+      destination[i] = source[((unsigned long long)cursor.Z()*_dim +
+                               cursor.Y())*_dim + cursor.X()];
+    }
+  });
+  double cursorSeconds = timer.Seconds();
+  std::cout << "cursor: " << cursorSeconds*1000.0 << " ms, "
+    << gigabytes/cursorSeconds << " GB/s\n";
+
+  // The other way around, reading rows in order and writing every voxel
+  // to its code
+  timer.Restart();
+  ThreadPool::Instance().ParallelFor(_dim, [=](unsigned int _z) {
+    std::vector<unsigned long long> codes(_dim);
+    for (unsigned int y=0; y<_dim; y++) {
+      Morton::EncodeRow(0, y, _z, _dim, &codes[0]);
+      const unsigned char *row =
+        source + ((unsigned long long)_z*_dim + y)*_dim;
+      for (unsigned int x=0; x<_dim; x++) {
+        destination[codes[x]] = row[x];
+      }
+    }
+  });
+  double rowSeconds = timer.Seconds();
+  std::cout << "row scatter: " << rowSeconds*1000.0 << " ms, "
+    << gigabytes/rowSeconds << " GB/s\n";
+}
+
+// Uploads the arrays the renderer puts in texture buffers into GL buffers
+// of the current context, and waits for the driver to take them
+static double UploadMilliseconds(const std::vector<unsigned int> &_packed,
+                                 const std::vector<unsigned int> &_ranges,
+                                 const std::vector<float> &_deviations,
+                                 const std::vector<unsigned int> &_gradients) {
+  const unsigned int nrArrays = 4;
+  const void *data[nrArrays] = {
+    _packed.data(), _ranges.data(), _deviations.data(), _gradients.data()
+  };
+  unsigned long long sizes[nrArrays] = {
+    _packed.size()*sizeof(unsigned int),
+    _ranges.size()*sizeof(unsigned int),
+    _deviations.size()*sizeof(float),
+    _gradients.size()*sizeof(unsigned int)
+  };
+  glFinish();
+  Timer timer;
+  unsigned int buffers[nrArrays];
+  glGenBuffers(nrArrays, buffers);
+  for (unsigned int i=0; i<nrArrays; i++) {
+    glBindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+    glBufferData(GL_TEXTURE_BUFFER,
+                 static_cast<GLsizeiptr>(sizes[i]),
+                 data[i],
+                 GL_STATIC_DRAW);
+  }
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  glFinish();
+  double milliseconds = timer.Milliseconds();
+  glDeleteBuffers(nrArrays, buffers);
+  return milliseconds;
+}
+
+static bool RunBenchmark(VolumeKind _kind,
+                         unsigned int _dim,
+                         unsigned int _imageSize,
+                         Result &_result) {
+  const std::string rawFileName = "benchmark_volume.raw";
+  _result.volume = VOLUME_NAMES[_kind];
+  _result.dim = _dim;
+  _result.threads = ThreadPool::Instance().NrThreads();
+
+  Timer timer;
+  if (!GenerateRawFile(_kind, _dim, rawFileName)) {
+    return false;
+  }
+  _result.generateMs = timer.Milliseconds();
+
+  // Read, convert and build the way VolumeTexture::LoadHostTree() does
+  timer.Restart();
+  std::vector<char> buffer;
+  if (!OctreeBuilder::ReadRaw(rawFileName, 1, _dim, buffer)) {
+    return false;
+  }
+  _result.readMs = timer.Milliseconds();
+  std::remove(rawFileName.c_str());
+
+  timer.Restart();
+  std::vector<float> volume;
+  OctreeBuilder::ConvertRaw(buffer, 1, volume);
+  _result.convertMs = timer.Milliseconds();
+  std::vector<char>().swap(buffer);
+
+  std::vector<float> nodes;
+  std::vector<float> ranges;
+  std::vector<float> deviations;
+  std::vector<float> gradients;
+  OctreeBuilder *builder = OctreeBuilder::New();
+  builder->BuildInMemory(volume, _dim, nodes, ranges, deviations, gradients);
+  _result.mortonMs = builder->MortonSeconds()*1000.0;
+  _result.reduceMs = builder->ReduceSeconds()*1000.0;
+  delete builder;
+  std::vector<float>().swap(volume);
+
+  timer.Restart();
+  std::vector<unsigned int> packed;
+  OctreeBuilder::PackNodes(nodes, ranges, packed);
+  std::vector<unsigned int> packedRanges(packed.size());
+  OctreeBuilder::PackRanges(&ranges[0], packed.size(), &packedRanges[0]);
+  std::vector<unsigned int> packedGradients;
+  OctreeBuilder::PackGradients(gradients, packedGradients);
+  _result.packMs = timer.Milliseconds();
+
+  _result.uploadMs = UploadMilliseconds(packed,
+                                        packedRanges,
+                                        deviations,
+                                        packedGradients);
+  unsigned long long nrVoxels = (unsigned long long)_dim*_dim*_dim;
+  double nodeBytes = (double)nodes.size()*sizeof(float);
+  double rangeBytes = (double)ranges.size()*sizeof(float);
+  double deviationBytes = (double)deviations.size()*sizeof(float);
+  // Packed trees upload their ranges quantized as well
+  double packedBytes = (double)(packed.size() + packedRanges.size())*
+                       sizeof(unsigned int);
+  _result.floatBytesPerVoxel =
+    (nodeBytes + rangeBytes + deviationBytes)/nrVoxels;
+  _result.packedBytesPerVoxel = (packedBytes + deviationBytes)/nrVoxels;
+  std::vector<unsigned int>().swap(packed);
+  std::vector<unsigned int>().swap(packedRanges);
+  std::vector<unsigned int>().swap(packedGradients);
+
+  // Full depth traversal through the CPU replica of the shader
+  SoftwareRenderer *renderer = SoftwareRenderer::New();
+  unsigned int maxDepth = 0;
+  while ((1U << maxDepth) < _dim) {
+    maxDepth++;
+  }
+  renderer->SetNodes(&nodes[0], &ranges[0], maxDepth);
+  // Only exactly constant nodes stop early, the image stays the same
+  renderer->SetDeviations(&deviations[0], 0.f);
+  renderer->SetMatrices(Camera::ModelMatrix(-30.f, 30.f, 0.f),
+                        Camera::ViewMatrix(),
+                        Camera::ProjMatrix(1.f));
+  timer.Restart();
+  renderer->Render(_imageSize, _imageSize);
+  double seconds = timer.Seconds();
+  _result.raysPerSecond = (double)_imageSize*_imageSize/seconds;
+  renderer->SetTraversal(SoftwareRenderer::RESTART_TRAVERSAL);
+  _result.restartRaysPerSecond = ScalarRaysPerSecond(renderer);
+  renderer->SetTraversal(SoftwareRenderer::ROPE_TRAVERSAL);
+  _result.ropeRaysPerSecond = ScalarRaysPerSecond(renderer);
+  delete renderer;
+
+  _result.peakRssMB = PeakRssMegabytes();
+  return true;
+}
+
+// One line of WriteCSV(), also how a run reports back to the main process
+static void WriteCSVRow(std::ostream &_out, const Result &_result) {
+  const Result &r = _result;
+  _out << r.volume << "," << r.dim << "," << r.threads << ","
+    << r.generateMs << "," << r.readMs << "," << r.convertMs << ","
+    << r.mortonMs << "," << r.reduceMs << "," << r.packMs << ","
+    << r.uploadMs << "," << r.peakRssMB << ","
+    << r.floatBytesPerVoxel << "," << r.packedBytesPerVoxel << ","
+    << r.raysPerSecond << "," << r.restartRaysPerSecond << ","
+    << r.ropeRaysPerSecond << "\n";
+}
+
+// Inverse of WriteCSVRow(). Returns false if a field is missing.
+static bool ParseCSVRow(std::string _line, Result &_result) {
+  std::istringstream in(_line);
+  Result &r = _result;
+  char comma;
+  std::getline(in, r.volume, ',');
+  in >> r.dim >> comma >> r.threads >> comma
+    >> r.generateMs >> comma >> r.readMs >> comma >> r.convertMs >> comma
+    >> r.mortonMs >> comma >> r.reduceMs >> comma >> r.packMs >> comma
+    >> r.uploadMs >> comma >> r.peakRssMB >> comma
+    >> r.floatBytesPerVoxel >> comma >> r.packedBytesPerVoxel >> comma
+    >> r.raysPerSecond >> comma >> r.restartRaysPerSecond >> comma
+    >> r.ropeRaysPerSecond;
+  return !in.fail();
+}
+
+static void WriteCSV(std::ostream &_out, const std::vector<Result> &_results) {
+  _out << "volume,dim,threads,generate_ms,read_ms,convert_ms,morton_ms,"
+    << "reduce_ms,pack_ms,upload_ms,peak_rss_mb,float_bytes_per_voxel,"
+    << "packed_bytes_per_voxel,rays_per_second,restart_rays_per_second,"
+    << "rope_rays_per_second\n";
+  for (unsigned int i=0; i<_results.size(); i++) {
+    WriteCSVRow(_out, _results[i]);
+  }
+}
+
+static void WriteJSON(std::ostream &_out,
+                      const std::vector<Result> &_results) {
+  _out << "[\n";
+  for (unsigned int i=0; i<_results.size(); i++) {
+    const Result &r = _results[i];
+    _out << "  {\"volume\": \"" << r.volume << "\", \"dim\": " << r.dim
+      << ", \"threads\": " << r.threads
+      << ", \"generate_ms\": " << r.generateMs
+      << ", \"read_ms\": " << r.readMs
+      << ", \"convert_ms\": " << r.convertMs
+      << ", \"morton_ms\": " << r.mortonMs
+      << ", \"reduce_ms\": " << r.reduceMs
+      << ", \"pack_ms\": " << r.packMs
+      << ", \"upload_ms\": " << r.uploadMs
+      << ", \"peak_rss_mb\": " << r.peakRssMB
+      << ", \"float_bytes_per_voxel\": " << r.floatBytesPerVoxel
+      << ", \"packed_bytes_per_voxel\": " << r.packedBytesPerVoxel
+      << ", \"rays_per_second\": " << r.raysPerSecond
+      << ", \"restart_rays_per_second\": " << r.restartRaysPerSecond
+      << ", \"rope_rays_per_second\": " << r.ropeRaysPerSecond << "}"
+      << (i+1 < _results.size() ? "," : "") << "\n";
+  }
+  _out << "]\n";
+}
+
+// Repeatable numbers for the octree build, its memory footprint and the
+// CPU traversal, on synthetic volumes from -min to -max dimensions
+int main(int _argc, char **_argv) {
+  unsigned int minDim = 64;
+  unsigned int maxDim = 256;
+  unsigned int imageSize = 256;
+  std::string csvFileName;
+  std::string jsonFileName;
+  unsigned int mortonDim = 0;
+  // Set in the processes started for every volume
+  unsigned int runKind = 0;
+  unsigned int runDim = 0;
+  for (int i=1; i<_argc; i++) {
+    std::string arg(_argv[i]);
+    bool hasValue = i+1 < _argc;
+    if (arg == "-min" && hasValue) {
+      minDim = atoi(_argv[++i]);
+    } else if (arg == "-max" && hasValue) {
+      maxDim = atoi(_argv[++i]);
+    } else if (arg == "-image" && hasValue) {
+      imageSize = atoi(_argv[++i]);
+    } else if (arg == "-threads" && hasValue) {
+      ThreadPool::Instance().SetNrThreads(atoi(_argv[++i]));
+    } else if (arg == "-csv" && hasValue) {
+      csvFileName = _argv[++i];
+    } else if (arg == "-json" && hasValue) {
+      jsonFileName = _argv[++i];
+    } else if (arg == "-morton" && hasValue) {
+      mortonDim = atoi(_argv[++i]);
+    } else if (arg == "-run" && i+2 < _argc) {
+      runKind = atoi(_argv[++i]);
+      runDim = atoi(_argv[++i]);
+    } else {
+      // 1024^3 needs a 64-bit build and around 24 GB for the float tree
+      // and its ranges
+      std::cout << "Usage: OctreeBenchmark [-min dim] [-max dim] "
+        << "[-image size] [-threads n] [-csv file] [-json file] "
+        << "[-morton dim]\n";
+      return 1;
+    }
+  }
+
+  // Only the Morton reorder, e.g. -morton 1024 for a 1 GB volume
+  if (mortonDim > 0) {
+    RunMortonBenchmark(mortonDim);
+    return 0;
+  }
+
+  if (minDim < 1 || (minDim & (minDim-1)) != 0) {
+    std::cout << "Error: Dimensions need to be a power of 2\n";
+    return 1;
+  }
+
+  // One volume, with a context of its own for the upload
+  if (runDim > 0) {
+    OffscreenContext *context = OffscreenContext::New();
+    if (!context->Create(_argc, _argv, 1, 1)) {
+      std::cout << "Error: Could not create a GL context\n";
+      delete context;
+      return 1;
+    }
+    GLenum err = glewInit();
+    if (err != GLEW_OK) {
+      std::cout << "GLEW error: " << glewGetErrorString(err) << std::endl;
+      delete context;
+      return 1;
+    }
+    Result result;
+    bool ran = runKind < NR_VOLUME_KINDS &&
+               RunBenchmark(static_cast<VolumeKind>(runKind),
+                            runDim,
+                            imageSize,
+                            result);
+    delete context;
+    if (!ran) {
+      return 1;
+    }
+    std::cout << RESULT_PREFIX;
+    WriteCSVRow(std::cout, result);
+    return 0;
+  }
+
+  std::vector<Result> results;
+  for (unsigned int dim=minDim; dim<=maxDim; dim*=2) {
+    for (unsigned int kind=0; kind<NR_VOLUME_KINDS; kind++) {
+      std::cout << "Benchmarking " << VOLUME_NAMES[kind] << " "
+        << dim << "^3\n";
+      std::ostringstream command;
+      command << "\"" << _argv[0] << "\" -run " << kind << " " << dim
+        << " -image " << imageSize
+        << " -threads " << ThreadPool::Instance().NrThreads();
+      FILE *pipe = OpenPipe(command.str());
+      if (pipe == NULL) {
+        std::cout << "Error: Could not start " << command.str() << "\n";
+        return 1;
+      }
+      // Everything but the result is passed through
+      Result result;
+      bool reported = false;
+      std::string prefix(RESULT_PREFIX);
+      char line[1024];
+      while (fgets(line, sizeof(line), pipe) != NULL) {
+        std::string text(line);
+        if (text.compare(0, prefix.size(), prefix) == 0) {
+          reported = ParseCSVRow(text.substr(prefix.size()), result);
+        } else {
+          std::cout << text;
+        }
+      }
+      if (ClosePipe(pipe) != 0 || !reported) {
+        std::cout << "Error: Benchmark of " << VOLUME_NAMES[kind] << " "
+          << dim << "^3 failed\n";
+        return 1;
+      }
+      results.push_back(result);
+    }
+  }
+
+  WriteCSV(std::cout, results);
+  if (!csvFileName.empty()) {
+    std::ofstream out(csvFileName.c_str());
+    WriteCSV(out, results);
+  }
+  if (!jsonFileName.empty()) {
+    std::ofstream out(jsonFileName.c_str());
+    WriteJSON(out, results);
+  }
+  return 0;
+}
@@ -0,0 +1,744 @@
+#include "OctreeBuilder.h"
+#include "Morton.h"
+#include "ThreadPool.h"
+#include "OctreeFile.h"
+#include "Timer.h"
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+
+// Volume value with coordinates clamped to the volume, so that gradients
+// on the border fall back to one-sided differences
+static float ClampedValue(const std::vector<float> &_volume,
+                          unsigned int _dim,
+                          int _x,
+                          int _y,
+                          int _z) {
+  int last = static_cast<int>(_dim) - 1;
+  unsigned long long x = std::min(std::max(_x, 0), last);
+  unsigned long long y = std::min(std::max(_y, 0), last);
+  unsigned long long z = std::min(std::max(_z, 0), last);
+  return _volume[(z*_dim + y)*_dim + x];
+}
+
+// Same for a slab of raw data of _dim by _dim voxels per slice. The slab
+// clamps z itself by repeating the border slices.
+static float ClampedSlabValue(const std::vector<char> &_slab,
+                              unsigned int _bytes,
+                              unsigned int _dim,
+                              int _x,
+                              int _y,
+                              unsigned int _slice) {
+  int last = static_cast<int>(_dim) - 1;
+  unsigned long long x = std::min(std::max(_x, 0), last);
+  unsigned long long y = std::min(std::max(_y, 0), last);
+  unsigned long long offset = ((unsigned long long)_slice*_dim + y)*_dim + x;
+  return OctreeBuilder::RawValue(&_slab[offset*_bytes], _bytes);
+}
+
+static unsigned int Log2(unsigned int _v) {
+  unsigned int result = 0;
+  while (_v > 1) {
+    _v >>= 1;
+    result++;
+  }
+  return result;
+}
+
+OctreeBuilder * OctreeBuilder::New() {
+  return new OctreeBuilder();
+}
+
+OctreeBuilder::OctreeBuilder()
+  : memoryBudget_(1024ULL*1024ULL*1024ULL),
+    dim_(0),
+    subtreeDim_(0),
+    subtreeLevels_(0),
+    maxDepth_(0),
+    layout_(OctreeFile::FLOAT_VALUE_CHILD),
+    rangeOffset_(0),
+    deviationOffset_(0),
+    gradientOffset_(0),
+    mortonSeconds_(0.0),
+    reduceSeconds_(0.0) {}
+
+void OctreeBuilder::SetMemoryBudget(unsigned long long _bytes) {
+  memoryBudget_ = _bytes;
+}
+
+unsigned long long OctreeBuilder::LevelStart(unsigned int _level) {
+  // (8^level - 1) / 7
+  return ((1ULL << (3*_level)) - 1) / 7;
+}
+
+unsigned long long OctreeBuilder::NrNodes(unsigned int _nrLevels) {
+  return LevelStart(_nrLevels);
+}
+
+unsigned int OctreeBuilder::PackNode(const float *_node,
+                                     const float *_range) {
+  float child = _node[1];
+  float value = std::min(std::max(_node[0], 0.f), 1.f);
+  if (child < -1.5f) {
+    unsigned int brick = static_cast<unsigned int>(-child) - 2;
+    unsigned int brickValue =
+      static_cast<unsigned int>(value*PACKED_BRICK_VALUE_MAX + 0.5f);
+    return PACKED_LEAF | PACKED_BRICK | (brick & PACKED_BRICK_INDEX) |
+           (brickValue << PACKED_BRICK_VALUE_SHIFT);
+  }
+  unsigned int word =
+    static_cast<unsigned int>(value*PACKED_VALUE_MAX + 0.5f);
+  if (child < 0.f) {
+    word |= PACKED_LEAF;
+  }
+  if (_range[1] <= 0.f) {
+    word |= PACKED_EMPTY;
+  }
+  return word;
+}
+
+void OctreeBuilder::PackNodes(const std::vector<float> &_nodes,
+                              const std::vector<float> &_ranges,
+                              std::vector<unsigned int> &_packed) {
+  unsigned long long nrNodes = _nodes.size()/NODE_SIZE;
+  _packed.resize(nrNodes);
+  const unsigned long long chunk = 1 << 16;
+  const float *nodes = &_nodes[0];
+  const float *ranges = &_ranges[0];
+  unsigned int *packed = &_packed[0];
+  unsigned int nrChunks = static_cast<unsigned int>((nrNodes+chunk-1)/chunk);
+  ThreadPool::Instance().ParallelFor(nrChunks, [=](unsigned int _c) {
+    unsigned long long end = std::min(nrNodes, (_c+1)*chunk);
+    for (unsigned long long i=_c*chunk; i<end; i++) {
+      packed[i] = PackNode(&nodes[i*NODE_SIZE], &ranges[i*RANGE_SIZE]);
+    }
+  });
+}
+
+unsigned int OctreeBuilder::PackRange(const float *_range) {
+  double min = std::min(std::max(_range[0], 0.f), 1.f);
+  double max = std::min(std::max(_range[1], 0.f), 1.f);
+  unsigned int packedMin =
+    static_cast<unsigned int>(floor(min*PACKED_VALUE_MAX));
+  unsigned int packedMax =
+    static_cast<unsigned int>(ceil(max*PACKED_VALUE_MAX));
+  return packedMin | (packedMax << 16);
+}
+
+void OctreeBuilder::PackRanges(const float *_ranges,
+                               unsigned long long _nrNodes,
+                               unsigned int *_packed) {
+  const unsigned long long chunk = 1 << 16;
+  unsigned int nrChunks =
+    static_cast<unsigned int>((_nrNodes+chunk-1)/chunk);
+  ThreadPool::Instance().ParallelFor(nrChunks, [=](unsigned int _c) {
+    unsigned long long end = std::min(_nrNodes, (_c+1)*chunk);
+    for (unsigned long long i=_c*chunk; i<end; i++) {
+      _packed[i] = PackRange(&_ranges[i*RANGE_SIZE]);
+    }
+  });
+}
+
+void OctreeBuilder::UnpackNodes(const unsigned int *_packed,
+                                unsigned long long _nrNodes,
+                                std::vector<float> &_nodes) {
+  _nodes.resize(_nrNodes*NODE_SIZE);
+  for (unsigned long long i=0; i<_nrNodes; i++) {
+    unsigned int word = _packed[i];
+    float *node = &_nodes[i*NODE_SIZE];
+    if (word & PACKED_BRICK) {
+      unsigned int brickValue =
+        (word >> PACKED_BRICK_VALUE_SHIFT) & PACKED_BRICK_VALUE_MAX;
+      node[0] = static_cast<float>(brickValue)/PACKED_BRICK_VALUE_MAX;
+      node[1] = -2.f - (word & PACKED_BRICK_INDEX);
+    } else {
+      node[0] = static_cast<float>(word & PACKED_VALUE_MAX)/PACKED_VALUE_MAX;
+      node[1] = (word & PACKED_LEAF) ? -1.f :
+                static_cast<float>((8*i+1)*NODE_SIZE);
+    }
+  }
+}
+
+unsigned int OctreeBuilder::PackGradient(const float *_gradient) {
+  float x = _gradient[0];
+  float y = _gradient[1];
+  float z = _gradient[2];
+  float magnitude =
+    std::min(static_cast<float>(sqrt(x*x + y*y + z*z)), 1.f);
+  // Project the direction onto the octahedron |x|+|y|+|z| = 1 and fold
+  // its lower half over the upper one
+  float u = 0.f;
+  float v = 0.f;
+  float norm = fabs(x) + fabs(y) + fabs(z);
+  if (norm > 0.f) {
+    u = x/norm;
+    v = y/norm;
+    if (z < 0.f) {
+      float foldedU = (1.f - fabs(v))*(u >= 0.f ? 1.f : -1.f);
+      float foldedV = (1.f - fabs(u))*(v >= 0.f ? 1.f : -1.f);
+      u = foldedU;
+      v = foldedV;
+    }
+  }
+  unsigned int packedU =
+    static_cast<unsigned int>((u*0.5f + 0.5f)*GRADIENT_AXIS_MAX + 0.5f);
+  unsigned int packedV =
+    static_cast<unsigned int>((v*0.5f + 0.5f)*GRADIENT_AXIS_MAX + 0.5f);
+  unsigned int packedMagnitude =
+    static_cast<unsigned int>(magnitude*GRADIENT_MAGNITUDE_MAX + 0.5f);
+  return packedU | (packedV << GRADIENT_AXIS_BITS) |
+         (packedMagnitude << GRADIENT_MAGNITUDE_SHIFT);
+}
+
+void OctreeBuilder::UnpackGradient(unsigned int _word, float *_gradient) {
+  float u = (_word & GRADIENT_AXIS_MAX)*2.f/GRADIENT_AXIS_MAX - 1.f;
+  float v = ((_word >> GRADIENT_AXIS_BITS) & GRADIENT_AXIS_MAX)*2.f/
+            GRADIENT_AXIS_MAX - 1.f;
+  float w = 1.f - fabs(u) - fabs(v);
+  if (w < 0.f) {
+    float unfoldedU = (1.f - fabs(v))*(u >= 0.f ? 1.f : -1.f);
+    float unfoldedV = (1.f - fabs(u))*(v >= 0.f ? 1.f : -1.f);
+    u = unfoldedU;
+    v = unfoldedV;
+  }
+  float magnitude = static_cast<float>(_word >> GRADIENT_MAGNITUDE_SHIFT)/
+                    GRADIENT_MAGNITUDE_MAX;
+  float scale = magnitude/sqrt(u*u + v*v + w*w);
+  _gradient[0] = u*scale;
+  _gradient[1] = v*scale;
+  _gradient[2] = w*scale;
+}
+
+void OctreeBuilder::PackGradients(const std::vector<float> &_gradients,
+                                  std::vector<unsigned int> &_packed) {
+  unsigned long long nrNodes = _gradients.size()/GRADIENT_SIZE;
+  _packed.resize(nrNodes);
+  const unsigned long long chunk = 1 << 16;
+  const float *gradients = &_gradients[0];
+  unsigned int *packed = &_packed[0];
+  unsigned int nrChunks = static_cast<unsigned int>((nrNodes+chunk-1)/chunk);
+  ThreadPool::Instance().ParallelFor(nrChunks, [=](unsigned int _c) {
+    unsigned long long end = std::min(nrNodes, (_c+1)*chunk);
+    for (unsigned long long i=_c*chunk; i<end; i++) {
+      packed[i] = PackGradient(&gradients[i*GRADIENT_SIZE]);
+    }
+  });
+}
+
+unsigned int OctreeBuilder::ChooseSubtreeDim(unsigned int _dim,
+                                             unsigned int _bytes) {
+  for (unsigned long long s=_dim; s>=1; s/=2) {
+    unsigned long long perAxis = _dim/s;
+    unsigned long long nrRoots = perAxis*perAxis*perAxis;
+    // z slab of raw data, with a slice on either side for the gradients
+    unsigned long long cost = (unsigned long long)_dim*_dim*(s+2)*_bytes;
+    // Subtree levels plus the records for its largest level
+    cost += NrNodes(Log2((unsigned int)s)+1)*sizeof(NodeStats);
+    cost += s*s*s*((NODE_SIZE+RANGE_SIZE+DEVIATION_SIZE)*sizeof(float) +
+                   sizeof(unsigned int));
+    // Subtree roots and the levels above them
+    cost += NrNodes(Log2((unsigned int)perAxis)+1)*sizeof(NodeStats);
+    cost += nrRoots*((NODE_SIZE+RANGE_SIZE+DEVIATION_SIZE)*sizeof(float) +
+                     sizeof(unsigned int));
+    if (layout_ == OctreeFile::PACKED_32) {
+      cost += std::max(s*s*s, nrRoots)*sizeof(unsigned int);
+    }
+    if (cost <= memoryBudget_) {
+      return (unsigned int)s;
+    }
+  }
+  return 0;
+}
+
+float OctreeBuilder::RawValue(const char *_data, unsigned int _bytes) {
+  if (_bytes == 1) {
+    return static_cast<float>(static_cast<unsigned char>(*_data))/255.f;
+  } else if (_bytes == 2) {
+    unsigned short value;
+    memcpy(&value, _data, sizeof(value));
+    return static_cast<float>(value)/65535.f;
+  } else {
+    float value;
+    memcpy(&value, _data, sizeof(value));
+    return value;
+  }
+}
+
+bool OctreeBuilder::ReadRaw(std::string _fileName,
+                            unsigned int _bytes,
+                            unsigned int _dim,
+                            std::vector<char> &_buffer,
+                            std::function<void(float)> _progress) {
+  std::ifstream in(_fileName.c_str(), std::ios::in|std::ios::binary);
+  if (!in.is_open()) {
+    std::cout << _fileName << " could not be opened." << std::endl;
+    return false;
+  }
+  unsigned long long sliceBytes = (unsigned long long)_dim*_dim*_bytes;
+  _buffer.resize(sliceBytes*_dim);
+  for (unsigned int z=0; z<_dim && in; z++) {
+    in.read(&_buffer[z*sliceBytes], sliceBytes);
+    if (_progress) {
+      _progress(static_cast<float>(z+1)/_dim);
+    }
+  }
+  if (!in) {
+    std::cout << "Error: " << _fileName << " is smaller than "
+      << _buffer.size() << " bytes\n";
+    return false;
+  }
+  return true;
+}
+
+void OctreeBuilder::ConvertRaw(const std::vector<char> &_buffer,
+                               unsigned int _bytes,
+                               std::vector<float> &_volume) {
+  unsigned long long nrVoxels = _buffer.size()/_bytes;
+  _volume.resize(nrVoxels);
+  const unsigned long long chunk = 1 << 16;
+  unsigned int nrChunks = static_cast<unsigned int>((nrVoxels+chunk-1)/chunk);
+  const char *data = _buffer.data();
+  float *volume = _volume.data();
+  ThreadPool::Instance().ParallelFor(nrChunks, [=](unsigned int _c) {
+    unsigned long long end = std::min((_c+1)*chunk, nrVoxels);
+    for (unsigned long long i=_c*chunk; i<end; i++) {
+      volume[i] = RawValue(&data[i*_bytes], _bytes);
+    }
+  });
+}
+
+OctreeBuilder::NodeStats OctreeBuilder::Reduce(const NodeStats *_children) {
+  NodeStats parent = _children[0];
+  float values[8];
+  float deviations[8];
+  for (unsigned int j=0; j<8; j++) {
+    if (j > 0) {
+      parent.value += _children[j].value;
+      parent.min = std::min(parent.min, _children[j].min);
+      parent.max = std::max(parent.max, _children[j].max);
+      for (unsigned int k=0; k<GRADIENT_SIZE; k++) {
+        parent.gradient[k] += _children[j].gradient[k];
+      }
+    }
+    values[j] = _children[j].value;
+    deviations[j] = _children[j].deviation;
+  }
+  parent.value /= 8.f;
+  for (unsigned int k=0; k<GRADIENT_SIZE; k++) {
+    parent.gradient[k] /= 8.f;
+  }
+  parent.deviation = CombineDeviations(values, 1, deviations,
+                                       parent.value, parent.min, parent.max);
+  return parent;
+}
+
+float OctreeBuilder::CombineDeviations(const float *_values,
+                                       unsigned int _valueStride,
+                                       const float *_deviations,
+                                       float _mean,
+                                       float _min,
+                                       float _max) {
+  if (_min == _max) {
+    return 0.f;
+  }
+  // Spread within the children plus the spread of their means, measured
+  // around the parent mean so nothing cancels
+  float variance = 0.f;
+  for (unsigned int j=0; j<8; j++) {
+    float offset = _values[j*_valueStride] - _mean;
+    float deviation = _deviations[j];
+    variance += deviation*deviation + offset*offset;
+  }
+  return sqrt(variance/8.f);
+}
+
+void OctreeBuilder::WriteNodes(std::ofstream &_out,
+                               const std::vector<NodeStats> &_stats,
+                               unsigned int _level,
+                               unsigned long long _firstNode) {
+  unsigned long long node = LevelStart(_level) + _firstNode;
+  records_.resize(_stats.size()*NODE_SIZE);
+  rangeRecords_.resize(_stats.size()*RANGE_SIZE);
+  deviationRecords_.resize(_stats.size()*DEVIATION_SIZE);
+  gradientRecords_.resize(_stats.size());
+  for (unsigned int i=0; i<_stats.size(); i++) {
+    records_[i*NODE_SIZE] = _stats[i].value;
+    rangeRecords_[i*RANGE_SIZE] = _stats[i].min;
+    rangeRecords_[i*RANGE_SIZE+1] = _stats[i].max;
+    deviationRecords_[i*DEVIATION_SIZE] = _stats[i].deviation;
+    gradientRecords_[i] = PackGradient(_stats[i].gradient);
+    if (_level == maxDepth_) {
+      records_[i*NODE_SIZE+1] = -1.f;
+    } else {
+      // Offset in floats to the first of the eight children
+      records_[i*NODE_SIZE+1] =
+        static_cast<float>((8*(node+i)+1)*NODE_SIZE);
+    }
+  }
+  _out.seekp(OctreeFile::DATA_OFFSET + node*OctreeFile::NodeSize(layout_),
+             std::ios::beg);
+  if (layout_ == OctreeFile::PACKED_32) {
+    packedRecords_.resize(_stats.size());
+    for (unsigned int i=0; i<_stats.size(); i++) {
+      packedRecords_[i] = PackNode(&records_[i*NODE_SIZE],
+                                   &rangeRecords_[i*RANGE_SIZE]);
+    }
+    _out.write(reinterpret_cast<const char*>(&packedRecords_[0]),
+               packedRecords_.size()*sizeof(unsigned int));
+  } else {
+    _out.write(reinterpret_cast<const char*>(&records_[0]),
+               records_.size()*sizeof(float));
+  }
+  _out.seekp(rangeOffset_ + node*RANGE_SIZE*sizeof(float), std::ios::beg);
+  _out.write(reinterpret_cast<const char*>(&rangeRecords_[0]),
+             rangeRecords_.size()*sizeof(float));
+  _out.seekp(deviationOffset_ + node*DEVIATION_SIZE*sizeof(float),
+             std::ios::beg);
+  _out.write(reinterpret_cast<const char*>(&deviationRecords_[0]),
+             deviationRecords_.size()*sizeof(float));
+  _out.seekp(gradientOffset_ + node*sizeof(unsigned int), std::ios::beg);
+  _out.write(reinterpret_cast<const char*>(&gradientRecords_[0]),
+             gradientRecords_.size()*sizeof(unsigned int));
+}
+
+OctreeBuilder::NodeStats OctreeBuilder::BuildSubtree(const std::vector<char> &_slab,
+                                  unsigned int _bytes,
+                                  unsigned int _x,
+                                  unsigned int _y,
+                                  unsigned long long _rootIndex,
+                                  std::ofstream &_out) {
+  // Gather the base level in Morton order, with the central differences
+  // of every voxel. The leaves are independent, so they are spread over
+  // the ThreadPool, and every chunk streams through its codes.
+  NodeStats *base = &levels_[subtreeLevels_-1][0];
+  unsigned int nrLeaves = subtreeDim_*subtreeDim_*subtreeDim_;
+  const unsigned int chunk = 1 << 12;
+  const std::vector<char> *slab = &_slab;
+  unsigned int dim = dim_;
+  unsigned int nrChunks = (nrLeaves + chunk - 1)/chunk;
+  ThreadPool::Instance().ParallelFor(nrChunks, [=](unsigned int _c) {
+    unsigned int end = std::min(nrLeaves, (_c+1)*chunk);
+    Morton::Cursor cursor(_c*chunk);
+    for (unsigned int i=_c*chunk; i<end; i++, cursor.Next()) {
+      int vx = static_cast<int>(_x+cursor.X());
+      int vy = static_cast<int>(_y+cursor.Y());
+      // Slice 0 of the slab is the one below the subtree
+      unsigned int slice = cursor.Z()+1;
+      float value = ClampedSlabValue(*slab, _bytes, dim, vx, vy, slice);
+      base[i].value = value;
+      base[i].min = value;
+      base[i].max = value;
+      base[i].deviation = 0.f;
+      base[i].gradient[0] = 0.5f*(
+        ClampedSlabValue(*slab, _bytes, dim, vx+1, vy, slice) -
+        ClampedSlabValue(*slab, _bytes, dim, vx-1, vy, slice));
+      base[i].gradient[1] = 0.5f*(
+        ClampedSlabValue(*slab, _bytes, dim, vx, vy+1, slice) -
+        ClampedSlabValue(*slab, _bytes, dim, vx, vy-1, slice));
+      base[i].gradient[2] = 0.5f*(
+        ClampedSlabValue(*slab, _bytes, dim, vx, vy, slice+1) -
+        ClampedSlabValue(*slab, _bytes, dim, vx, vy, slice-1));
+    }
+  });
+
+  // Reduce children to get the levels above, all inside the subtree
+  for (int level=subtreeLevels_-2; level>=0; level--) {
+    std::vector<NodeStats> &parents = levels_[level];
+    std::vector<NodeStats> &children = levels_[level+1];
+    for (unsigned int i=0; i<parents.size(); i++) {
+      parents[i] = Reduce(&children[8*i]);
+    }
+  }
+
+  // The subtree's nodes are contiguous within every level of the full tree
+  unsigned int rootLevel = maxDepth_ - (subtreeLevels_-1);
+  for (unsigned int level=0; level<subtreeLevels_; level++) {
+    WriteNodes(_out,
+               levels_[level],
+               rootLevel+level,
+               _rootIndex << (3*level));
+  }
+  return levels_[0][0];
+}
+
+bool OctreeBuilder::BuildToFile(std::string _rawFileName,
+                                int _bits,
+                                int _dim,
+                                std::string _octreeFileName,
+                                OctreeFile::NodeLayout _layout) {
+  if (_dim < 1 || (_dim & (_dim-1)) != 0) {
+    std::cout << "Error: Dimensions need to be a power of 2\n";
+    return false;
+  }
+  if (_bits != 8 && _bits != 16 && _bits != 32) {
+    std::cout << "Error: Unsupported bits per voxel: " << _bits << "\n";
+    return false;
+  }
+  unsigned int bytes = _bits/8;
+  dim_ = _dim;
+  maxDepth_ = Log2(dim_);
+  layout_ = _layout;
+
+  subtreeDim_ = ChooseSubtreeDim(dim_, bytes);
+  if (subtreeDim_ == 0) {
+    std::cout << "Error: Memory budget of " << memoryBudget_
+      << " bytes is too small for dimensions " << dim_ << "\n";
+    return false;
+  }
+  subtreeLevels_ = Log2(subtreeDim_) + 1;
+  unsigned int rootLevel = maxDepth_ - (subtreeLevels_-1);
+  unsigned int subtreesPerAxis = dim_/subtreeDim_;
+
+  std::ifstream in;
+  in.open(_rawFileName.c_str(), std::ios::in|std::ios::binary);
+  if (!in.is_open()) {
+    std::cout << _rawFileName << " could not be opened." << std::endl;
+    return false;
+  }
+  in.seekg(0, std::ios::end);
+  unsigned long long fileSize = in.tellg();
+  unsigned long long volumeSize = (unsigned long long)dim_*dim_*dim_*bytes;
+  if (fileSize < volumeSize) {
+    std::cout << "Error: " << _rawFileName << " holds " << fileSize
+      << " bytes, expected " << volumeSize << "\n";
+    return false;
+  }
+
+  std::ofstream out;
+  out.open(_octreeFileName.c_str(),
+           std::ios::out|std::ios::binary|std::ios::trunc);
+  if (!out.is_open()) {
+    std::cout << _octreeFileName << " could not be opened." << std::endl;
+    return false;
+  }
+
+  OctreeFileHeader header = OctreeFile::MakeHeader(dim_,
+                                                   _bits,
+                                                   layout_,
+                                                   OctreeFile::RANGE |
+                                                   OctreeFile::DEVIATION |
+                                                   OctreeFile::GRADIENT);
+  OctreeFile::WriteHeader(out, header);
+  rangeOffset_ = OctreeFile::ChannelOffset(header, OctreeFile::RANGE);
+  deviationOffset_ = OctreeFile::ChannelOffset(header,
+                                               OctreeFile::DEVIATION);
+  gradientOffset_ = OctreeFile::ChannelOffset(header, OctreeFile::GRADIENT);
+
+  std::cout << "Streaming octree build\n"
+    << "Dimensions: " << dim_ << "\n"
+    << "Nr of levels in octree: " << maxDepth_+1 << "\n"
+    << "Subtree dimensions: " << subtreeDim_ << "\n"
+    << "Memory budget: " << memoryBudget_ << " bytes\n";
+
+  levels_.resize(subtreeLevels_);
+  for (unsigned int level=0; level<subtreeLevels_; level++) {
+    levels_[level].resize(1ULL << (3*level));
+  }
+
+  unsigned long long sliceSize = (unsigned long long)dim_*dim_*bytes;
+  unsigned long long slabSize = sliceSize*subtreeDim_;
+  std::vector<char> slab(slabSize + 2*sliceSize);
+  std::vector<NodeStats> roots(1ULL << (3*rootLevel));
+
+  for (unsigned int z=0; z<subtreesPerAxis; z++) {
+    // The slices next to the slab, or the border slices repeated
+    unsigned long long below = z > 0 ? z*slabSize - sliceSize : 0;
+    unsigned long long above = std::min((z+1)*slabSize,
+                                        volumeSize - sliceSize);
+    in.seekg(below, std::ios::beg);
+    in.read(&slab[0], sliceSize);
+    in.seekg(z*slabSize, std::ios::beg);
+    in.read(&slab[sliceSize], slabSize);
+    in.seekg(above, std::ios::beg);
+    in.read(&slab[sliceSize + slabSize], sliceSize);
+    if (!in) {
+      std::cout << "Error: Failed to read slab " << z << "\n";
+      return false;
+    }
+    for (unsigned int y=0; y<subtreesPerAxis; y++) {
+      for (unsigned int x=0; x<subtreesPerAxis; x++) {
+        unsigned long long rootIndex = Morton::Encode(x, y, z);
+        roots[rootIndex] = BuildSubtree(slab,
+                                        bytes,
+                                        x*subtreeDim_,
+                                        y*subtreeDim_,
+                                        rootIndex,
+                                        out);
+      }
+    }
+    std::cout << "Finished slab " << z+1 << "/" << subtreesPerAxis << "\n";
+  }
+  in.close();
+
+  // Finish the levels above the subtree roots, they are small
+  std::vector<NodeStats> parents;
+  for (int level=rootLevel-1; level>=0; level--) {
+    parents.resize(roots.size()/8);
+    for (unsigned int i=0; i<parents.size(); i++) {
+      parents[i] = Reduce(&roots[8*i]);
+    }
+    WriteNodes(out, parents, level, 0);
+    roots.swap(parents);
+  }
+
+  out.close();
+  if (!out) {
+    std::cout << "Error: Failed to write " << _octreeFileName << "\n";
+    return false;
+  }
+  std::cout << "Finished streaming octree build\n\n";
+  return true;
+}
+
+void OctreeBuilder::ReduceNode(std::vector<float> &_nodes,
+                               std::vector<float> &_ranges,
+                               std::vector<float> &_deviations,
+                               std::vector<float> &_gradients,
+                               unsigned long long _node) {
+  unsigned long long firstChild = 8*_node+1;
+  const float *child = &_nodes[firstChild*NODE_SIZE];
+  const float *childRange = &_ranges[firstChild*RANGE_SIZE];
+  const float *childGradient = &_gradients[firstChild*GRADIENT_SIZE];
+  float sum = 0.f;
+  float min = childRange[0];
+  float max = childRange[1];
+  float gradient[GRADIENT_SIZE] = { 0.f, 0.f, 0.f };
+  for (unsigned int j=0; j<8; j++) {
+    sum += child[j*NODE_SIZE];
+    min = std::min(min, childRange[j*RANGE_SIZE]);
+    max = std::max(max, childRange[j*RANGE_SIZE+1]);
+    for (unsigned int k=0; k<GRADIENT_SIZE; k++) {
+      gradient[k] += childGradient[j*GRADIENT_SIZE+k];
+    }
+  }
+  for (unsigned int k=0; k<GRADIENT_SIZE; k++) {
+    _gradients[_node*GRADIENT_SIZE+k] = gradient[k]/8.f;
+  }
+  _nodes[_node*NODE_SIZE] = sum/8.f;
+  _nodes[_node*NODE_SIZE+1] = static_cast<float>(firstChild*NODE_SIZE);
+  _ranges[_node*RANGE_SIZE] = min;
+  _ranges[_node*RANGE_SIZE+1] = max;
+  _deviations[_node*DEVIATION_SIZE] =
+    CombineDeviations(child,
+                      NODE_SIZE,
+                      &_deviations[firstChild*DEVIATION_SIZE],
+                      sum/8.f,
+                      min,
+                      max);
+}
+
+void OctreeBuilder::ScatterLeaves(const std::vector<float> &_volume,
+                                  unsigned int _dim,
+                                  unsigned int _maxDepth,
+                                  unsigned int _rootLevel,
+                                  unsigned long long _rootIndex,
+                                  std::vector<float> &_nodes,
+                                  std::vector<float> &_ranges,
+                                  std::vector<float> &_deviations,
+                                  std::vector<float> &_gradients) {
+  unsigned int subtreeDim = _dim >> _rootLevel;
+  unsigned int x0, y0, z0;
+  Morton::Decode(_rootIndex, x0, y0, z0);
+  x0 *= subtreeDim;
+  y0 *= subtreeDim;
+  z0 *= subtreeDim;
+
+  // Scatter the leaves into Morton order
+  unsigned long long nrLeaves =
+    (unsigned long long)subtreeDim*subtreeDim*subtreeDim;
+  unsigned long long firstLeaf = LevelStart(_maxDepth) + _rootIndex*nrLeaves;
+  float *leaf = &_nodes[firstLeaf*NODE_SIZE];
+  float *leafRange = &_ranges[firstLeaf*RANGE_SIZE];
+  float *leafDeviation = &_deviations[firstLeaf*DEVIATION_SIZE];
+  float *leafGradient = &_gradients[firstLeaf*GRADIENT_SIZE];
+  Morton::Cursor cursor(0);
+  for (unsigned long long i=0; i<nrLeaves; i++, cursor.Next()) {
+    int vx = static_cast<int>(x0+cursor.X());
+    int vy = static_cast<int>(y0+cursor.Y());
+    int vz = static_cast<int>(z0+cursor.Z());
+    float value = ClampedValue(_volume, _dim, vx, vy, vz);
+    leaf[i*NODE_SIZE] = value;
+    leaf[i*NODE_SIZE+1] = -1.f;
+    leafRange[i*RANGE_SIZE] = value;
+    leafRange[i*RANGE_SIZE+1] = value;
+    leafDeviation[i*DEVIATION_SIZE] = 0.f;
+    // Central differences, one-sided on the volume border
+    float *gradient = &leafGradient[i*GRADIENT_SIZE];
+    gradient[0] = 0.5f*(ClampedValue(_volume, _dim, vx+1, vy, vz) -
+                        ClampedValue(_volume, _dim, vx-1, vy, vz));
+    gradient[1] = 0.5f*(ClampedValue(_volume, _dim, vx, vy+1, vz) -
+                        ClampedValue(_volume, _dim, vx, vy-1, vz));
+    gradient[2] = 0.5f*(ClampedValue(_volume, _dim, vx, vy, vz+1) -
+                        ClampedValue(_volume, _dim, vx, vy, vz-1));
+  }
+}
+
+void OctreeBuilder::ReduceSubtree(unsigned int _maxDepth,
+                                  unsigned int _rootLevel,
+                                  unsigned long long _rootIndex,
+                                  std::vector<float> &_nodes,
+                                  std::vector<float> &_ranges,
+                                  std::vector<float> &_deviations,
+                                  std::vector<float> &_gradients) {
+  // Reduce bottom-up, the subtree's part of each level is contiguous
+  for (int level=_maxDepth-1; level>=(int)_rootLevel; level--) {
+    unsigned long long count = 1ULL << (3*(level-_rootLevel));
+    unsigned long long first = LevelStart(level) + _rootIndex*count;
+    for (unsigned long long i=0; i<count; i++) {
+      ReduceNode(_nodes, _ranges, _deviations, _gradients, first+i);
+    }
+  }
+}
+
+void OctreeBuilder::BuildInMemory(const std::vector<float> &_volume,
+                                  unsigned int _dim,
+                                  std::vector<float> &_nodes,
+                                  std::vector<float> &_ranges,
+                                  std::vector<float> &_deviations,
+                                  std::vector<float> &_gradients) {
+  unsigned int maxDepth = Log2(_dim);
+  _nodes.resize(NrNodes(maxDepth+1)*NODE_SIZE);
+  _ranges.resize(NrNodes(maxDepth+1)*RANGE_SIZE);
+  _deviations.resize(NrNodes(maxDepth+1)*DEVIATION_SIZE);
+  _gradients.resize(NrNodes(maxDepth+1)*GRADIENT_SIZE);
+
+  // Enough subtrees to keep every thread busy, a single one when running
+  // single threaded. Each parent is always the average of its own eight
+  // children, so the result does not depend on the split.
+  unsigned int nrThreads = ThreadPool::Instance().NrThreads();
+  unsigned int rootLevel = 0;
+  while (rootLevel < maxDepth && nrThreads > 1 &&
+         (1ULL << (3*rootLevel)) < 8ULL*nrThreads) {
+    rootLevel++;
+  }
+  unsigned int nrSubtrees = 1U << (3*rootLevel);
+
+  const std::vector<float> *volume = &_volume;
+  std::vector<float> *nodes = &_nodes;
+  std::vector<float> *ranges = &_ranges;
+  std::vector<float> *deviations = &_deviations;
+  std::vector<float> *gradients = &_gradients;
+  Timer timer;
+  ThreadPool::Instance().ParallelFor(nrSubtrees, [=](unsigned int _i) {
+    ScatterLeaves(*volume, _dim, maxDepth, rootLevel, _i,
+                  *nodes, *ranges, *deviations, *gradients);
+  });
+  mortonSeconds_ = timer.Seconds();
+
+  timer.Restart();
+  ThreadPool::Instance().ParallelFor(nrSubtrees, [=](unsigned int _i) {
+    ReduceSubtree(maxDepth, rootLevel, _i,
+                  *nodes, *ranges, *deviations, *gradients);
+  });
+
+  // Finish the top levels serially
+  for (int level=rootLevel-1; level>=0; level--) {
+    unsigned long long first = LevelStart(level);
+    unsigned long long count = 1ULL << (3*level);
+    for (unsigned long long i=0; i<count; i++) {
+      ReduceNode(_nodes, _ranges, _deviations, _gradients, first+i);
+    }
+  }
+  reduceSeconds_ = timer.Seconds();
+}
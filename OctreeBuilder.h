@@ -0,0 +1,214 @@
+#ifndef OCTREEBUILDER_H
+#define OCTREEBUILDER_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <functional>
+#include "OctreeFile.h"
+
+// Builds the octree node array (the same layout VolumeTexture uploads)
+// without holding the whole volume in memory. The raw file is read in slabs
+// of z slices, every slab is cut into Morton ordered subtrees, and the
+// finished nodes are written straight to their place in an OctreeFile.
+class OctreeBuilder {
+public:
+  static OctreeBuilder * New();
+  // Upper limit for the working memory of the builder, in bytes
+  void SetMemoryBudget(unsigned long long _bytes);
+  unsigned long long MemoryBudget() { return memoryBudget_; }
+  // Streams a .raw file into an octree file
+  // Params: raw file name, bits per voxel (8, 16 or 32 for float),
+  // dimensions (cube, power of 2), octree file name, node layout
+  // Returns false if the input could not be read or the budget is too small
+  bool BuildToFile(std::string _rawFileName,
+                   int _bits,
+                   int _dim,
+                   std::string _octreeFileName,
+                   OctreeFile::NodeLayout _layout =
+                     OctreeFile::FLOAT_VALUE_CHILD);
+  // Builds the whole node array in memory from normalized values in
+  // x-fastest order. Independent subtrees are built in parallel on the
+  // ThreadPool, only the few levels above them run on the calling thread.
+  // Params: volume values, dimensions (cube, power of 2), node array out,
+  // value ranges out (min and max per node, see OctreeFile::RANGE),
+  // deviations out (see OctreeFile::DEVIATION), gradient vectors out (see
+  // PackGradients)
+  void BuildInMemory(const std::vector<float> &_volume,
+                     unsigned int _dim,
+                     std::vector<float> &_nodes,
+                     std::vector<float> &_ranges,
+                     std::vector<float> &_deviations,
+                     std::vector<float> &_gradients);
+  // Wall time of the phases of the last BuildInMemory, in seconds
+  double MortonSeconds() { return mortonSeconds_; }
+  double ReduceSeconds() { return reduceSeconds_; }
+
+  // Node index of the first node in a level, root level is 0
+  static unsigned long long LevelStart(unsigned int _level);
+  // Total number of nodes in a tree with the given number of levels
+  static unsigned long long NrNodes(unsigned int _nrLevels);
+  // Number of floats per node in the node array (value, child offset)
+  static const unsigned int NODE_SIZE = 2;
+  // Number of floats per node in the range array (min, max)
+  static const unsigned int RANGE_SIZE = 2;
+  // Number of floats per node in the deviation array
+  static const unsigned int DEVIATION_SIZE = 1;
+  // Number of floats per node in a gradient vector array. Leaves hold the
+  // central differences of their voxel in value per voxel, every other
+  // node the average of its children's vectors.
+  static const unsigned int GRADIENT_SIZE = 3;
+  // Packed node words (OctreeFile::PACKED_32). Inner nodes and constant
+  // leaves keep their value as 16-bit fixed point in the low bits. Leaves
+  // with a brick (see BrickPool) keep the brick index in the low bits and
+  // the brick's average as 8-bit fixed point above it, which stands in
+  // for the brick while it is not resident. The children of node n are
+  // always nodes 8n+1 to 8n+8, so the word needs no child pointer and
+  // node indices are not limited by float precision.
+  static const unsigned int PACKED_LEAF = 0x80000000;
+  static const unsigned int PACKED_BRICK = 0x40000000;
+  // Every value below the node is zero
+  static const unsigned int PACKED_EMPTY = 0x20000000;
+  static const unsigned int PACKED_PAYLOAD = 0x1fffffff;
+  static const unsigned int PACKED_VALUE_MAX = 0xffff;
+  static const unsigned int PACKED_BRICK_INDEX = 0x1fffff;
+  static const unsigned int PACKED_BRICK_VALUE_SHIFT = 21;
+  static const unsigned int PACKED_BRICK_VALUE_MAX = 0xff;
+  // Packs one node from its float record and range. Values are clamped to
+  // [0, 1], brick indices need to fit in PACKED_BRICK_INDEX.
+  static unsigned int PackNode(const float *_node, const float *_range);
+  // Packs a whole node array, in parallel on the ThreadPool
+  static void PackNodes(const std::vector<float> &_nodes,
+                        const std::vector<float> &_ranges,
+                        std::vector<unsigned int> &_packed);
+  // Ranges of packed trees on the GPU, min and max as 16-bit fixed point
+  // in the low and the high half of a word. They are rounded outwards, so
+  // a node skipped for its range is still invisible.
+  static unsigned int PackRange(const float *_range);
+  // Packs _nrNodes ranges, in parallel on the ThreadPool
+  static void PackRanges(const float *_ranges,
+                         unsigned long long _nrNodes,
+                         unsigned int *_packed);
+  // Expands packed words back into float records
+  static void UnpackNodes(const unsigned int *_packed,
+                          unsigned long long _nrNodes,
+                          std::vector<float> &_nodes);
+  // Packed gradient words (OctreeFile::GRADIENT). The direction is
+  // octahedron encoded in two 12-bit fields, the magnitude sits in the top
+  // 8 bits, clamped to [0, 1].
+  static const unsigned int GRADIENT_AXIS_BITS = 12;
+  static const unsigned int GRADIENT_AXIS_MAX = 0xfff;
+  static const unsigned int GRADIENT_MAGNITUDE_SHIFT = 24;
+  static const unsigned int GRADIENT_MAGNITUDE_MAX = 0xff;
+  // Packs one gradient vector, and expands a word back into one
+  static unsigned int PackGradient(const float *_gradient);
+  static void UnpackGradient(unsigned int _word, float *_gradient);
+  // Packs a whole gradient vector array, in parallel on the ThreadPool
+  static void PackGradients(const std::vector<float> &_gradients,
+                            std::vector<unsigned int> &_packed);
+  // Converts one voxel of raw data to a normalized value
+  static float RawValue(const char *_data, unsigned int _bytes);
+  // Reads a whole .raw file of _dim^3 voxels a z slice at a time,
+  // _progress is called with the fraction read if set. Returns false if
+  // the file is missing or too small.
+  static bool ReadRaw(std::string _fileName,
+                      unsigned int _bytes,
+                      unsigned int _dim,
+                      std::vector<char> &_buffer,
+                      std::function<void(float)> _progress =
+                        std::function<void(float)>());
+  // Converts raw data to normalized values, in parallel on the ThreadPool
+  static void ConvertRaw(const std::vector<char> &_buffer,
+                         unsigned int _bytes,
+                         std::vector<float> &_volume);
+  // Averages the children of a node and their gradients, merges their
+  // ranges and deviations and points the node at them
+  static void ReduceNode(std::vector<float> &_nodes,
+                         std::vector<float> &_ranges,
+                         std::vector<float> &_deviations,
+                         std::vector<float> &_gradients,
+                         unsigned long long _node);
+  // Standard deviation of eight equally sized children around their
+  // parent's mean. Values are _valueStride floats apart, deviations are
+  // contiguous. Exactly 0 if the children span a single value.
+  static float CombineDeviations(const float *_values,
+                                 unsigned int _valueStride,
+                                 const float *_deviations,
+                                 float _mean,
+                                 float _min,
+                                 float _max);
+
+private:
+  // Everything that is reduced bottom-up for a node
+  struct NodeStats {
+    float value;
+    float min;
+    float max;
+    float deviation;
+    float gradient[GRADIENT_SIZE];
+  };
+
+  OctreeBuilder();
+  OctreeBuilder(const OctreeBuilder&) {}
+
+  // Picks the largest subtree dimension whose working set fits the budget.
+  // Returns 0 if nothing fits.
+  unsigned int ChooseSubtreeDim(unsigned int _dim, unsigned int _bytes);
+  // Combines eight children into their parent
+  static NodeStats Reduce(const NodeStats *_children);
+  // Builds a subtree from the slab and writes its nodes to the file. The
+  // slab holds one more z slice on either side for the gradients.
+  // Returns the stats of the subtree root.
+  NodeStats BuildSubtree(const std::vector<char> &_slab,
+                     unsigned int _bytes,
+                     unsigned int _x,
+                     unsigned int _y,
+                     unsigned long long _rootIndex,
+                     std::ofstream &_out);
+  // Scatters the leaves of one in-memory subtree into Morton order
+  static void ScatterLeaves(const std::vector<float> &_volume,
+                            unsigned int _dim,
+                            unsigned int _maxDepth,
+                            unsigned int _rootLevel,
+                            unsigned long long _rootIndex,
+                            std::vector<float> &_nodes,
+                            std::vector<float> &_ranges,
+                            std::vector<float> &_deviations,
+                            std::vector<float> &_gradients);
+  // Reduces one in-memory subtree from its leaves up to its root
+  static void ReduceSubtree(unsigned int _maxDepth,
+                            unsigned int _rootLevel,
+                            unsigned long long _rootIndex,
+                            std::vector<float> &_nodes,
+                            std::vector<float> &_ranges,
+                            std::vector<float> &_deviations,
+                            std::vector<float> &_gradients);
+  // Writes a level as node and range records starting at a given node
+  void WriteNodes(std::ofstream &_out,
+                  const std::vector<NodeStats> &_stats,
+                  unsigned int _level,
+                  unsigned long long _firstNode);
+
+  unsigned long long memoryBudget_;
+  // Parameters for the build in progress
+  unsigned int dim_;
+  unsigned int subtreeDim_;
+  unsigned int subtreeLevels_;
+  unsigned int maxDepth_;
+  // Scratch buffers, reused between subtrees
+  std::vector< std::vector<NodeStats> > levels_;
+  std::vector<float> records_;
+  std::vector<float> rangeRecords_;
+  std::vector<float> deviationRecords_;
+  std::vector<unsigned int> gradientRecords_;
+  std::vector<unsigned int> packedRecords_;
+  OctreeFile::NodeLayout layout_;
+  // Byte offset of the range array in the file being written
+  unsigned long long rangeOffset_;
+  unsigned long long deviationOffset_;
+  unsigned long long gradientOffset_;
+  double mortonSeconds_;
+  double reduceSeconds_;
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include "OctreeBuilder.h"
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+
+static bool EndsWith(std::string _name, std::string _suffix) {
+  return _name.size() >= _suffix.size() &&
+         _name.compare(_name.size() - _suffix.size(),
+                       _suffix.size(), _suffix) == 0;
+}
+
+static void PrintUsage() {
+  std::cout << "Usage: OctreeConverter <in.raw> <bits per voxel> "
+    << "<dimensions> <out.oct> [memory budget in MB] [-packed] "
+    << "[-codec none|rle|lz]\n"
+    << "       OctreeConverter <in.oct> <out.oct> -codec none|rle|lz\n";
+}
+
+// Writes a copy of an octree file with its arrays stored by _codec
+static bool Recompress(std::string _inFileName,
+                       std::string _outFileName,
+                       OctreeFile::Codec _codec) {
+  OctreeFile *file = OctreeFile::New();
+  bool success = file->Open(_inFileName) &&
+                 file->WriteCopy(_outFileName, _codec);
+  delete file;
+  return success;
+}
+
+// Offline converter from .raw volumes to octree files that the renderer
+// can load with -octree <file>. Existing octree files can be converted to
+// another codec.
+int main(int _argc, char **_argv) {
+  if (_argc < 5) {
+    PrintUsage();
+    return 1;
+  }
+  // Compressed storage is chosen per dataset, the renderer reads any codec
+  OctreeFile::Codec codec = OctreeFile::UNCOMPRESSED;
+  for (int i=1; i<_argc-1; i++) {
+    if (std::string(_argv[i]) == "-codec" &&
+        !OctreeFile::ParseCodec(_argv[i+1], codec)) {
+      std::cout << "Error: Unknown codec " << _argv[i+1] << "\n";
+      return 1;
+    }
+  }
+  if (EndsWith(_argv[1], ".oct")) {
+    return Recompress(_argv[1], _argv[2], codec) ? 0 : 1;
+  }
+
+  std::string rawFileName = _argv[1];
+  int bits = atoi(_argv[2]);
+  int dim = atoi(_argv[3]);
+  std::string octreeFileName = _argv[4];
+
+  OctreeBuilder *builder = OctreeBuilder::New();
+  OctreeFile::NodeLayout layout = OctreeFile::FLOAT_VALUE_CHILD;
+  for (int i=5; i<_argc; i++) {
+    std::string arg(_argv[i]);
+    // One 32-bit word per node instead of two floats
+    if (arg == "-packed") {
+      layout = OctreeFile::PACKED_32;
+    } else if (arg == "-codec") {
+      i++;
+    } else if (!arg.empty() &&
+               arg.find_first_not_of("0123456789") == std::string::npos) {
+      unsigned long long megabytes = atoi(_argv[i]);
+      builder->SetMemoryBudget(megabytes*1024ULL*1024ULL);
+    } else {
+      // Typos would otherwise end up as a budget of 0
+      std::cout << "Error: Unknown argument " << arg << "\n";
+      PrintUsage();
+      delete builder;
+      return 1;
+    }
+  }
+  // The builder writes nodes out of order, compressed files are made from
+  // an uncompressed one afterwards
+  std::string buildFileName = octreeFileName;
+  if (codec != OctreeFile::UNCOMPRESSED) {
+    buildFileName += ".tmp";
+  }
+  bool success = builder->BuildToFile(rawFileName,
+                                      bits,
+                                      dim,
+                                      buildFileName,
+                                      layout);
+  delete builder;
+  if (success && codec != OctreeFile::UNCOMPRESSED) {
+    success = Recompress(buildFileName, octreeFileName, codec);
+    remove(buildFileName.c_str());
+  }
+  return success ? 0 : 1;
+}
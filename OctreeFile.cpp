@@ -0,0 +1,533 @@
+#include "OctreeFile.h"
+#include "OctreeBuilder.h"
+#include "BlockCodec.h"
+#include "ThreadPool.h"
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static const char MAGIC[4] = { 'O', 'C', 'T', 'R' };
+// Channel bits in the order their arrays are stored
+static const OctreeFile::Channel CHANNELS[] = {
+  OctreeFile::RANGE,
+  OctreeFile::DEVIATION,
+  OctreeFile::GRADIENT
+};
+static const unsigned int NR_CHANNELS = sizeof(CHANNELS)/sizeof(CHANNELS[0]);
+
+static unsigned long long PageAlign(unsigned long long _offset) {
+  return (_offset + OctreeFile::DATA_OFFSET - 1) /
+         OctreeFile::DATA_OFFSET * OctreeFile::DATA_OFFSET;
+}
+
+OctreeFile * OctreeFile::New() {
+  return new OctreeFile();
+}
+
+OctreeFile::OctreeFile()
+  : mapping_(NULL),
+    mappedSize_(0),
+    fileHandle_(NULL),
+    mapHandle_(NULL),
+    fd_(-1) {
+  memset(&header_, 0, sizeof(header_));
+}
+
+OctreeFile::~OctreeFile() {
+  Close();
+}
+
+OctreeFileHeader OctreeFile::MakeHeader(unsigned int _dim,
+                                        unsigned int _voxelBits,
+                                        NodeLayout _layout,
+                                        unsigned int _channels) {
+  OctreeFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.dim = _dim;
+  header.maxDepth = 0;
+  while ((1U << header.maxDepth) < _dim) {
+    header.maxDepth++;
+  }
+  header.voxelBits = _voxelBits;
+  header.nodeLayout = _layout;
+  header.nodeSize = NodeSize(_layout);
+  header.nrNodes = OctreeBuilder::NrNodes(header.maxDepth+1);
+  header.channels = _channels;
+  header.dataOffset = DATA_OFFSET;
+  return header;
+}
+
+unsigned int OctreeFile::NodeSize(NodeLayout _layout) {
+  switch (_layout) {
+  case FLOAT_VALUE_CHILD:
+    return OctreeBuilder::NODE_SIZE*sizeof(float);
+  case PACKED_32:
+    return sizeof(unsigned int);
+  }
+  return 0;
+}
+
+unsigned int OctreeFile::ChannelSize(Channel _channel) {
+  switch (_channel) {
+  case RANGE:
+    return 2*sizeof(float);
+  case DEVIATION:
+    return sizeof(float);
+  case GRADIENT:
+    return sizeof(unsigned int);
+  }
+  return 0;
+}
+
+unsigned long long OctreeFile::ChannelOffset(const OctreeFileHeader &_header,
+                                             Channel _channel) {
+  unsigned long long offset =
+    PageAlign(_header.dataOffset + _header.nrNodes*_header.nodeSize);
+  for (unsigned int i=0; i<NR_CHANNELS && CHANNELS[i] != _channel; i++) {
+    if (_header.channels & CHANNELS[i]) {
+      offset = PageAlign(offset + _header.nrNodes*ChannelSize(CHANNELS[i]));
+    }
+  }
+  return offset;
+}
+
+void OctreeFile::WriteHeader(std::ofstream &_out,
+                             const OctreeFileHeader &_header) {
+  _out.seekp(0, std::ios::beg);
+  _out.write(reinterpret_cast<const char*>(&_header), sizeof(_header));
+}
+
+bool OctreeFile::ParseCodec(std::string _name, Codec &_codec) {
+  for (unsigned int i=UNCOMPRESSED; i<=LZ; i++) {
+    if (_name == CodecName(static_cast<Codec>(i))) {
+      _codec = static_cast<Codec>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string OctreeFile::CodecName(Codec _codec) {
+  switch (_codec) {
+  case UNCOMPRESSED:
+    return "none";
+  case DELTA_RLE:
+    return "rle";
+  case LZ:
+    return "lz";
+  }
+  return "unknown";
+}
+
+bool OctreeFile::Open(std::string _fileName) {
+  Close();
+
+#ifdef _WIN32
+  HANDLE file = CreateFileA(_fileName.c_str(),
+                            GENERIC_READ,
+                            FILE_SHARE_READ,
+                            NULL,
+                            OPEN_EXISTING,
+                            FILE_FLAG_SEQUENTIAL_SCAN,
+                            NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    std::cout << _fileName << " could not be opened." << std::endl;
+    return false;
+  }
+  LARGE_INTEGER size;
+  GetFileSizeEx(file, &size);
+  HANDLE map = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  const void *view = NULL;
+  if (map != NULL) {
+    view = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+  }
+  fileHandle_ = file;
+  mapHandle_ = map;
+  mappedSize_ = size.QuadPart;
+#else
+  int fd = open(_fileName.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cout << _fileName << " could not be opened." << std::endl;
+    return false;
+  }
+  struct stat info;
+  fstat(fd, &info);
+  void *view = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (view == MAP_FAILED) {
+    view = NULL;
+  } else {
+    // The whole node array is read front to back by the upload
+    madvise(view, info.st_size, MADV_SEQUENTIAL);
+  }
+  fd_ = fd;
+  mappedSize_ = info.st_size;
+#endif
+  mapping_ = static_cast<const char*>(view);
+  if (mapping_ == NULL) {
+    std::cout << "Error: Failed to map " << _fileName << "\n";
+    Close();
+    return false;
+  }
+
+  if (mappedSize_ < sizeof(header_)) {
+    std::cout << "Error: " << _fileName << " is too small\n";
+    Close();
+    return false;
+  }
+  memcpy(&header_, mapping_, sizeof(header_));
+  if (memcmp(header_.magic, MAGIC, sizeof(MAGIC)) != 0) {
+    std::cout << "Error: " << _fileName << " is not an octree file\n";
+    Close();
+    return false;
+  }
+  if (header_.version < 1 || header_.version > VERSION) {
+    std::cout << "Error: " << _fileName << " has version "
+      << header_.version << ", expected at most " << VERSION << "\n";
+    Close();
+    return false;
+  }
+  if (header_.version == 1) {
+    header_.channels = 0;
+  }
+  if (header_.version < 3) {
+    header_.codec = UNCOMPRESSED;
+    header_.blockNodes = 0;
+  }
+  NodeLayout layout = static_cast<NodeLayout>(header_.nodeLayout);
+  if (header_.nodeLayout > PACKED_32 || header_.nodeSize != NodeSize(layout)) {
+    std::cout << "Error: " << _fileName << " has unknown node layout "
+      << header_.nodeLayout << "\n";
+    Close();
+    return false;
+  }
+  if (header_.codec > LZ || (Compressed() && header_.blockNodes == 0)) {
+    std::cout << "Error: " << _fileName << " has unknown codec "
+      << header_.codec << "\n";
+    Close();
+    return false;
+  }
+
+  bool truncated = false;
+  if (Compressed()) {
+    unsigned long long nrEntries = 2*FirstBlockEntry(NR_ARRAYS);
+    unsigned long long tableEnd = header_.dataOffset +
+                                  nrEntries*sizeof(unsigned long long);
+    truncated = tableEnd > mappedSize_;
+    if (!truncated) {
+      const unsigned long long *table =
+        reinterpret_cast<const unsigned long long*>(mapping_ +
+                                                    header_.dataOffset);
+      blocks_.assign(table, table + nrEntries);
+    }
+    for (unsigned long long i=0; i<blocks_.size(); i+=2) {
+      if (blocks_[i] > mappedSize_ || blocks_[i+1] > mappedSize_ - blocks_[i]) {
+        truncated = true;
+      }
+    }
+  } else {
+    unsigned long long end = header_.dataOffset + NodeDataSize();
+    for (unsigned int i=0; i<NR_CHANNELS; i++) {
+      if (HasChannel(CHANNELS[i])) {
+        end = ChannelOffset(header_, CHANNELS[i]) +
+              header_.nrNodes*ChannelSize(CHANNELS[i]);
+      }
+    }
+    truncated = end > mappedSize_;
+  }
+  if (truncated) {
+    std::cout << "Error: " << _fileName << " is truncated\n";
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void OctreeFile::Close() {
+#ifdef _WIN32
+  if (mapping_ != NULL) {
+    UnmapViewOfFile(mapping_);
+  }
+  if (mapHandle_ != NULL) {
+    CloseHandle(mapHandle_);
+  }
+  if (fileHandle_ != NULL) {
+    CloseHandle(fileHandle_);
+  }
+#else
+  if (mapping_ != NULL) {
+    munmap(const_cast<char*>(mapping_), mappedSize_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+#endif
+  mapping_ = NULL;
+  mappedSize_ = 0;
+  blocks_.clear();
+  for (unsigned int i=0; i<NR_ARRAYS; i++) {
+    std::vector<char>().swap(expanded_[i]);
+  }
+  fileHandle_ = NULL;
+  mapHandle_ = NULL;
+  fd_ = -1;
+}
+
+const void * OctreeFile::NodeData() {
+  return ArrayData(0);
+}
+
+unsigned long long OctreeFile::NodeDataSize() {
+  return header_.nrNodes*header_.nodeSize;
+}
+
+bool OctreeFile::HasChannel(Channel _channel) {
+  return (header_.channels & _channel) != 0;
+}
+
+const void * OctreeFile::ChannelData(Channel _channel) {
+  for (unsigned int i=0; i<NR_CHANNELS; i++) {
+    if (CHANNELS[i] == _channel) {
+      return ArrayData(i+1);
+    }
+  }
+  return NULL;
+}
+
+bool OctreeFile::ReadNodes(unsigned long long _first,
+                           unsigned long long _count,
+                           void *_out) {
+  return ReadArray(0, _first, _count, static_cast<char*>(_out));
+}
+
+bool OctreeFile::ReadChannel(Channel _channel,
+                             unsigned long long _first,
+                             unsigned long long _count,
+                             void *_out) {
+  for (unsigned int i=0; i<NR_CHANNELS; i++) {
+    if (CHANNELS[i] == _channel) {
+      return ReadArray(i+1, _first, _count, static_cast<char*>(_out));
+    }
+  }
+  return false;
+}
+
+unsigned long long OctreeFile::RecordSize(unsigned int _array) {
+  if (_array == 0) {
+    return header_.nodeSize;
+  }
+  return ChannelSize(CHANNELS[_array-1]);
+}
+
+bool OctreeFile::HasArray(unsigned int _array) {
+  return _array == 0 || HasChannel(CHANNELS[_array-1]);
+}
+
+unsigned long long OctreeFile::FirstBlockEntry(unsigned int _array) {
+  unsigned long long blockNodes = header_.blockNodes;
+  unsigned long long nrBlocks = (header_.nrNodes + blockNodes - 1)/blockNodes;
+  unsigned long long entry = 0;
+  for (unsigned int i=0; i<_array; i++) {
+    if (HasArray(i)) {
+      entry += nrBlocks;
+    }
+  }
+  return entry;
+}
+
+const void * OctreeFile::ArrayData(unsigned int _array) {
+  if (!HasArray(_array)) {
+    return NULL;
+  }
+  if (!Compressed()) {
+    if (_array == 0) {
+      return mapping_ + header_.dataOffset;
+    }
+    return mapping_ + ChannelOffset(header_, CHANNELS[_array-1]);
+  }
+  std::vector<char> &expanded = expanded_[_array];
+  if (expanded.empty()) {
+    expanded.resize(header_.nrNodes*RecordSize(_array));
+    if (!ReadArray(_array, 0, header_.nrNodes, &expanded[0])) {
+      std::vector<char>().swap(expanded);
+      return NULL;
+    }
+  }
+  return &expanded[0];
+}
+
+bool OctreeFile::ReadArray(unsigned int _array,
+                           unsigned long long _first,
+                           unsigned long long _count,
+                           char *_out) {
+  if (!HasArray(_array) || _first + _count > header_.nrNodes) {
+    return false;
+  }
+  if (_count == 0) {
+    return true;
+  }
+  // Uncompressed files are copied in blocks as well, which has the pages
+  // read in parallel
+  unsigned long long recordSize = RecordSize(_array);
+  unsigned long long blockNodes = Compressed() ? header_.blockNodes
+                                               : BLOCK_NODES;
+  unsigned long long firstBlock = _first/blockNodes;
+  unsigned long long nrBlocks = (_first + _count - 1)/blockNodes -
+                                firstBlock + 1;
+  const char *source = NULL;
+  unsigned long long entry = 0;
+  if (Compressed()) {
+    entry = FirstBlockEntry(_array);
+  } else {
+    source = static_cast<const char*>(ArrayData(_array));
+  }
+
+  std::atomic<bool> failed(false);
+  ThreadPool::Instance().ParallelFor(static_cast<unsigned int>(nrBlocks),
+    [&](unsigned int _i) {
+      unsigned long long block = firstBlock + _i;
+      unsigned long long blockFirst = block*blockNodes;
+      unsigned long long blockCount = std::min(blockNodes,
+                                               header_.nrNodes - blockFirst);
+      // Part of the block that was asked for
+      unsigned long long begin = std::max(blockFirst, _first);
+      unsigned long long end = std::min(blockFirst + blockCount,
+                                        _first + _count);
+      char *target = _out + (begin - _first)*recordSize;
+      if (source != NULL) {
+        memcpy(target, source + begin*recordSize, (end - begin)*recordSize);
+        return;
+      }
+      // Blocks that are only partly asked for are expanded aside
+      std::vector<char> whole;
+      char *expanded = target;
+      if (begin != blockFirst || end != blockFirst + blockCount) {
+        whole.resize(blockCount*recordSize);
+        expanded = &whole[0];
+      }
+      const unsigned long long *location = &blocks_[2*(entry + block)];
+      if (!BlockCodec::Decompress(header_.codec,
+                                  mapping_ + location[0],
+                                  location[1],
+                                  recordSize/sizeof(unsigned int),
+                                  expanded,
+                                  blockCount*recordSize)) {
+        failed = true;
+        return;
+      }
+      if (expanded != target) {
+        memcpy(target,
+               expanded + (begin - blockFirst)*recordSize,
+               (end - begin)*recordSize);
+      }
+    });
+  if (failed) {
+    std::cout << "Error: Octree file has a corrupt block\n";
+    return false;
+  }
+  return true;
+}
+
+bool OctreeFile::WriteCopy(std::string _fileName,
+                           Codec _codec,
+                           unsigned int _blockNodes) {
+  if (mapping_ == NULL || _blockNodes == 0) {
+    return false;
+  }
+  std::ofstream out(_fileName.c_str(),
+                    std::ios::out|std::ios::binary|std::ios::trunc);
+  if (!out.is_open()) {
+    std::cout << _fileName << " could not be opened." << std::endl;
+    return false;
+  }
+  OctreeFileHeader header = header_;
+  header.version = VERSION;
+  header.dataOffset = DATA_OFFSET;
+  header.codec = _codec;
+  header.blockNodes = _codec == UNCOMPRESSED ? 0 : _blockNodes;
+  WriteHeader(out, header);
+
+  // Blocks are compressed a batch at a time on the ThreadPool and written
+  // in order after the block table
+  unsigned long long nrBlocks = (header.nrNodes + _blockNodes - 1)/_blockNodes;
+  unsigned int batch = ThreadPool::Instance().NrThreads()*4;
+  std::vector<unsigned long long> table;
+  unsigned long long position = header.dataOffset;
+  for (unsigned int i=0; i<NR_ARRAYS; i++) {
+    if (_codec != UNCOMPRESSED && HasArray(i)) {
+      position += 2*nrBlocks*sizeof(unsigned long long);
+    }
+  }
+  unsigned long long expandedBytes = 0;
+  for (unsigned int i=0; i<NR_ARRAYS; i++) {
+    if (!HasArray(i)) {
+      continue;
+    }
+    unsigned long long recordSize = RecordSize(i);
+    if (_codec == UNCOMPRESSED && i > 0) {
+      position = ChannelOffset(header, CHANNELS[i-1]);
+    }
+    for (unsigned long long first=0; first<nrBlocks; first+=batch) {
+      unsigned int count = static_cast<unsigned int>(
+        std::min((unsigned long long)batch, nrBlocks - first));
+      std::vector< std::vector<char> > compressed(count);
+      std::atomic<bool> failed(false);
+      ThreadPool::Instance().ParallelFor(count, [&](unsigned int _j) {
+        unsigned long long blockFirst = (first + _j)*_blockNodes;
+        unsigned long long blockCount =
+          std::min((unsigned long long)_blockNodes,
+                   header.nrNodes - blockFirst);
+        std::vector<char> records(blockCount*recordSize);
+        if (!ReadArray(i, blockFirst, blockCount, &records[0])) {
+          failed = true;
+          return;
+        }
+        BlockCodec::Compress(_codec,
+                             &records[0],
+                             records.size(),
+                             static_cast<unsigned int>(
+                               recordSize/sizeof(unsigned int)),
+                             compressed[_j]);
+      });
+      if (failed) {
+        return false;
+      }
+      for (unsigned int j=0; j<count; j++) {
+        out.seekp(position, std::ios::beg);
+        out.write(compressed[j].data(), compressed[j].size());
+        table.push_back(position);
+        table.push_back(compressed[j].size());
+        position += compressed[j].size();
+      }
+    }
+    expandedBytes += header.nrNodes*recordSize;
+  }
+  if (_codec != UNCOMPRESSED) {
+    out.seekp(header.dataOffset, std::ios::beg);
+    out.write(reinterpret_cast<const char*>(table.data()),
+              table.size()*sizeof(unsigned long long));
+  }
+  out.close();
+  if (!out) {
+    std::cout << "Error: Failed to write " << _fileName << "\n";
+    return false;
+  }
+  std::cout << "Wrote " << _fileName << " with codec " << CodecName(_codec)
+    << ", " << expandedBytes/(1024*1024) << " MB of arrays in "
+    << position/(1024*1024) << " MB\n";
+  return true;
+}
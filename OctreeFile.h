@@ -0,0 +1,160 @@
+#ifndef OCTREEFILE_H
+#define OCTREEFILE_H
+
+#include <string>
+#include <fstream>
+#include <vector>
+
+// Header at the start of an octree file. The node array follows at
+// dataOffset, in the same order as it is uploaded to the GPU. Optional
+// per-node channels follow the node array, each on a page boundary.
+// Compressed files instead have a table of blocks at dataOffset, see
+// OctreeFile::Codec.
+struct OctreeFileHeader {
+  char magic[4];
+  unsigned int version;
+  // Dimensions of the base level (cube)
+  unsigned int dim;
+  unsigned int maxDepth;
+  // Bits per voxel in the source data
+  unsigned int voxelBits;
+  // OctreeFile::NodeLayout of the node array
+  unsigned int nodeLayout;
+  // Bytes per node record
+  unsigned int nodeSize;
+  // Bit mask of OctreeFile::Channel arrays stored after the node array
+  unsigned int channels;
+  unsigned long long nrNodes;
+  // Byte offset of the node array from the start of the file
+  unsigned long long dataOffset;
+  // OctreeFile::Codec of the arrays, 0 before version 3
+  unsigned int codec;
+  // Nodes per compressed block, 0 for uncompressed files
+  unsigned int blockNodes;
+};
+
+// Versioned on-disk octree. Files are memory mapped read-only so that the
+// node pages of uncompressed files can be handed straight to the buffer
+// upload, compressed ones are expanded in parallel by ReadNodes() and
+// ReadChannel().
+class OctreeFile {
+public:
+  enum NodeLayout {
+    // Two floats per node: average value, child offset in floats
+    FLOAT_VALUE_CHILD = 0,
+    // One 32-bit word per node, see OctreeBuilder::PackNode
+    PACKED_32 = 1
+  };
+  enum Channel {
+    // Two floats per node: min and max of all voxels below the node
+    RANGE = 1,
+    // One float per node: standard deviation of the voxels below the node
+    DEVIATION = 2,
+    // One 32-bit word per node: average value gradient below the node, see
+    // OctreeBuilder::PackGradient
+    GRADIENT = 4
+  };
+  // Compressed files split every array into blocks of blockNodes nodes
+  // that are compressed on their own, so that they can be expanded in
+  // parallel and into any destination. A table at dataOffset holds the
+  // file offset and compressed size of each block (two 64-bit values),
+  // the node array's blocks first and then those of the channels present.
+  enum Codec {
+    UNCOMPRESSED = 0,
+    // 32-bit words as differences to the previous node, zero runs
+    // collapsed. Fast, and good on large homogeneous regions.
+    DELTA_RLE = 1,
+    // LZ4 style byte matching, also finds repeated patterns
+    LZ = 2
+  };
+  // Version 1 files have no channels, version 2 files are uncompressed
+  static const unsigned int VERSION = 3;
+  // The node array starts on a page boundary
+  static const unsigned int DATA_OFFSET = 4096;
+  // Default nodes per compressed block
+  static const unsigned int BLOCK_NODES = 1 << 16;
+
+  static OctreeFile * New();
+  ~OctreeFile();
+  // Fills in a header for a tree with the given base level dimensions
+  static OctreeFileHeader MakeHeader(unsigned int _dim,
+                                     unsigned int _voxelBits,
+                                     NodeLayout _layout,
+                                     unsigned int _channels);
+  // Bytes per node record in a node layout
+  static unsigned int NodeSize(NodeLayout _layout);
+  // Bytes per node in a channel array
+  static unsigned int ChannelSize(Channel _channel);
+  // Byte offset of a channel array in a file with the given header
+  static unsigned long long ChannelOffset(const OctreeFileHeader &_header,
+                                          Channel _channel);
+  // Writes the header at the start of an open file
+  static void WriteHeader(std::ofstream &_out,
+                          const OctreeFileHeader &_header);
+  // Codec by name (none, rle or lz). Returns false for unknown names.
+  static bool ParseCodec(std::string _name, Codec &_codec);
+  static std::string CodecName(Codec _codec);
+  // Maps a file and validates its header. Returns false on failure.
+  bool Open(std::string _fileName);
+  void Close();
+  const OctreeFileHeader & Header() { return header_; }
+  bool Compressed() { return header_.codec != UNCOMPRESSED; }
+  // Node array, valid until Close(). Compressed files are expanded into
+  // memory on the first call, NULL if a block is corrupt.
+  const void * NodeData();
+  unsigned long long NodeDataSize();
+  bool HasChannel(Channel _channel);
+  // Channel array, NULL if the file does not have the channel. Compressed
+  // files are expanded into memory on the first call, NULL if a block is
+  // corrupt.
+  const void * ChannelData(Channel _channel);
+  // Copies the records of nodes [_first, _first+_count) to _out, expanding
+  // the blocks they are in on the ThreadPool. Returns false if a block is
+  // corrupt.
+  bool ReadNodes(unsigned long long _first,
+                 unsigned long long _count,
+                 void *_out);
+  // Same for a channel array, also false if the file does not have it
+  bool ReadChannel(Channel _channel,
+                   unsigned long long _first,
+                   unsigned long long _count,
+                   void *_out);
+  // Writes a copy of the open file with its arrays stored by _codec in
+  // blocks of _blockNodes nodes. Returns false on failure.
+  bool WriteCopy(std::string _fileName,
+                 Codec _codec,
+                 unsigned int _blockNodes = BLOCK_NODES);
+
+private:
+  // The node array and one per channel
+  static const unsigned int NR_ARRAYS = 4;
+
+  OctreeFile();
+  OctreeFile(const OctreeFile&) {}
+  // Arrays by index, the node array is 0 and channel i of CHANNELS is i+1
+  unsigned long long RecordSize(unsigned int _array);
+  bool HasArray(unsigned int _array);
+  // Position of an array's first block in the block table
+  unsigned long long FirstBlockEntry(unsigned int _array);
+  bool ReadArray(unsigned int _array,
+                 unsigned long long _first,
+                 unsigned long long _count,
+                 char *_out);
+  // Start of an array in the mapping of an uncompressed file, or its
+  // expanded copy for compressed ones
+  const void * ArrayData(unsigned int _array);
+
+  OctreeFileHeader header_;
+  // Offset and size of every block of a compressed file
+  std::vector<unsigned long long> blocks_;
+  // Arrays of a compressed file expanded by NodeData() and ChannelData()
+  std::vector<char> expanded_[NR_ARRAYS];
+  const char *mapping_;
+  unsigned long long mappedSize_;
+  // Platform handles for the mapping
+  void *fileHandle_;
+  void *mapHandle_;
+  int fd_;
+};
+
+#endif
@@ -0,0 +1,154 @@
+#include "OffscreenContext.h"
+#include <gl\glew.h>
+#include <iostream>
+
+#if defined(USE_EGL)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#elif defined(USE_OSMESA)
+#include <GL/osmesa.h>
+#else
+#include <gl\glut.h>
+#endif
+
+OffscreenContext * OffscreenContext::New() {
+  return new OffscreenContext();
+}
+
+OffscreenContext::OffscreenContext()
+  : display_(NULL),
+    surface_(NULL),
+    context_(NULL),
+    window_(0) {}
+
+OffscreenContext::~OffscreenContext() {
+  Destroy();
+}
+
+bool OffscreenContext::Create(int &_argc,
+                              char **_argv,
+                              unsigned int _width,
+                              unsigned int _height) {
+  Destroy();
+#if defined(USE_EGL)
+  EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  EGLint major, minor;
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+    // Without a window system Mesa can still render to pbuffers through
+    // its surfaceless platform
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+      reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+        eglGetProcAddress("eglGetPlatformDisplayEXT"));
+    display = EGL_NO_DISPLAY;
+    if (getPlatformDisplay != NULL) {
+      display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                                   EGL_DEFAULT_DISPLAY,
+                                   NULL);
+    }
+    if (display == EGL_NO_DISPLAY ||
+        !eglInitialize(display, &major, &minor)) {
+      std::cout << "Error: Failed to initialize EGL\n";
+      return false;
+    }
+  }
+  display_ = display;
+  const EGLint configAttribs[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RED_SIZE, 8,
+    EGL_GREEN_SIZE, 8,
+    EGL_BLUE_SIZE, 8,
+    EGL_DEPTH_SIZE, 24,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_NONE
+  };
+  EGLConfig config;
+  EGLint nrConfigs = 0;
+  if (!eglChooseConfig(display, configAttribs, &config, 1, &nrConfigs) ||
+      nrConfigs < 1) {
+    std::cout << "Error: No EGL config for desktop GL pbuffers\n";
+    Destroy();
+    return false;
+  }
+  const EGLint surfaceAttribs[] = {
+    EGL_WIDTH, static_cast<EGLint>(_width),
+    EGL_HEIGHT, static_cast<EGLint>(_height),
+    EGL_NONE
+  };
+  surface_ = eglCreatePbufferSurface(display, config, surfaceAttribs);
+  eglBindAPI(EGL_OPENGL_API);
+  // The renderer uses fixed function calls and no VAO, so it needs a
+  // compatibility profile
+  const EGLint contextAttribs[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 3,
+    EGL_CONTEXT_MINOR_VERSION, 3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK,
+    EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+    EGL_NONE
+  };
+  context_ = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+  if (surface_ == EGL_NO_SURFACE || context_ == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(display, surface_, surface_, context_)) {
+    std::cout << "Error: Failed to create EGL context\n";
+    Destroy();
+    return false;
+  }
+#elif defined(USE_OSMESA)
+  const int attribs[] = {
+    OSMESA_FORMAT, OSMESA_RGBA,
+    OSMESA_DEPTH_BITS, 24,
+    OSMESA_PROFILE, OSMESA_COMPAT_PROFILE,
+    OSMESA_CONTEXT_MAJOR_VERSION, 3,
+    OSMESA_CONTEXT_MINOR_VERSION, 3,
+    0
+  };
+  OSMesaContext context = OSMesaCreateContextAttribs(attribs, NULL);
+  if (context == NULL) {
+    std::cout << "Error: Failed to create OSMesa context\n";
+    return false;
+  }
+  context_ = context;
+  buffer_.resize(_width*_height*4);
+  if (!OSMesaMakeCurrent(context, &buffer_[0], GL_UNSIGNED_BYTE,
+                         _width, _height)) {
+    std::cout << "Error: Failed to make OSMesa context current\n";
+    Destroy();
+    return false;
+  }
+#else
+  glutInit(&_argc, _argv);
+  glutInitDisplayMode(GLUT_DEPTH | GLUT_RGBA);
+  glutInitWindowSize(_width, _height);
+  window_ = glutCreateWindow("Volume renderer - batch");
+  glutHideWindow();
+#endif
+  std::cout << "Offscreen context initialized\n";
+  return true;
+}
+
+void OffscreenContext::Destroy() {
+#if defined(USE_EGL)
+  if (display_ != NULL) {
+    eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (context_ != NULL) {
+      eglDestroyContext(display_, context_);
+    }
+    if (surface_ != NULL) {
+      eglDestroySurface(display_, surface_);
+    }
+    eglTerminate(display_);
+  }
+#elif defined(USE_OSMESA)
+  if (context_ != NULL) {
+    OSMesaDestroyContext(static_cast<OSMesaContext>(context_));
+  }
+  buffer_.clear();
+#else
+  if (window_ != 0) {
+    glutDestroyWindow(window_);
+  }
+#endif
+  display_ = NULL;
+  surface_ = NULL;
+  context_ = NULL;
+  window_ = 0;
+}
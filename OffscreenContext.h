@@ -0,0 +1,36 @@
+#ifndef OFFSCREENCONTEXT_H
+#define OFFSCREENCONTEXT_H
+
+#include <vector>
+
+// GL context without a visible window, for batch rendering. Build with
+// USE_EGL for an EGL pbuffer context or USE_OSMESA for OSMesa; both run on
+// Mesa llvmpipe on machines without a GPU. GLEW has to be built for the
+// same backend. Without either flag a hidden GLUT window is used.
+// The default framebuffer is not used for output, Manager renders into
+// its own FBO and reads that back.
+class OffscreenContext {
+public:
+  static OffscreenContext * New();
+  ~OffscreenContext();
+  // Creates the context and makes it current. Returns false on failure.
+  bool Create(int &_argc,
+              char **_argv,
+              unsigned int _width,
+              unsigned int _height);
+  void Destroy();
+
+private:
+  OffscreenContext();
+  OffscreenContext(const OffscreenContext&) {}
+
+  // Backend handles, kept opaque so the header needs no platform includes
+  void *display_;
+  void *surface_;
+  void *context_;
+  int window_;
+  // OSMesa renders into client memory
+  std::vector<unsigned char> buffer_;
+};
+
+#endif
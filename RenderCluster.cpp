@@ -0,0 +1,395 @@
+#include "RenderCluster.h"
+#include "Socket.h"
+#include "Manager.h"
+#include "Timer.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Starts _program with _arguments as a new process. Returns its handle, or
+// -1 on failure.
+static long long StartProcess(std::string _program,
+                              std::vector<std::string> &_arguments) {
+#ifdef _WIN32
+  std::string commandLine = "\"" + _program + "\"";
+  for (unsigned int i=0; i<_arguments.size(); i++) {
+    commandLine += " \"" + _arguments[i] + "\"";
+  }
+  STARTUPINFOA startup;
+  memset(&startup, 0, sizeof(startup));
+  startup.cb = sizeof(startup);
+  PROCESS_INFORMATION process;
+  std::vector<char> line(commandLine.begin(), commandLine.end());
+  line.push_back('\0');
+  if (!CreateProcessA(NULL, &line[0], NULL, NULL, FALSE, 0, NULL, NULL,
+                      &startup, &process)) {
+    return -1;
+  }
+  CloseHandle(process.hThread);
+  return reinterpret_cast<long long>(process.hProcess);
+#else
+  std::vector<char*> argv;
+  argv.push_back(const_cast<char*>(_program.c_str()));
+  for (unsigned int i=0; i<_arguments.size(); i++) {
+    argv.push_back(const_cast<char*>(_arguments[i].c_str()));
+  }
+  argv.push_back(NULL);
+  // The child would print whatever is still buffered a second time
+  std::cout.flush();
+  pid_t pid = fork();
+  if (pid == 0) {
+    execvp(argv[0], &argv[0]);
+    std::cout << "Error: Could not run " << _program << "\n";
+    _exit(1);
+  }
+  return pid;
+#endif
+}
+
+static void WaitForProcess(long long _process) {
+#ifdef _WIN32
+  HANDLE process = reinterpret_cast<HANDLE>(_process);
+  WaitForSingleObject(process, INFINITE);
+  CloseHandle(process);
+#else
+  waitpid(static_cast<pid_t>(_process), NULL, 0);
+#endif
+}
+
+RenderCluster::RenderCluster()
+  : rank_(0),
+    nrWorkers_(0),
+    width_(0),
+    height_(0),
+    rootLevel_(0),
+    method_(Compositor::BINARY_SWAP),
+    master_(NULL),
+    compositor_(NULL) {
+}
+
+RenderCluster::~RenderCluster() {
+  Shutdown();
+}
+
+RenderCluster * RenderCluster::Launch(unsigned int _nrWorkers,
+                                      Compositor::Method _method,
+                                      unsigned int _width,
+                                      unsigned int _height,
+                                      unsigned short _port,
+                                      std::string _program,
+                                      std::vector<std::string>
+                                        _workerArguments) {
+  unsigned int level = 0;
+  while (level < 10 && (1U << 3*level) < _nrWorkers) {
+    level++;
+  }
+  if (_nrWorkers == 0 || (1U << 3*level) != _nrWorkers) {
+    std::cout << "Error: The number of workers has to be a power of 8\n";
+    return NULL;
+  }
+  Socket *listener = Socket::Listen(_program.empty() ? _port : 0);
+  if (listener == NULL) {
+    return NULL;
+  }
+
+  RenderCluster *cluster = new RenderCluster();
+  cluster->nrWorkers_ = _nrWorkers;
+  cluster->width_ = _width;
+  cluster->height_ = _height;
+  cluster->rootLevel_ = level;
+  cluster->method_ = _method;
+  if (!_program.empty()) {
+    std::ostringstream master;
+    master << "127.0.0.1:" << listener->Port();
+    _workerArguments.push_back("-worker");
+    _workerArguments.push_back(master.str());
+    for (unsigned int i=0; i<_nrWorkers; i++) {
+      long long process = StartProcess(_program, _workerArguments);
+      if (process == -1) {
+        std::cout << "Error: Could not start worker " << _program << "\n";
+        delete listener;
+        delete cluster;
+        return NULL;
+      }
+      cluster->processes_.push_back(process);
+    }
+  } else {
+    std::cout << "Waiting for " << _nrWorkers << " workers on port "
+      << listener->Port() << "\n";
+  }
+
+  // Ranks are handed out in the order the workers connect
+  std::vector<Peer> peers(_nrWorkers);
+  for (unsigned int i=0; i<_nrWorkers; i++) {
+    Socket *worker = listener->Accept();
+    Hello hello;
+    if (worker == NULL || !worker->Receive(&hello, sizeof(hello)) ||
+        hello.magic != MAGIC) {
+      std::cout << "Error: Worker " << i << " did not connect\n";
+      delete worker;
+      delete listener;
+      delete cluster;
+      return NULL;
+    }
+    cluster->workers_.push_back(worker);
+    memset(&peers[i], 0, sizeof(Peer));
+    strncpy(peers[i].host, worker->PeerHost().c_str(), HOST_SIZE-1);
+    peers[i].port = hello.port;
+  }
+  delete listener;
+
+  bool sent = true;
+  for (unsigned int i=0; i<_nrWorkers; i++) {
+    Setup setup = { i, _nrWorkers, _width, _height, _method };
+    sent = sent &&
+      cluster->workers_[i]->Send(&setup, sizeof(setup)) &&
+      cluster->workers_[i]->Send(&peers[0], _nrWorkers*sizeof(Peer));
+  }
+  // Loading the subtrees takes a while, every worker has to answer anyway
+  bool ready = sent;
+  for (unsigned int i=0; i<_nrWorkers && sent; i++) {
+    Status status;
+    if (!cluster->workers_[i]->Receive(&status, sizeof(status)) ||
+        !status.ok) {
+      ready = false;
+    }
+  }
+  if (!ready) {
+    std::cout << "Error: Not all workers could load their subtrees\n";
+    delete cluster;
+    return NULL;
+  }
+  std::cout << "Rendering with " << _nrWorkers << " workers, "
+    << Compositor::MethodName(_method) << " compositing\n";
+  return cluster;
+}
+
+bool RenderCluster::RenderBatch(std::string _poseFileName,
+                                std::string _outputPrefix,
+                                bool _refine) {
+  std::ifstream poseFile(_poseFileName.c_str());
+  if (!poseFile.is_open()) {
+    std::cout << "Error: Could not open pose file " << _poseFileName << "\n";
+    return false;
+  }
+
+  unsigned long long nrPixels = (unsigned long long)width_*height_;
+  std::vector<float> rgba(nrPixels*4);
+  std::vector<unsigned char> pixels(nrPixels*3);
+  Timer timer;
+  unsigned int nrViews = 0;
+  double totalCompositeMs = 0.0;
+  std::string line;
+  while (std::getline(poseFile, line)) {
+    std::istringstream pose(line);
+    float pitch, roll, yaw;
+    if (line.empty() || line[0] == '#' || !(pose >> pitch >> roll >> yaw)) {
+      continue;
+    }
+    Timer viewTimer;
+    View view = { pitch, roll, yaw, _refine ? 1U : 0U, 0 };
+    for (unsigned int i=0; i<nrWorkers_; i++) {
+      if (!workers_[i]->Send(&view, sizeof(view))) {
+        std::cout << "Error: Lost connection to worker " << i << "\n";
+        return false;
+      }
+    }
+    // Every worker ends up with one band of the final image
+    double renderMs = 0.0;
+    double compositeMs = 0.0;
+    for (unsigned int i=0; i<nrWorkers_; i++) {
+      Band band;
+      bool received = workers_[i]->Receive(&band, sizeof(band)) &&
+        band.firstRow + band.nrRows <= height_ &&
+        workers_[i]->Receive(&rgba[(unsigned long long)band.firstRow*
+                                   width_*4],
+                             (unsigned long long)band.nrRows*width_*4*
+                               sizeof(float));
+      if (!received) {
+        std::cout << "Error: Lost connection to worker " << i << "\n";
+        return false;
+      }
+      renderMs = std::max(renderMs, static_cast<double>(band.renderMs));
+      compositeMs = std::max(compositeMs,
+                             static_cast<double>(band.compositeMs));
+    }
+    // Rounded like the blit of the float image to the output in a single
+    // process
+    for (unsigned long long i=0; i<nrPixels; i++) {
+      for (unsigned int c=0; c<3; c++) {
+        float value = std::min(std::max(rgba[4*i+c], 0.f), 1.f);
+        pixels[3*i+c] = static_cast<unsigned char>(value*255.f + 0.5f);
+      }
+    }
+    char fileName[32];
+    sprintf(fileName, "%04u.ppm", nrViews);
+    if (!Manager::WriteImage(_outputPrefix + fileName, width_, height_,
+                             pixels)) {
+      break;
+    }
+    std::cout << "View " << nrViews << ": " << viewTimer.Milliseconds()
+      << " ms, rendering " << renderMs << " ms, compositing " << compositeMs
+      << " ms\n";
+    totalCompositeMs += compositeMs;
+    nrViews++;
+  }
+  double seconds = timer.Seconds();
+  std::cout << "Rendered " << nrViews << " views in " << seconds << " s";
+  if (nrViews > 0) {
+    std::cout << " (" << seconds*1000.0/nrViews << " ms per view, "
+      << totalCompositeMs/nrViews << " ms compositing)";
+  }
+  std::cout << "\n";
+  return true;
+}
+
+RenderCluster * RenderCluster::Join(std::string _master) {
+  size_t colon = _master.rfind(':');
+  if (colon == std::string::npos) {
+    std::cout << "Error: Master address has to be <host>:<port>\n";
+    return NULL;
+  }
+  std::string host = _master.substr(0, colon);
+  unsigned short port =
+    static_cast<unsigned short>(atoi(_master.substr(colon+1).c_str()));
+  // The others connect here, so listen before telling the master the port
+  Socket *listener = Socket::Listen(0);
+  if (listener == NULL) {
+    return NULL;
+  }
+  Socket *master = Socket::Connect(host, port, CONNECT_SECONDS);
+  if (master == NULL) {
+    delete listener;
+    return NULL;
+  }
+
+  RenderCluster *cluster = new RenderCluster();
+  cluster->master_ = master;
+  Hello hello = { MAGIC, listener->Port() };
+  Setup setup;
+  std::vector<Peer> peers;
+  bool received = master->Send(&hello, sizeof(hello)) &&
+    master->Receive(&setup, sizeof(setup));
+  if (received) {
+    peers.resize(setup.nrWorkers);
+    received = master->Receive(&peers[0], setup.nrWorkers*sizeof(Peer));
+  }
+  if (!received) {
+    std::cout << "Error: Lost connection to master\n";
+    delete listener;
+    delete cluster;
+    return NULL;
+  }
+  cluster->rank_ = setup.rank;
+  cluster->nrWorkers_ = setup.nrWorkers;
+  cluster->width_ = setup.width;
+  cluster->height_ = setup.height;
+  cluster->method_ = static_cast<Compositor::Method>(setup.method);
+  while ((1U << 3*cluster->rootLevel_) < setup.nrWorkers) {
+    cluster->rootLevel_++;
+  }
+  cluster->compositor_ = Compositor::New(cluster->method_,
+                                         setup.rank,
+                                         setup.nrWorkers,
+                                         setup.width,
+                                         setup.height);
+
+  // Every worker connects to those of lower rank and is connected to by
+  // those of higher rank, each connection starts with the connecting rank.
+  // Connections complete in the backlog, so nobody waits for the others.
+  bool connected = true;
+  for (unsigned int i=0; i<setup.rank && connected; i++) {
+    Socket *peer = Socket::Connect(peers[i].host,
+                                   static_cast<unsigned short>(peers[i].port),
+                                   CONNECT_SECONDS);
+    connected = peer != NULL && peer->Send(&setup.rank, sizeof(setup.rank));
+    cluster->compositor_->SetPeer(i, peer);
+  }
+  for (unsigned int i=setup.rank+1; i<setup.nrWorkers && connected; i++) {
+    Socket *peer = listener->Accept();
+    unsigned int rank = 0;
+    connected = peer != NULL && peer->Receive(&rank, sizeof(rank)) &&
+      rank > setup.rank && rank < setup.nrWorkers;
+    if (!connected) {
+      delete peer;
+      break;
+    }
+    cluster->compositor_->SetPeer(rank, peer);
+  }
+  delete listener;
+  if (!connected) {
+    std::cout << "Error: Worker " << setup.rank
+      << " could not connect to the others\n";
+    delete cluster;
+    return NULL;
+  }
+  return cluster;
+}
+
+bool RenderCluster::Ready(bool _loaded) {
+  Status status = { _loaded ? 1U : 0U };
+  return master_->Send(&status, sizeof(status));
+}
+
+bool RenderCluster::NextView(float &_pitch,
+                             float &_roll,
+                             float &_yaw,
+                             bool &_refine) {
+  View view;
+  if (!master_->Receive(&view, sizeof(view)) || view.stop) {
+    return false;
+  }
+  _pitch = view.pitch;
+  _roll = view.roll;
+  _yaw = view.yaw;
+  _refine = view.refine != 0;
+  return true;
+}
+
+bool RenderCluster::FinishView(std::vector<float> &_rgba,
+                               std::vector<float> &_depths,
+                               double _renderMs) {
+  if (!compositor_->Composite(_rgba, _depths)) {
+    return false;
+  }
+  Band band = {
+    compositor_->FirstRow(),
+    compositor_->NrRows(),
+    static_cast<float>(_renderMs),
+    static_cast<float>(compositor_->LastMilliseconds())
+  };
+  return master_->Send(&band, sizeof(band)) &&
+    master_->Send(_rgba.data() + (unsigned long long)band.firstRow*width_*4,
+                  (unsigned long long)band.nrRows*width_*4*sizeof(float));
+}
+
+void RenderCluster::Shutdown() {
+  View stop = { 0.f, 0.f, 0.f, 0, 1 };
+  for (unsigned int i=0; i<workers_.size(); i++) {
+    workers_[i]->Send(&stop, sizeof(stop));
+    delete workers_[i];
+  }
+  workers_.clear();
+  for (unsigned int i=0; i<processes_.size(); i++) {
+    WaitForProcess(processes_[i]);
+  }
+  processes_.clear();
+  delete compositor_;
+  compositor_ = NULL;
+  delete master_;
+  master_ = NULL;
+}
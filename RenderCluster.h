@@ -0,0 +1,131 @@
+#ifndef RENDERCLUSTER_H
+#define RENDERCLUSTER_H
+
+#include "Compositor.h"
+#include <string>
+#include <vector>
+
+class Socket;
+
+// Sort-last rendering of one volume by several processes, for volumes no
+// single process can hold. The octree is split into the subtrees below
+// one level, one per worker process, and every worker only loads its own
+// subtree (see VolumeTexture::LoadHostSubtree) and renders it with the
+// usual ray caster into RGBA plus ray depth. The workers composite their
+// images with a Compositor and send their bands of the final image to the
+// master, which holds no volume and needs no GL context.
+//
+// The master starts the workers as processes on the same machine, or
+// waits for workers started elsewhere with -worker <host>:<port>. Workers
+// listen for each other on ports of their own and report them to the
+// master, which hands every worker the addresses of the others.
+class RenderCluster {
+public:
+  ~RenderCluster();
+
+  // Master side. Listens for _nrWorkers workers, a power of 8 so that they
+  // split the tree at one level. With _program set they are started as
+  // processes of _program with _workerArguments plus -worker, otherwise
+  // they are waited for on _port. Returns NULL on failure.
+  static RenderCluster * Launch(unsigned int _nrWorkers,
+                                Compositor::Method _method,
+                                unsigned int _width,
+                                unsigned int _height,
+                                unsigned short _port,
+                                std::string _program,
+                                std::vector<std::string> _workerArguments);
+  // Renders the views of a pose file like Manager::RenderBatch() and
+  // writes them the same way. Prints the compositing time of every view.
+  // Returns false if the pose file could not be read or a worker failed.
+  bool RenderBatch(std::string _poseFileName,
+                   std::string _outputPrefix,
+                   bool _refine);
+
+  // Worker side. Connects to the master at <host>:<port>, gets its rank
+  // and the image size and connects to the other workers. Returns NULL on
+  // failure.
+  static RenderCluster * Join(std::string _master);
+  unsigned int Rank() { return rank_; }
+  unsigned int Width() { return width_; }
+  unsigned int Height() { return height_; }
+  // The worker's subtree, the node of its rank on this level
+  unsigned int RootLevel() { return rootLevel_; }
+  unsigned long long RootIndex() { return rank_; }
+  // Reports whether the subtree could be loaded. Returns false if the
+  // master is gone.
+  bool Ready(bool _loaded);
+  // Waits for the next view, with _refine set it is refined until it has
+  // converged. Returns false once the master is done.
+  bool NextView(float &_pitch, float &_roll, float &_yaw, bool &_refine);
+  // Composites the worker's image of the view with the others' and sends
+  // its band to the master. _renderMs is reported along with it.
+  bool FinishView(std::vector<float> &_rgba,
+                  std::vector<float> &_depths,
+                  double _renderMs);
+
+private:
+  // First word of every worker's hello, catches strangers on the port
+  static const unsigned int MAGIC = 0x4f435452;
+  // Seconds a worker keeps trying to reach a master that is not up yet
+  static const unsigned int CONNECT_SECONDS = 30;
+  static const unsigned int HOST_SIZE = 64;
+
+  // Worker to master, once the worker listens for the others
+  struct Hello {
+    unsigned int magic;
+    unsigned int port;
+  };
+  // Master to worker, followed by a Peer for every worker
+  struct Setup {
+    unsigned int rank;
+    unsigned int nrWorkers;
+    unsigned int width;
+    unsigned int height;
+    unsigned int method;
+  };
+  struct Peer {
+    char host[HOST_SIZE];
+    unsigned int port;
+  };
+  // Worker to master, once it is ready to render
+  struct Status {
+    unsigned int ok;
+  };
+  // Master to workers for every view, or to end the session
+  struct View {
+    float pitch;
+    float roll;
+    float yaw;
+    unsigned int refine;
+    unsigned int stop;
+  };
+  // Worker to master, followed by the band's RGBA
+  struct Band {
+    unsigned int firstRow;
+    unsigned int nrRows;
+    float renderMs;
+    float compositeMs;
+  };
+
+  RenderCluster();
+  RenderCluster(const RenderCluster&) {}
+  // Asks the workers to stop and waits for the processes started
+  void Shutdown();
+
+  unsigned int rank_;
+  unsigned int nrWorkers_;
+  unsigned int width_;
+  unsigned int height_;
+  unsigned int rootLevel_;
+  Compositor::Method method_;
+  // Master: connection to every worker, in rank order
+  std::vector<Socket*> workers_;
+  // Worker: connection to the master, and to the other workers through
+  // the compositor
+  Socket *master_;
+  Compositor *compositor_;
+  // Master: handles of the worker processes it started
+  std::vector<long long> processes_;
+};
+
+#endif
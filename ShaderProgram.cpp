@@ -72,12 +72,29 @@ void ShaderProgram::CreateProgram() {
   
   // Since we have linked the program, we can get rid of the shaders
   std::for_each(shaderHandles_.begin(), shaderHandles_.end(), glDeleteShader);
+
+  // Cache locations of the plain uniforms, block members have none
+  uniformLocations_.clear();
+  int nrUniforms, maxNameLength;
+  glGetProgramiv(programHandle_, GL_ACTIVE_UNIFORMS, &nrUniforms);
+  glGetProgramiv(programHandle_, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+  std::vector<char> name(maxNameLength+1);
+  for (int i=0; i<nrUniforms; i++) {
+    int size;
+    GLenum type;
+    glGetActiveUniform(programHandle_, i, maxNameLength, NULL, &size, &type,
+                       &name[0]);
+    int location = glGetUniformLocation(programHandle_, &name[0]);
+    if (location != -1) {
+      uniformLocations_[&name[0]] = location;
+    }
+  }
   std::cout << "Finished creating shader program\n\n";
 }
 
 void ShaderProgram::BindMatrix4fv(std::string _uniform, float *_matrix) {
   glUseProgram(programHandle_);
-  int location = glGetUniformLocation(programHandle_, _uniform.c_str());
+  int location = UniformLocation(_uniform);
   glUniformMatrix4fv(location, 1, GL_FALSE, _matrix);
   glUseProgram(0);
 }
@@ -89,7 +106,7 @@ void ShaderProgram::BindTexture2D(std::string _uniform,
   glUseProgram(programHandle_);
   glActiveTexture(_texUnit);
   glEnable(GL_TEXTURE_2D);
-  int location = glGetUniformLocation(programHandle_, _uniform.c_str());
+  int location = UniformLocation(_uniform);
   glUniform1i(location, _unitNumber);
   glBindTexture(GL_TEXTURE_2D, _tex->Handle());
   glUseProgram(0);
@@ -99,29 +116,84 @@ void ShaderProgram::BindVolumeTexture(std::string _uniform,
                                       GLenum _texUnit,
                                       unsigned int _unitNumber,
                                       VolumeTexture *_tex) {
+  BindTextureBuffer(_uniform, _texUnit, _unitNumber, _tex->Handle());
+}
+
+void ShaderProgram::BindTextureBuffer(std::string _uniform,
+                                      GLenum _texUnit,
+                                      unsigned int _unitNumber,
+                                      unsigned int _handle) {
   glUseProgram(programHandle_);
   glActiveTexture(_texUnit);
-  int location = glGetUniformLocation(programHandle_, _uniform.c_str());
+  int location = UniformLocation(_uniform);
   glUniform1i(location, _unitNumber);
-  glBindTexture(GL_TEXTURE_BUFFER, _tex->Handle());
-  glUseProgram(0);                                    
+  glBindTexture(GL_TEXTURE_BUFFER, _handle);
+  glUseProgram(0);
+}
+
+void ShaderProgram::BindTexture3D(std::string _uniform,
+                                  GLenum _texUnit,
+                                  unsigned int _unitNumber,
+                                  unsigned int _handle) {
+  glUseProgram(programHandle_);
+  glActiveTexture(_texUnit);
+  int location = UniformLocation(_uniform);
+  glUniform1i(location, _unitNumber);
+  glBindTexture(GL_TEXTURE_3D, _handle);
+  glUseProgram(0);
 }
 
 unsigned int ShaderProgram::GetAttribLocation(std::string _attrib) {
   return glGetAttribLocation(programHandle_, _attrib.c_str());
 }
 
+int ShaderProgram::UniformLocation(std::string _uniform) {
+  std::map<std::string, int>::iterator it = uniformLocations_.find(_uniform);
+  if (it == uniformLocations_.end()) {
+    return -1;
+  }
+  return it->second;
+}
+
+void ShaderProgram::SetSampler(std::string _uniform,
+                               unsigned int _unitNumber) {
+  glUseProgram(programHandle_);
+  glUniform1i(UniformLocation(_uniform), _unitNumber);
+  glUseProgram(0);
+}
+
+bool ShaderProgram::BindUniformBlock(std::string _block,
+                                     unsigned int _bindingPoint) {
+  unsigned int index = glGetUniformBlockIndex(programHandle_, _block.c_str());
+  if (index == GL_INVALID_INDEX) {
+    std::cout << "Error: No uniform block " << _block << " in program\n";
+    return false;
+  }
+  glUniformBlockBinding(programHandle_, index, _bindingPoint);
+  return true;
+}
+
 void ShaderProgram::BindFloat(std::string _uniform, float _value) {
   glUseProgram(programHandle_);
-  int location = glGetUniformLocation(programHandle_, _uniform.c_str());
+  int location = UniformLocation(_uniform);
   glUniform1f(location, _value);
   glUseProgram(0);
 }
 
+void ShaderProgram::BindVec3(std::string _uniform,
+                             float _x,
+                             float _y,
+                             float _z) {
+  glUseProgram(programHandle_);
+  int location = UniformLocation(_uniform);
+  glUniform3f(location, _x, _y, _z);
+  glUseProgram(0);
+}
+
 void ShaderProgram::BindInt(std::string _uniform, int _value) {
   std::cout << "Binding " << _uniform << " = " << _value << std::endl;
   glUseProgram(programHandle_);
-  int location = glGetUniformLocation(programHandle_, _uniform.c_str());
+  int location = UniformLocation(_uniform);
   glUniform1i(location, _value);
   glUseProgram(0);
 }
@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <string>
+#include <map>
 
 #include <gl\glew.h>
 
@@ -18,7 +19,8 @@ public:
   static ShaderProgram * New();
   // Creates a vertex or fragment shader from file
   void CreateShader(ShaderType _type, std::string _fileName);
-  // Attaches the created shaders and links the program
+  // Attaches the created shaders and links the program. Uniform locations
+  // are looked up once here and cached.
   void CreateProgram();
   // Returns the handle to the linked program
   unsigned int Handle() { return programHandle_; }
@@ -34,12 +36,31 @@ public:
                          GLenum _texUnit,
                          unsigned int _unitNumber,
                          VolumeTexture *_tex);
+  // Binds a buffer texture handle to the shader program
+  void BindTextureBuffer(std::string _uniform,
+                         GLenum _texUnit,
+                         unsigned int _unitNumber,
+                         unsigned int _handle);
+  // Binds a 3D texture handle to the shader program
+  void BindTexture3D(std::string _uniform,
+                     GLenum _texUnit,
+                     unsigned int _unitNumber,
+                     unsigned int _handle);
   // Binds a float uniform to the shader program
   void BindFloat(std::string _uniform, float _value); 
+  // Binds a vec3 uniform to the shader program
+  void BindVec3(std::string _uniform, float _x, float _y, float _z);
   // Binds an integer uniform to the shader program
   void BindInt(std::string _uniform, int _value);
   // Get location for named attribute
   unsigned int GetAttribLocation(std::string _attrib);
+  // Cached location of a uniform, -1 if it is not active
+  int UniformLocation(std::string _uniform);
+  // Points a sampler uniform at a texture unit, only needed once
+  void SetSampler(std::string _uniform, unsigned int _unitNumber);
+  // Connects a uniform block to a buffer binding point. Returns false if
+  // the program has no such block.
+  bool BindUniformBlock(std::string _block, unsigned int _bindingPoint);
 
 private:
   ShaderProgram() {}
@@ -51,6 +72,7 @@ private:
 
   std::vector<unsigned int> shaderHandles_;
   unsigned int programHandle_;
+  std::map<std::string, int> uniformLocations_;
 };
 
 #endif
\ No newline at end of file
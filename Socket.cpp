@@ -0,0 +1,199 @@
+#include "Socket.h"
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef int socklen_t;
+#define CLOSE_SOCKET closesocket
+#define SEND_FLAGS 0
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#define CLOSE_SOCKET close
+#define INVALID_SOCKET -1
+// A lost connection is reported by Send(), not by SIGPIPE
+#define SEND_FLAGS MSG_NOSIGNAL
+#endif
+
+// Handles are kept as long long, SOCKET is unsigned on Windows
+static const long long NO_HANDLE = static_cast<long long>(INVALID_SOCKET);
+
+// Largest piece handed to one send() or recv() call, their sizes are ints
+// on Windows
+static const unsigned long long MAX_CHUNK = 1 << 30;
+// Pause between connection attempts
+static const unsigned int RETRY_MILLISECONDS = 100;
+
+bool Socket::Startup() {
+#ifdef _WIN32
+  static bool started = false;
+  if (!started) {
+    WSADATA data;
+    if (WSAStartup(MAKEWORD(2, 2), &data) != 0) {
+      std::cout << "Error: Could not initialize Winsock\n";
+      return false;
+    }
+    started = true;
+  }
+#endif
+  return true;
+}
+
+Socket * Socket::Listen(unsigned short _port) {
+  if (!Startup()) {
+    return NULL;
+  }
+  long long handle = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (handle == NO_HANDLE) {
+    std::cout << "Error: Could not create socket\n";
+    return NULL;
+  }
+  int reuse = 1;
+  setsockopt(handle, SOL_SOCKET, SO_REUSEADDR,
+             reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(_port);
+  if (bind(handle, reinterpret_cast<sockaddr*>(&address),
+           sizeof(address)) != 0 ||
+      listen(handle, SOMAXCONN) != 0) {
+    std::cout << "Error: Could not listen on port " << _port << "\n";
+    CLOSE_SOCKET(handle);
+    return NULL;
+  }
+  return new Socket(handle);
+}
+
+Socket * Socket::Connect(std::string _host,
+                         unsigned short _port,
+                         double _seconds) {
+  if (!Startup()) {
+    return NULL;
+  }
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  std::ostringstream port;
+  port << _port;
+  addrinfo *addresses = NULL;
+  if (getaddrinfo(_host.c_str(), port.str().c_str(), &hints,
+                  &addresses) != 0 || addresses == NULL) {
+    std::cout << "Error: Unknown host " << _host << "\n";
+    return NULL;
+  }
+
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() +
+    std::chrono::milliseconds(static_cast<long long>(_seconds*1000.0));
+  long long handle = NO_HANDLE;
+  while (true) {
+    handle = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (handle != NO_HANDLE &&
+        connect(handle, addresses->ai_addr,
+                static_cast<socklen_t>(addresses->ai_addrlen)) == 0) {
+      break;
+    }
+    if (handle != NO_HANDLE) {
+      CLOSE_SOCKET(handle);
+      handle = NO_HANDLE;
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+      break;
+    }
+    std::this_thread::sleep_for(
+      std::chrono::milliseconds(RETRY_MILLISECONDS));
+  }
+  freeaddrinfo(addresses);
+  if (handle == NO_HANDLE) {
+    std::cout << "Error: Could not connect to " << _host << ":" << _port
+      << "\n";
+    return NULL;
+  }
+  // Requests are small and answered right away
+  int noDelay = 1;
+  setsockopt(handle, IPPROTO_TCP, TCP_NODELAY,
+             reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+  return new Socket(handle);
+}
+
+Socket::~Socket() {
+  CLOSE_SOCKET(handle_);
+}
+
+Socket * Socket::Accept() {
+  long long handle = accept(handle_, NULL, NULL);
+  if (handle == NO_HANDLE) {
+    std::cout << "Error: Could not accept connection\n";
+    return NULL;
+  }
+  int noDelay = 1;
+  setsockopt(handle, IPPROTO_TCP, TCP_NODELAY,
+             reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+  return new Socket(handle);
+}
+
+bool Socket::Send(const void *_data, unsigned long long _size) {
+  const char *data = static_cast<const char*>(_data);
+  while (_size > 0) {
+    int chunk = static_cast<int>(std::min(_size, MAX_CHUNK));
+    int sent = send(handle_, data, chunk, SEND_FLAGS);
+    if (sent <= 0) {
+      return false;
+    }
+    data += sent;
+    _size -= sent;
+  }
+  return true;
+}
+
+bool Socket::Receive(void *_data, unsigned long long _size) {
+  char *data = static_cast<char*>(_data);
+  while (_size > 0) {
+    int chunk = static_cast<int>(std::min(_size, MAX_CHUNK));
+    int received = recv(handle_, data, chunk, 0);
+    if (received <= 0) {
+      return false;
+    }
+    data += received;
+    _size -= received;
+  }
+  return true;
+}
+
+unsigned short Socket::Port() {
+  sockaddr_in address;
+  socklen_t size = sizeof(address);
+  if (getsockname(handle_, reinterpret_cast<sockaddr*>(&address),
+                  &size) != 0) {
+    return 0;
+  }
+  return ntohs(address.sin_port);
+}
+
+std::string Socket::PeerHost() {
+  sockaddr_in address;
+  socklen_t size = sizeof(address);
+  if (getpeername(handle_, reinterpret_cast<sockaddr*>(&address),
+                  &size) != 0) {
+    return "";
+  }
+  // inet_ntoa is available everywhere, the result is copied right away
+  return inet_ntoa(address.sin_addr);
+}
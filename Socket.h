@@ -0,0 +1,41 @@
+#ifndef SOCKET_H
+#define SOCKET_H
+
+#include <string>
+
+// Blocking TCP socket, either listening for connections or connected to
+// another process. The processes of a RenderCluster talk over these, on
+// one machine through the loopback interface.
+class Socket {
+public:
+  // Listens on all interfaces, port 0 picks a free port (see Port()).
+  // Returns NULL on failure.
+  static Socket * Listen(unsigned short _port);
+  // Connects to a listening socket, retrying for up to _seconds while
+  // nobody listens yet. Returns NULL on failure.
+  static Socket * Connect(std::string _host,
+                          unsigned short _port,
+                          double _seconds = 0.0);
+  ~Socket();
+  // Waits for the next connection to a listening socket. Returns NULL on
+  // failure.
+  Socket * Accept();
+  // Sends or receives exactly _size bytes. Returns false if the
+  // connection is lost.
+  bool Send(const void *_data, unsigned long long _size);
+  bool Receive(void *_data, unsigned long long _size);
+  // Local port, the one others connect to for a listening socket
+  unsigned short Port();
+  // Numeric address of the other end of a connection
+  std::string PeerHost();
+
+private:
+  explicit Socket(long long _handle) : handle_(_handle) {}
+  Socket(const Socket&) {}
+  // Initializes the socket library once, where there is one
+  static bool Startup();
+
+  long long handle_;
+};
+
+#endif
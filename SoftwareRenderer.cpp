@@ -0,0 +1,473 @@
+#include "SoftwareRenderer.h"
+#include "ThreadPool.h"
+#include <emmintrin.h>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+
+// Tiles are handed out to the threads one at a time
+static const unsigned int TILE_SIZE = 16;
+// Same limit as MAX_NODE_VISITS in octreeFrag.glsl
+static const unsigned int MAX_NODE_VISITS = 1024;
+
+// Scalar port of IntersectCube() in octreeFrag.glsl
+static bool IntersectCube(const glm::vec3 &_boundsMin,
+                          const glm::vec3 &_boundsMax,
+                          const glm::vec3 &_rayO,
+                          const glm::vec3 &_rayD,
+                          float &_tMinOut,
+                          float &_tMaxOut) {
+  float tMin = -1e20f;
+  float tMax = 1e20f;
+  for (unsigned int i=0; i<3; i++) {
+    float div = (_rayD[i] == 0.f) ? 1e20f : 1.f/_rayD[i];
+    float t1 = (_boundsMin[i] - _rayO[i]) * div;
+    float t2 = (_boundsMax[i] - _rayO[i]) * div;
+    if (div < 0.f) {
+      std::swap(t1, t2);
+    }
+    if (tMin > t2 || t1 > tMax) {
+      return false;
+    }
+    tMin = std::max(tMin, t1);
+    tMax = std::min(tMax, t2);
+  }
+  _tMinOut = tMin;
+  _tMaxOut = tMax;
+  return (tMin < 1e20f && tMax > -1e20f);
+}
+
+SoftwareRenderer * SoftwareRenderer::New() {
+  return new SoftwareRenderer();
+}
+
+SoftwareRenderer::SoftwareRenderer()
+  : nodes_(NULL),
+    ranges_(NULL),
+    deviations_(NULL),
+    homogeneity_(0.f),
+    maxDepth_(0),
+    maxLevel_(0),
+    traversal_(RESTART_TRAVERSAL),
+    intensity_(1.f),
+    opacityThreshold_(0.f),
+    invMVP_(1.f),
+    width_(0),
+    height_(0) {}
+
+void SoftwareRenderer::SetNodes(const float *_nodes,
+                                const float *_ranges,
+                                unsigned int _maxDepth) {
+  nodes_ = _nodes;
+  ranges_ = _ranges;
+  maxDepth_ = _maxDepth;
+  maxLevel_ = _maxDepth;
+}
+
+void SoftwareRenderer::SetMatrices(const glm::mat4 &_model,
+                                   const glm::mat4 &_view,
+                                   const glm::mat4 &_proj) {
+  invMVP_ = glm::inverse(_proj*_view*_model);
+}
+
+void SoftwareRenderer::SetIntensity(float _intensity) {
+  intensity_ = _intensity;
+}
+
+void SoftwareRenderer::SetOpacityThreshold(float _threshold) {
+  opacityThreshold_ = _threshold;
+}
+
+void SoftwareRenderer::SetDeviations(const float *_deviations,
+                                     float _homogeneity) {
+  deviations_ = _deviations;
+  homogeneity_ = _homogeneity;
+}
+
+bool SoftwareRenderer::IsHomogeneous(int _nodeOffset) {
+  // One float per node, node records are two
+  return deviations_ != NULL && deviations_[_nodeOffset/2] <= homogeneity_;
+}
+
+bool SoftwareRenderer::IsTransparent(int _nodeOffset) {
+  // Node and range records are both two floats, so offsets line up
+  return intensity_*ranges_[_nodeOffset+1] <= opacityThreshold_;
+}
+
+void SoftwareRenderer::SetMaxLevel(unsigned int _level) {
+  maxLevel_ = _level;
+}
+
+void SoftwareRenderer::SetTraversal(Traversal _traversal) {
+  traversal_ = _traversal;
+}
+
+bool SoftwareRenderer::ParseTraversal(std::string _name,
+                                      Traversal &_traversal) {
+  if (_name == "restart") {
+    _traversal = RESTART_TRAVERSAL;
+  } else if (_name == "ropes") {
+    _traversal = ROPE_TRAVERSAL;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+unsigned int SoftwareRenderer::Levels() {
+  return std::min(maxLevel_, maxDepth_);
+}
+
+void SoftwareRenderer::GenerateRay(unsigned int _x,
+                                   unsigned int _y,
+                                   glm::vec3 &_origin,
+                                   glm::vec3 &_direction) {
+  float ndcX = 2.f*((float)_x + 0.5f)/(float)width_ - 1.f;
+  float ndcY = 2.f*((float)_y + 0.5f)/(float)height_ - 1.f;
+  // Unproject the pixel on the near and far planes
+  glm::vec4 nearPoint = invMVP_*glm::vec4(ndcX, ndcY, -1.f, 1.f);
+  glm::vec4 farPoint = invMVP_*glm::vec4(ndcX, ndcY, 1.f, 1.f);
+  for (unsigned int i=0; i<3; i++) {
+    _origin[i] = nearPoint[i]/nearPoint.w;
+    _direction[i] = farPoint[i]/farPoint.w - _origin[i];
+  }
+  _direction = glm::normalize(_direction);
+}
+
+float SoftwareRenderer::TraceRay(const glm::vec3 &_origin,
+                                 const glm::vec3 &_direction) {
+  if (traversal_ == ROPE_TRAVERSAL) {
+    return TraceRayRopes(_origin, _direction);
+  }
+  return TraceRayRestart(_origin, _direction);
+}
+
+float SoftwareRenderer::TraceRayRestart(const glm::vec3 &_origin,
+                                        const glm::vec3 &_direction) {
+  float tMin, tMax;
+  if (!IntersectCube(glm::vec3(0.f), glm::vec3(1.f),
+                     _origin, _direction, tMin, tMax)) {
+    return 0.f;
+  }
+
+  float color = 0.f;
+  unsigned int levels = Levels();
+  for (unsigned int i=0; i<MAX_NODE_VISITS && tMin < tMax; i++) {
+    // Find the point P where the ray is now
+    float P[3];
+    for (unsigned int j=0; j<3; j++) {
+      P[j] = _origin[j] + tMin*_direction[j];
+    }
+
+    // Restart from the root and descend through the enclosing children,
+    // stopping early at empty and homogeneous nodes
+    glm::vec3 offset(0.f);
+    float boxDim = 1.f;
+    int nodeOffset = 0;
+    bool skip = IsTransparent(nodeOffset);
+    bool stop = skip || IsHomogeneous(nodeOffset);
+    for (unsigned int level=0; level<levels && !stop; level++) {
+      boxDim /= 2.f;
+      int child = 0;
+      for (unsigned int j=0; j<3; j++) {
+        if (P[j] >= offset[j] + boxDim) {
+          child |= 1 << j;
+          offset[j] += boxDim;
+        }
+      }
+      nodeOffset = static_cast<int>(nodes_[nodeOffset+1]) + child*2;
+      skip = IsTransparent(nodeOffset);
+      stop = skip || IsHomogeneous(nodeOffset);
+    }
+
+    float tMinNode, tMaxNode;
+    if (!IntersectCube(offset, offset + glm::vec3(boxDim),
+                       _origin, _direction, tMinNode, tMaxNode)) {
+      tMaxNode = tMin;
+    }
+    if (!skip) {
+      color += nodes_[nodeOffset]*(tMaxNode - std::max(tMin, tMinNode));
+    }
+    tMin = tMaxNode + 0.0001f;
+  }
+  return intensity_*color;
+}
+
+// Cell of a level enclosing P, clamped to the cube like EnclosingCell()
+static void EnclosingCell(const float _P[3],
+                          unsigned int _level,
+                          int _cell[3]) {
+  int cells = 1 << _level;
+  for (unsigned int i=0; i<3; i++) {
+    int c = static_cast<int>(floor(_P[i]*cells));
+    _cell[i] = std::min(std::max(c, 0), cells - 1);
+  }
+}
+
+float SoftwareRenderer::TraceRayRopes(const glm::vec3 &_origin,
+                                      const glm::vec3 &_direction) {
+  float tMin, tMax;
+  if (!IntersectCube(glm::vec3(0.f), glm::vec3(1.f),
+                     _origin, _direction, tMin, tMax)) {
+    return 0.f;
+  }
+
+  float color = 0.f;
+  unsigned int levels = Levels();
+  int nodeOffset = 0;
+  unsigned int level = 0;
+  int cell[3] = { 0, 0, 0 };
+  bool skip = IsTransparent(nodeOffset);
+  bool stop = skip || IsHomogeneous(nodeOffset);
+  // Cells of coarser levels are this one shifted down
+  int leafCell[3];
+  float P[3];
+  for (unsigned int j=0; j<3; j++) {
+    P[j] = _origin[j] + tMin*_direction[j];
+  }
+  EnclosingCell(P, levels, leafCell);
+  for (unsigned int i=0; i<MAX_NODE_VISITS && tMin < tMax; i++) {
+    // Descend to the node enclosing P, stopping early at empty and
+    // homogeneous nodes
+    while (level < levels && !stop) {
+      level++;
+      for (unsigned int j=0; j<3; j++) {
+        cell[j] = leafCell[j] >> (levels - level);
+      }
+      int child = (cell[0] & 1) | (cell[1] & 1) << 1 | (cell[2] & 1) << 2;
+      nodeOffset = static_cast<int>(nodes_[nodeOffset+1]) + child*2;
+      skip = IsTransparent(nodeOffset);
+      stop = skip || IsHomogeneous(nodeOffset);
+    }
+
+    float boxDim = 1.f/static_cast<float>(1 << level);
+    glm::vec3 offset(cell[0]*boxDim, cell[1]*boxDim, cell[2]*boxDim);
+    float tMinNode, tMaxNode;
+    if (!IntersectCube(offset, offset + glm::vec3(boxDim),
+                       _origin, _direction, tMinNode, tMaxNode)) {
+      tMaxNode = tMin;
+    }
+    if (!skip) {
+      color += nodes_[nodeOffset]*(tMaxNode - std::max(tMin, tMinNode));
+    }
+    tMin = tMaxNode + 0.0001f;
+    for (unsigned int j=0; j<3; j++) {
+      P[j] = _origin[j] + tMin*_direction[j];
+    }
+    EnclosingCell(P, levels, leafCell);
+
+    // Climb to the common ancestor, nodes are stored level by level so
+    // the parent of node n is (n-1)/8
+    int next[3];
+    for (unsigned int j=0; j<3; j++) {
+      next[j] = leafCell[j] >> (levels - level);
+    }
+    while (next[0] != cell[0] || next[1] != cell[1] || next[2] != cell[2]) {
+      for (unsigned int j=0; j<3; j++) {
+        next[j] >>= 1;
+        cell[j] >>= 1;
+      }
+      nodeOffset = (nodeOffset/2 - 1)/8*2;
+      level--;
+      skip = false;
+      stop = false;
+    }
+  }
+  return intensity_*color;
+}
+
+void SoftwareRenderer::TracePacket(const float _origin[3][4],
+                                   const float _direction[3][4],
+                                   float _out[4]) {
+  const __m128 one = _mm_set1_ps(1.f);
+  const __m128 big = _mm_set1_ps(1e20f);
+
+  // Slab test against the unit cube for all four rays
+  __m128 tMin = _mm_set1_ps(-1e20f);
+  __m128 tMax = big;
+  __m128 O[3];
+  __m128 div[3];
+  for (unsigned int i=0; i<3; i++) {
+    O[i] = _mm_loadu_ps(_origin[i]);
+    __m128 D = _mm_loadu_ps(_direction[i]);
+    __m128 zeroDir = _mm_cmpeq_ps(D, _mm_setzero_ps());
+    div[i] = _mm_or_ps(_mm_and_ps(zeroDir, big),
+                       _mm_andnot_ps(zeroDir, _mm_div_ps(one, D)));
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_setzero_ps(), O[i]), div[i]);
+    __m128 t2 = _mm_mul_ps(_mm_sub_ps(one, O[i]), div[i]);
+    tMin = _mm_max_ps(tMin, _mm_min_ps(t1, t2));
+    tMax = _mm_min_ps(tMax, _mm_max_ps(t1, t2));
+  }
+  // Rays that hit the cube and have something left to march through
+  __m128 active = _mm_and_ps(_mm_cmplt_ps(tMin, tMax),
+                             _mm_and_ps(_mm_cmplt_ps(tMin, big),
+                                        _mm_cmpgt_ps(tMax, _mm_set1_ps(-1e20f))));
+
+  __m128 color = _mm_setzero_ps();
+  unsigned int levels = Levels();
+  for (unsigned int visit=0;
+       visit<MAX_NODE_VISITS && _mm_movemask_ps(active) != 0;
+       visit++) {
+    // Current sample points. Finished lanes keep descending harmlessly,
+    // they only ever follow valid child offsets and are masked out.
+    __m128 P[3];
+    __m128 offset[3];
+    for (unsigned int i=0; i<3; i++) {
+      P[i] = _mm_add_ps(O[i], _mm_mul_ps(tMin, _mm_loadu_ps(_direction[i])));
+      offset[i] = _mm_setzero_ps();
+    }
+    __m128 boxDim = one;
+
+    // Restart from the root, lanes stop descending at empty and
+    // homogeneous nodes
+    int nodeOffset[4] = { 0, 0, 0, 0 };
+    int skip[4];
+    int stop[4];
+    for (unsigned int lane=0; lane<4; lane++) {
+      skip[lane] = IsTransparent(0) ? -1 : 0;
+      stop[lane] = (skip[lane] || IsHomogeneous(0)) ? -1 : 0;
+    }
+    for (unsigned int level=0; level<levels; level++) {
+      __m128 descend = _mm_castsi128_ps(_mm_xor_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(stop)),
+        _mm_set1_epi32(-1)));
+      if (_mm_movemask_ps(descend) == 0) {
+        break;
+      }
+      __m128 half = _mm_mul_ps(boxDim, _mm_set1_ps(0.5f));
+      boxDim = _mm_or_ps(_mm_and_ps(descend, half),
+                         _mm_andnot_ps(descend, boxDim));
+      // Child selection: one bit per axis where P is past the midpoint
+      __m128i child = _mm_setzero_si128();
+      for (unsigned int i=0; i<3; i++) {
+        __m128 upper = _mm_and_ps(descend,
+          _mm_cmpge_ps(P[i], _mm_add_ps(offset[i], boxDim)));
+        child = _mm_or_si128(child, _mm_and_si128(_mm_castps_si128(upper),
+                                                  _mm_set1_epi32(1 << i)));
+        offset[i] = _mm_add_ps(offset[i], _mm_and_ps(upper, boxDim));
+      }
+      int childIndex[4];
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(childIndex), child);
+      for (unsigned int lane=0; lane<4; lane++) {
+        if (!stop[lane]) {
+          nodeOffset[lane] = static_cast<int>(nodes_[nodeOffset[lane]+1]) +
+                             childIndex[lane]*2;
+          skip[lane] = IsTransparent(nodeOffset[lane]) ? -1 : 0;
+          stop[lane] = (skip[lane] || IsHomogeneous(nodeOffset[lane])) ? -1
+                                                                        : 0;
+        }
+      }
+    }
+
+    // Where the rays enter and leave the selected nodes
+    __m128 tMinNode = _mm_set1_ps(-1e20f);
+    __m128 tMaxNode = big;
+    for (unsigned int i=0; i<3; i++) {
+      __m128 t1 = _mm_mul_ps(_mm_sub_ps(offset[i], O[i]), div[i]);
+      __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(offset[i], boxDim), O[i]),
+                             div[i]);
+      tMinNode = _mm_max_ps(tMinNode, _mm_min_ps(t1, t2));
+      tMaxNode = _mm_min_ps(tMaxNode, _mm_max_ps(t1, t2));
+    }
+    __m128 missed = _mm_cmpgt_ps(tMinNode, tMaxNode);
+    tMaxNode = _mm_or_ps(_mm_and_ps(missed, tMin),
+                         _mm_andnot_ps(missed, tMaxNode));
+
+    // Integrate the visible nodes over their extent
+    __m128 value = _mm_set_ps(nodes_[nodeOffset[3]],
+                              nodes_[nodeOffset[2]],
+                              nodes_[nodeOffset[1]],
+                              nodes_[nodeOffset[0]]);
+    __m128 visible = _mm_andnot_ps(
+      _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(skip))),
+      active);
+    __m128 delta = _mm_sub_ps(tMaxNode, _mm_max_ps(tMin, tMinNode));
+    color = _mm_add_ps(color, _mm_and_ps(visible, _mm_mul_ps(value, delta)));
+
+    tMin = _mm_add_ps(tMaxNode, _mm_set1_ps(0.0001f));
+    active = _mm_and_ps(active, _mm_cmplt_ps(tMin, tMax));
+  }
+
+  _mm_storeu_ps(_out, _mm_mul_ps(color, _mm_set1_ps(intensity_)));
+}
+
+void SoftwareRenderer::RenderTile(unsigned int _tile) {
+  unsigned int tilesX = (width_ + TILE_SIZE - 1)/TILE_SIZE;
+  unsigned int x0 = (_tile % tilesX)*TILE_SIZE;
+  unsigned int y0 = (_tile / tilesX)*TILE_SIZE;
+  unsigned int x1 = std::min(x0 + TILE_SIZE, width_);
+  unsigned int y1 = std::min(y0 + TILE_SIZE, height_);
+
+  if (traversal_ == ROPE_TRAVERSAL) {
+    for (unsigned int y=y0; y<y1; y++) {
+      for (unsigned int x=x0; x<x1; x++) {
+        glm::vec3 o, d;
+        GenerateRay(x, y, o, d);
+        image_[y*width_ + x] = TraceRayRopes(o, d);
+      }
+    }
+    return;
+  }
+
+  // Packets are 2x2 pixel quads
+  for (unsigned int y=y0; y<y1; y+=2) {
+    for (unsigned int x=x0; x<x1; x+=2) {
+      float origin[3][4];
+      float direction[3][4];
+      for (unsigned int lane=0; lane<4; lane++) {
+        glm::vec3 o, d;
+        GenerateRay(x + (lane & 1), y + (lane >> 1), o, d);
+        for (unsigned int i=0; i<3; i++) {
+          origin[i][lane] = o[i];
+          direction[i][lane] = d[i];
+        }
+      }
+      float out[4];
+      TracePacket(origin, direction, out);
+      for (unsigned int lane=0; lane<4; lane++) {
+        unsigned int px = x + (lane & 1);
+        unsigned int py = y + (lane >> 1);
+        if (px < x1 && py < y1) {
+          image_[py*width_ + px] = out[lane];
+        }
+      }
+    }
+  }
+}
+
+void SoftwareRenderer::Render(unsigned int _width, unsigned int _height) {
+  if (nodes_ == NULL) {
+    std::cout << "Error: SoftwareRenderer has no nodes\n";
+    return;
+  }
+  width_ = _width;
+  height_ = _height;
+  image_.assign(width_*height_, 0.f);
+  unsigned int tilesX = (width_ + TILE_SIZE - 1)/TILE_SIZE;
+  unsigned int tilesY = (height_ + TILE_SIZE - 1)/TILE_SIZE;
+  ThreadPool::Instance().ParallelFor(tilesX*tilesY, [this](unsigned int _i) {
+    RenderTile(_i);
+  });
+}
+
+bool SoftwareRenderer::WritePPM(std::string _fileName) {
+  std::ofstream out;
+  out.open(_fileName.c_str(), std::ios::out|std::ios::binary);
+  if (!out.is_open()) {
+    std::cout << _fileName << " could not be opened." << std::endl;
+    return false;
+  }
+  out << "P6\n" << width_ << " " << height_ << "\n255\n";
+  std::vector<unsigned char> row(width_*3);
+  // PPM rows go top-down
+  for (int y=height_-1; y>=0; y--) {
+    for (unsigned int x=0; x<width_; x++) {
+      float v = std::min(std::max(image_[y*width_ + x], 0.f), 1.f);
+      unsigned char c = static_cast<unsigned char>(v*255.f + 0.5f);
+      row[3*x] = row[3*x+1] = row[3*x+2] = c;
+    }
+    out.write(reinterpret_cast<const char*>(&row[0]), row.size());
+  }
+  return out.good();
+}
@@ -0,0 +1,95 @@
+#ifndef SOFTWARERENDERER_H
+#define SOFTWARERENDERER_H
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+
+// CPU reference implementation of the octree ray caster in
+// octreeFrag.glsl. Consumes the same node array VolumeTexture uploads,
+// renders the image in tiles spread over the ThreadPool and traces four
+// rays at a time with SSE. Integrates the raw values, like the shader
+// does without a transfer function.
+class SoftwareRenderer {
+public:
+  // Same values as the traversal uniform in octreeFrag.glsl
+  enum Traversal {
+    // Descends from the root for every node, traced in SSE packets
+    RESTART_TRAVERSAL = 0,
+    // Walks the ray along implicit ropes, traced one ray at a time
+    ROPE_TRAVERSAL
+  };
+
+  static SoftwareRenderer * New();
+  // Node and range arrays in the layout VolumeTexture uploads. Not copied,
+  // need to stay valid while rendering.
+  void SetNodes(const float *_nodes,
+                const float *_ranges,
+                unsigned int _maxDepth);
+  void SetMatrices(const glm::mat4 &_model,
+                   const glm::mat4 &_view,
+                   const glm::mat4 &_proj);
+  void SetIntensity(float _intensity);
+  // Nodes with intensity*max at or below this are skipped
+  void SetOpacityThreshold(float _threshold);
+  // Per node standard deviations (OctreeFile::DEVIATION), not copied.
+  // Nodes deviating at most the homogeneity are integrated as a whole
+  // instead of descended into. NULL, the default, descends everywhere.
+  void SetDeviations(const float *_deviations, float _homogeneity);
+  // Deepest level to descend to, clamped to the tree depth
+  void SetMaxLevel(unsigned int _level);
+  // Defaults to RESTART_TRAVERSAL
+  void SetTraversal(Traversal _traversal);
+  // "restart" or "ropes", returns false for other names
+  static bool ParseTraversal(std::string _name, Traversal &_traversal);
+  // Renders a full image, rows stored bottom-up like the GL framebuffer
+  void Render(unsigned int _width, unsigned int _height);
+  // Traces a single ray with the scalar path of the current traversal
+  float TraceRay(const glm::vec3 &_origin, const glm::vec3 &_direction);
+  // Ray through the center of a pixel, in unit cube coordinates
+  void GenerateRay(unsigned int _x,
+                   unsigned int _y,
+                   glm::vec3 &_origin,
+                   glm::vec3 &_direction);
+  const std::vector<float> & Image() { return image_; }
+  unsigned int Width() { return width_; }
+  unsigned int Height() { return height_; }
+  // Writes the last image as a binary PPM
+  bool WritePPM(std::string _fileName);
+
+private:
+  SoftwareRenderer();
+  SoftwareRenderer(const SoftwareRenderer&) {}
+  void RenderTile(unsigned int _tile);
+  // Mirrors Traverse()
+  float TraceRayRestart(const glm::vec3 &_origin,
+                        const glm::vec3 &_direction);
+  // Mirrors TraverseRopes()
+  float TraceRayRopes(const glm::vec3 &_origin,
+                      const glm::vec3 &_direction);
+  // Traces four rays, components are stored as [axis][lane]
+  void TracePacket(const float _origin[3][4],
+                   const float _direction[3][4],
+                   float _out[4]);
+  unsigned int Levels();
+  // True if nothing below the node can contribute, mirrors IsTransparent()
+  bool IsTransparent(int _nodeOffset);
+  // True if the node is close enough to constant, mirrors IsHomogeneous()
+  bool IsHomogeneous(int _nodeOffset);
+
+  const float *nodes_;
+  const float *ranges_;
+  const float *deviations_;
+  float homogeneity_;
+  unsigned int maxDepth_;
+  unsigned int maxLevel_;
+  Traversal traversal_;
+  float intensity_;
+  float opacityThreshold_;
+  glm::mat4 invMVP_;
+  unsigned int width_;
+  unsigned int height_;
+  std::vector<float> image_;
+};
+
+#endif
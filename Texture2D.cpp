@@ -7,14 +7,45 @@ Texture2D * Texture2D::New(unsigned int _width, unsigned int _height) {
 }
 
 Texture2D::Texture2D(unsigned int _width, unsigned int _height) 
-  : width_(_width), height_(_height), initialized_(false) {}
+  : width_(_width),
+    height_(_height),
+    initialized_(false),
+    handle_(0),
+    internalFormat_(GL_RGB32F),
+    format_(GL_RGBA),
+    type_(GL_FLOAT) {}
 
-void Texture2D::Init() {
+Texture2D::~Texture2D() {
+  if (initialized_) {
+    glDeleteTextures(1, &handle_);
+  }
+}
+
+void Texture2D::Init(unsigned int _internalFormat,
+                     unsigned int _format,
+                     unsigned int _type) {
   if (initialized_) {
     std::cout << "Warning: Texture2D already initialized\n";
     return;
   }
+  internalFormat_ = _internalFormat;
+  format_ = _format;
+  type_ = _type;
+  Allocate();
+  initialized_ = true;
+}
+
+void Texture2D::Resize(unsigned int _width, unsigned int _height) {
+  width_ = _width;
+  height_ = _height;
+  if (!initialized_) {
+    return;
+  }
+  glDeleteTextures(1, &handle_);
+  Allocate();
+}
 
+void Texture2D::Allocate() {
   glGenTextures(1, &handle_);
   glBindTexture(GL_TEXTURE_2D, handle_);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
@@ -23,13 +54,12 @@ void Texture2D::Init() {
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
   glTexImage2D(GL_TEXTURE_2D,     // target
                0,                 // level
-               GL_RGB8,           // internal format
+               internalFormat_,   // internal format
                width_,            // width
                height_,           // height
                0,                 // border
-               GL_RGBA,           // format
-               GL_UNSIGNED_BYTE,  // type
+               format_,           // format
+               type_,             // type
                0);                // data
   glBindTexture(GL_TEXTURE_2D, 0);
-  initialized_ = true;
-}
\ No newline at end of file
+}
@@ -4,8 +4,15 @@
 class Texture2D {
 public:
   static Texture2D * New(unsigned int _width, unsigned int _height);
-  // Init an empty texture
-  void Init();
+  ~Texture2D();
+  // Init an empty texture with the given internal format, pixel format and
+  // type, e.g. as a render target
+  void Init(unsigned int _internalFormat,
+            unsigned int _format,
+            unsigned int _type);
+  // Reallocates the storage at a new size with a new handle, the contents
+  // are lost. Framebuffers the texture was attached to need it reattached.
+  void Resize(unsigned int _width, unsigned int _height);
   unsigned int Handle() { return handle_; }
   unsigned int Width() { return width_; }
   unsigned int Height() { return height_; }
@@ -13,11 +20,16 @@ public:
 private:
   Texture2D(unsigned int _width, unsigned int _height);
   Texture2D(const Texture2D&) {}
+  // Creates the texture with the current size and formats
+  void Allocate();
 
   bool initialized_;
   unsigned int width_;
   unsigned int height_;
   unsigned int handle_;
+  unsigned int internalFormat_;
+  unsigned int format_;
+  unsigned int type_;
 };
 
-#endif
\ No newline at end of file
+#endif
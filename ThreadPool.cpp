@@ -0,0 +1,136 @@
+#include "ThreadPool.h"
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// Set while a thread runs a job so that nested ParallelFor calls run inline
+static THREAD_LOCAL bool insideJob = false;
+
+ThreadPool& ThreadPool::Instance() {
+  static ThreadPool instance;
+  return instance;
+}
+
+ThreadPool::ThreadPool()
+  : nrThreads_(0),
+    jobCount_(0),
+    nextIndex_(0),
+    activeWorkers_(0),
+    generation_(0),
+    quit_(false) {
+  SetNrThreads(0);
+}
+
+ThreadPool::~ThreadPool() {
+  StopWorkers();
+}
+
+void ThreadPool::SetNrThreads(unsigned int _nrThreads) {
+  std::lock_guard<std::mutex> callLock(callMutex_);
+  if (_nrThreads == 0) {
+    _nrThreads = std::thread::hardware_concurrency();
+    if (_nrThreads == 0) {
+      _nrThreads = 1;
+    }
+  }
+  if (_nrThreads == nrThreads_) {
+    return;
+  }
+  StopWorkers();
+  nrThreads_ = _nrThreads;
+}
+
+void ThreadPool::StartWorkers() {
+  // Workers restarted by SetNrThreads() must not take the last job for a
+  // new one
+  unsigned int generation;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = false;
+    generation = generation_;
+  }
+  for (unsigned int i=1; i<nrThreads_; i++) {
+    workers_.push_back(std::thread(&ThreadPool::WorkerLoop, this,
+                                   generation));
+  }
+}
+
+void ThreadPool::StopWorkers() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  wake_.notify_all();
+  for (unsigned int i=0; i<workers_.size(); i++) {
+    workers_[i].join();
+  }
+  workers_.clear();
+}
+
+void ThreadPool::RunJob() {
+  bool wasInside = insideJob;
+  insideJob = true;
+  unsigned int i;
+  while ((i = nextIndex_++) < jobCount_) {
+    job_(i);
+  }
+  insideJob = wasInside;
+}
+
+void ThreadPool::WorkerLoop(unsigned int _generation) {
+  unsigned int seen = _generation;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (!quit_ && generation_ == seen) {
+        wake_.wait(lock);
+      }
+      if (quit_) {
+        return;
+      }
+      seen = generation_;
+    }
+    RunJob();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--activeWorkers_ == 0) {
+        done_.notify_one();
+      }
+    }
+  }
+}
+
+void ThreadPool::ParallelFor(unsigned int _count,
+                             std::function<void(unsigned int)> _func) {
+  if (nrThreads_ <= 1 || _count <= 1 || insideJob) {
+    for (unsigned int i=0; i<_count; i++) {
+      _func(i);
+    }
+    return;
+  }
+
+  std::lock_guard<std::mutex> callLock(callMutex_);
+  if (workers_.empty()) {
+    StartWorkers();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    job_ = _func;
+    jobCount_ = _count;
+    nextIndex_ = 0;
+    activeWorkers_ = workers_.size();
+    generation_++;
+  }
+  wake_.notify_all();
+
+  RunJob();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (activeWorkers_ != 0) {
+    done_.wait(lock);
+  }
+  job_ = nullptr;
+}
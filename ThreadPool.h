@@ -0,0 +1,53 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// Fixed set of worker threads for data parallel loops. The calling thread
+// takes part in the work, so a pool with one thread runs everything inline.
+class ThreadPool {
+public:
+  static ThreadPool& Instance();
+  ~ThreadPool();
+  // Sets the number of threads, 0 means one per hardware thread.
+  // 1 forces single threaded execution (useful for reproducibility checks).
+  void SetNrThreads(unsigned int _nrThreads);
+  unsigned int NrThreads() { return nrThreads_; }
+  // Calls _func(i) for every i in [0, _count) and returns when all calls
+  // are done. Calls from several threads are serialized, nested calls
+  // from inside _func run inline.
+  void ParallelFor(unsigned int _count,
+                   std::function<void(unsigned int)> _func);
+
+private:
+  ThreadPool();
+  ThreadPool(const ThreadPool&) {}
+  void StartWorkers();
+  void StopWorkers();
+  // Runs the jobs started after _generation
+  void WorkerLoop(unsigned int _generation);
+  // Pulls indices from the current job until it is exhausted
+  void RunJob();
+
+  unsigned int nrThreads_;
+  std::vector<std::thread> workers_;
+  // Serializes ParallelFor callers
+  std::mutex callMutex_;
+  // Protects the job state below
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  std::function<void(unsigned int)> job_;
+  unsigned int jobCount_;
+  std::atomic<unsigned int> nextIndex_;
+  unsigned int activeWorkers_;
+  unsigned int generation_;
+  bool quit_;
+};
+
+#endif
@@ -0,0 +1,252 @@
+#include "TimeSeries.h"
+#include "Manager.h"
+#include <gl\glew.h>
+#include <iostream>
+#include <cstdio>
+#include <chrono>
+
+TimeSeries * TimeSeries::New() {
+  return new TimeSeries();
+}
+
+TimeSeries::TimeSeries()
+  : first_(0),
+    nrSteps_(0),
+    bits_(8),
+    dim_(0),
+    prefetchDepth_(4),
+    memoryCap_(1024ULL*1024*1024),
+    stepsPerSecond_(10.0),
+    uploadBudget_(16ULL*1024*1024),
+    playing_(true),
+    stepRequested_(false),
+    front_(0),
+    upload_(NULL),
+    backReady_(false),
+    currentStep_(0),
+    backStep_(-1),
+    loadedBytes_(0),
+    lastStepBytes_(0),
+    quit_(false) {
+  for (unsigned int i=0; i<NR_SLOTS; i++) {
+    slots_[i] = NULL;
+    fences_[i] = NULL;
+  }
+}
+
+TimeSeries::~TimeSeries() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  wake_.notify_all();
+  if (loader_.joinable()) {
+    loader_.join();
+  }
+  std::map<unsigned int, VolumeTexture::HostTree*>::iterator it;
+  for (it=loaded_.begin(); it!=loaded_.end(); it++) {
+    delete it->second;
+  }
+  delete upload_;
+  for (unsigned int i=0; i<NR_SLOTS; i++) {
+    if (fences_[i] != NULL) {
+      glDeleteSync(static_cast<GLsync>(fences_[i]));
+    }
+    delete slots_[i];
+  }
+}
+
+bool TimeSeries::Init(std::string _pattern,
+                      unsigned int _first,
+                      unsigned int _nrSteps,
+                      int _bits,
+                      int _dim) {
+  pattern_ = _pattern;
+  first_ = _first;
+  nrSteps_ = _nrSteps;
+  bits_ = _bits;
+  dim_ = _dim;
+  if (nrSteps_ == 0) {
+    std::cout << "Error: Time series needs at least one step\n";
+    return false;
+  }
+
+  // The first step goes up in one piece, there is nothing to show before
+  VolumeTexture::HostTree tree;
+  std::cout << "Loading time series step " << FileName(0) << "\n";
+  if (!VolumeTexture::LoadHostTree(FileName(0), bits_, dim_, tree)) {
+    return false;
+  }
+  lastStepBytes_ = tree.Bytes();
+  for (unsigned int i=0; i<NR_SLOTS; i++) {
+    slots_[i] = VolumeTexture::New();
+  }
+  slots_[front_]->BeginUpload(&tree);
+  slots_[front_]->ContinueUpload(tree.Bytes());
+  Manager::CheckGLErrors("TimeSeries::Init()");
+  std::cout << "Time series of " << nrSteps_ << " steps, "
+    << lastStepBytes_/(1024*1024) << " MB per step\n";
+
+  if (nrSteps_ > 1) {
+    loader_ = std::thread(&TimeSeries::LoaderLoop, this);
+  }
+  stepTimer_.Restart();
+  return true;
+}
+
+void TimeSeries::SetPrefetchDepth(unsigned int _depth) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  prefetchDepth_ = _depth > 0 ? _depth : 1;
+  wake_.notify_all();
+}
+
+void TimeSeries::SetMemoryCap(unsigned long long _megabytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  memoryCap_ = _megabytes*1024*1024;
+  wake_.notify_all();
+}
+
+void TimeSeries::SetStepsPerSecond(double _stepsPerSecond) {
+  stepsPerSecond_ = _stepsPerSecond;
+}
+
+void TimeSeries::SetUploadBudget(unsigned long long _bytes) {
+  uploadBudget_ = _bytes > 0 ? _bytes : 1;
+}
+
+void TimeSeries::SetPlaying(bool _playing) {
+  playing_ = _playing;
+  stepTimer_.Restart();
+}
+
+void TimeSeries::RequestNextStep() {
+  stepRequested_ = true;
+}
+
+std::string TimeSeries::FileName(unsigned int _step) {
+  char fileName[1024];
+  sprintf(fileName, pattern_.c_str(), first_ + _step);
+  return fileName;
+}
+
+void TimeSeries::LoaderLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!quit_) {
+    // First step of the window after the current one that is missing
+    int step = -1;
+    for (unsigned int i=1; i<=prefetchDepth_ && i<nrSteps_; i++) {
+      unsigned int candidate = (currentStep_ + i) % nrSteps_;
+      if ((int)candidate != backStep_ && loaded_.count(candidate) == 0) {
+        step = candidate;
+        break;
+      }
+    }
+    bool fits = loaded_.empty() ||
+                loadedBytes_ + lastStepBytes_ <= memoryCap_;
+    if (step < 0 || !fits) {
+      wake_.wait(lock);
+      continue;
+    }
+
+    // Disk reads and builds happen outside the lock
+    std::string fileName = FileName(step);
+    lock.unlock();
+    VolumeTexture::HostTree *tree = new VolumeTexture::HostTree();
+    if (!VolumeTexture::LoadHostTree(fileName, bits_, dim_, *tree)) {
+      std::cout << "Error: Skipping time series step " << fileName << "\n";
+      delete tree;
+      tree = NULL;
+    }
+    lock.lock();
+    loaded_[step] = tree;
+    if (tree != NULL) {
+      lastStepBytes_ = tree->Bytes();
+      loadedBytes_ += lastStepBytes_;
+    }
+  }
+}
+
+bool TimeSeries::SlotIdle(unsigned int _slot) {
+  if (fences_[_slot] == NULL) {
+    return true;
+  }
+  GLsync fence = static_cast<GLsync>(fences_[_slot]);
+  GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+  if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+    return false;
+  }
+  glDeleteSync(fence);
+  fences_[_slot] = NULL;
+  return true;
+}
+
+bool TimeSeries::Update() {
+  if (nrSteps_ < 2) {
+    return false;
+  }
+  unsigned int back = (front_ + 1) % NR_SLOTS;
+  unsigned int next = (currentStep_ + 1) % nrSteps_;
+
+  // Take the next step once the GPU is done with the back slot
+  if (upload_ == NULL && !backReady_ && SlotIdle(back)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::map<unsigned int, VolumeTexture::HostTree*>::iterator it =
+      loaded_.find(next);
+    if (it != loaded_.end()) {
+      upload_ = it->second;
+      loaded_.erase(it);
+      if (upload_ != NULL) {
+        backStep_ = next;
+        slots_[back]->BeginUpload(upload_);
+      } else {
+        // Failed to load, move past it and keep showing the current step
+        currentStep_ = next;
+        wake_.notify_all();
+        return false;
+      }
+    }
+  }
+
+  if (upload_ != NULL && slots_[back]->ContinueUpload(uploadBudget_)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    loadedBytes_ -= upload_->Bytes();
+    delete upload_;
+    upload_ = NULL;
+    backReady_ = true;
+    wake_.notify_all();
+  }
+
+  bool due = stepRequested_ ||
+             (playing_ && stepTimer_.Seconds()*stepsPerSecond_ >= 1.0);
+  if (!backReady_ || !due) {
+    return false;
+  }
+
+  // Earlier frames may still read the old front slot, it is only
+  // uploaded to again once they have finished
+  if (fences_[front_] != NULL) {
+    glDeleteSync(static_cast<GLsync>(fences_[front_]));
+  }
+  fences_[front_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  front_ = back;
+  backReady_ = false;
+  stepRequested_ = false;
+  stepTimer_.Restart();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    currentStep_ = next;
+    backStep_ = -1;
+  }
+  wake_.notify_all();
+  return true;
+}
+
+void TimeSeries::WaitForNextStep() {
+  if (nrSteps_ < 2) {
+    return;
+  }
+  RequestNextStep();
+  while (!Update()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
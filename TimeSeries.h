@@ -0,0 +1,107 @@
+#ifndef TIMESERIES_H
+#define TIMESERIES_H
+
+#include "VolumeTexture.h"
+#include "Timer.h"
+#include <string>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Plays back a numbered sequence of volumes, such as simulation timesteps
+// or cardiac phases. A loader thread reads or builds the steps ahead of
+// the one on screen, and Update() streams the next one into a second
+// volume texture a slice per frame while the first one is drawn. A step
+// that is not ready in time is shown late rather than waited for, so
+// playback never stalls the render loop.
+class TimeSeries {
+public:
+  static TimeSeries * New();
+  ~TimeSeries();
+  // Takes a printf style pattern with one integer, e.g. "heart%03d.oct",
+  // and the number of steps from _first on. Names ending in .oct are read
+  // as octree files, anything else as raw data with _bits per voxel and
+  // _dim voxels per side. The first step is loaded right away, the rest in
+  // the background. Returns false if the first step could not be loaded.
+  bool Init(std::string _pattern,
+            unsigned int _first,
+            unsigned int _nrSteps,
+            int _bits,
+            int _dim);
+  // Number of steps loaded ahead of the current one, defaults to 4
+  void SetPrefetchDepth(unsigned int _depth);
+  // Host memory for prefetched steps, defaults to 1024 MB. At least one
+  // step is always prefetched.
+  void SetMemoryCap(unsigned long long _megabytes);
+  // Playback rate, defaults to 10
+  void SetStepsPerSecond(double _stepsPerSecond);
+  // Bytes streamed to the GPU per Update(), defaults to 16 MB
+  void SetUploadBudget(unsigned long long _bytes);
+  void SetPlaying(bool _playing);
+  bool Playing() { return playing_; }
+  // Shows the next step as soon as it is on the GPU, also while paused
+  void RequestNextStep();
+  // True while playing or until a requested step is shown, Update() has
+  // to be called every frame until then
+  bool Active() { return playing_ || stepRequested_; }
+  // Call once per frame on the GL thread. Continues the upload of the next
+  // step and swaps it in when it is due. Returns true if Current() changed.
+  bool Update();
+  // Blocks until the next step is shown, for batch rendering
+  void WaitForNextStep();
+  VolumeTexture * Current() { return slots_[front_]; }
+  unsigned int CurrentStep() { return first_ + currentStep_; }
+  unsigned int NrSteps() { return nrSteps_; }
+
+private:
+  // One texture is drawn from while the other one is uploaded to
+  static const unsigned int NR_SLOTS = 2;
+
+  TimeSeries();
+  TimeSeries(const TimeSeries&) {}
+  std::string FileName(unsigned int _step);
+  // Loads the steps after the current one until the window or the memory
+  // cap is full
+  void LoaderLoop();
+  // True once the GPU has finished the draws from a slot
+  bool SlotIdle(unsigned int _slot);
+
+  std::string pattern_;
+  unsigned int first_;
+  unsigned int nrSteps_;
+  int bits_;
+  int dim_;
+  unsigned int prefetchDepth_;
+  unsigned long long memoryCap_;
+  double stepsPerSecond_;
+  unsigned long long uploadBudget_;
+  bool playing_;
+  bool stepRequested_;
+  Timer stepTimer_;
+
+  VolumeTexture *slots_[NR_SLOTS];
+  // Fence after the last draw from a slot, NULL once passed
+  void *fences_[NR_SLOTS];
+  unsigned int front_;
+  // Step being uploaded to the back slot, NULL once it is there
+  VolumeTexture::HostTree *upload_;
+  bool backReady_;
+
+  std::thread loader_;
+  // Protects the state below, shared with the loader thread
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  // Indices from 0 of the steps in the front and back slot, -1 while the
+  // back slot holds nothing newer
+  unsigned int currentStep_;
+  int backStep_;
+  // Prefetched steps by index, NULL if the step failed to load
+  std::map<unsigned int, VolumeTexture::HostTree*> loaded_;
+  // Host memory of the prefetched steps and of the one being uploaded
+  unsigned long long loadedBytes_;
+  unsigned long long lastStepBytes_;
+  bool quit_;
+};
+
+#endif
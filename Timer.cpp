@@ -0,0 +1,13 @@
+#include "Timer.h"
+
+Timer::Timer()
+  : start_(std::chrono::high_resolution_clock::now()) {}
+
+void Timer::Restart() {
+  start_ = std::chrono::high_resolution_clock::now();
+}
+
+double Timer::Seconds() {
+  return std::chrono::duration<double>(
+    std::chrono::high_resolution_clock::now() - start_).count();
+}
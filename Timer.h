@@ -0,0 +1,19 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <chrono>
+
+// Wall clock stopwatch, starts running when created
+class Timer {
+public:
+  Timer();
+  void Restart();
+  // Time since creation or the last Restart()
+  double Seconds();
+  double Milliseconds() { return Seconds()*1000.0; }
+
+private:
+  std::chrono::high_resolution_clock::time_point start_;
+};
+
+#endif
@@ -0,0 +1,113 @@
+#include "TransferFunction.h"
+#include "Manager.h"
+#include <gl\glew.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+TransferFunction * TransferFunction::New() {
+  return new TransferFunction();
+}
+
+TransferFunction::TransferFunction()
+  : handle_(0),
+    opacityHandle_(0),
+    width_(0),
+    height_(0) {}
+
+TransferFunction::~TransferFunction() {
+  if (handle_ != 0) {
+    glDeleteTextures(1, &handle_);
+    glDeleteTextures(1, &opacityHandle_);
+  }
+}
+
+bool TransferFunction::ReadFromFile(std::string _fileName) {
+  std::ifstream in(_fileName.c_str());
+  if (!in.is_open()) {
+    std::cout << _fileName << " could not be opened." << std::endl;
+    return false;
+  }
+
+  unsigned int width = 0;
+  unsigned int height = 0;
+  std::vector<float> table;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream values(line);
+    if (width == 0) {
+      if (!(values >> width) || width == 0) {
+        break;
+      }
+      if (!(values >> height) || height == 0) {
+        height = 1;
+      }
+      continue;
+    }
+    float rgba[4];
+    if (values >> rgba[0] >> rgba[1] >> rgba[2] >> rgba[3]) {
+      table.insert(table.end(), rgba, rgba+4);
+    }
+  }
+  if (width == 0 || table.size() < 4*width*height) {
+    std::cout << "Error: " << _fileName << " needs a size and "
+      << width*height << " entries\n";
+    return false;
+  }
+  table.resize(4*width*height);
+  for (unsigned int i=0; i<table.size(); i++) {
+    table[i] = std::min(std::max(table[i], 0.f), 1.f);
+  }
+
+  width_ = width;
+  height_ = height;
+  table_.swap(table);
+  Upload();
+  std::cout << "Read " << width_ << "x" << height_
+    << " transfer function from " << _fileName << "\n";
+  return true;
+}
+
+void TransferFunction::Upload() {
+  // Largest opacity over entries x to y, for any gradient magnitude. Linear
+  // filtering never leaves the range spanned by the two entries.
+  std::vector<float> columnMax(width_, 0.f);
+  for (unsigned int y=0; y<height_; y++) {
+    for (unsigned int x=0; x<width_; x++) {
+      columnMax[x] = std::max(columnMax[x], table_[4*(y*width_ + x) + 3]);
+    }
+  }
+  std::vector<float> opacity(width_*width_, 0.f);
+  for (unsigned int y=0; y<width_; y++) {
+    float running = 0.f;
+    for (unsigned int x=y; x<width_; x++) {
+      running = std::max(running, columnMax[x]);
+      opacity[y*width_ + x] = running;
+    }
+  }
+
+  if (handle_ == 0) {
+    glGenTextures(1, &handle_);
+    glGenTextures(1, &opacityHandle_);
+  }
+  glBindTexture(GL_TEXTURE_2D, handle_);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width_, height_, 0,
+               GL_RGBA, GL_FLOAT, &table_[0]);
+
+  // Only ever fetched from, row y holds the ranges starting at entry y
+  glBindTexture(GL_TEXTURE_2D, opacityHandle_);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width_, width_, 0,
+               GL_RED, GL_FLOAT, &opacity[0]);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  Manager::CheckGLErrors("TransferFunction::Upload()");
+}
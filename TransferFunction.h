@@ -0,0 +1,41 @@
+#ifndef TRANSFERFUNCTION_H
+#define TRANSFERFUNCTION_H
+
+#include <vector>
+#include <string>
+
+// Maps values, and optionally gradient magnitudes, to color and opacity.
+// The table is a 2D texture with value along x and gradient magnitude
+// along y, a 1D function is a single row. Opacities are for a segment of
+// stepSize and get corrected for other lengths in the shaders. A second
+// texture holds the largest opacity over every range of values, so that
+// the octree can skip nodes the function makes invisible.
+class TransferFunction {
+public:
+  static TransferFunction * New();
+  ~TransferFunction();
+  // Reads a table from a text file and uploads it. The first line holds
+  // the width and, for a 2D function, the height. Then follow width*height
+  // lines of r g b a in [0, 1], value fastest. Lines starting with # are
+  // skipped. Returns false if the file is missing or too short.
+  bool ReadFromFile(std::string _fileName);
+  // RGBA table, linearly filtered
+  unsigned int Handle() { return handle_; }
+  // Width x width table of the largest opacity over entries x to y
+  unsigned int OpacityHandle() { return opacityHandle_; }
+  unsigned int Width() { return width_; }
+  unsigned int Height() { return height_; }
+
+private:
+  TransferFunction();
+  TransferFunction(const TransferFunction&) {}
+  void Upload();
+
+  unsigned int handle_;
+  unsigned int opacityHandle_;
+  unsigned int width_;
+  unsigned int height_;
+  std::vector<float> table_;
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include "UniformBuffer.h"
+#include "ShaderProgram.h"
+#include <gl\glew.h>
+#include <iostream>
+#include <cstring>
+
+UniformBuffer * UniformBuffer::New(unsigned int _bindingPoint) {
+  return new UniformBuffer(_bindingPoint);
+}
+
+UniformBuffer::UniformBuffer(unsigned int _bindingPoint)
+  : handle_(0),
+    bindingPoint_(_bindingPoint),
+    dirty_(false) {}
+
+UniformBuffer::~UniformBuffer() {
+  if (handle_ != 0) {
+    glDeleteBuffers(1, &handle_);
+  }
+}
+
+bool UniformBuffer::Init(ShaderProgram *_program, std::string _block) {
+  unsigned int program = _program->Handle();
+  unsigned int index = glGetUniformBlockIndex(program, _block.c_str());
+  if (index == GL_INVALID_INDEX) {
+    std::cout << "Error: No uniform block " << _block << " in program\n";
+    return false;
+  }
+  int size, nrMembers;
+  glGetActiveUniformBlockiv(program, index, GL_UNIFORM_BLOCK_DATA_SIZE, &size);
+  glGetActiveUniformBlockiv(program, index,
+                            GL_UNIFORM_BLOCK_ACTIVE_UNIFORMS, &nrMembers);
+  offsets_.clear();
+  if (nrMembers > 0) {
+    std::vector<int> indices(nrMembers);
+    glGetActiveUniformBlockiv(program, index,
+                              GL_UNIFORM_BLOCK_ACTIVE_UNIFORM_INDICES,
+                              &indices[0]);
+    std::vector<unsigned int> members(indices.begin(), indices.end());
+    std::vector<int> offsets(nrMembers);
+    glGetActiveUniformsiv(program, nrMembers, &members[0],
+                          GL_UNIFORM_OFFSET, &offsets[0]);
+    char name[256];
+    for (int i=0; i<nrMembers; i++) {
+      glGetActiveUniformName(program, members[i], sizeof(name), NULL, name);
+      offsets_[name] = offsets[i];
+    }
+  }
+
+  data_.assign(size, 0);
+  if (handle_ == 0) {
+    glGenBuffers(1, &handle_);
+  }
+  glBindBuffer(GL_UNIFORM_BUFFER, handle_);
+  glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  glBindBufferBase(GL_UNIFORM_BUFFER, bindingPoint_, handle_);
+  _program->BindUniformBlock(_block, bindingPoint_);
+  dirty_ = true;
+  return true;
+}
+
+bool UniformBuffer::SetFloat(std::string _name, float _value) {
+  return Set(_name, &_value, sizeof(float));
+}
+
+bool UniformBuffer::SetMatrix4(std::string _name, const float *_matrix) {
+  // Column major mat4 in std140 is four tightly packed vec4 columns
+  return Set(_name, _matrix, 16*sizeof(float));
+}
+
+bool UniformBuffer::Set(std::string _name,
+                        const void *_data,
+                        unsigned int _size) {
+  std::map<std::string, unsigned int>::iterator it = offsets_.find(_name);
+  if (it == offsets_.end() || it->second + _size > data_.size()) {
+    return false;
+  }
+  unsigned char *dst = &data_[it->second];
+  if (memcmp(dst, _data, _size) != 0) {
+    memcpy(dst, _data, _size);
+    dirty_ = true;
+  }
+  return true;
+}
+
+void UniformBuffer::Update() {
+  if (!dirty_ || data_.empty()) {
+    return;
+  }
+  glBindBuffer(GL_UNIFORM_BUFFER, handle_);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, data_.size(), &data_[0]);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  dirty_ = false;
+}
@@ -0,0 +1,42 @@
+#ifndef UNIFORMBUFFER_H
+#define UNIFORMBUFFER_H
+
+#include <vector>
+#include <string>
+#include <map>
+
+class ShaderProgram;
+
+// CPU copy of a std140 uniform block backed by a uniform buffer object.
+// Member offsets are resolved once from a linked program. Setters only
+// mark the buffer dirty when a value actually changes, and Update()
+// uploads it in one call, so unchanged frames cost no GL calls at all.
+class UniformBuffer {
+public:
+  static UniformBuffer * New(unsigned int _bindingPoint);
+  ~UniformBuffer();
+  // Sizes the buffer after a block in the program and binds it to the
+  // binding point. Other programs declaring the same block can share it
+  // through ShaderProgram::BindUniformBlock.
+  bool Init(ShaderProgram *_program, std::string _block);
+  // Return false if the block has no active member with that name
+  bool SetFloat(std::string _name, float _value);
+  bool SetMatrix4(std::string _name, const float *_matrix);
+  // Uploads the block if anything changed since the last call
+  void Update();
+  unsigned int BindingPoint() const { return bindingPoint_; }
+
+private:
+  UniformBuffer(unsigned int _bindingPoint);
+  UniformBuffer(const UniformBuffer&) {}
+
+  bool Set(std::string _name, const void *_data, unsigned int _size);
+
+  unsigned int handle_;
+  unsigned int bindingPoint_;
+  std::vector<unsigned char> data_;
+  std::map<std::string, unsigned int> offsets_;
+  bool dirty_;
+};
+
+#endif
@@ -0,0 +1,286 @@
+#include "VolumeLoader.h"
+#include "OctreeFile.h"
+#include "OctreeBuilder.h"
+#include "Manager.h"
+#include "ThreadPool.h"
+#include <gl\glew.h>
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+
+VolumeLoader * VolumeLoader::New() {
+  return new VolumeLoader();
+}
+
+VolumeLoader::VolumeLoader()
+  : coarse_(NULL),
+    coarseLevels_(0),
+    texture_(NULL),
+    file_(NULL),
+    treeReady_(false),
+    nodesLoaded_(0),
+    nrNodes_(0),
+    buildPermille_(0),
+    failed_(false),
+    done_(false) {}
+
+VolumeLoader::~VolumeLoader() {
+  if (worker_.joinable()) {
+    worker_.join();
+  }
+  // Kept until here since it may still be the texture being drawn
+  if (coarse_ != texture_) {
+    delete coarse_;
+  }
+  delete file_;
+}
+
+void VolumeLoader::Start(std::string _octreeFileName,
+                         std::string _rawFileName,
+                         int _bits,
+                         int _dim) {
+  worker_ = std::thread(&VolumeLoader::Load, this,
+                        _octreeFileName, _rawFileName, _bits, _dim);
+}
+
+void VolumeLoader::Load(std::string _octreeFileName,
+                        std::string _rawFileName,
+                        int _bits,
+                        int _dim) {
+  OctreeFile *file = OctreeFile::New();
+  if (!_octreeFileName.empty() && file->Open(_octreeFileName)) {
+    std::cout << "Loading octree file " << _octreeFileName
+      << " in the background\n";
+    nrNodes_ = file->Header().nrNodes;
+    bool mapped = !file->Compressed() &&
+                  file->HasChannel(OctreeFile::RANGE) &&
+                  file->HasChannel(OctreeFile::DEVIATION);
+    bool packed = file->Header().nodeLayout == OctreeFile::PACKED_32;
+    if (mapped) {
+      file_ = file;
+      // The ranges are quantized here rather than in the uploads
+      tree_.packedRanges.resize(packed ? nrNodes_ : 0);
+    } else {
+      VolumeTexture::InitHostTree(file, tree_);
+    }
+    treeReady_ = true;
+
+    // Level order, the first chunks hold the coarse levels. Touching a
+    // word per page is enough to have the disk reads happen here rather
+    // than in the uploads. Files without gradients have no array for them.
+    const char *arrays[4] = { NULL, NULL, NULL, NULL };
+    if (mapped) {
+      arrays[0] = static_cast<const char*>(file->NodeData());
+      arrays[1] =
+        static_cast<const char*>(file->ChannelData(OctreeFile::RANGE));
+      arrays[2] =
+        static_cast<const char*>(file->ChannelData(OctreeFile::DEVIATION));
+      arrays[3] =
+        static_cast<const char*>(file->ChannelData(OctreeFile::GRADIENT));
+    }
+    unsigned long long nodeBytes[4] = {
+      file->NodeDataSize()/nrNodes_,
+      OctreeFile::ChannelSize(OctreeFile::RANGE),
+      OctreeFile::ChannelSize(OctreeFile::DEVIATION),
+      OctreeFile::ChannelSize(OctreeFile::GRADIENT)
+    };
+    // Compressed chunks span enough blocks to keep the ThreadPool busy
+    unsigned long long chunk = CHUNK_NODES;
+    if (file->Compressed()) {
+      chunk = std::max(chunk, (unsigned long long)file->Header().blockNodes*
+                              ThreadPool::Instance().NrThreads()*2);
+    }
+    unsigned long long page = PAGE_SIZE;
+    volatile char sink = 0;
+    for (unsigned long long first=0; first<nrNodes_; first+=chunk) {
+      unsigned long long count = std::min(chunk, nrNodes_ - first);
+      if (mapped) {
+        for (unsigned int i=0; i<4 && arrays[i] != NULL; i++) {
+          unsigned long long end = (first+count)*nodeBytes[i];
+          for (unsigned long long b=first*nodeBytes[i]; b<end; b+=page) {
+            sink = sink + arrays[i][b];
+          }
+        }
+        if (packed) {
+          OctreeBuilder::PackRanges(
+            reinterpret_cast<const float*>(arrays[1]) +
+              first*OctreeBuilder::RANGE_SIZE,
+            count,
+            &tree_.packedRanges[first]);
+        }
+      } else if (!VolumeTexture::CopyHostNodes(file, first, count,
+                                                tree_, first)) {
+        failed_ = true;
+        break;
+      }
+      nodesLoaded_ = first + count;
+    }
+    if (!mapped) {
+      delete file;
+    }
+    return;
+  }
+  delete file;
+
+  std::cout << "Building " << _rawFileName << " in the background\n";
+  std::atomic<unsigned int> *permille = &buildPermille_;
+  bool loaded = VolumeTexture::LoadHostTree(_rawFileName, _bits, _dim, tree_,
+    [=](float _fraction) {
+      *permille = static_cast<unsigned int>(_fraction*1000.f);
+    });
+  if (!loaded) {
+    failed_ = true;
+    return;
+  }
+  nrNodes_ = tree_.ranges.size()/OctreeBuilder::RANGE_SIZE;
+  treeReady_ = true;
+  nodesLoaded_ = nrNodes_;
+}
+
+void VolumeLoader::BeginUpload(VolumeTexture *_texture,
+                               unsigned long long _nrNodes) {
+  if (file_ != NULL) {
+    const OctreeFileHeader &header = file_->Header();
+    _texture->BeginUpload(
+      file_->NodeData(),
+      tree_.packedRanges.empty() ? file_->ChannelData(OctreeFile::RANGE)
+                                 : tree_.packedRanges.data(),
+      static_cast<const float*>(file_->ChannelData(OctreeFile::DEVIATION)),
+      static_cast<const unsigned int*>(
+        file_->ChannelData(OctreeFile::GRADIENT)),
+      _nrNodes,
+      _nrNodes*(file_->NodeDataSize()/nrNodes_),
+      header.maxDepth,
+      header.nodeLayout);
+  } else {
+    _texture->BeginUpload(tree_.nodes.data(),
+                          tree_.packedRanges.empty()
+                            ? (const void*)tree_.ranges.data()
+                            : tree_.packedRanges.data(),
+                          tree_.deviations.data(),
+                          tree_.gradients.empty() ? NULL
+                                                  : tree_.gradients.data(),
+                          _nrNodes,
+                          _nrNodes*(tree_.nodes.size()/nrNodes_)*
+                            sizeof(unsigned int),
+                          tree_.maxDepth,
+                          tree_.nodeLayout);
+  }
+}
+
+void VolumeLoader::Update(unsigned long long _budget) {
+  if (done_ || !treeReady_) {
+    return;
+  }
+  unsigned int maxDepth = file_ != NULL ? file_->Header().maxDepth
+                                        : tree_.maxDepth;
+  unsigned long long nodeBytes = file_ != NULL ? file_->NodeDataSize()
+    : tree_.nodes.size()*sizeof(unsigned int);
+  if (coarse_ == NULL) {
+    // Both layouts are read as 32-bit words, the shader decodes them
+    int maxSize;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxSize);
+    if (nodeBytes/sizeof(unsigned int) > (unsigned long long)maxSize) {
+      std::cout << "Data is too big for texture buffer\n";
+      failed_ = true;
+      worker_.join();
+      return;
+    }
+    // The levels that fit in one upload go to a small texture first, so
+    // that the first image does not wait for the storage of the whole tree
+    unsigned long long bytesPerNode = nodeBytes/nrNodes_ +
+      OctreeFile::ChannelSize(OctreeFile::RANGE) +
+      OctreeFile::ChannelSize(OctreeFile::DEVIATION) +
+      OctreeFile::ChannelSize(OctreeFile::GRADIENT);
+    coarseLevels_ = 1;
+    while (coarseLevels_ <= maxDepth &&
+           OctreeBuilder::LevelStart(coarseLevels_+1)*bytesPerNode <=
+           _budget) {
+      coarseLevels_++;
+    }
+    coarse_ = VolumeTexture::New();
+    BeginUpload(coarse_, OctreeBuilder::LevelStart(coarseLevels_));
+  }
+
+  if (coarse_->UploadedLevels() < (int)coarseLevels_) {
+    coarse_->ContinueUpload(_budget, nodesLoaded_);
+  } else if (coarseLevels_ > maxDepth) {
+    // The coarse texture already is the whole tree
+    texture_ = coarse_;
+  } else {
+    if (texture_ == NULL) {
+      texture_ = VolumeTexture::New();
+      BeginUpload(texture_, nrNodes_);
+    }
+    texture_->ContinueUpload(_budget, nodesLoaded_);
+  }
+
+  if (texture_ != NULL &&
+      texture_->UploadedLevels() == (int)maxDepth+1) {
+    done_ = true;
+    worker_.join();
+    // The GPU has its copy now
+    delete file_;
+    file_ = NULL;
+    std::vector<unsigned int>().swap(tree_.nodes);
+    std::vector<float>().swap(tree_.ranges);
+    std::vector<unsigned int>().swap(tree_.packedRanges);
+    std::vector<float>().swap(tree_.deviations);
+    std::vector<unsigned int>().swap(tree_.gradients);
+    Manager::CheckGLErrors("VolumeLoader::Update()");
+    std::cout << "Finished loading volume\n";
+  }
+}
+
+VolumeTexture * VolumeLoader::Texture() {
+  if (done_ || (texture_ != NULL &&
+                texture_->UploadedLevels() > (int)coarseLevels_)) {
+    return texture_;
+  }
+  if (coarse_ != NULL && coarse_->UploadedLevels() == (int)coarseLevels_) {
+    return coarse_;
+  }
+  return NULL;
+}
+
+bool VolumeLoader::Finish() {
+  while (!done_ && !failed_) {
+    Update(~0ULL);
+    if (!done_) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  return !failed_;
+}
+
+float VolumeLoader::Progress() {
+  if (done_) {
+    return 1.f;
+  }
+  // Reading or building counts for half, uploading for the other half
+  float loaded = buildPermille_/1000.f;
+  if (treeReady_ && nrNodes_ > 0) {
+    loaded = (float)nodesLoaded_/nrNodes_;
+  }
+  // The full texture uploads the coarse levels again, both uploads count
+  // so that the fraction never goes back when it starts
+  float uploaded = 0.f;
+  if (coarse_ != NULL) {
+    unsigned long long coarseNodes = OctreeBuilder::LevelStart(coarseLevels_);
+    unsigned long long total = nrNodes_;
+    unsigned long long done = coarse_->UploadedNodes();
+    if (coarseNodes < nrNodes_) {
+      total += coarseNodes;
+    }
+    if (texture_ != NULL && texture_ != coarse_) {
+      done += texture_->UploadedNodes();
+    }
+    uploaded = (float)done/total;
+  }
+  return 0.5f*(loaded + uploaded);
+}
+
+int VolumeLoader::LevelsReady() {
+  VolumeTexture *texture = Texture();
+  return texture != NULL ? texture->UploadedLevels() : 0;
+}
@@ -0,0 +1,82 @@
+#ifndef VOLUMELOADER_H
+#define VOLUMELOADER_H
+
+#include "VolumeTexture.h"
+#include "OctreeFile.h"
+#include <string>
+#include <thread>
+#include <atomic>
+
+// Loads a volume on a worker thread so that the window keeps drawing
+// during startup. The worker pages in a memory mapped octree file a chunk
+// of nodes at a time, or expands the blocks of a compressed one, and the
+// nodes it is done with go to the GPU in bounded uploads from the render
+// thread. Nodes are stored level by level, so the coarse levels can be
+// drawn long before the finest one has arrived. The levels that fit in a
+// single upload get a small texture of their own, drawn while the storage
+// for the whole tree is allocated and filled. Raw files are built in the
+// background and uploaded the same way once the tree exists.
+class VolumeLoader {
+public:
+  static VolumeLoader * New();
+  ~VolumeLoader();
+  // Starts loading an octree file, or building a tree from the raw file
+  // with _bits per voxel and _dim voxels per side if there is no octree
+  // file or it fails to open
+  void Start(std::string _octreeFileName,
+             std::string _rawFileName,
+             int _bits,
+             int _dim);
+  // Call once per frame on the GL thread. Uploads up to _budget bytes of
+  // the nodes the worker has finished.
+  void Update(unsigned long long _budget);
+  // Blocks until the whole tree is on the GPU. Returns false on failure.
+  bool Finish();
+  // Fraction of the read, build and upload that is done
+  float Progress();
+  // Complete levels on the GPU, 0 until the root has arrived
+  int LevelsReady();
+  bool Done() { return done_; }
+  bool Failed() { return failed_; }
+  // Texture holding the levels that are ready, NULL before the root has
+  // arrived. It changes while loading, the last one is owned by the caller.
+  VolumeTexture * Texture();
+
+private:
+  // Nodes paged in from an octree file between progress updates
+  static const unsigned long long CHUNK_NODES = 1 << 18;
+  // Stride of the reads that page in a mapped file
+  static const unsigned long long PAGE_SIZE = 4096;
+
+  VolumeLoader();
+  VolumeLoader(const VolumeLoader&) {}
+  // Starts uploading the first _nrNodes nodes of the tree
+  void BeginUpload(VolumeTexture *_texture, unsigned long long _nrNodes);
+  // Runs on the worker thread
+  void Load(std::string _octreeFileName,
+            std::string _rawFileName,
+            int _bits,
+            int _dim);
+
+  // Levels that fit in one upload, and the whole tree
+  VolumeTexture *coarse_;
+  unsigned int coarseLevels_;
+  VolumeTexture *texture_;
+  // Mapped octree file with all channels, uploaded from directly
+  OctreeFile *file_;
+  // Copy of the tree for raw files, compressed octree files and octree
+  // files missing channels
+  VolumeTexture::HostTree tree_;
+  std::thread worker_;
+  // Set by the worker once file_ or tree_ and nrNodes_ are set
+  std::atomic<bool> treeReady_;
+  // Nodes the worker has paged in or built, published after their data
+  std::atomic<unsigned long long> nodesLoaded_;
+  unsigned long long nrNodes_;
+  // Read and build progress of raw files in thousandths
+  std::atomic<unsigned int> buildPermille_;
+  std::atomic<bool> failed_;
+  bool done_;
+};
+
+#endif
@@ -1,56 +1,321 @@
 #include "Manager.h"
 #include "ShaderProgram.h"
-#include "Texture2D.h"
 #include "VolumeTexture.h"
+#include "ThreadPool.h"
+#include "TimeSeries.h"
+#include "VolumeLoader.h"
+#include "RenderCluster.h"
+#include <string>
+#include <vector>
+#include <iostream>
+#include <cstdlib>
 
-int main(int _argc, char * _argv) {
+// GPU memory for streamed bricks when the atlas does not fit
+static const unsigned long long DEFAULT_BRICK_MEGABYTES = 512;
+
+int main(int _argc, char **_argv) {
   unsigned int width = 600;
   unsigned int height = 600;
 
+  // Our own arguments, anything else is left to GLUT
+  std::string octreeFileName;
+  bool useBricks = false;
+  unsigned long long brickMegabytes = 0;
+  std::string poseFileName;
+  std::string outputPrefix = "frame";
+  std::string profileFileName;
+  bool refine = false;
+  double targetMs = 0.0;
+  Manager::Traversal traversal = Manager::ROPE_TRAVERSAL;
+  std::string transferFunctionFileName = "transfer.txt";
+  bool bruteForce = false;
+  std::string seriesPattern;
+  unsigned int seriesFirst = 0;
+  unsigned int seriesSteps = 0;
+  int seriesBits = 8;
+  int seriesDim = 256;
+  unsigned int prefetchDepth = 4;
+  unsigned long long cacheMegabytes = 1024;
+  double stepsPerSecond = 10.0;
+  unsigned long long uploadMegabytes = 16;
+  unsigned int nrWorkers = 0;
+  Compositor::Method compositeMethod = Compositor::BINARY_SWAP;
+  bool listen = false;
+  unsigned short listenPort = 0;
+  std::string masterAddress;
+  // Passed on to the workers a master starts
+  std::vector<std::string> workerArguments;
+  for (int i=1; i<_argc; i++) {
+    int first = i;
+    std::string arg(_argv[i]);
+    // Force single threaded octree construction for reproducibility checks
+    if (arg == "-singlethread") {
+      ThreadPool::Instance().SetNrThreads(1);
+    }
+    // Prebuilt octree file from OctreeConverter, skips the rebuild
+    if (arg == "-octree" && i+1 < _argc) {
+      octreeFileName = _argv[++i];
+    }
+    // Brick tree with a filtered 3D atlas instead of single voxel leaves
+    if (arg == "-bricks") {
+      useBricks = true;
+    }
+    // GPU memory for bricks streamed in as rays need them, for volumes
+    // whose bricks do not all fit
+    if (arg == "-brickmb" && i+1 < _argc) {
+      useBricks = true;
+      brickMegabytes = atoi(_argv[++i]);
+    }
+    // Render the camera poses in a file offscreen and exit
+    if (arg == "-batch" && i+1 < _argc) {
+      poseFileName = _argv[++i];
+    }
+    if (arg == "-output" && i+1 < _argc) {
+      outputPrefix = _argv[++i];
+    }
+    // Batch images refined until converged, like an idle window
+    if (arg == "-refine") {
+      refine = true;
+    }
+    // Frame time to aim for while dragging, in milliseconds
+    if (arg == "-targetms" && i+1 < _argc) {
+      targetMs = atof(_argv[++i]);
+    }
+    // Octree traversal, restart or ropes
+    if (arg == "-traversal" && i+1 < _argc) {
+      if (!Manager::ParseTraversal(_argv[++i], traversal)) {
+        std::cout << "Error: Unknown traversal " << _argv[i] << "\n";
+        return 1;
+      }
+    }
+    // Transfer function table, "none" integrates the raw values
+    if (arg == "-transfer" && i+1 < _argc) {
+      transferFunctionFileName = _argv[++i];
+      if (transferFunctionFileName == "none") {
+        transferFunctionFileName.clear();
+      }
+    }
+    // Sample every step of the finest level instead of the octree
+    if (arg == "-bruteforce") {
+      bruteForce = true;
+    }
+    // Time series from a numbered file pattern, first index and count
+    if (arg == "-series" && i+3 < _argc) {
+      seriesPattern = _argv[++i];
+      seriesFirst = atoi(_argv[++i]);
+      seriesSteps = atoi(_argv[++i]);
+    }
+    // Bits per voxel and dimensions of raw time series steps
+    if (arg == "-seriesraw" && i+2 < _argc) {
+      seriesBits = atoi(_argv[++i]);
+      seriesDim = atoi(_argv[++i]);
+    }
+    // Steps loaded ahead and the host memory they may take
+    if (arg == "-prefetch" && i+1 < _argc) {
+      prefetchDepth = atoi(_argv[++i]);
+    }
+    if (arg == "-cachemb" && i+1 < _argc) {
+      cacheMegabytes = atoi(_argv[++i]);
+    }
+    if (arg == "-stepfps" && i+1 < _argc) {
+      stepsPerSecond = atof(_argv[++i]);
+    }
+    // Upload per frame, larger steps are spread over several frames
+    if (arg == "-uploadmb" && i+1 < _argc) {
+      uploadMegabytes = atoi(_argv[++i]);
+    }
+    // Per pass timings of the batch as JSON
+    if (arg == "-profile" && i+1 < _argc) {
+      profileFileName = _argv[++i];
+    }
+    // Render with worker processes that each hold one subtree of the
+    // octree, a power of 8 of them, and composite their images
+    if (arg == "-distribute" && i+1 < _argc) {
+      nrWorkers = atoi(_argv[++i]);
+    }
+    // Compositing of the workers' images, direct or swap
+    if (arg == "-composite" && i+1 < _argc) {
+      if (!Compositor::ParseMethod(_argv[++i], compositeMethod)) {
+        std::cout << "Error: Unknown compositing method " << _argv[i] << "\n";
+        return 1;
+      }
+    }
+    // Wait for workers started elsewhere instead of starting them
+    if (arg == "-listen" && i+1 < _argc) {
+      listen = true;
+      listenPort = static_cast<unsigned short>(atoi(_argv[++i]));
+    }
+    // Render one subtree for the master at <host>:<port>
+    if (arg == "-worker" && i+1 < _argc) {
+      masterAddress = _argv[++i];
+    }
+    bool masterOnly = arg == "-distribute" || arg == "-composite" ||
+      arg == "-listen" || arg == "-batch" || arg == "-output" ||
+      arg == "-profile" || arg == "-refine";
+    if (!masterOnly) {
+      workerArguments.insert(workerArguments.end(),
+                             _argv + first, _argv + i + 1);
+    }
+  }
+  bool batch = !poseFileName.empty();
+
+  // The master of a cluster holds no volume, it only collects the images
+  if (nrWorkers > 0) {
+    if (!batch || octreeFileName.empty() || bruteForce ||
+        !seriesPattern.empty()) {
+      std::cout << "Error: -distribute needs -batch and -octree, and works "
+        "without -bruteforce and -series\n";
+      return 1;
+    }
+    RenderCluster *cluster = RenderCluster::Launch(nrWorkers,
+                                                   compositeMethod,
+                                                   width,
+                                                   height,
+                                                   listenPort,
+                                                   listen ? "" : _argv[0],
+                                                   workerArguments);
+    if (cluster == NULL) {
+      return 1;
+    }
+    bool rendered = cluster->RenderBatch(poseFileName, outputPrefix, refine);
+    delete cluster;
+    return rendered ? 0 : 1;
+  }
+  RenderCluster *cluster = NULL;
+  if (!masterAddress.empty()) {
+    if (octreeFileName.empty()) {
+      std::cout << "Error: Workers need -octree\n";
+      return 1;
+    }
+    cluster = RenderCluster::Join(masterAddress);
+    if (cluster == NULL) {
+      return 1;
+    }
+    width = cluster->Width();
+    height = cluster->Height();
+    batch = true;
+  }
+
   // Initialize 
   Manager::Instance().SetWinDimensions(width, height);
-  Manager::Instance().InitWindow(_argc, &_argv);
+  if (batch) {
+    Manager::Instance().InitOffscreen(_argc, _argv);
+  } else {
+    Manager::Instance().InitWindow(_argc, _argv);
+  }
   Manager::Instance().InitCubePositionBuffer();
-  Manager::Instance().InitCallbacks();
+  if (!batch) {
+    Manager::Instance().InitCallbacks();
+  }
   Manager::Instance().InitMatrices();
 
-  // Create shader programs
-  ShaderProgram *cubeShaderProg = ShaderProgram::New();
-  cubeShaderProg->CreateShader(ShaderProgram::VERTEX, "cubeVert.glsl");
-  cubeShaderProg->CreateShader(ShaderProgram::FRAGMENT, "cubeFrag.glsl");
-  cubeShaderProg->CreateProgram();
+  // Create shader program
   ShaderProgram *volumeShaderProg = ShaderProgram::New();
-  volumeShaderProg->CreateShader(ShaderProgram::VERTEX, "octreeVert.glsl");
-  volumeShaderProg->CreateShader(ShaderProgram::FRAGMENT, "octreeFrag.glsl");
+  if (bruteForce) {
+    volumeShaderProg->CreateShader(ShaderProgram::VERTEX, "volumeVert.glsl");
+    volumeShaderProg->CreateShader(ShaderProgram::FRAGMENT, "volumeFrag.glsl");
+  } else {
+    volumeShaderProg->CreateShader(ShaderProgram::VERTEX, "octreeVert.glsl");
+    volumeShaderProg->CreateShader(ShaderProgram::FRAGMENT, "octreeFrag.glsl");
+  }
   volumeShaderProg->CreateProgram();
 
-  // Bind shader programs to manager
-  Manager::Instance().SetCubeShaderProgram(cubeShaderProg);
+  // Bind shader program to manager
   Manager::Instance().SetVolumeShaderProgram(volumeShaderProg);
-
-  // Create textures to render to
-  Texture2D *cubeFrontTex = Texture2D::New(width, height);
-  cubeFrontTex->Init();
-  Texture2D *cubeBackTex = Texture2D::New(width, height);
-  cubeBackTex->Init();
+  Manager::Instance().InitRenderState();
+  if (targetMs > 0.0) {
+    Manager::SetTargetFrameTime(targetMs);
+  }
+  Manager::SetTraversal(traversal);
 
   // Create 3D texture and populate it
-  VolumeTexture *volTex = VolumeTexture::New();
-  volTex->ReadFromFile("skull.raw", 8, 256);
-
-  // Bind the textures to the manager
-  // (The manager takes care of the FBO binding in the rendering loop)
-  Manager::Instance().SetCubeFrontTexture(cubeFrontTex);
-  Manager::Instance().SetCubeBackTexture(cubeBackTex);
-  Manager::Instance().SetVolumeTexture(volTex);
+  if (cluster != NULL) {
+    // Only the worker's own subtree is read
+    VolumeTexture::HostTree tree;
+    bool loaded = VolumeTexture::LoadHostSubtree(octreeFileName,
+                                                 cluster->RootLevel(),
+                                                 cluster->RootIndex(),
+                                                 tree);
+    if (!cluster->Ready(loaded) || !loaded) {
+      delete cluster;
+      return 1;
+    }
+    VolumeTexture *volTex = VolumeTexture::New();
+    volTex->BeginUpload(&tree);
+    volTex->ContinueUpload(tree.Bytes());
+    Manager::Instance().SetVolumeTexture(volTex);
+  } else if (!seriesPattern.empty()) {
+    TimeSeries *series = TimeSeries::New();
+    series->SetPrefetchDepth(prefetchDepth);
+    series->SetMemoryCap(cacheMegabytes);
+    series->SetStepsPerSecond(stepsPerSecond);
+    series->SetUploadBudget(uploadMegabytes*1024*1024);
+    if (!series->Init(seriesPattern,
+                      seriesFirst,
+                      seriesSteps,
+                      seriesBits,
+                      seriesDim)) {
+      return 1;
+    }
+    Manager::Instance().SetTimeSeries(series);
+  } else if (useBricks && octreeFileName.empty()) {
+    // The brick atlas is uploaded in one go, unless it is streamed
+    VolumeTexture *volTex = VolumeTexture::New();
+    bool loaded = volTex->ReadBricksFromFile("skull.raw", 8, 256,
+                                             brickMegabytes*1024*1024);
+    if (!loaded && brickMegabytes == 0) {
+      // Too many bricks for one atlas, stream them instead
+      loaded = volTex->ReadBricksFromFile("skull.raw", 8, 256,
+                                          DEFAULT_BRICK_MEGABYTES*1024*1024);
+    }
+    if (!loaded && !volTex->ReadFromFile("skull.raw", 8, 256)) {
+      std::cout << "Error: Could not load skull.raw\n";
+      return 1;
+    }
+    Manager::Instance().SetVolumeTexture(volTex);
+  } else {
+    // Read and build on a worker thread, the raw file is the fallback for
+    // a missing octree file. The window draws the levels as they arrive.
+    VolumeLoader *loader = VolumeLoader::New();
+    loader->Start(octreeFileName, "skull.raw", 8, 256);
+    if (batch) {
+      if (!loader->Finish()) {
+        return 1;
+      }
+      Manager::Instance().SetVolumeTexture(loader->Texture());
+      delete loader;
+    } else {
+      Manager::Instance().SetVolumeLoader(loader);
+    }
+  }
 
   // Read constants from file
   Manager::Instance().SetConfigFileName("constants.txt");
   Manager::Instance().ReadConfigFile();
+  Manager::Instance().SetTransferFunctionFileName(transferFunctionFileName);
+  Manager::Instance().ReadTransferFunction();
 
   // Now we have everything to fire up the buffers
   Manager::Instance().InitFramebuffer();
 
+  if (cluster != NULL) {
+    bool rendered = Manager::Instance().RenderForCluster(cluster);
+    delete cluster;
+    return rendered ? 0 : 1;
+  }
+  if (batch) {
+    if (!Manager::Instance().RenderBatch(poseFileName,
+                                         outputPrefix,
+                                         refine)) {
+      return 1;
+    }
+    if (!profileFileName.empty() &&
+        !Manager::WriteProfile(profileFileName)) {
+      return 1;
+    }
+    return 0;
+  }
+
   // Let's go!
   Manager::Instance().StartLoop();
 }
@@ -1,419 +1,507 @@
 #include "VolumeTexture.h"
+#include "OctreeBuilder.h"
+#include "OctreeFile.h"
+#include "BrickPool.h"
+#include "BrickCache.h"
 #include <gl/glew.h>
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <cmath>
+#include <cfloat>
+#include <cstring>
 #include <algorithm>
 #include "Manager.h"
 
-#define idx(x, y, z) (x + y*8 + z*8*8)
-#define uint32_t unsigned __int32
-#define uint16_t unsigned __int16
-
-// http://graphics.stanford.edu/~seander/bithacks.html
-uint32_t calcZOrder(uint16_t xPos, uint16_t yPos, uint16_t zPos)
-{
-    static const uint32_t MASKS[] =
-    {0x55555555, 0x33333333, 0x0F0F0F0F, 0x00FF00FF};
-    static const uint32_t SHIFTS[] = {1, 2, 4, 8};
-    uint32_t x = xPos; 
-    uint32_t y = yPos; 
-    uint32_t z = zPos;
-    x = (x | (x << 16)) & 0x030000FF;
-    x = (x | (x <<  8)) & 0x0300F00F;
-    x = (x | (x <<  4)) & 0x030C30C3;
-    x = (x | (x <<  2)) & 0x09249249;
-    y = (y | (y << 16)) & 0x030000FF;
-    y = (y | (y <<  8)) & 0x0300F00F;
-    y = (y | (y <<  4)) & 0x030C30C3;
-    y = (y | (y <<  2)) & 0x09249249;
-    z = (z | (z << 16)) & 0x030000FF;
-    z = (z | (z <<  8)) & 0x0300F00F;
-    z = (z | (z <<  4)) & 0x030C30C3;
-    z = (z | (z <<  2)) & 0x09249249;
-    const uint32_t result = x | (y << 1) | (z << 2);
-    return result;
-}
-
 VolumeTexture * VolumeTexture::New() {
   return new VolumeTexture();
 }
 
-void VolumeTexture::ReadFromFile(std::string _fileName, int _bits, int _dim) {
+VolumeTexture::~VolumeTexture() {
+  unsigned int handles[] = {
+    handle_, rangeHandle_, deviationHandle_, gradientHandle_, brickHandle_
+  };
+  for (unsigned int i=0; i<5; i++) {
+    if (handles[i] != 0) {
+      glDeleteTextures(1, &handles[i]);
+    }
+  }
+  for (unsigned int i=0; i<NR_STREAMS; i++) {
+    if (streamBuffers_[i] != 0) {
+      glDeleteBuffers(1, &streamBuffers_[i]);
+    }
+  }
+  delete brickCache_;
+}
 
-  _dim = 8;
-  
-  std::cout << "Checking errors..." << std::endl;
-  Manager::Instance().CheckGLErrors();
+unsigned int VolumeTexture::BrickHandle() {
+  if (brickCache_ != NULL) {
+    return brickCache_->AtlasHandle();
+  }
+  return brickHandle_;
+}
 
-  int bytes = _bits/8;
-  int nrVoxelsBaseLevel = _dim*_dim*_dim;
-  int nrLevels = log(_dim)/log(2) + 1;
-  int nrVoxels = ((pow(8, nrLevels) - 1) / 7);
+bool VolumeTexture::ReadFromFile(std::string _fileName, int _bits, int _dim) {
+  std::cout << "Creating octree texture from " << _fileName << "\n";
+  HostTree tree;
+  if (!LoadHostTree(_fileName, _bits, _dim, tree)) {
+    return false;
+  }
 
   int maxSize;
   glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxSize);
-  std::cout << "GL_MAX_TEXTURE_BUFFER_SIZE: " << maxSize << "\n";
-	if (nrVoxels*2 > maxSize) {
+  if (tree.nodes.size() > (unsigned long long)maxSize) {
     std::cout << "Data is too big for texture buffer\n";
-    exit(1);
+    return false;
   }
+  std::cout << "Base level dimensions: " << _dim << "\n"
+    << "Nr of levels in octree: " << tree.maxDepth+1 << "\n"
+    << "Nr of voxels in whole tree: " << tree.nodes.size() << "\n";
+
+  // The whole tree in one go, the host copy is gone once this returns
+  BeginUpload(&tree);
+  ContinueUpload(tree.Bytes());
+  Manager::Instance().CheckGLErrors("Bound texture buffer");
+  std::cout << "Finished creating volume buffer texture\n\n";
+  return true;
+}
 
-  // Tree levels start with 0 in the shader, so max depth is one less
-  maxDepth_ = nrLevels - 1;
-
-  std::cout << "Creating octree texture\n"
-    << "Base level dimensions: " << _dim << "\n" 
-    << "Nr of voxels in base level: " << nrVoxelsBaseLevel << "\n"
-    << "Nr of levels in octree: " << nrLevels << "\n"
-    << "Nr of voxels in whole tree: " << nrVoxels << "\n";
-
-  // Allocate a vector to hold the whole octree data before creating texture
-  std::vector<double> hostData;
-  hostData.resize(nrVoxels * 2);
-  std::cout << "hostData size: " << hostData.size() << "\n";
+bool VolumeTexture::ReadBricksFromFile(std::string _fileName,
+                                       int _bits,
+                                       int _dim,
+                                       unsigned long long _cacheBytes) {
+  std::cout << "Loading " << _fileName << " into bricks\n";
+  std::vector<char> buffer;
+  if (!OctreeBuilder::ReadRaw(_fileName, _bits/8, _dim, buffer)) {
+    return false;
+  }
+  std::vector<float> volume;
+  OctreeBuilder::ConvertRaw(buffer, _bits/8, volume);
+  std::vector<char>().swap(buffer);
+
+  // Streamed bricks only need to fit in host memory
+  int maxAtlasDim = 0;
+  if (_cacheBytes == 0) {
+    glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxAtlasDim);
+  }
+  BrickPool *pool = BrickPool::New();
+  if (!pool->Build(volume, _dim, maxAtlasDim)) {
+    delete pool;
+    return false;
+  }
+  if (pool->NrBricks() > OctreeBuilder::PACKED_BRICK_INDEX + 1) {
+    std::cout << "Error: " << pool->NrBricks()
+      << " bricks are more than packed nodes can index\n";
+    delete pool;
+    return false;
+  }
+  maxDepth_ = pool->MaxDepth();
+
+  std::vector<unsigned int> packed;
+  OctreeBuilder::PackNodes(pool->Nodes(), pool->Ranges(), packed);
+  nodeLayout_ = OctreeFile::PACKED_32;
+  handle_ = CreateTextureBuffer(&packed[0],
+                                packed.size()*sizeof(unsigned int),
+                                GL_R32UI);
+  std::vector<unsigned int> packedRanges(packed.size());
+  OctreeBuilder::PackRanges(&pool->Ranges()[0], packed.size(),
+                            &packedRanges[0]);
+  rangeHandle_ = CreateTextureBuffer(&packedRanges[0],
+                                     packedRanges.size()*sizeof(unsigned int),
+                                     GL_RG16);
+  deviationHandle_ =
+    CreateTextureBuffer(&pool->Deviations()[0],
+                        pool->Deviations().size()*sizeof(float),
+                        GL_R32F);
+  std::vector<unsigned int> packedGradients;
+  OctreeBuilder::PackGradients(pool->Gradients(), packedGradients);
+  gradientHandle_ =
+    CreateTextureBuffer(&packedGradients[0],
+                        packedGradients.size()*sizeof(unsigned int),
+                        GL_R32UI);
+  hasGradients_ = true;
+
+  if (_cacheBytes > 0) {
+    brickCache_ = BrickCache::New();
+    std::vector<float> bricks;
+    pool->ReleaseAtlas(bricks);
+    unsigned int nrBricks = pool->NrBricks();
+    delete pool;
+    if (!brickCache_->Init(bricks, nrBricks, _cacheBytes)) {
+      delete brickCache_;
+      brickCache_ = NULL;
+      return false;
+    }
+    std::cout << "Finished loading bricks\n\n";
+    return true;
+  }
 
-  // Read data from file. This will later be the base level data.
-  std::ifstream inFileStream;
-  char *buffer;
-  inFileStream.open(_fileName.c_str(), std::ios::in|std::ios::binary);
-  if (inFileStream.is_open()) {
-    inFileStream.seekg(0, std::ios::end);
-    std::cout << "File size: " << inFileStream.tellg() << std::endl;
-    inFileStream.seekg(0, std::ios::beg);
-    buffer = new char[bytes*nrVoxelsBaseLevel];
-    inFileStream.read(buffer, bytes*nrVoxelsBaseLevel);
-    inFileStream.close();
+  // Bricks are sampled with hardware trilinear filtering, the aprons keep
+  // the filter from reading the neighbouring slots
+  glGenTextures(1, &brickHandle_);
+  glBindTexture(GL_TEXTURE_3D, brickHandle_);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+  glTexImage3D(GL_TEXTURE_3D,
+               0,
+               GL_R16F,
+               pool->AtlasBricks(0)*BrickPool::PADDED_SIZE,
+               pool->AtlasBricks(1)*BrickPool::PADDED_SIZE,
+               pool->AtlasBricks(2)*BrickPool::PADDED_SIZE,
+               0,
+               GL_RED,
+               GL_FLOAT,
+               &pool->Atlas()[0]);
+  glBindTexture(GL_TEXTURE_3D, 0);
+  delete pool;
+
+  Manager::Instance().CheckGLErrors("Created brick atlas");
+  std::cout << "Finished loading bricks\n\n";
+  return true;
+}
 
+unsigned int VolumeTexture::CreateTextureBuffer(const void *_data,
+                                                unsigned long long _size,
+                                                unsigned int _format) {
+  // Create a buffer object for the data
+  unsigned int dataBuffer;
+  glGenBuffers(1, &dataBuffer);
+  glBindBuffer(GL_ARRAY_BUFFER, dataBuffer);
+  glBufferData(GL_ARRAY_BUFFER,
+               static_cast<GLsizeiptr>(_size),
+               _data,
+               GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  // Construct 1D texture array, no filtering to make things easier and clearer
+  unsigned int handle;
+  glGenTextures(1, &handle);
+  glBindTexture(GL_TEXTURE_BUFFER, handle);
+  glTexBuffer(GL_TEXTURE_BUFFER, _format, dataBuffer);
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+  return handle;
+}
 
-   
-    // The data is sorted geometrically, but we want it sorted to that the 
-    // octree nodes are laid out together. Therefore, we reshuffle the data
-    // and put it in its place in the octree structure.
+unsigned long long VolumeTexture::HostTree::Bytes() const {
+  return (nodes.size() + packedRanges.size() + gradients.size())*
+           sizeof(unsigned int) +
+         (ranges.size() + deviations.size())*sizeof(float);
+}
 
+bool VolumeTexture::IsOctreeFileName(std::string _fileName) {
+  std::string extension = ".oct";
+  return _fileName.size() >= extension.size() &&
+         _fileName.compare(_fileName.size() - extension.size(),
+                           extension.size(), extension) == 0;
+}
 
-    // Copy the base level data, starting from the position where the last
-    // level begins.
-    int currentLevel = maxDepth_;
-    int levelAbove = maxDepth_-1;
-    int currentLevelStart = ((int)(pow(8, (levelAbove)+1) - 1) / 7) * 2;
-    std::cout << "First iteration currentLevelStart: " << currentLevelStart << "\n";
+void VolumeTexture::InitHostTree(OctreeFile *_file, HostTree &_tree) {
+  const OctreeFileHeader &header = _file->Header();
+  _tree.maxDepth = header.maxDepth;
+  _tree.nodeLayout = header.nodeLayout;
+  _tree.nodes.resize(_file->NodeDataSize()/sizeof(unsigned int));
+  _tree.ranges.resize(header.nrNodes*OctreeBuilder::RANGE_SIZE);
+  _tree.packedRanges.resize(
+    header.nodeLayout == OctreeFile::PACKED_32 ? header.nrNodes : 0);
+  _tree.deviations.resize(header.nrNodes*OctreeBuilder::DEVIATION_SIZE);
+  _tree.gradients.resize(_file->HasChannel(OctreeFile::GRADIENT) ?
+                         header.nrNodes : 0);
+}
 
-    std::vector<double> controlData;
-    controlData.resize(nrVoxelsBaseLevel);
-    int index = 0;
-    for (int z=0; z<_dim; z++) {
-      for (int y=0; y<_dim; y++) {
-        for (int x=0; x<_dim; x++) {
-          controlData[index++] = (0.57*sqrt(pow((double)x/(double)(_dim-1), 2.0) + pow((double)y/(double)(_dim-1), 2.0) + pow((double)z/(double)(_dim-1), 2.0)));
-        }
-      }
-    }
+bool VolumeTexture::CopyHostNodes(OctreeFile *_file,
+                                  unsigned long long _first,
+                                  unsigned long long _count,
+                                  HostTree &_tree,
+                                  unsigned long long _destination) {
+  const OctreeFileHeader &header = _file->Header();
+  unsigned long long wordsPerNode = header.nodeSize/sizeof(unsigned int);
+  unsigned int *nodes = &_tree.nodes[_destination*wordsPerNode];
+  float *ranges = &_tree.ranges[_destination*OctreeBuilder::RANGE_SIZE];
+  float *deviations = &_tree.deviations[_destination];
+  bool hasRanges = _file->HasChannel(OctreeFile::RANGE);
+  bool hasDeviations = _file->HasChannel(OctreeFile::DEVIATION);
+  // Gradients have no fallback, trees without them leave them empty
+  bool hasGradients = !_tree.gradients.empty();
+  if (!_file->ReadNodes(_first, _count, nodes) ||
+      (hasRanges &&
+       !_file->ReadChannel(OctreeFile::RANGE, _first, _count, ranges)) ||
+      (hasDeviations &&
+       !_file->ReadChannel(OctreeFile::DEVIATION, _first, _count,
+                           deviations)) ||
+      (hasGradients &&
+       !_file->ReadChannel(OctreeFile::GRADIENT, _first, _count,
+                           &_tree.gradients[_destination]))) {
+    return false;
+  }
 
-    // Make an array with Morton (Z-order curve) numbers
-    std::vector<uint32_t> morton;
-    morton.resize(nrVoxelsBaseLevel);
-    uint16_t x, y, z;
-    for (z=0; z<(uint32_t)_dim; z++) {
-      for (y=0; y<(uint32_t)_dim; y++) {
-        for (x=0; x<(uint32_t)_dim; x++) {
-          morton.at(idx(x, y, z)) = calcZOrder(x, y, z);
-          if (morton.at(idx(x, y, z)) > (unsigned int)nrVoxelsBaseLevel) {
-            std::cout << "FETFEL";
-            exit(1);
-          }
-        }
-      }
+  // Older files have no ranges or deviations, make every node look
+  // visible and nothing homogeneous
+  for (unsigned long long i=0; i<_count; i++) {
+    if (!hasRanges) {
+      ranges[2*i] = 0.f;
+      ranges[2*i+1] = FLT_MAX;
     }
-    
-    // Use the morton array to sort the host data
-    for (int i=0; i<nrVoxelsBaseLevel; i++) {
-      hostData[currentLevelStart+morton[i]*2] = controlData[i];
-      hostData[currentLevelStart+morton[i]*2+1] = -1.f;
+    if (hasDeviations) {
+      continue;
+    } else if (hasRanges) {
+      deviations[i] = 0.5f*(ranges[2*i+1] - ranges[2*i]);
+    } else {
+      deviations[i] = FLT_MAX;
     }
+  }
+  if (!_tree.packedRanges.empty()) {
+    OctreeBuilder::PackRanges(ranges, _count,
+                              &_tree.packedRanges[_destination]);
+  }
+  return true;
+}
 
-    /*
-    
-    
-    int x = 0;
-    int y = 0;
-    int z = 0;
-    int value;
-    int index = currentLevelStart;
-    while (index < nrVoxels*2)
-    {
-      for (int j=0; j<8; j++)
-      {
-       for (int i=0; i<8; i++)
-       {
-          
-          // (0, 0, 0)
-          value = (int)(buffer[bytes*idx(x,y,z)]);
-          hostData.at(index++) = 0.57*sqrt(pow((double)x/(double)(_dim-1), 2.0) + pow((double)y/(double)(_dim-1), 2.0) + pow((double)z/(double)(_dim-1), 2.0));//(double)value/(double)_dim;
-          hostData.at(index++) = -1.f;
-  
-          x++; 
-          // (1, 0, 0)
-          value = (int)(buffer[bytes*idx(x,y,z)]);
-          hostData.at(index++) = 0.57*sqrt(pow((double)x/(double)(_dim-1), 2.0) + pow((double)y/(double)(_dim-1), 2.0) + pow((double)z/(double)(_dim-1), 2.0));//(double)value/(double)_dim;
-          hostData.at(index++) = -1.f;
-  
-          x--;
-          y++;
-          // (0, 1, 0)
-          value = (int)(buffer[bytes*idx(x,y,z)]);
-          hostData.at(index++) = 0.57*sqrt(pow((double)x/(double)(_dim-1), 2.0) + pow((double)y/(double)(_dim-1), 2.0) + pow((double)z/(double)(_dim-1), 2.0));//(double)value/(double)_dim;
-          hostData.at(index++) = -1.f;
-  
-          x++;
-          // (1, 1, 0)
-          value = (int)(buffer[bytes*idx(x,y,z)]);
-          hostData.at(index++) = 0.57*sqrt(pow((double)x/(double)(_dim-1), 2.0) + pow((double)y/(double)(_dim-1), 2.0) + pow((double)z/(double)(_dim-1), 2.0));//(double)value/(double)_dim;
-          hostData.at(index++) = -1.f;
-  
-          x--;
-          y--;
-          z++;
-          // (0, 0, 1)
-          value = (int)(buffer[bytes*idx(x,y,z)]);
-          hostData.at(index++) = 0.57*sqrt(pow((double)x/(double)(_dim-1), 2.0) + pow((double)y/(double)(_dim-1), 2.0) + pow((double)z/(double)(_dim-1), 2.0));//(double)value/(double)_dim;
-          hostData.at(index++) = -1.f;
-
-          x++;
-          // (1, 0, 1)
-          value = (int)(buffer[bytes*idx(x,y,z)]);
-          hostData.at(index++) = 0.57*sqrt(pow((double)x/(double)(_dim-1), 2.0) + pow((double)y/(double)(_dim-1), 2.0) + pow((double)z/(double)(_dim-1), 2.0));//(double)value/(double)_dim;
-          hostData.at(index++) = -1.f;
-
-          x--;
-          y++;
-          // (0, 1, 1)
-          value = (int)(buffer[bytes*idx(x,y,z)]);
-          hostData.at(index++) = 0.57*sqrt(pow((double)x/(double)(_dim-1), 2.0) + pow((double)y/(double)(_dim-1), 2.0) + pow((double)z/(double)(_dim-1), 2.0));//(double)value/(double)_dim;
-          hostData.at(index++) = -1.f;
-
-          x++;
-          // (1, 1, 1)
-          value = (int)(buffer[bytes*idx(x,y,z)]);
-          hostData.at(index++) = 0.57*sqrt(pow((double)x/(double)(_dim-1), 2.0) + pow((double)y/(double)(_dim-1), 2.0) + pow((double)z/(double)(_dim-1), 2.0));//(double)value/(double)_dim;
-          hostData.at(index++) = -1.f;
-
-          // (0, 0, 0)
-          x--; 
-          y--;
-          z--;
-
-          // (2, 0, 0)
-          x+=2;
-          
-          if (x > 3) { x -= 4; y += 2; }
-          if (y > 3) { y -= 3; z += 2; }
-        }
-       
-       x -= 4;
-        
-      }
-      x=0;
-      y++;
-      z=0;
+bool VolumeTexture::LoadHostTree(std::string _fileName,
+                                 int _bits,
+                                 int _dim,
+                                 HostTree &_tree,
+                                 std::function<void(float)> _progress) {
+  if (IsOctreeFileName(_fileName)) {
+    OctreeFile *file = OctreeFile::New();
+    if (!file->Open(_fileName)) {
+      delete file;
+      return false;
     }
+    InitHostTree(file, _tree);
+    bool copied = CopyHostNodes(file, 0, file->Header().nrNodes, _tree, 0);
+    delete file;
+    return copied;
+  }
 
-    std::cout << "Last position written to by first iteration: " << index-1 << std::endl;
-
-    
-   */
-
-    /*
+  // Reading is reported as the first half, the build is the other half
+  std::function<void(float)> readProgress;
+  if (_progress) {
+    readProgress = [=](float _done) { _progress(0.5f*_done); };
+  }
+  std::vector<char> buffer;
+  if (!OctreeBuilder::ReadRaw(_fileName, _bits/8, _dim, buffer,
+                              readProgress)) {
+    return false;
+  }
+  std::vector<float> volume;
+  OctreeBuilder::ConvertRaw(buffer, _bits/8, volume);
+  std::vector<char>().swap(buffer);
+
+  std::vector<float> nodes;
+  std::vector<float> gradients;
+  OctreeBuilder *builder = OctreeBuilder::New();
+  builder->BuildInMemory(volume, _dim, nodes, _tree.ranges, _tree.deviations,
+                         gradients);
+  delete builder;
+  OctreeBuilder::PackNodes(nodes, _tree.ranges, _tree.nodes);
+  _tree.packedRanges.resize(_tree.nodes.size());
+  OctreeBuilder::PackRanges(_tree.ranges.data(), _tree.nodes.size(),
+                            _tree.packedRanges.data());
+  OctreeBuilder::PackGradients(gradients, _tree.gradients);
+  _tree.nodeLayout = OctreeFile::PACKED_32;
+  _tree.maxDepth = 0;
+  while ((1 << _tree.maxDepth) < _dim) {
+    _tree.maxDepth++;
+  }
+  if (_progress) {
+    _progress(1.f);
+  }
+  return true;
+}
 
-    // Where to put the data
-    int toFill=currentLevelStart; 
-    // Read positions in original array
-    int front = 0;
-    int back = _dim;
-    int frontZ = _dim*_dim;
-    int backZ = _dim*_dim + _dim;
-    int value;
-    do
-    {
-      for (int i=0; i<_dim/2; i++)
-      {
-        for (int j=0; j<_dim/2; j++)
-        {
-          //value = static_cast<int>(buffer[bytes*front++]);
-          hostData.at(toFill++) = controlData.at(front++);//static_cast<float>(value)/256.f;
-          hostData.at(toFill++) = -1.f;
-          //value = static_cast<int>(buffer[bytes*front++]);
-          hostData.at(toFill++) = controlData.at(front++);//static_cast<float>(value)/256.f;
-          hostData.at(toFill++) = -1.f;
-          //value = static_cast<int>(buffer[bytes*back++]);
-          hostData.at(toFill++) = controlData.at(back++);//static_cast<float>(value)/256.f;
-          hostData.at(toFill++) = -1.f;
-         // value = static_cast<int>(buffer[bytes*back++]);
-          hostData.at(toFill++) = controlData.at(back++);//static_cast<float>(value)/256.f;
-          hostData.at(toFill++) = -1.f;
+bool VolumeTexture::LoadHostSubtree(std::string _fileName,
+                                    unsigned int _rootLevel,
+                                    unsigned long long _rootIndex,
+                                    HostTree &_tree) {
+  OctreeFile *file = OctreeFile::New();
+  if (!file->Open(_fileName)) {
+    delete file;
+    return false;
+  }
+  const OctreeFileHeader &header = file->Header();
+  if (_rootLevel > header.maxDepth ||
+      _rootIndex >= 1ULL << (3*_rootLevel)) {
+    std::cout << "Error: " << _fileName << " has no node " << _rootIndex
+      << " on level " << _rootLevel << "\n";
+    delete file;
+    return false;
+  }
+  _tree.maxDepth = header.maxDepth - _rootLevel;
+  _tree.nodeLayout = header.nodeLayout;
+  _tree.rootLevel = _rootLevel;
+  _tree.rootIndex = _rootIndex;
+  unsigned long long nrNodes = OctreeBuilder::NrNodes(_tree.maxDepth+1);
+  _tree.nodes.resize(nrNodes*header.nodeSize/sizeof(unsigned int));
+  _tree.ranges.resize(nrNodes*OctreeBuilder::RANGE_SIZE);
+  _tree.packedRanges.resize(
+    header.nodeLayout == OctreeFile::PACKED_32 ? nrNodes : 0);
+  _tree.deviations.resize(nrNodes*OctreeBuilder::DEVIATION_SIZE);
+  _tree.gradients.resize(file->HasChannel(OctreeFile::GRADIENT) ?
+                         nrNodes : 0);
+
+  // The subtree's part of each level is contiguous, and becomes the whole
+  // level of the new tree
+  bool copied = true;
+  for (unsigned int level=0; level<=_tree.maxDepth && copied; level++) {
+    unsigned long long count = 1ULL << (3*level);
+    unsigned long long first =
+      OctreeBuilder::LevelStart(_rootLevel+level) + _rootIndex*count;
+    copied = CopyHostNodes(file, first, count, _tree,
+                           OctreeBuilder::LevelStart(level));
+  }
+  delete file;
+  if (!copied) {
+    return false;
+  }
 
-         // value = static_cast<int>(buffer[bytes*frontZ++]);
-          hostData.at(toFill++) = controlData.at(frontZ++);//static_cast<float>(value)/256.f;
-          hostData.at(toFill++) = -1.f;
-         // value = static_cast<int>(buffer[bytes*frontZ++]);
-          hostData.at(toFill++) = controlData.at(frontZ++);//static_cast<float>(value)/256.f;
-          hostData.at(toFill++) = -1.f;
-          //value = static_cast<int>(buffer[bytes*backZ++]);
-          hostData.at(toFill++) = controlData.at(backZ++);//static_cast<float>(value)/256.f;
-          hostData.at(toFill++) = -1.f;
-          //value = static_cast<int>(buffer[bytes*backZ++]);
-          hostData.at(toFill++) = controlData.at(backZ++);//static_cast<float>(value)/256.f;
-          hostData.at(toFill++) = -1.f;
-        }
-        front += _dim;
-        back += _dim;
-        frontZ += _dim;
-        backZ += _dim;
+  // Float records point at their first child, which has moved with them
+  if (_tree.nodeLayout == OctreeFile::FLOAT_VALUE_CHILD) {
+    for (unsigned long long i=0; i<nrNodes; i++) {
+      unsigned int *record = &_tree.nodes[i*OctreeBuilder::NODE_SIZE];
+      float child;
+      memcpy(&child, &record[1], sizeof(child));
+      if (child >= 0.f) {
+        child = static_cast<float>((8*i+1)*OctreeBuilder::NODE_SIZE);
+        memcpy(&record[1], &child, sizeof(child));
       }
-      front += _dim*_dim;
-      back += _dim*_dim;
-      frontZ += _dim*_dim;
-      backZ += _dim*_dim;
-    } 
-    while (toFill < nrVoxels*2);
-    
-    */
+    }
+  }
+  return true;
+}
 
-   // std::cout << "Last position written to: " << toFill-1 << "\n";
-    delete buffer;
+void VolumeTexture::BeginUpload(const HostTree *_tree) {
+  BeginUpload(_tree->nodes.data(),
+              _tree->packedRanges.empty() ? (const void*)_tree->ranges.data()
+                                          : _tree->packedRanges.data(),
+              _tree->deviations.data(),
+              _tree->gradients.empty() ? NULL : _tree->gradients.data(),
+              _tree->ranges.size()/OctreeBuilder::RANGE_SIZE,
+              _tree->nodes.size()*sizeof(unsigned int),
+              _tree->maxDepth,
+              _tree->nodeLayout);
+  rootLevel_ = _tree->rootLevel;
+  rootIndex_ = _tree->rootIndex;
+}
 
-    // Construct the higher levels in the tree by averaging the children
-    
-    int currentLevelDim = _dim;
-    do
-    {
-      currentLevel--;
-      std::cout << "\ncurrentLevel: " << currentLevel << std::endl;
-      levelAbove--;
-      std::cout << "levelAbove: " << levelAbove << std::endl;
-      currentLevelDim /= 2;
-      std::cout << "currentLevelDim: " << currentLevelDim << std::endl;
-      currentLevelStart = ((pow(8, (levelAbove)+1) - 1) / 7) * 2;
-      std::cout << "currentLevelStart: " << currentLevelStart << "\n";
-      int toFill = currentLevelStart;
-      int firstChild = ((pow(8, (currentLevel)+1) - 1) / 7) * 2;
-      std::cout << "first child: " << firstChild << "\n";
-      int child = firstChild;
-      for (int i=0; i<currentLevelDim*currentLevelDim*currentLevelDim; i++)
-      {
-        double data = 0.0;
-        for (int j=0; j<8; j++)
-        {
-          data += hostData.at(child);
-          child += 2;
-        }
-        hostData.at(toFill++) = data/8.0;
-        hostData.at(toFill++) = static_cast<double>(child-16);
-      }
-      std::cout << "Last child written: " << child-16 << std::endl;
-      std::cout << "Last pos written to: " << toFill - 1 << "\n";
+void VolumeTexture::BeginUpload(const void *_nodes,
+                                const void *_ranges,
+                                const float *_deviations,
+                                const unsigned int *_gradients,
+                                unsigned long long _nrNodes,
+                                unsigned long long _nodeBytes,
+                                unsigned int _maxDepth,
+                                unsigned int _nodeLayout) {
+  // Packed trees upload their ranges quantized, see
+  // OctreeBuilder::PackRange()
+  bool packedRanges = _nodeLayout == OctreeFile::PACKED_32;
+  unsigned long long sizes[NR_STREAMS] = {
+    _nodeBytes,
+    packedRanges ? _nrNodes*sizeof(unsigned int)
+                 : _nrNodes*OctreeBuilder::RANGE_SIZE*sizeof(float),
+    _nrNodes*OctreeBuilder::DEVIATION_SIZE*sizeof(float),
+    // Empty for trees without gradients
+    _gradients != NULL ? _nrNodes*sizeof(unsigned int) : 0
+  };
+  unsigned int formats[NR_STREAMS] = {
+    GL_R32UI, packedRanges ? GL_RG16 : GL_RG32F, GL_R32F, GL_R32UI
+  };
+  unsigned int *handles[NR_STREAMS] = {
+    &handle_, &rangeHandle_, &deviationHandle_, &gradientHandle_
+  };
+  for (unsigned int i=0; i<NR_STREAMS; i++) {
+    if (streamBuffers_[i] == 0) {
+      glGenBuffers(1, &streamBuffers_[i]);
+      glGenTextures(1, handles[i]);
+    }
+    // Storage is only respecified when the size or the layout changes,
+    // otherwise the ranges are overwritten in place
+    if (sizes[i] != streamSizes_[i] || _nodeLayout != nodeLayout_) {
+      glBindBuffer(GL_TEXTURE_BUFFER, streamBuffers_[i]);
+      glBufferData(GL_TEXTURE_BUFFER,
+                   static_cast<GLsizeiptr>(sizes[i]),
+                   NULL,
+                   GL_STREAM_DRAW);
+      glBindTexture(GL_TEXTURE_BUFFER, *handles[i]);
+      glTexBuffer(GL_TEXTURE_BUFFER, formats[i], streamBuffers_[i]);
+      glBindTexture(GL_TEXTURE_BUFFER, 0);
+      streamSizes_[i] = sizes[i];
     }
-    while (currentLevel != 0);
+  }
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  maxDepth_ = _maxDepth;
+  nodeLayout_ = _nodeLayout;
+  rootLevel_ = 0;
+  rootIndex_ = 0;
+  uploadData_[0] = static_cast<const char*>(_nodes);
+  uploadData_[1] = static_cast<const char*>(_ranges);
+  uploadData_[2] = reinterpret_cast<const char*>(_deviations);
+  uploadData_[3] = reinterpret_cast<const char*>(_gradients);
+  hasGradients_ = _gradients != NULL;
+  uploadNodes_ = _nrNodes;
+  uploadedNodes_ = 0;
+  uploading_ = true;
+}
 
-    std::vector<float> gpuData;
-    gpuData.resize(hostData.size());
-    for (unsigned int i=0; i<hostData.size(); i++)
-    {
-      gpuData.at(i) = (float)hostData.at(i);
+bool VolumeTexture::ContinueUpload(unsigned long long _budget,
+                                   unsigned long long _nrNodes) {
+  if (!uploading_) {
+    return true;
+  }
+  if (uploadNodes_ == 0) {
+    uploading_ = false;
+    return true;
+  }
+  // All arrays advance by the same nodes, so the levels become
+  // complete from the root down
+  unsigned long long nodeBytes[NR_STREAMS];
+  unsigned long long bytesPerNode = 0;
+  for (unsigned int i=0; i<NR_STREAMS; i++) {
+    nodeBytes[i] = streamSizes_[i]/uploadNodes_;
+    bytesPerNode += nodeBytes[i];
+  }
+  unsigned long long last = std::min(_nrNodes, uploadNodes_);
+  unsigned long long count = std::max(1ULL, _budget/bytesPerNode);
+  count = std::min(count, last > uploadedNodes_ ? last - uploadedNodes_ : 0);
+  for (unsigned int i=0; i<NR_STREAMS && count > 0; i++) {
+    if (nodeBytes[i] == 0) {
+      continue;
     }
-    std::cout << "gpuData.size() = " << gpuData.size() << std::endl;
-    for (unsigned int i=0; i<146; i+=2)
-    {
-      std::cout << i << ": " << gpuData.at(i) << " " << gpuData.at(i+1) << std::endl;
+    unsigned long long offset = uploadedNodes_*nodeBytes[i];
+    unsigned long long chunk = count*nodeBytes[i];
+    glBindBuffer(GL_TEXTURE_BUFFER, streamBuffers_[i]);
+    void *mapped = glMapBufferRange(GL_TEXTURE_BUFFER,
+                                    static_cast<GLintptr>(offset),
+                                    static_cast<GLsizeiptr>(chunk),
+                                    GL_MAP_WRITE_BIT |
+                                    GL_MAP_INVALIDATE_RANGE_BIT |
+                                    GL_MAP_UNSYNCHRONIZED_BIT);
+    if (mapped == NULL) {
+      std::cout << "Error: Could not map volume buffer\n";
+      exit(1);
     }
-    /*
-    // Level to be written to, starting at second to lowest
-    int level = nrLevels - 1;
-    // Dimensions for level to be read from
-    int levelDim = _dim;
-    // Offset into index array for level to be written to
-    int offsetWrite = _dim*_dim*_dim;;
-    // Offset into index array for level to be read from
-    int offsetRead = 0;
-
-    while (level>0) {
-
-      std::cout 
-        << "\n"
-        << "level: " << level << "\n"
-        << "levelDim: " << levelDim << "\n"
-        << "offsetWrite: " << offsetWrite << "\n"
-        << "offsetRead: " << offsetRead << "\n";
-
-      for (int z=0; z<levelDim; z+=2) {
-        for (int y=0; y<levelDim; y+=2) {
-          for (int x=0; x<levelDim; x+=2) {
-            // 8 sample points in 
-            int idx[8];
-            idx[0] = x     + y    *levelDim + z*    levelDim*levelDim;
-            idx[1] = (x+1) + y    *levelDim + z*    levelDim*levelDim;
-            idx[2] = x     + (y+1)*levelDim + z*    levelDim*levelDim;
-            idx[3] = (x+1) + (y+1)*levelDim + z*    levelDim*levelDim;
-            idx[4] = x     + y    *levelDim + (z+1)*levelDim*levelDim;
-            idx[5] = (x+1) + y    *levelDim + (z+1)*levelDim*levelDim;
-            idx[6] = x     + (y+1)*levelDim + (z+1)*levelDim*levelDim;
-            idx[7] = (x+1) + (y+1)*levelDim + (z+1)*levelDim*levelDim;
-            // Sample level below and average
-            float sum = 0.f;
-            for (int i=0; i<8; i++) {
-              sum += hostData.at(offsetRead+idx[i]);
-            }
-            // Write to current level and step offset forward
-            hostData.at(offsetWrite) = sum/8.f;
-            offsetWrite++;
-          } // z
-        } // y     
-      } // x
-
-      // Add current level's size to next read level
-      offsetRead += levelDim*levelDim*levelDim;
-      // Calculate dimensions for next level to read from
-      levelDim /= 2;
-      // Start again
-      level--;
-
-      
-
-    } // while
-
-    */
-
-    // TODO remove this temporary hack
-    //std::reverse(hostData.begin(), hostData.end());
-
-    std::cout << "Created octree structure on host\n";
-    //std::cout << "Last postion written to: " << offsetWrite-1 << "\n\n";
-    std::cout << "Creating texture buffer object and array...\n";
-
-    // Create a buffer object for the data
-    unsigned int dataBuffer;
-    glGenBuffers(1, &dataBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, dataBuffer);
-    glBufferData(GL_ARRAY_BUFFER, 
-                 gpuData.size()*sizeof(float), // WAVE
-                 static_cast<GLvoid*>(&gpuData[0]),
-                 GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-    // Construct 1D texture array, no filtering to make things easier and clearer
-    glGenTextures(1, &handle_);
-    glBindTexture(GL_TEXTURE_BUFFER, handle_);
-    glTexBuffer(GL_TEXTURE_BUFFER, GL_R32F, dataBuffer);
-    glBindTexture(GL_TEXTURE_BUFFER, 0);
-
-    Manager::Instance().CheckGLErrors("Bound texture buffer");
-
-    std::cout << "Finished creating texture buffer object and array\n";
-
-    std::cout << "Finished creating volume buffer texture\n\n";
-
-  } else {
-    std::cout << _fileName << " could not be opened." << std::endl;
+    memcpy(mapped, uploadData_[i] + offset, chunk);
+    glUnmapBuffer(GL_TEXTURE_BUFFER);
   }
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  uploadedNodes_ += count;
+  if (uploadedNodes_ < uploadNodes_) {
+    return false;
+  }
+  uploading_ = false;
+  return true;
+}
 
-}
\ No newline at end of file
+int VolumeTexture::UploadedLevels() {
+  if (uploadNodes_ == 0) {
+    return maxDepth_ + 1;
+  }
+  int levels = 0;
+  while (levels <= (int)maxDepth_ &&
+         OctreeBuilder::LevelStart(levels+1) <= uploadedNodes_) {
+    levels++;
+  }
+  return levels;
+}
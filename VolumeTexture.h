@@ -2,20 +2,171 @@
 #define VOLUMETEXTURE_H
 
 #include <string>
+#include <vector>
+#include <functional>
+
+class OctreeFile;
+class BrickCache;
 
 class VolumeTexture {
 public:
+  // Node buffers of a tree in host memory, loaded without a GL context
+  struct HostTree {
+    HostTree() : maxDepth(0), nodeLayout(0), rootLevel(0), rootIndex(0) {}
+    unsigned long long Bytes() const;
+    // Node array as 32-bit words, in nodeLayout
+    std::vector<unsigned int> nodes;
+    std::vector<float> ranges;
+    // Ranges as uploaded for PACKED_32 trees (see OctreeBuilder::PackRange()),
+    // quantized while loading so that uploads only copy. Empty otherwise.
+    std::vector<unsigned int> packedRanges;
+    std::vector<float> deviations;
+    // Packed gradients (see OctreeBuilder::PackGradient), empty if the
+    // source has none
+    std::vector<unsigned int> gradients;
+    unsigned int maxDepth;
+    unsigned int nodeLayout;
+    // See VolumeTexture::RootLevel()
+    unsigned int rootLevel;
+    unsigned long long rootIndex;
+  };
+
   static VolumeTexture * New();
-  // Read voxel data from .raw file, create the 3D texture
+  ~VolumeTexture();
+  // Read voxel data from .raw file, build the octree and upload it
   // Params: filename, bits per voxel in raw data, dimensions (assuming cube)
-  void ReadFromFile(std::string _fileName, int _bits, int _dim);
+  // Returns false if the file is missing or too small.
+  bool ReadFromFile(std::string _fileName, int _bits, int _dim);
+  // Read a .raw file into a brick tree (see BrickPool). The node buffers
+  // only hold the coarse levels, the voxels go to a filtered 3D atlas.
+  // With _cacheBytes set the bricks stay in host memory and are streamed
+  // into a BrickCache of that size as rays ask for them.
+  // Returns false if the file is missing or the bricks do not fit.
+  bool ReadBricksFromFile(std::string _fileName,
+                          int _bits,
+                          int _dim,
+                          unsigned long long _cacheBytes = 0);
+  // Loads an octree file (.oct) or builds a packed tree from a .raw file
+  // into host memory. Safe to call from any thread, _progress is called
+  // with the fraction done if set. Returns false if the file is missing
+  // or invalid.
+  static bool LoadHostTree(std::string _fileName,
+                           int _bits,
+                           int _dim,
+                           HostTree &_tree,
+                           std::function<void(float)> _progress =
+                             std::function<void(float)>());
+  // Loads the subtree below node _rootIndex (in Morton order) of level
+  // _rootLevel of an octree file as a complete tree of its own. Only the
+  // subtree's part of every level is read, so a volume too big for one
+  // process can be split between several. Returns false if the file is
+  // missing or invalid, or has no such node.
+  static bool LoadHostSubtree(std::string _fileName,
+                              unsigned int _rootLevel,
+                              unsigned long long _rootIndex,
+                              HostTree &_tree);
+  // True for names of octree files rather than raw data
+  static bool IsOctreeFileName(std::string _fileName);
+  // Sizes a host tree for an open octree file
+  static void InitHostTree(OctreeFile *_file, HostTree &_tree);
+  // Copies nodes [_first, _first+_count) of an open octree file and their
+  // channels to node _destination on. Missing ranges and deviations are
+  // filled in so that every node looks visible and nothing homogeneous.
+  // Compressed blocks are expanded on the ThreadPool.
+  // Returns false if the file has a corrupt block.
+  static bool CopyHostNodes(OctreeFile *_file,
+                            unsigned long long _first,
+                            unsigned long long _count,
+                            HostTree &_tree,
+                            unsigned long long _destination);
+  // Starts replacing the node buffers with a host tree, which has to stay
+  // alive until ContinueUpload() returns true. The copies are not
+  // synchronized: the GPU must be done with earlier draws from this
+  // texture, and while the upload runs only the levels counted by
+  // UploadedLevels() may be read, e.g. by clamping the draw's depth to it.
+  void BeginUpload(const HostTree *_tree);
+  // Same for arrays anywhere in host memory, e.g. a mapped octree file.
+  // _ranges are packed for PACKED_32 trees and floats otherwise, _gradients
+  // may be NULL for trees without them.
+  void BeginUpload(const void *_nodes,
+                   const void *_ranges,
+                   const float *_deviations,
+                   const unsigned int *_gradients,
+                   unsigned long long _nrNodes,
+                   unsigned long long _nodeBytes,
+                   unsigned int _maxDepth,
+                   unsigned int _nodeLayout);
+  // Copies up to _budget bytes through mapped buffer ranges, in node order
+  // and at most up to node _nrNodes of the host tree. Returns true once
+  // the whole tree is on the GPU.
+  bool ContinueUpload(unsigned long long _budget,
+                      unsigned long long _nrNodes = ~0ULL);
+  // Number of complete levels on the GPU, counted from the root
+  int UploadedLevels();
+  unsigned long long UploadedNodes() { return uploadedNodes_; }
   unsigned int Handle() { return handle_; }
+  // Buffer texture with min and max of the values below each node
+  unsigned int RangeHandle() { return rangeHandle_; }
+  // Buffer texture with the standard deviation of the values below each
+  // node
+  unsigned int DeviationHandle() { return deviationHandle_; }
+  // Buffer texture with the packed value gradient below each node, see
+  // OctreeBuilder::PackGradient()
+  unsigned int GradientHandle() { return gradientHandle_; }
+  bool HasGradients() { return hasGradients_; }
   unsigned int MaxDepth() { return maxDepth_; }
+  // OctreeFile::NodeLayout of the node buffer
+  unsigned int NodeLayout() { return nodeLayout_; }
+  // Position of the tree in the whole volume: it is the subtree below node
+  // RootIndex() of level RootLevel(). 0 and 0 for a whole tree.
+  unsigned int RootLevel() { return rootLevel_; }
+  unsigned long long RootIndex() { return rootIndex_; }
+  // 3D atlas of the bricks, 0 if the tree has no bricks
+  unsigned int BrickHandle();
+  bool HasBricks() { return BrickHandle() != 0; }
+  // NULL unless the bricks are streamed
+  BrickCache * Cache() { return brickCache_; }
 private:
-  VolumeTexture() {}
+  // Node, range, deviation and gradient buffers of streamed uploads
+  static const unsigned int NR_STREAMS = 4;
+
+  VolumeTexture()
+    : handle_(0), rangeHandle_(0), deviationHandle_(0), gradientHandle_(0),
+      hasGradients_(false), brickHandle_(0), brickCache_(NULL),
+      maxDepth_(0), nodeLayout_(0), rootLevel_(0), rootIndex_(0),
+      uploading_(false), uploadNodes_(0), uploadedNodes_(0) {
+    for (unsigned int i=0; i<NR_STREAMS; i++) {
+      streamBuffers_[i] = 0;
+      streamSizes_[i] = 0;
+      uploadData_[i] = NULL;
+    }
+  }
   VolumeTexture(const VolumeTexture&) {}
+  // Uploads an array and creates a buffer texture with the given internal
+  // format around it. Returns the texture handle.
+  unsigned int CreateTextureBuffer(const void *_data,
+                                   unsigned long long _size,
+                                   unsigned int _format);
   unsigned int handle_;
+  unsigned int rangeHandle_;
+  unsigned int deviationHandle_;
+  unsigned int gradientHandle_;
+  bool hasGradients_;
+  unsigned int brickHandle_;
+  BrickCache *brickCache_;
   unsigned int maxDepth_;
+  unsigned int nodeLayout_;
+  unsigned int rootLevel_;
+  unsigned long long rootIndex_;
+  // Buffers behind the texture handles when uploads are streamed, they are
+  // reused and only reallocated when a tree changes size
+  unsigned int streamBuffers_[NR_STREAMS];
+  unsigned long long streamSizes_[NR_STREAMS];
+  // Arrays being uploaded, their nodes and the nodes copied so far
+  bool uploading_;
+  const char *uploadData_[NR_STREAMS];
+  unsigned long long uploadNodes_;
+  unsigned long long uploadedNodes_;
 };
 
 #endif
\ No newline at end of file
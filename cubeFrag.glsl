@@ -1,8 +0,0 @@
-#version 330
-
-in vec4 color;
-out vec4 outputColor;
-
-void main() {
-	outputColor = color;
-}
\ No newline at end of file
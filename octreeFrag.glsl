@@ -1,19 +1,113 @@
 #version 330
 
-uniform sampler2D cubeFrontTex;
-uniform sampler2D cubeBackTex;
-uniform samplerBuffer volumeTex;
-
-uniform float stepSize;
-uniform float intensity;
-uniform float winSizeX;
-uniform float winSizeY;
+// Same block as in the vertex shader
+layout(std140) uniform Transform {
+  mat4 projMatrix;
+  mat4 viewMatrix;
+  mat4 modelMatrix;
+  mat4 inverseMatrix;
+};
+
+// Node array as 32-bit words, decoded according to nodeLayout
+uniform usamplerBuffer volumeTex;
+uniform samplerBuffer rangeTex;
+// Standard deviation of the values below each node
+uniform samplerBuffer deviationTex;
+// Brick atlas, an empty texture unless the tree has bricks
+uniform sampler3D brickTex;
+// Atlas slot of every brick when they are streamed, -1 if not resident
+uniform isamplerBuffer pageTable;
+uniform int useBrickCache;
+// Packed value gradient below each node, see OctreeBuilder::PackGradient.
+// Only bound when useGradients is set.
+uniform usamplerBuffer gradientTex;
+uniform int useGradients;
+// Varies the resident brick a pixel reports, see BrickCache
+uniform int feedbackPick;
+
+// Values from constants.txt, a name missing here is ignored
+layout(std140) uniform Constants {
+  float stepSize;
+  float intensity;
+  float winSizeX;
+  float winSizeY;
+  float opacityThreshold;
+  // Rays stop once their opacity reaches this, 0 lets them run through
+  float terminationOpacity;
+  // Nodes whose values deviate at most this much are integrated as a
+  // whole, 0 only takes constant nodes
+  float homogeneity;
+  // Blend from unshaded (0) to headlight Blinn-Phong shading (1) with the
+  // terms below, only with a transfer function
+  float shading;
+  float ambient;
+  float diffuse;
+  float specular;
+  float shininess;
+};
 uniform int maxDepth;
+// OctreeFile::NodeLayout of volumeTex
+uniform int nodeLayout;
+// Deepest level the traversal descends to, coarser while interacting
+uniform int maxLevel;
+// Multiplier on the brick sampling step, above 1 while interacting
+uniform float stepScale;
+// Box of the tree within the unit cube. The whole cube, unless the tree
+// is the subtree one process of a RenderCluster renders.
+uniform vec3 treeOrigin;
+uniform float treeSize;
+// Voxels per brick side, the atlas adds a one voxel apron on every side
+uniform int brickSize;
+// Position of the brick samples within a step, varied per refinement
+// frame. 0.5 samples the step centers.
+uniform float stepJitter;
+// RESTART_TRAVERSAL or ROPE_TRAVERSAL
+uniform int traversal;
+// Color and opacity by value and gradient magnitude, see TransferFunction.
+// Without one the raw values are integrated along the ray.
+uniform int useTransferFunction;
+uniform sampler2D transferFunc;
+// Largest opacity over every range of transfer function entries
+uniform sampler2D opacityTable;
+
+// Upper bound on the nodes one ray visits, enough to cross a 256^3 leaf
+// level diagonally
+const int MAX_NODE_VISITS = 1024;
+
+const int FLOAT_VALUE_CHILD = 0;
+const int PACKED_32 = 1;
+const int RESTART_TRAVERSAL = 0;
+const int ROPE_TRAVERSAL = 1;
+// Packed node words, see OctreeBuilder::PackNode
+const uint PACKED_BRICK = 0x40000000u;
+const uint PACKED_EMPTY = 0x20000000u;
+const uint PACKED_VALUE_MAX = 0xffffu;
+const uint PACKED_BRICK_INDEX = 0x1fffffu;
+const uint PACKED_BRICK_VALUE_SHIFT = 21u;
+const uint PACKED_BRICK_VALUE_MAX = 0xffu;
+// Packed gradient words, see OctreeBuilder::PackGradient
+const uint GRADIENT_AXIS_BITS = 12u;
+const uint GRADIENT_AXIS_MAX = 0xfffu;
+const uint GRADIENT_MAGNITUDE_SHIFT = 24u;
+const float GRADIENT_MAGNITUDE_MAX = 255.0;
+// Feedback flag of resident bricks, BrickCache::FEEDBACK_USED
+const uint FEEDBACK_USED = 0x80000000u;
+// Resident bricks along a ray a pixel picks from
+const int FEEDBACK_PICKS = 4;
 
 in vec4 eye;
 in float cubeSize;
 in vec4 cubeOrigin;
 
+// Brick id plus one of the first missing brick on the ray and of the
+// resident brick picked for the feedback, 0 for none
+uint missingBrick = 0u;
+uint usedBrick = 0u;
+int nrUsedBricks = 0;
+int feedbackIndex = 0;
+// Towards the eye, the light sits at the camera
+vec3 lightDir = vec3(0.0, 0.0, 1.0);
+
 // Checks ray-cube intersection
 // Takes opposite cube corners as input and returns\
 // hit/no hit bool along with tMin and tMax
@@ -70,17 +164,278 @@ bool IntersectCube(in vec3 boundsMin,
 	return ( (tMin < 1e20 && tMax > -1e20 ) );
 }
 
+// Nodes are addressed by their index in both layouts
 int GetRootOffset()
 {
 	return 0;
 }
 
+// Nodes are stored level by level, so the parent of node n is always
+// node (n-1)/8 in both layouts
+int GetParentNodeOffset(in int currentOffset)
+{
+  return (currentOffset - 1) / 8;
+}
+
 int GetChildNodeOffset(in int currentOffset, in int child)
 {
-  return int(texelFetch(volumeTex, currentOffset+1).r) + child*2;
+  if (nodeLayout == PACKED_32) {
+    // The children of node n are always nodes 8n+1 to 8n+8
+    return 8*currentOffset + 1 + child;
+  }
+  // The float layout stores the first child's offset in floats
+  uint childBits = texelFetch(volumeTex, 2*currentOffset+1).r;
+  return int(uintBitsToFloat(childBits))/2 + child;
+}
+
+float NodeValue(in int nodeOffset)
+{
+  if (nodeLayout == PACKED_32) {
+    uint word = texelFetch(volumeTex, nodeOffset).r;
+    if ((word & PACKED_BRICK) != 0u) {
+      uint brickValue = (word >> PACKED_BRICK_VALUE_SHIFT) &
+                        PACKED_BRICK_VALUE_MAX;
+      return float(brickValue)/float(PACKED_BRICK_VALUE_MAX);
+    }
+    return float(word & PACKED_VALUE_MAX)/float(PACKED_VALUE_MAX);
+  }
+  return uintBitsToFloat(texelFetch(volumeTex, 2*nodeOffset).r);
 }
 
-vec3 VisitNode(in int nodeOffset, 
+// Brick of a brick tree leaf, -1 for every other node
+int NodeBrick(in int nodeOffset)
+{
+  if (nodeLayout == PACKED_32) {
+    uint word = texelFetch(volumeTex, nodeOffset).r;
+    return (word & PACKED_BRICK) != 0u ? int(word & PACKED_BRICK_INDEX) : -1;
+  }
+  // Float leaves point at their brick with -2-brick
+  float child = uintBitsToFloat(texelFetch(volumeTex, 2*nodeOffset+1).r);
+  return child < -1.5 ? int(-child + 0.5) - 2 : -1;
+}
+
+// Atlas slot of a brick, -1 while a streamed brick is not resident. Notes
+// the brick for the feedback.
+int BrickSlot(in int brick)
+{
+  if (useBrickCache == 0) {
+    return brick;
+  }
+  int slot = texelFetch(pageTable, brick).r;
+  if (slot < 0) {
+    if (missingBrick == 0u) {
+      missingBrick = uint(brick) + 1u;
+    }
+  } else if (nrUsedBricks <= feedbackIndex) {
+    usedBrick = uint(brick) + 1u;
+    nrUsedBricks++;
+  }
+  return slot;
+}
+
+// True if nothing below the node can contribute to the color, so the ray
+// can skip the whole subtree
+bool IsTransparent(in int nodeOffset)
+{
+  if (useTransferFunction != 0) {
+    // Largest opacity the transfer function gives a value in the range
+    vec2 range = texelFetch(rangeTex, nodeOffset).rg;
+    int last = textureSize(opacityTable, 0).x - 1;
+    ivec2 entries = clamp(ivec2(floor(range.x*float(last)),
+                                ceil(range.y*float(last))), 0, last);
+    return texelFetch(opacityTable, entries.yx, 0).r <= opacityThreshold;
+  }
+  // Packed words flag all-zero subtrees, no need to look at the range
+  if (nodeLayout == PACKED_32 && opacityThreshold >= 0.0 &&
+      (texelFetch(volumeTex, nodeOffset).r & PACKED_EMPTY) != 0u) {
+    return true;
+  }
+  vec2 range = texelFetch(rangeTex, nodeOffset).rg;
+  return intensity*range.y <= opacityThreshold;
+}
+
+// True if the transfer function has a gradient magnitude axis
+bool TransferFunction2D()
+{
+  return useTransferFunction != 0 && textureSize(transferFunc, 0).y > 1;
+}
+
+// Octahedral direction and magnitude of a packed gradient word, in value
+// per voxel
+vec3 UnpackGradient(in uint word)
+{
+  vec2 p = vec2(float(word & GRADIENT_AXIS_MAX),
+                float((word >> GRADIENT_AXIS_BITS) & GRADIENT_AXIS_MAX));
+  p = p*(2.0/float(GRADIENT_AXIS_MAX)) - 1.0;
+  vec3 n = vec3(p, 1.0 - abs(p.x) - abs(p.y));
+  if (n.z < 0.0) {
+    vec2 signs = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    n.xy = (1.0 - abs(n.yx))*signs;
+  }
+  float magnitude = float(word >> GRADIENT_MAGNITUDE_SHIFT)/
+                    GRADIENT_MAGNITUDE_MAX;
+  return magnitude*normalize(n);
+}
+
+// Lights a transfer function color with the gradient as surface normal.
+// Either side of an isosurface faces the light, a zero gradient is left
+// unshaded.
+vec3 Shade(in vec3 rgb, in vec3 normal)
+{
+  float magnitude = length(normal);
+  if (shading <= 0.0 || magnitude <= 0.0) {
+    return rgb;
+  }
+  // Light and eye coincide, so the halfway vector is the light direction
+  float lambert = abs(dot(normal/magnitude, lightDir));
+  vec3 lit = (ambient + diffuse*lambert)*rgb +
+             vec3(specular*pow(lambert, max(shininess, 1.0)));
+  return mix(rgb, lit, shading);
+}
+
+// Composites a segment of constant value behind the color accumulated so
+// far. Without a transfer function the value is just integrated.
+void Accumulate(inout vec4 color,
+                in float value,
+                in float gradient,
+                in vec3 normal,
+                in float segment)
+{
+  if (useTransferFunction == 0) {
+    color.rgb += vec3(value*segment);
+    return;
+  }
+  if (segment <= 0.0) {
+    return;
+  }
+  // Entries sit at texel centers, values 0 and 1 hit the end entries
+  vec2 size = vec2(textureSize(transferFunc, 0));
+  vec2 entry = clamp(vec2(value, gradient), 0.0, 1.0)*(size - 1.0);
+  vec4 tf = texture(transferFunc, (entry + 0.5)/size);
+  // Table opacities are for a segment of stepSize
+  float alpha = 1.0 - pow(1.0 - tf.a, segment/stepSize);
+  color.rgb += (1.0 - color.a)*alpha*Shade(tf.rgb, normal);
+  color.a += (1.0 - color.a)*alpha;
+}
+
+// True once nothing further along the ray can show through
+bool Saturated(in vec4 color)
+{
+  return terminationOpacity > 0.0 && color.a >= terminationOpacity;
+}
+
+// Spreads the low 10 bits of x out to every third bit, the GPU side of
+// Morton::Encode for levels up to 1024^3
+int Part1By2(in int x)
+{
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x << 8)) & 0x0300f00f;
+  x = (x | (x << 4)) & 0x030c30c3;
+  x = (x | (x << 2)) & 0x09249249;
+  return x;
+}
+
+// Node at a cell of a level, levels are stored one after the other and
+// Morton ordered within, see OctreeBuilder::LevelStart
+int CellNodeOffset(in int level, in ivec3 cell)
+{
+  int levelStart = ((1 << (3*level)) - 1) / 7;
+  return levelStart +
+    (Part1By2(cell.x) | (Part1By2(cell.y) << 1) | (Part1By2(cell.z) << 2));
+}
+
+// Value of the node at a cell, clamped to the volume
+float CellValue(in int level, in ivec3 cell)
+{
+  int last = (1 << level) - 1;
+  return NodeValue(CellNodeOffset(level, clamp(cell, ivec3(0), ivec3(last))));
+}
+
+// Gradient magnitude at a node by central differences with its face
+// neighbours, in value per node
+float NodeGradient(in int level, in ivec3 cell)
+{
+  ivec3 dx = ivec3(1, 0, 0);
+  ivec3 dy = ivec3(0, 1, 0);
+  ivec3 dz = ivec3(0, 0, 1);
+  vec3 gradient = vec3(
+    CellValue(level, cell+dx) - CellValue(level, cell-dx),
+    CellValue(level, cell+dy) - CellValue(level, cell-dy),
+    CellValue(level, cell+dz) - CellValue(level, cell-dz));
+  return 0.5*length(gradient);
+}
+
+// True if the node is close enough to constant to use its average, or
+// for a brick to take a single sample, instead of descending further
+bool IsHomogeneous(in int nodeOffset)
+{
+  return texelFetch(deviationTex, nodeOffset).r <= homogeneity;
+}
+
+// Marches through a brick leaf with filtered samples from an atlas slot.
+// The samples are spread evenly over the node's extent, at least one per
+// voxel, so that a constant brick integrates to the same as a plain leaf.
+void MarchBrick(inout vec4 color,
+                in int brick,
+                in bool homogeneous,
+                in vec3 boxMin,
+                in float boxDim,
+                in vec3 rayO,
+                in vec3 rayD,
+                in float tMinNode,
+                in float tMaxNode)
+{
+  int paddedSize = brickSize + 2;
+  ivec3 atlasSize = textureSize(brickTex, 0);
+  int bricksX = atlasSize.x / paddedSize;
+  int bricksY = atlasSize.y / paddedSize;
+  vec3 slot = vec3(brick % bricksX,
+                   (brick / bricksX) % bricksY,
+                   brick / (bricksX*bricksY));
+  // Texel position of the brick's first voxel corner, past the apron
+  vec3 brickOrigin = slot*float(paddedSize) + vec3(1.0);
+
+  float extent = tMaxNode - tMinNode;
+  if (extent <= 0.0) {
+    return;
+  }
+  float stepLength = stepScale*min(stepSize, boxDim/float(brickSize));
+  int nrSamples = homogeneous ? 1 : max(1, int(ceil(extent/stepLength)));
+  stepLength = extent/float(nrSamples);
+  bool gradients = TransferFunction2D() ||
+                   (useTransferFunction != 0 && shading > 0.0);
+  // Differences stay within the apron, past it is the next brick
+  vec3 apronMin = brickOrigin - vec3(0.5);
+  vec3 apronMax = brickOrigin + vec3(float(brickSize) + 0.5);
+  for (int i=0; i<nrSamples && !Saturated(color); i++) {
+    vec3 P = rayO + (tMinNode + (float(i)+stepJitter)*stepLength)*rayD;
+    vec3 local = clamp((P - boxMin)/boxDim, 0.0, 1.0);
+    vec3 texel = brickOrigin + local*float(brickSize);
+    float value = texture(brickTex, texel/vec3(atlasSize)).r;
+    float gradient = 0.0;
+    vec3 gradientVec = vec3(0.0);
+    if (gradients) {
+      for (int axis=0; axis<3; axis++) {
+        vec3 d = vec3(0.0);
+        d[axis] = 1.0;
+        vec3 above = clamp(texel + d, apronMin, apronMax);
+        vec3 below = clamp(texel - d, apronMin, apronMax);
+        gradientVec[axis] = texture(brickTex, above/vec3(atlasSize)).r -
+                            texture(brickTex, below/vec3(atlasSize)).r;
+      }
+      gradientVec *= 0.5;
+      gradient = length(gradientVec);
+    }
+    Accumulate(color, value, gradient, gradientVec, stepLength);
+  }
+}
+
+void VisitNode(inout vec4 color,
+               in int nodeOffset,
+               in int level,
+               in vec3 boxMin,
+               in float boxDim,
                in vec3 rayO,
                in vec3 rayD, 
                in float tMinNode,
@@ -99,14 +454,32 @@ vec3 VisitNode(in int nodeOffset,
   else if (w < 0.40) return vec3(0.0001);
   */
 
-  // Sample the texture buffer
-  float nodeValue = texelFetch(volumeTex, nodeOffset).r;
-  return vec3(nodeValue);
+  int brick = NodeBrick(nodeOffset);
+  int slot = brick >= 0 ? BrickSlot(brick) : -1;
+  if (slot >= 0) {
+    MarchBrick(color, slot, IsHomogeneous(nodeOffset), boxMin, boxDim,
+               rayO, rayD, tMinNode, tMaxNode);
+    return;
+  }
+
+  // Sample the texture buffer. A brick that is not resident yet stands in
+  // with its average.
+  float nodeValue = NodeValue(nodeOffset);
   // Integrate along the node's extent
   vec3 start = vec3(rayO+tMinNode*rayD);
   vec3 end = vec3(rayO+tMaxNode*rayD);
   float delta = length(end-start);
-  return vec3(nodeValue*stepSize);
+  float gradient = 0.0;
+  vec3 normal = vec3(0.0);
+  if (useGradients != 0 && useTransferFunction != 0) {
+    // One fetch for both the magnitude and the normal
+    normal = UnpackGradient(texelFetch(gradientTex, nodeOffset).r);
+    gradient = length(normal);
+  } else if (TransferFunction2D()) {
+    ivec3 cell = ivec3(floor((boxMin - treeOrigin)/boxDim + 0.5));
+    gradient = NodeGradient(level, cell);
+  }
+  Accumulate(color, nodeValue, gradient, normal, delta);
 } 
 
 int EnclosingChild(vec3 P, float boxMid, vec3 offset)
@@ -145,38 +518,40 @@ int EnclosingChild(vec3 P, float boxMid, vec3 offset)
 }
  
 // Traverse the octree structure and return an accumulated color
-vec3 Traverse(in vec3 rayO, in vec3 rayD)
+vec4 Traverse(in vec3 rayO, in vec3 rayD)
 {
   float boxDim, boxMid, boxMin;
 	int nodeOffset, level, parent;
   vec3 offset;
-  vec3 color = vec3(0.0);
+  vec4 color = vec4(0.0);
 
-	// Find tMin and tMax for unit cube.
+	// Find tMin and tMax for the tree's box
 	float tMin, tMax;
-	if (!IntersectCube(vec3(0.0), vec3(1.0), rayO, rayD, tMin, tMax))
+	if (!IntersectCube(treeOrigin, treeOrigin+vec3(treeSize), rayO, rayD, tMin, tMax))
   {
     return color;
   }
  
-	// Keep traversing until the sample point goes outside the unit square
-	//while (tMin < tMax) 
-  //for (int i=0; i<10; i++)
+	// Keep traversing until the sample point goes outside the box
+  for (int i=0; i<MAX_NODE_VISITS && tMin < tMax && !Saturated(color); i++)
 	{
 		// Reset the traversal variables
-		offset = vec3(0.0);
-		boxDim = 1.0;
+		offset = treeOrigin;
+		boxDim = treeSize;
     level = 0;
     int child;
 
 		// Set node to root
 		nodeOffset = GetRootOffset();
+    bool skip = IsTransparent(nodeOffset);
+    // Empty and homogeneous nodes are visited as a whole
+    bool stop = skip || IsHomogeneous(nodeOffset);
 
 		// Find the point P where the ray intersects the bounding volume
 		vec3 P = vec3(rayO + tMin*rayD);
 
 		// Traverse to the selected level
-		while (level < 3)
+		while (level < maxLevel && !stop)
 		{
       
 			// Next box dimenstions
@@ -220,6 +595,10 @@ vec3 Traverse(in vec3 rayO, in vec3 rayD)
         offset.z += boxDim;
       }
 
+      // Stop descending if the whole child is empty or homogeneous
+      skip = IsTransparent(nodeOffset);
+      stop = skip || IsHomogeneous(nodeOffset);
+
       level++;
 
     } // while level < maxDepth
@@ -228,13 +607,17 @@ vec3 Traverse(in vec3 rayO, in vec3 rayD)
     float tMinNode, tMaxNode;
     if (!IntersectCube(offset, offset+vec3(boxDim), rayO, rayD, tMinNode, tMaxNode)) {
       // This should never happen!
-      color += vec3(10000, 0, 0);
+      color.rgb += vec3(10000, 0, 0);
+      tMaxNode = tMin;
     }
 
    // return vec3(length((rayO + tMaxNode*rayD)-(rayO+tMinNode*rayD)));
     
-    // Raymarch, add to the color
-    color += VisitNode(nodeOffset, rayO, rayD, tMinNode, tMaxNode);
+    // Raymarch, add to the color. Empty nodes are stepped over whole.
+    if (!skip) {
+      VisitNode(color, nodeOffset, level, offset, boxDim, rayO, rayD,
+                max(tMin, tMinNode), tMaxNode);
+    }
     
     // Set tMin for next iteration
     tMin = tMaxNode + 0.0001;
@@ -243,30 +626,140 @@ vec3 Traverse(in vec3 rayO, in vec3 rayD)
   return color;
 } // Traverse()
 
-out vec4 color;
+// Cell of the level that encloses P, points outside the tree's box are
+// clamped to the border cells like EnclosingChild() does
+ivec3 EnclosingCell(in vec3 P, in int level)
+{
+  float cells = float(1 << level);
+  return clamp(ivec3(floor((P - treeOrigin)/treeSize*cells)),
+               ivec3(0), ivec3((1 << level) - 1));
+}
 
-void main() {
+// Stackless traversal that walks the ray front to back instead of
+// restarting at the root for every node. The tree is complete and Morton
+// ordered, so the rope to the neighbour across the exit face is implicit:
+// the walk climbs from the node it leaves to the deepest ancestor that
+// also encloses the next point, and descends from there. Neighbours share
+// most of their path, so a node costs a constant number of fetches on
+// average instead of one per level. Visits the same nodes as Traverse().
+vec4 TraverseRopes(in vec3 rayO, in vec3 rayD)
+{
+  vec4 color = vec4(0.0);
+
+  float tMin, tMax;
+  if (!IntersectCube(treeOrigin, treeOrigin+vec3(treeSize), rayO, rayD, tMin, tMax))
+  {
+    return color;
+  }
+
+  int nodeOffset = GetRootOffset();
+  int level = 0;
+  ivec3 cell = ivec3(0);
+  bool skip = IsTransparent(nodeOffset);
+  bool stop = skip || IsHomogeneous(nodeOffset);
+  // Cells of coarser levels are this one shifted down
+  ivec3 leafCell = EnclosingCell(rayO + tMin*rayD, maxLevel);
+  for (int i=0; i<MAX_NODE_VISITS && tMin < tMax && !Saturated(color); i++)
+  {
+    // Descend to the node enclosing P, stopping early at empty and
+    // homogeneous nodes
+    while (level < maxLevel && !stop)
+    {
+      level++;
+      cell = leafCell >> (maxLevel - level);
+      ivec3 bit = cell & ivec3(1);
+      nodeOffset = GetChildNodeOffset(nodeOffset, bit.x + 2*bit.y + 4*bit.z);
+      skip = IsTransparent(nodeOffset);
+      stop = skip || IsHomogeneous(nodeOffset);
+    }
+
+    float boxDim = treeSize/float(1 << level);
+    vec3 offset = treeOrigin + vec3(cell)*boxDim;
+    float tMinNode, tMaxNode;
+    if (!IntersectCube(offset, offset+vec3(boxDim), rayO, rayD, tMinNode, tMaxNode)) {
+      // Only a grazing ray misses the cell it is in, step past it
+      skip = true;
+      tMaxNode = tMin;
+    }
+    if (!skip) {
+      VisitNode(color, nodeOffset, level, offset, boxDim, rayO, rayD,
+                max(tMin, tMinNode), tMaxNode);
+    }
+    tMin = tMaxNode + 0.0001;
+    leafCell = EnclosingCell(rayO + tMin*rayD, maxLevel);
 
-	// Get window coordinates for cube texture sampling
-	float xSample = gl_FragCoord.x / winSizeX;
-	float ySample = gl_FragCoord.y / winSizeY;
+    // Follow the rope up to the common ancestor. Every ancestor was
+    // descended through, so none of them is transparent or homogeneous.
+    ivec3 next = leafCell >> (maxLevel - level);
+    while (next != cell)
+    {
+      next >>= 1;
+      cell >>= 1;
+      nodeOffset = GetParentNodeOffset(nodeOffset);
+      level--;
+      skip = false;
+      stop = false;
+    }
+  }
+  return color;
+} // TraverseRopes()
+
+layout(location = 0) out vec4 color;
+// Read back by BrickCache, only drawn to while bricks are streamed
+layout(location = 1) out uint feedback;
+// Ray parameter where the ray enters the tree's box, NO_DEPTH if it
+// misses. Orders the images of a RenderCluster's subtrees per pixel, only
+// drawn to there.
+layout(location = 2) out float rayDepth;
 
-	// Sample cube colors
-	vec4 front = texture(cubeFrontTex, vec2(xSample, ySample));
-	vec4 back = texture(cubeBackTex, vec2(xSample, ySample));
+const float NO_DEPTH = 1e20;
 
-	// Adjust coord system
-	//front.xyz = vec3(front.z, 1.0-front.x, 1.0-front.y);
-	//back.xyz = vec3(back.z, 1.0-back.x, 1.0-back.y);
+void main() {
 
-	// Calculate viewing direction and cross-section length
-	vec3 direction = (back-front).xyz;
-  float dist = length(direction);
-	direction = normalize(direction);
+	feedback = 0u;
+	rayDepth = NO_DEPTH;
+	feedbackIndex = (int(gl_FragCoord.x) + 2*int(gl_FragCoord.y) +
+	                 feedbackPick) % FEEDBACK_PICKS;
+
+	// Unproject the pixel on the near and far planes to get the eye ray in
+	// unit cube coordinates
+	vec2 ndc = 2.0*vec2(gl_FragCoord.x/winSizeX, gl_FragCoord.y/winSizeY) - 1.0;
+	vec4 nearPoint = inverseMatrix * vec4(ndc, -1.0, 1.0);
+	vec4 farPoint = inverseMatrix * vec4(ndc, 1.0, 1.0);
+	vec3 rayO = nearPoint.xyz/nearPoint.w;
+	vec3 direction = normalize(farPoint.xyz/farPoint.w - rayO);
+	lightDir = -direction;
+
+	// Entry point into the cube, or the near plane if that is inside. The
+	// whole cube even for a subtree, so that its pieces see the same rays.
+	float tEntry, tExit;
+	if (!IntersectCube(vec3(0.0), vec3(1.0), rayO, direction, tEntry, tExit) ||
+	    tExit < 0.0) {
+		color = vec4(0.0);
+		return;
+	}
+	vec3 front = rayO + max(tEntry, 0.0)*direction;
 
 	// Traverse structure
 	vec3 rayStart = front.xyz + 0.1 * direction;
-  color = intensity * vec4(Traverse(rayStart, direction), 1.0);
+  float tTree, tTreeExit;
+  if (IntersectCube(treeOrigin, treeOrigin+vec3(treeSize), rayStart, direction,
+                    tTree, tTreeExit)) {
+    rayDepth = tTree;
+  }
+  vec4 sum;
+  if (traversal == ROPE_TRAVERSAL) {
+    sum = TraverseRopes(rayStart, direction);
+  } else {
+    sum = Traverse(rayStart, direction);
+  }
+  // Premultiplied, the alpha composites subtree images front to back
+  color = vec4(intensity*sum.rgb, sum.a);
+  if (missingBrick != 0u) {
+    feedback = missingBrick;
+  } else if (usedBrick != 0u) {
+    feedback = usedBrick | FEEDBACK_USED;
+  }
   //color = vec4(front.xyz, 1.f);
 
  // vec3 sampler = front.xyz + 0.01*direction;
@@ -1,10 +1,15 @@
 #version 330
 
-uniform mat4 projMatrix;
-uniform mat4 viewMatrix;
-uniform mat4 modelMatrix;
+// Shared with the fragment shader through one uniform buffer
+layout(std140) uniform Transform {
+  mat4 projMatrix;
+  mat4 viewMatrix;
+  mat4 modelMatrix;
+  // Inverse of projMatrix*viewMatrix*modelMatrix
+  mat4 inverseMatrix;
+};
 
-in vec4 position; 
+layout(location = 0) in vec4 position;
 
 out vec4 eye;
 out vec4 cubeOrigin;
@@ -0,0 +1,42 @@
+#version 330
+
+// Scales the volume pass up to the window when it was rendered at a lower
+// resolution. Plain bilinear filtering smears the silhouette and sharp
+// transfer function boundaries, so each of the four source pixels is
+// weighted down the more its color differs from the nearest one.
+
+uniform sampler2D source;
+// Rendered size in pixels, and the window size
+uniform vec2 sourceSize;
+uniform vec2 targetSize;
+
+// Falloff of the weights with the color difference
+const float EDGE_SHARPNESS = 32.0;
+
+layout(location = 0) out vec4 color;
+
+float EdgeWeight(vec4 _color, vec4 _nearest) {
+	vec4 difference = _color - _nearest;
+	return exp(-EDGE_SHARPNESS*dot(difference, difference));
+}
+
+void main() {
+	// Position in source pixels relative to the first pixel center
+	vec2 position = gl_FragCoord.xy*sourceSize/targetSize - 0.5;
+	ivec2 base = ivec2(floor(position));
+	vec2 f = position - vec2(base);
+	ivec2 last = ivec2(sourceSize) - 1;
+	vec4 c00 = texelFetch(source, clamp(base, ivec2(0), last), 0);
+	vec4 c10 = texelFetch(source, clamp(base + ivec2(1, 0), ivec2(0), last), 0);
+	vec4 c01 = texelFetch(source, clamp(base + ivec2(0, 1), ivec2(0), last), 0);
+	vec4 c11 = texelFetch(source, clamp(base + ivec2(1, 1), ivec2(0), last), 0);
+	vec4 nearest = f.y < 0.5 ? (f.x < 0.5 ? c00 : c10)
+	                         : (f.x < 0.5 ? c01 : c11);
+
+	// The nearest pixel keeps its bilinear weight of at least 1/4
+	float w00 = (1.0 - f.x)*(1.0 - f.y)*EdgeWeight(c00, nearest);
+	float w10 = f.x*(1.0 - f.y)*EdgeWeight(c10, nearest);
+	float w01 = (1.0 - f.x)*f.y*EdgeWeight(c01, nearest);
+	float w11 = f.x*f.y*EdgeWeight(c11, nearest);
+	color = (w00*c00 + w10*c10 + w01*c01 + w11*c11)/(w00 + w10 + w01 + w11);
+}
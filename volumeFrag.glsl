@@ -1,47 +1,262 @@
 #version 330
 
-uniform sampler2D cubeFrontTex;
-uniform sampler2D cubeBackTex;
-uniform samplerBuffer volumeTex;
+// Brute force reference for octreeFrag.glsl. Samples the finest level of
+// the same node buffers at every step through the cube, without skipping
+// anything, and composites the samples with the same transfer function.
 
-uniform float stepSize;
-uniform float intensity;
-uniform float winSizeX;
-uniform float winSizeY;
+// Same block as in the vertex shader
+layout(std140) uniform Transform {
+  mat4 projMatrix;
+  mat4 viewMatrix;
+  mat4 modelMatrix;
+  mat4 inverseMatrix;
+};
 
-out vec4 color;
+// Same uniforms as in octreeFrag.glsl
+uniform usamplerBuffer volumeTex;
+uniform sampler3D brickTex;
+uniform isamplerBuffer pageTable;
+uniform int useBrickCache;
+
+layout(std140) uniform Constants {
+  float stepSize;
+  float intensity;
+  float winSizeX;
+  float winSizeY;
+  float opacityThreshold;
+  float terminationOpacity;
+  float homogeneity;
+};
+uniform int maxDepth;
+uniform int nodeLayout;
+uniform int maxLevel;
+uniform float stepScale;
+uniform int brickSize;
+uniform float stepJitter;
+uniform int useTransferFunction;
+uniform sampler2D transferFunc;
+
+// Upper bound on the samples of one ray
+const int MAX_STEPS = 4096;
+
+const int PACKED_32 = 1;
+const uint PACKED_BRICK = 0x40000000u;
+const uint PACKED_PAYLOAD = 0x1fffffffu;
+const uint PACKED_VALUE_MAX = 0xffffu;
+
+// Brick id plus one of the first missing brick, for BrickCache
+uint missingBrick = 0u;
+
+// Slab test against an axis aligned box
+bool IntersectCube(in vec3 boundsMin,
+                   in vec3 boundsMax,
+                   in vec3 rayO,
+                   in vec3 rayD,
+                   out float tMinOut,
+                   out float tMaxOut)
+{
+  vec3 div = vec3(rayD.x == 0.0 ? 1e20 : 1.0/rayD.x,
+                  rayD.y == 0.0 ? 1e20 : 1.0/rayD.y,
+                  rayD.z == 0.0 ? 1e20 : 1.0/rayD.z);
+  vec3 t1 = (boundsMin - rayO)*div;
+  vec3 t2 = (boundsMax - rayO)*div;
+  vec3 tNear = min(t1, t2);
+  vec3 tFar = max(t1, t2);
+  tMinOut = max(max(tNear.x, tNear.y), tNear.z);
+  tMaxOut = min(min(tFar.x, tFar.y), tFar.z);
+  return tMinOut <= tMaxOut;
+}
+
+float NodeValue(in int nodeOffset)
+{
+  if (nodeLayout == PACKED_32) {
+    uint word = texelFetch(volumeTex, nodeOffset).r;
+    return float(word & PACKED_VALUE_MAX)/float(PACKED_VALUE_MAX);
+  }
+  return uintBitsToFloat(texelFetch(volumeTex, 2*nodeOffset).r);
+}
+
+int NodeBrick(in int nodeOffset)
+{
+  if (nodeLayout == PACKED_32) {
+    uint word = texelFetch(volumeTex, nodeOffset).r;
+    return (word & PACKED_BRICK) != 0u ? int(word & PACKED_PAYLOAD) : -1;
+  }
+  float child = uintBitsToFloat(texelFetch(volumeTex, 2*nodeOffset+1).r);
+  return child < -1.5 ? int(-child + 0.5) - 2 : -1;
+}
+
+// Atlas slot of a brick, -1 while a streamed brick is not resident
+int BrickSlot(in int brick)
+{
+  if (useBrickCache == 0) {
+    return brick;
+  }
+  int slot = texelFetch(pageTable, brick).r;
+  if (slot < 0 && missingBrick == 0u) {
+    missingBrick = uint(brick) + 1u;
+  }
+  return slot;
+}
+
+bool TransferFunction2D()
+{
+  return useTransferFunction != 0 && textureSize(transferFunc, 0).y > 1;
+}
+
+void Accumulate(inout vec4 color,
+                in float value,
+                in float gradient,
+                in float segment)
+{
+  if (useTransferFunction == 0) {
+    color.rgb += vec3(value*segment);
+    return;
+  }
+  if (segment <= 0.0) {
+    return;
+  }
+  vec2 size = vec2(textureSize(transferFunc, 0));
+  vec2 entry = clamp(vec2(value, gradient), 0.0, 1.0)*(size - 1.0);
+  vec4 tf = texture(transferFunc, (entry + 0.5)/size);
+  float alpha = 1.0 - pow(1.0 - tf.a, segment/stepSize);
+  color.rgb += (1.0 - color.a)*alpha*tf.rgb;
+  color.a += (1.0 - color.a)*alpha;
+}
+
+bool Saturated(in vec4 color)
+{
+  return terminationOpacity > 0.0 && color.a >= terminationOpacity;
+}
+
+int Part1By2(in int x)
+{
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x << 8)) & 0x0300f00f;
+  x = (x | (x << 4)) & 0x030c30c3;
+  x = (x | (x << 2)) & 0x09249249;
+  return x;
+}
+
+int CellNodeOffset(in int level, in ivec3 cell)
+{
+  int levelStart = ((1 << (3*level)) - 1) / 7;
+  return levelStart +
+    (Part1By2(cell.x) | (Part1By2(cell.y) << 1) | (Part1By2(cell.z) << 2));
+}
+
+float CellValue(in int level, in ivec3 cell, in float fallback)
+{
+  int last = (1 << level) - 1;
+  int nodeOffset = CellNodeOffset(level, clamp(cell, ivec3(0), ivec3(last)));
+  if (nodeLayout == PACKED_32 && NodeBrick(nodeOffset) >= 0) {
+    return fallback;
+  }
+  return NodeValue(nodeOffset);
+}
+
+// Atlas texel of a point inside the brick of a leaf cell
+vec3 BrickTexel(in int brick, in ivec3 cell, in int level, in vec3 P)
+{
+  int paddedSize = brickSize + 2;
+  ivec3 atlasSize = textureSize(brickTex, 0);
+  int bricksX = atlasSize.x / paddedSize;
+  int bricksY = atlasSize.y / paddedSize;
+  vec3 slot = vec3(brick % bricksX,
+                   (brick / bricksX) % bricksY,
+                   brick / (bricksX*bricksY));
+  vec3 local = clamp(P*float(1 << level) - vec3(cell), 0.0, 1.0);
+  return slot*float(paddedSize) + vec3(1.0) + local*float(brickSize);
+}
+
+// Value and, for a 2D transfer function, gradient magnitude at P
+vec2 Sample(in vec3 P, in int level)
+{
+  int last = (1 << level) - 1;
+  ivec3 cell = clamp(ivec3(floor(P*float(1 << level))), ivec3(0), ivec3(last));
+  int nodeOffset = CellNodeOffset(level, cell);
+  int brick = NodeBrick(nodeOffset);
+  bool gradients = TransferFunction2D();
+  if (brick >= 0) {
+    brick = BrickSlot(brick);
+    // Missing bricks fall back to the parent like in octreeFrag.glsl
+    if (brick < 0 && nodeLayout == PACKED_32) {
+      nodeOffset = (nodeOffset - 1) / 8;
+    }
+  }
+
+  if (brick >= 0) {
+    vec3 atlasSize = vec3(textureSize(brickTex, 0));
+    vec3 texel = BrickTexel(brick, cell, level, P);
+    float value = texture(brickTex, texel/atlasSize).r;
+    if (!gradients) {
+      return vec2(value, 0.0);
+    }
+    // Differences stay within the apron, past it is the next brick
+    vec3 slotMin = floor(texel/float(brickSize + 2))*float(brickSize + 2);
+    vec3 apronMin = slotMin + vec3(0.5);
+    vec3 apronMax = slotMin + vec3(float(brickSize) + 1.5);
+    vec3 gradient;
+    for (int axis=0; axis<3; axis++) {
+      vec3 d = vec3(0.0);
+      d[axis] = 1.0;
+      vec3 above = clamp(texel + d, apronMin, apronMax);
+      vec3 below = clamp(texel - d, apronMin, apronMax);
+      gradient[axis] = texture(brickTex, above/atlasSize).r -
+                       texture(brickTex, below/atlasSize).r;
+    }
+    return vec2(value, 0.5*length(gradient));
+  }
+
+  float value = NodeValue(nodeOffset);
+  if (!gradients) {
+    return vec2(value, 0.0);
+  }
+  ivec3 dx = ivec3(1, 0, 0);
+  ivec3 dy = ivec3(0, 1, 0);
+  ivec3 dz = ivec3(0, 0, 1);
+  vec3 gradient = vec3(
+    CellValue(level, cell+dx, value) - CellValue(level, cell-dx, value),
+    CellValue(level, cell+dy, value) - CellValue(level, cell-dy, value),
+    CellValue(level, cell+dz, value) - CellValue(level, cell-dz, value));
+  return vec2(value, 0.5*length(gradient));
+}
+
+layout(location = 0) out vec4 color;
+layout(location = 1) out uint feedback;
 
 void main() {
 
-	// Get window coordinates for cube texture sampling
-	float xSample = gl_FragCoord.x / winSizeX;
-	float ySample = gl_FragCoord.y / winSizeY;
-
-	// Sample cube colors
-	vec4 front = texture(cubeFrontTex, vec2(xSample, ySample));
-	vec4 back = texture(cubeBackTex, vec2(xSample, ySample));
-
-	// Adjust coord system
-	front.xyz = vec3(front.z, 1.0-front.x, 1.0-front.y);
-	back.xyz = vec3(back.z, 1.0-back.x, 1.0-back.y);
-
-	// Calculate viewing direction and cross-section length
-	vec3 direction = (back-front).xyz;
-	float dirLength = length(direction);
-	direction = normalize(direction);
-
-	// Init traversal
-	float sum = 0.0;
-	vec3 sample = front.xyz;
-	float traversedLength = 0.0;
-	
-	// Sample volume
-	while (traversedLength < dirLength) {
-		sample += stepSize * direction;
-		traversedLength += stepSize;
-		sum += texelFetch(volumeTex, int(256.0*sample.x*pow(256.0, 0.0)) + int(256.0*sample.y*pow(256.0, 1.0)) + int(256.0*sample.z*pow(256.0, 2.0)));
+	feedback = 0u;
+
+	// Same eye ray as in octreeFrag.glsl
+	vec2 ndc = 2.0*vec2(gl_FragCoord.x/winSizeX, gl_FragCoord.y/winSizeY) - 1.0;
+	vec4 nearPoint = inverseMatrix * vec4(ndc, -1.0, 1.0);
+	vec4 farPoint = inverseMatrix * vec4(ndc, 1.0, 1.0);
+	vec3 rayO = nearPoint.xyz/nearPoint.w;
+	vec3 direction = normalize(farPoint.xyz/farPoint.w - rayO);
+
+	float tEntry, tExit;
+	if (!IntersectCube(vec3(0.0), vec3(1.0), rayO, direction, tEntry, tExit) ||
+	    tExit < 0.0) {
+		color = vec4(0.0);
+		return;
 	}
+	tEntry = max(tEntry, 0.0);
 
-	color = vec4(vec3(intensity*stepSize*sum), 1.0);//  * 0.001 + vec4(vec3(front), 1);
+	// Sample the level the octree would descend to, at a fixed step
+	int level = min(maxLevel, maxDepth);
+	float stepLength = stepScale*stepSize;
+	int nrSteps = min(MAX_STEPS, int(ceil((tExit - tEntry)/stepLength)));
+	vec4 sum = vec4(0.0);
+	for (int i=0; i<nrSteps && !Saturated(sum); i++) {
+		float t = tEntry + (float(i) + stepJitter)*stepLength;
+		float segment = min(stepLength, tExit - (tEntry + float(i)*stepLength));
+		vec2 valueGradient = Sample(rayO + t*direction, level);
+		Accumulate(sum, valueGradient.x, valueGradient.y, segment);
+	}
 
+	color = vec4(intensity*sum.rgb, 1.0);
+	feedback = missingBrick;
 }
\ No newline at end of file
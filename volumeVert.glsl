@@ -1,10 +1,14 @@
 #version 330
 
-uniform mat4 projMatrix;
-uniform mat4 viewMatrix;
-uniform mat4 modelMatrix;
+// Same block as in octreeVert.glsl
+layout(std140) uniform Transform {
+  mat4 projMatrix;
+  mat4 viewMatrix;
+  mat4 modelMatrix;
+  mat4 inverseMatrix;
+};
 
-in vec4 position;
+layout(location = 0) in vec4 position;
 
 void main() {
 	gl_Position = projMatrix * viewMatrix * modelMatrix * position;